@@ -55,11 +55,16 @@ void smp_init()
         auto c = new sched::cpu(i);
         c->arch.mpid = mpids[i];
         c->arch.smp_idx = i;
+        // Without SMT, affinity level 0 numbers the cores of a cluster;
+        // take the cluster as sharing the last-level cache.
+        c->topology.llc = (mpids[i] >> 8) & 0xff;
+        c->topology.package = (mpids[i] >> 16) & 0xff;
         c->arch.initstack.next = smp_stack_free;  /* setup thread stack */
         smp_stack_free = &c->arch.initstack;
         sched::cpus.push_back(c);
     }
     sched::current_cpu = sched::cpus[0];
+    sched::cpu::init_domains();
 
     for (auto c : sched::cpus) {
         c->incoming_wakeups = new sched::cpu::incoming_wakeup_queue[sched::cpus.size()];
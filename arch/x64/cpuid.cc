@@ -56,7 +56,9 @@ cpuid_bit cpuid_bits[] = {
     { 1, 'c', 30, &f::rdrand, 0, nullptr, "rdrand" },
     { 1, 'd', 19, &f::clflush, 0, nullptr, "clflush" },
     { 7, 'b', 0, &f::fsgsbase, 0, nullptr, "fgsbase" },
+    { 7, 'b', 5, &f::avx2, 0, nullptr, "avx2" },
     { 7, 'b', 9, &f::repmovsb, 0, nullptr, "repmovsb" },
+    { 7, 'b', 29, &f::sha, 0, nullptr, "sha_ni" },
     { 0x80000001, 'd', 26, &f::gbpage, 0, nullptr, "gbpage" },
     { 0x80000007, 'd', 8, &f::invariant_tsc, 0, nullptr, "invariant_tsc"},
     { 0x40000001, 'a', 0, &f::kvm_clocksource, 0, &kvm_signature, "kvmclock" },
@@ -24,6 +24,8 @@ struct features_type {
     bool xsave;
     bool osxsave;
     bool avx;
+    bool avx2;
+    bool sha;
     bool rdrand;
     bool clflush;
     bool fsgsbase;
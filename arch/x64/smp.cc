@@ -21,6 +21,9 @@ extern "C" {
 #include <osv/barrier.hh>
 #include <osv/prio.hh>
 #include "osv/percpu.hh"
+#include <osv/numa.hh>
+#include <osv/ilog2.hh>
+#include <algorithm>
 
 extern "C" { void smp_main(void); }
 
@@ -37,8 +40,53 @@ volatile unsigned smp_processors = 1;
 
 using boost::intrusive::get_parent_from_member;
 
+// Where a CPU sits in the machine follows from its APIC id: the low bits
+// number the SMT threads of a core, the next ones the cores of a package.
+// CPUID tells us the widths of these fields (leaf 0xb), and how many
+// logical CPUs share the last-level cache (leaf 4).
+struct topology_shifts {
+    unsigned smt = 0;
+    unsigned llc = 0;
+    unsigned package = 0;
+};
+
+static topology_shifts get_topology_shifts()
+{
+    topology_shifts ret;
+    auto max_leaf = cpuid(0).a;
+    if (max_leaf >= 0xb && cpuid(0xb, 0).b) {
+        for (unsigned level = 0; level < 8; level++) {
+            auto r = cpuid(0xb, level);
+            auto type = (r.c >> 8) & 0xff;
+            if (type == 0) {
+                break;
+            } else if (type == 1) {
+                ret.smt = r.a & 0x1f;
+            } else if (type == 2) {
+                ret.package = r.a & 0x1f;
+            }
+        }
+    } else {
+        // logical CPUs per package
+        ret.package = ilog2_roundup((cpuid(1).b >> 16) & 0xff);
+    }
+    ret.llc = ret.package;
+    if (max_leaf >= 4) {
+        for (unsigned i = 0; i < 16; i++) {
+            auto r = cpuid(4, i);
+            if ((r.a & 0x1f) == 0) {
+                break;
+            }
+            // the caches are listed from level 1 up
+            ret.llc = std::min(ret.package, ilog2_roundup(((r.a >> 14) & 0xfff) + 1));
+        }
+    }
+    return ret;
+}
+
 void parse_madt()
 {
+    auto shifts = get_topology_shifts();
     char madt_sig[] = ACPI_SIG_MADT;
     ACPI_TABLE_HEADER* madt_header;
     auto st = AcpiGetTable(madt_sig, 0, &madt_header);
@@ -58,6 +106,10 @@ void parse_madt()
             auto c = new sched::cpu(nr_cpus++);
             c->arch.apic_id = lapic->Id;
             c->arch.acpi_id = lapic->ProcessorId;
+            c->topology.core = lapic->Id >> shifts.smt;
+            c->topology.llc = lapic->Id >> shifts.llc;
+            c->topology.package = lapic->Id >> shifts.package;
+            memory::numa::attach_cpu(c->id, lapic->Id);
             c->arch.initstack.next = smp_stack_free;
             smp_stack_free = &c->arch.initstack;
             sched::cpus.push_back(c);
@@ -69,6 +121,7 @@ void parse_madt()
         subtable += s->Length;
     }
     debug(fmt("%d CPUs detected\n") % nr_cpus);
+    sched::cpu::init_domains();
 }
 
 void smp_init()
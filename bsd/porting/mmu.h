@@ -51,7 +51,12 @@ uint64_t kmem_used(void);
 int vm_paging_needed(void);
 int vm_throttling_needed(void);
 
-void mmu_unmap(void* ab);
+/*
+ * Drop the page cache's mappings of an ARC buffer. Returns nonzero if the
+ * page cache still has pages of it lent out; it then owns the buffer's data
+ * and releases it with free() itself.
+ */
+int mmu_unmap(void* ab, void* data, size_t size, void (*free)(void*, size_t));
 void mmu_map(void* key, void* ab, void* page);
 
 #define vtophys(_va) virt_to_phys((void *)_va)
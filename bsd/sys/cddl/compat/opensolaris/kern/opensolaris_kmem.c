@@ -50,83 +50,6 @@ zfs_kmem_free(void *buf, size_t size)
 	free(buf);
 }
 
-static int
-kmem_std_constructor(void *mem, int size, void *private, int flags)
-{
-	struct kmem_cache *cache = private;
-
-	return (cache->kc_constructor(mem, cache->kc_private, flags));
-}
-
-static void
-kmem_std_destructor(void *mem, int size, void *private)
-{
-	struct kmem_cache *cache = private;
-
-	cache->kc_destructor(mem, cache->kc_private);
-}
-
-kmem_cache_t *
-kmem_cache_create(char *name, size_t bufsize, size_t align,
-    int (*constructor)(void *, void *, int), void (*destructor)(void *, void *),
-    void (*reclaim)(void *), void *private, vmem_t *vmp, int cflags)
-{
-	kmem_cache_t *cache;
-
-	ASSERT(vmp == NULL);
-
-	cache = kmem_alloc(sizeof(*cache), KM_SLEEP);
-	strlcpy(cache->kc_name, name, sizeof(cache->kc_name));
-	cache->kc_constructor = constructor;
-	cache->kc_destructor = destructor;
-	cache->kc_private = private;
-	cache->kc_size = bufsize;
-	cache->kc_align = align;
-
-	return (cache);
-}
-
-void
-kmem_cache_destroy(kmem_cache_t *cache)
-{
-	kmem_free(cache, sizeof(*cache));
-}
-
-void *
-kmem_cache_alloc(kmem_cache_t *cache, int flags)
-{
-	void *p;
-	if (cache->kc_align) {
-		int error = posix_memalign(&p, cache->kc_align, cache->kc_size);
-		if (error)
-			p = NULL;
-	} else
-		p = malloc(cache->kc_size);
-	if (p && (flags & M_ZERO))
-		memset(p, 0, cache->kc_size);
-	if (p != NULL && cache->kc_constructor != NULL)
-		kmem_std_constructor(p, cache->kc_size, cache, flags);
-	return (p);
-}
-
-void
-kmem_cache_free(kmem_cache_t *cache, void *buf)
-{
-	if (cache->kc_destructor != NULL)
-		kmem_std_destructor(buf, cache->kc_size, cache);
-	free(buf);
-}
-
-void
-kmem_cache_reap_now(kmem_cache_t *cache)
-{
-}
-
-void
-kmem_reap(void)
-{
-}
-
 int
 kmem_debugging(void)
 {
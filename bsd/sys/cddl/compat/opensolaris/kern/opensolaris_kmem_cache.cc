@@ -0,0 +1,699 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+/*
+ * The object caches ZFS creates with kmem_cache_create(), after Bonwick's
+ * "Magazines and Vmem".
+ *
+ * Objects are carved from slabs: naturally aligned, power of two sized runs
+ * of pages, with the slab's header at their end. So an object's slab is
+ * found by rounding its address down, and the objects get the cache's
+ * alignment without a header page per object.
+ *
+ * Freed objects stay constructed, and are kept in magazines (stacks of
+ * objects): every cpu has a loaded magazine and the previously loaded one,
+ * used with preemption disabled, and the cache's depot keeps the full and
+ * empty magazines for all of them. So the constructor runs only when an
+ * object is carved from a slab, and the destructor only when it is given
+ * back to its slab, which happens when the depot is reaped: by
+ * kmem_cache_reap_now() and kmem_reap(), which ARC calls when memory is
+ * short, and by the "kmem caches" shrinker. A hard shrink also has every
+ * cpu move its magazines to the depot first, so all the cached objects,
+ * and the spare slab each cache keeps, can be given back.
+ */
+
+#include <bsd/sys/cddl/compat/opensolaris/sys/kmem.h>
+#include <bsd/porting/kthread.h>
+
+#include <osv/mempool.hh>
+#include <osv/mutex.h>
+#include <osv/percpu.hh>
+#include <osv/percpu-worker.hh>
+#include <osv/preempt-lock.hh>
+#include <osv/semaphore.hh>
+#include <osv/align.hh>
+#include <osv/ilog2.hh>
+#include <osv/printf.hh>
+#include <osv/trace.hh>
+
+#include <boost/intrusive/list.hpp>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include <string.h>
+
+namespace bi = boost::intrusive;
+
+TRACEPOINT(trace_kmem_cache_slab_alloc, "cache=%s, slab=%p, objs=%u", const char*, void*, unsigned);
+TRACEPOINT(trace_kmem_cache_slab_free, "cache=%s, slab=%p", const char*, void*);
+TRACEPOINT(trace_kmem_cache_reap, "cache=%s, magazines=%u, freed=%lu", const char*, unsigned, size_t);
+
+static constexpr size_t page_size = PAGE_SIZE;
+// A slab holds at least this many objects...
+static constexpr unsigned min_slab_objs = 8;
+// ...so objects larger than this get slabs of more than one page. Those
+// come from the large allocator, which puts a header page before them, so
+// they are not made too small either.
+static constexpr size_t max_small_obj = page_size / min_slab_objs;
+static constexpr size_t min_large_slab = 16 * page_size;
+
+namespace {
+
+struct free_obj {
+    free_obj* next;
+};
+
+struct slab : bi::list_base_hook<> {
+    free_obj* free;
+    unsigned nfree;
+};
+
+typedef bi::list<slab, bi::constant_time_size<false>> slab_list;
+
+struct magazine : bi::list_base_hook<> {
+    static constexpr unsigned max_rounds = 64;
+    unsigned rounds = 0;
+    void* objs[max_rounds];
+};
+
+typedef bi::list<magazine, bi::constant_time_size<true>> magazine_list;
+
+}
+
+struct kmem_cache : bi::list_base_hook<> {
+    kmem_cache(const char* name, size_t size, size_t align,
+               int (*ctor)(void *, void *, int), void (*dtor)(void *, void *),
+               void (*reclaim)(void *), void *priv);
+    ~kmem_cache();
+
+    void* alloc(int flags);
+    void free(void* obj);
+    size_t reap(bool all);
+    // Moves the current cpu's magazines to the depot
+    void flush_cpu();
+
+    struct counters {
+        char name[32];
+        size_t size, chunk;
+        unsigned long allocs, frees, hits, depot_hits, misses, objs, slab_kb;
+    };
+    void stats(counters& c);
+
+    struct cpu_cache {
+        magazine* loaded = nullptr;
+        magazine* prev = nullptr;
+        // Statistics
+        unsigned long allocs = 0;
+        unsigned long hits = 0;
+        unsigned long frees = 0;
+        void* alloc(unsigned rounds);
+        bool free(void* obj, unsigned rounds);
+    };
+
+    char kc_name[32];
+    size_t kc_size;
+    size_t kc_align;
+    int (*kc_constructor)(void *, void *, int);
+    void (*kc_destructor)(void *, void *);
+    void (*kc_reclaim)(void *);
+    void *kc_private;
+private:
+    void* alloc_slow(int flags);
+    void free_slow(void* obj);
+    void* slab_alloc(int flags);
+    // Called with _lock held. Returns how many bytes of slabs were given back
+    size_t slab_free(void* obj);
+    void free_slab_memory(void* base);
+    size_t destroy_object(void* obj);
+    size_t destroy_magazine(magazine* m);
+    slab* to_slab(void* obj) {
+        return reinterpret_cast<slab*>(
+            align_down(reinterpret_cast<uintptr_t>(obj), _slab_size)
+            + _slab_size - sizeof(slab));
+    }
+    void* slab_base(slab* s) {
+        return reinterpret_cast<char*>(s) + sizeof(slab) - _slab_size;
+    }
+private:
+    size_t _chunk;
+    size_t _slab_size;
+    unsigned _slab_objs;
+    unsigned _mag_rounds;
+    dynamic_percpu<cpu_cache> _cpu;
+    // Protects the depot and the slabs
+    mutex _lock;
+    magazine_list _full;
+    magazine_list _empty;
+    slab_list _partial;
+    slab* _spare = nullptr;
+    // Statistics, under _lock
+    unsigned long _depot_hits = 0;
+    unsigned long _misses = 0;
+    unsigned long _slabs = 0;
+    unsigned long _objs = 0;
+};
+
+// The list is not allocated into, so the shrinker can hold the lock while
+// it reaps, without waiting for a kmem_cache_create() waiting for memory.
+static mutex caches_lock;
+static bi::list<kmem_cache, bi::constant_time_size<false>> caches;
+
+// The cpu magazines are only used by their own cpu, with preemption
+// disabled, so each cpu's worker thread flushes its own. Neither it nor the
+// thread waiting for it allocates memory, so this can be done by the
+// shrinker.
+static void flush_cpu_magazines();
+PCPU_WORKERITEM(kmem_flush, flush_cpu_magazines);
+static mutex flush_lock;
+static semaphore flush_done{0};
+
+static void flush_cpu_magazines()
+{
+    WITH_LOCK(caches_lock) {
+        for (auto& cache : caches) {
+            cache.flush_cpu();
+        }
+    }
+    flush_done.post();
+}
+
+static void flush_all_cpu_magazines()
+{
+    WITH_LOCK(flush_lock) {
+        for (auto c : sched::cpus) {
+            kmem_flush.signal(c);
+        }
+        flush_done.wait(sched::cpus.size());
+    }
+}
+
+class kmem_shrinker : public memory::shrinker {
+public:
+    kmem_shrinker() : shrinker("kmem caches") {}
+    size_t request_memory(size_t n, bool hard);
+};
+
+void* kmem_cache::cpu_cache::alloc(unsigned rounds)
+{
+    if (CONF_debug_memory) {
+        return nullptr;
+    }
+    if (!loaded || !loaded->rounds) {
+        if (!prev || !prev->rounds) {
+            return nullptr;
+        }
+        std::swap(loaded, prev);
+    }
+    return loaded->objs[--loaded->rounds];
+}
+
+bool kmem_cache::cpu_cache::free(void* obj, unsigned rounds)
+{
+    if (CONF_debug_memory) {
+        return false;
+    }
+    if (!loaded || loaded->rounds == rounds) {
+        if (!prev || prev->rounds == rounds) {
+            return false;
+        }
+        std::swap(loaded, prev);
+    }
+    loaded->objs[loaded->rounds++] = obj;
+    return true;
+}
+
+kmem_cache::kmem_cache(const char* name, size_t size, size_t align,
+                       int (*ctor)(void *, void *, int),
+                       void (*dtor)(void *, void *),
+                       void (*reclaim)(void *), void *priv)
+    : kc_size(size)
+    , kc_align(align)
+    , kc_constructor(ctor)
+    , kc_destructor(dtor)
+    , kc_reclaim(reclaim)
+    , kc_private(priv)
+{
+    strlcpy(kc_name, name, sizeof(kc_name));
+    align = std::max(align, sizeof(void*));
+    assert(is_power_of_two(align));
+    _chunk = align_up(std::max(size, sizeof(free_obj)), align);
+    if (_chunk <= max_small_obj) {
+        _slab_size = page_size;
+    } else {
+        _slab_size = std::max(min_large_slab,
+                size_t(1) << ilog2_roundup(_chunk * min_slab_objs + sizeof(slab)));
+    }
+    _slab_objs = (_slab_size - sizeof(slab)) / _chunk;
+    // Large objects are cached in fewer numbers
+    _mag_rounds = std::max(4ul, std::min(size_t(magazine::max_rounds),
+                                         (64ul << 10) / _chunk));
+}
+
+kmem_cache::~kmem_cache()
+{
+    // No one uses the cache anymore, so the cpu magazines can be emptied
+    // from here
+    for (auto c : sched::cpus) {
+        auto* cc = _cpu.for_cpu(c);
+        for (auto m : {cc->loaded, cc->prev}) {
+            if (m) {
+                destroy_magazine(m);
+            }
+        }
+        cc->loaded = cc->prev = nullptr;
+    }
+    reap(true);
+    assert(_partial.empty() && !_spare);
+}
+
+void* kmem_cache::alloc(int flags)
+{
+    void* obj;
+    WITH_LOCK(preempt_lock) {
+        auto& cc = *_cpu;
+        cc.allocs++;
+        obj = cc.alloc(_mag_rounds);
+        if (obj) {
+            cc.hits++;
+            return obj;
+        }
+    }
+    return alloc_slow(flags);
+}
+
+// The cpu's magazines are both empty: exchange one for a full magazine
+// from the depot, or construct a new object.
+void* kmem_cache::alloc_slow(int flags)
+{
+    magazine* full = nullptr;
+    WITH_LOCK(_lock) {
+        if (!_full.empty()) {
+            full = &_full.front();
+            _full.pop_front();
+            _depot_hits++;
+        } else {
+            _misses++;
+        }
+    }
+    if (full) {
+        void* obj;
+        magazine* empty = nullptr;
+        WITH_LOCK(preempt_lock) {
+            // We may have moved to another cpu, whose magazines are not
+            // necessarily empty
+            auto& cc = *_cpu;
+            obj = cc.alloc(_mag_rounds);
+            if (!obj) {
+                empty = cc.prev;
+                cc.prev = cc.loaded;
+                cc.loaded = full;
+                full = nullptr;
+                obj = cc.alloc(_mag_rounds);
+            }
+        }
+        WITH_LOCK(_lock) {
+            if (full) {
+                _full.push_front(*full);
+            }
+            if (empty) {
+                _empty.push_front(*empty);
+            }
+        }
+        return obj;
+    }
+
+    auto obj = slab_alloc(flags);
+    if (obj && kc_constructor &&
+            kc_constructor(obj, kc_private, flags) != 0) {
+        WITH_LOCK(_lock) {
+            slab_free(obj);
+        }
+        return nullptr;
+    }
+    return obj;
+}
+
+void kmem_cache::free(void* obj)
+{
+    WITH_LOCK(preempt_lock) {
+        auto& cc = *_cpu;
+        cc.frees++;
+        if (cc.free(obj, _mag_rounds)) {
+            return;
+        }
+    }
+    free_slow(obj);
+}
+
+// ARC frees into the caches from the reclaimer thread, which can't wait for
+// memory (it would be waiting for itself), and when memory is short the
+// objects are better given back than cached.
+static bool can_alloc_magazine()
+{
+    return curproc != pageproc &&
+           memory::stats::free() > memory::stats::total() -
+                                   memory::stats::max_no_reclaim();
+}
+
+// The cpu's magazines are both full: exchange one for an empty magazine,
+// moving it to the depot, or destroy the object if no magazine can be had.
+void kmem_cache::free_slow(void* obj)
+{
+    magazine* empty = nullptr;
+    WITH_LOCK(_lock) {
+        if (!_empty.empty()) {
+            empty = &_empty.front();
+            _empty.pop_front();
+        }
+    }
+    if (!empty && !CONF_debug_memory && can_alloc_magazine()) {
+        empty = new (std::nothrow) magazine;
+    }
+    if (!empty) {
+        destroy_object(obj);
+        return;
+    }
+    magazine* full = nullptr;
+    WITH_LOCK(preempt_lock) {
+        auto& cc = *_cpu;
+        if (!cc.free(obj, _mag_rounds)) {
+            full = cc.prev;
+            cc.prev = cc.loaded;
+            cc.loaded = empty;
+            empty = nullptr;
+            cc.free(obj, _mag_rounds);
+        }
+    }
+    WITH_LOCK(_lock) {
+        if (full) {
+            _full.push_front(*full);
+        }
+        if (empty) {
+            _empty.push_front(*empty);
+        }
+    }
+}
+
+void* kmem_cache::slab_alloc(int flags)
+{
+    for (;;) {
+        WITH_LOCK(_lock) {
+            if (_partial.empty() && _spare) {
+                _partial.push_front(*_spare);
+                _spare = nullptr;
+            }
+            if (!_partial.empty()) {
+                auto& s = _partial.front();
+                auto* obj = s.free;
+                s.free = obj->next;
+                if (!--s.nfree) {
+                    // Full slabs aren't tracked: to_slab() finds them
+                    // when an object is freed
+                    _partial.pop_front();
+                }
+                _objs++;
+                return obj;
+            }
+        }
+        // Don't hold the lock while the page allocator may wait for the
+        // shrinkers, which include ours.
+        void* base;
+        if (_slab_size == page_size) {
+            base = (flags & KM_NOSLEEP) ? memory::alloc_page_noblock()
+                                        : memory::alloc_page();
+        } else {
+            base = memory::alloc_phys_contiguous_aligned(_slab_size,
+                    _slab_size, !(flags & KM_NOSLEEP));
+        }
+        if (!base) {
+            return nullptr;
+        }
+        auto* s = new (static_cast<char*>(base) + _slab_size - sizeof(slab)) slab;
+        s->free = nullptr;
+        for (unsigned i = _slab_objs; i > 0; i--) {
+            auto* obj = reinterpret_cast<free_obj*>(
+                    static_cast<char*>(base) + (i - 1) * _chunk);
+            obj->next = s->free;
+            s->free = obj;
+        }
+        s->nfree = _slab_objs;
+        trace_kmem_cache_slab_alloc(kc_name, base, _slab_objs);
+        WITH_LOCK(_lock) {
+            _partial.push_back(*s);
+            _slabs++;
+        }
+    }
+}
+
+size_t kmem_cache::slab_free(void* p)
+{
+    auto* s = to_slab(p);
+    auto* obj = static_cast<free_obj*>(p);
+    obj->next = s->free;
+    s->free = obj;
+    _objs--;
+    if (s->nfree++ == 0) {
+        _partial.push_front(*s);
+    }
+    if (s->nfree < _slab_objs) {
+        return 0;
+    }
+    _partial.erase(_partial.iterator_to(*s));
+    // Keep one free slab, so a cache whose use goes up and down around a
+    // slab boundary doesn't allocate and free slabs all the time.
+    if (!_spare) {
+        _spare = s;
+        return 0;
+    }
+    _slabs--;
+    auto* base = slab_base(s);
+    trace_kmem_cache_slab_free(kc_name, base);
+    free_slab_memory(base);
+    return _slab_size;
+}
+
+void kmem_cache::free_slab_memory(void* base)
+{
+    if (_slab_size == page_size) {
+        memory::free_page(base);
+    } else {
+        memory::free_phys_contiguous_aligned(base);
+    }
+}
+
+size_t kmem_cache::destroy_object(void* obj)
+{
+    if (kc_destructor) {
+        kc_destructor(obj, kc_private);
+    }
+    WITH_LOCK(_lock) {
+        return slab_free(obj);
+    }
+}
+
+size_t kmem_cache::destroy_magazine(magazine* m)
+{
+    if (kc_destructor) {
+        for (unsigned i = 0; i < m->rounds; i++) {
+            kc_destructor(m->objs[i], kc_private);
+        }
+    }
+    size_t freed = 0;
+    WITH_LOCK(_lock) {
+        for (unsigned i = 0; i < m->rounds; i++) {
+            freed += slab_free(m->objs[i]);
+        }
+    }
+    delete m;
+    return freed + sizeof(*m);
+}
+
+// Gives the depot's magazines back, all of them or half of the full ones,
+// and the spare slab. Returns the number of bytes freed.
+size_t kmem_cache::reap(bool all)
+{
+    magazine_list full, empty;
+    WITH_LOCK(_lock) {
+        auto n = all ? _full.size() : _full.size() / 2;
+        while (n--) {
+            auto& m = _full.back();
+            _full.pop_back();
+            full.push_front(m);
+        }
+        empty.swap(_empty);
+    }
+    unsigned nmags = full.size() + empty.size();
+    size_t freed = 0;
+    full.clear_and_dispose([&] (magazine* m) { freed += destroy_magazine(m); });
+    empty.clear_and_dispose([&] (magazine* m) { freed += destroy_magazine(m); });
+    slab* spare;
+    WITH_LOCK(_lock) {
+        spare = _spare;
+        _spare = nullptr;
+        if (spare) {
+            _slabs--;
+        }
+    }
+    if (spare) {
+        auto* base = slab_base(spare);
+        trace_kmem_cache_slab_free(kc_name, base);
+        free_slab_memory(base);
+        freed += _slab_size;
+    }
+    trace_kmem_cache_reap(kc_name, nmags, freed);
+    return freed;
+}
+
+void kmem_cache::flush_cpu()
+{
+    magazine* mags[2];
+    WITH_LOCK(preempt_lock) {
+        auto& cc = *_cpu;
+        mags[0] = cc.loaded;
+        mags[1] = cc.prev;
+        cc.loaded = cc.prev = nullptr;
+    }
+    WITH_LOCK(_lock) {
+        for (auto m : mags) {
+            if (m) {
+                // alloc_slow() expects the depot's full magazines to have
+                // at least one object
+                (m->rounds ? _full : _empty).push_front(*m);
+            }
+        }
+    }
+}
+
+void kmem_cache::stats(counters& c)
+{
+    strlcpy(c.name, kc_name, sizeof(c.name));
+    c.size = kc_size;
+    c.chunk = _chunk;
+    c.allocs = c.hits = c.frees = 0;
+    for (auto cpu : sched::cpus) {
+        auto* cc = _cpu.for_cpu(cpu);
+        c.allocs += cc->allocs;
+        c.hits += cc->hits;
+        c.frees += cc->frees;
+    }
+    WITH_LOCK(_lock) {
+        c.depot_hits = _depot_hits;
+        c.misses = _misses;
+        c.objs = _objs;
+        c.slab_kb = _slabs * _slab_size / 1024;
+    }
+}
+
+size_t kmem_shrinker::request_memory(size_t n, bool hard)
+{
+    size_t freed = 0;
+    if (hard) {
+        flush_all_cpu_magazines();
+    }
+    WITH_LOCK(caches_lock) {
+        for (auto& cache : caches) {
+            if (cache.kc_reclaim) {
+                cache.kc_reclaim(cache.kc_private);
+            }
+            freed += cache.reap(hard);
+        }
+    }
+    return freed;
+}
+
+kmem_cache_t *
+kmem_cache_create(char *name, size_t bufsize, size_t align,
+    int (*constructor)(void *, void *, int), void (*destructor)(void *, void *),
+    void (*reclaim)(void *), void *priv, vmem_t *vmp, int cflags)
+{
+    assert(vmp == NULL);
+    static kmem_shrinker* shrinker = new kmem_shrinker;
+    (void)shrinker;
+
+    auto* cache = new kmem_cache(name, bufsize, align, constructor,
+                                 destructor, reclaim, priv);
+    WITH_LOCK(caches_lock) {
+        caches.push_back(*cache);
+    }
+    return cache;
+}
+
+void
+kmem_cache_destroy(kmem_cache_t *cache)
+{
+    WITH_LOCK(caches_lock) {
+        caches.erase(caches.iterator_to(*cache));
+    }
+    delete cache;
+}
+
+void *
+kmem_cache_alloc(kmem_cache_t *cache, int flags)
+{
+    auto* p = cache->alloc(flags);
+    if (p && (flags & M_ZERO)) {
+        memset(p, 0, cache->kc_size);
+    }
+    return p;
+}
+
+void
+kmem_cache_free(kmem_cache_t *cache, void *buf)
+{
+    cache->free(buf);
+}
+
+void
+kmem_cache_reap_now(kmem_cache_t *cache)
+{
+    cache->reap(true);
+}
+
+void
+kmem_reap(void)
+{
+    WITH_LOCK(caches_lock) {
+        for (auto& cache : caches) {
+            cache.reap(false);
+        }
+    }
+}
+
+std::string kmem_cache_stats()
+{
+    // Nothing may be allocated under caches_lock, so the counters are
+    // copied into room made before taking it, and formatted after.
+    std::vector<kmem_cache::counters> counters;
+    size_t n;
+    do {
+        WITH_LOCK(caches_lock) {
+            n = std::distance(caches.begin(), caches.end());
+        }
+        counters.resize(n);
+        WITH_LOCK(caches_lock) {
+            n = std::distance(caches.begin(), caches.end());
+            if (n <= counters.size()) {
+                auto* c = counters.data();
+                for (auto& cache : caches) {
+                    cache.stats(*c++);
+                }
+            }
+        }
+    } while (n > counters.size());
+    counters.resize(n);
+
+    std::ostringstream os;
+    osv::fprintf(os, "%-32s %8s %8s %12s %12s %12s %12s %12s %8s %8s\n",
+                 "name", "size", "chunk", "allocs", "frees", "cpu_hits",
+                 "depot_hits", "misses", "objs", "slab_kb");
+    for (auto& c : counters) {
+        osv::fprintf(os, "%-32s %8lu %8lu %12lu %12lu %12lu %12lu %12lu %8lu %8lu\n",
+                     c.name, c.size, c.chunk, c.allocs, c.frees, c.hits,
+                     c.depot_hits, c.misses, c.objs, c.slab_kb);
+    }
+    return os.str();
+}
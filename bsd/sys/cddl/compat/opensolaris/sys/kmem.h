@@ -45,24 +45,20 @@
 #define	KMC_NOTOUCH		0
 #define	KMC_NODEBUG		UMA_ZONE_NODUMP
 
-typedef struct kmem_cache {
-	char		kc_name[32];
-	size_t		kc_size;
-	size_t		kc_align;
-	int		(*kc_constructor)(void *, void *, int);
-	void		(*kc_destructor)(void *, void *);
-	void		*kc_private;
-} kmem_cache_t;
+/* OSv: defined in opensolaris_kmem_cache.cc */
+typedef struct kmem_cache kmem_cache_t;
 
 #define vmem_t	void
 
+__BEGIN_DECLS
+
 void *zfs_kmem_alloc(size_t size, int kmflags);
 void zfs_kmem_free(void *buf, size_t size);
 uint64_t kmem_size(void);
 uint64_t kmem_used(void);
 kmem_cache_t *kmem_cache_create(char *name, size_t bufsize, size_t align,
     int (*constructor)(void *, void *, int), void (*destructor)(void *, void *),
-    void (*reclaim)(void *), void *private, vmem_t *vmp, int cflags);
+    void (*reclaim)(void *), void *priv, vmem_t *vmp, int cflags);
 void kmem_cache_destroy(kmem_cache_t *cache);
 void *kmem_cache_alloc(kmem_cache_t *cache, int flags);
 void kmem_cache_free(kmem_cache_t *cache, void *buf);
@@ -71,6 +67,8 @@ void kmem_reap(void);
 int kmem_debugging(void);
 void *calloc(size_t n, size_t s);
 
+__END_DECLS
+
 #define	kmem_alloc(size, kmflags)	zfs_kmem_alloc((size), (kmflags))
 #define	kmem_zalloc(size, kmflags)	zfs_kmem_alloc((size), (kmflags) | M_ZERO)
 #define	kmem_free(buf, size)		zfs_kmem_free((buf), (size))
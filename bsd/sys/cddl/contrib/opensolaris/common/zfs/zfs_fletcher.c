@@ -165,8 +165,14 @@ fletcher_2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a0, a1, b0, b1);
 }
 
+/*
+ * fletcher_4_native() is the default checksum of every block, so on x64 it
+ * is an implementation using SIMD instructions, chosen according to the
+ * cpu when the kernel is loaded (see bsd/x64/machine/cksum_simd.cc).  This
+ * is the portable one, which those are validated against.
+ */
 void
-fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+fletcher_4_scalar_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
 	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
@@ -182,6 +188,14 @@ fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
+#if !defined(__x86_64__)
+void
+fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_scalar_native(buf, size, zcp);
+}
+#endif
+
 void
 fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 {
@@ -1640,9 +1640,12 @@ arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 		arc_state_t *state = buf->b_hdr->b_state;
 		uint64_t size = buf->b_hdr->b_size;
 		arc_buf_contents_t type = buf->b_hdr->b_type;
+		boolean_t lent = B_FALSE;
 
 		if (buf->b_hdr->b_mmaped) {
-			mmu_unmap(buf);
+			lent = mmu_unmap(buf, buf->b_data, size,
+			    type == ARC_BUFC_METADATA ?
+			    zio_buf_free : zio_data_buf_free);
 		}
 
 		arc_cksum_verify(buf);
@@ -1652,11 +1655,13 @@ arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 
 		if (!recycle) {
 			if (type == ARC_BUFC_METADATA) {
-				arc_buf_data_free(buf, zio_buf_free);
+				if (!lent)
+					arc_buf_data_free(buf, zio_buf_free);
 				arc_space_return(size, ARC_SPACE_DATA);
 			} else {
 				ASSERT(type == ARC_BUFC_DATA);
-				arc_buf_data_free(buf, zio_data_buf_free);
+				if (!lent)
+					arc_buf_data_free(buf, zio_data_buf_free);
 				ARCSTAT_INCR(arcstat_data_size, -size);
 				atomic_add_64(&arc_size, -size);
 			}
@@ -1943,9 +1948,15 @@ evict_start:
 				}
 				if (buf->b_data) {
 					bytes_evicted += ab->b_size;
+					/*
+					 * The page cache may have lent out
+					 * pages of a shared buffer, so don't
+					 * hand its data out for reuse.
+					 */
 					if (recycle && ab->b_type == type &&
 					    ab->b_size == bytes &&
-					    !HDR_L2_WRITING(ab)) {
+					    !HDR_L2_WRITING(ab) &&
+					    !ab->b_mmaped) {
 						stolen = buf->b_data;
 						recycle = FALSE;
 					}
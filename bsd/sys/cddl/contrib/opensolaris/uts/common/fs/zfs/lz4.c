@@ -962,7 +962,34 @@ LZ4_uncompress_unknownOutputSize(const char *source, char *dest, int isize,
 
 		/* get runlength */
 		token = *ip++;
-		if ((length = (token >> ML_BITS)) == RUN_MASK) {
+		length = token >> ML_BITS;
+
+		/*
+		 * Fast path for the common short sequence, far from the end
+		 * of both buffers: at most 14 literals and an 18 byte match
+		 * not overlapping its own first 8 bytes, copied with a few
+		 * fixed size (and so unrolled, vector sized) moves instead of
+		 * the length checks and byte loops below.
+		 */
+		if (length != RUN_MASK && iend - ip >= 16 && oend - op >= 32) {
+			(void) memcpy(op, ip, 16);
+			op += length;
+			ip += length;
+			LZ4_READ_LITTLEENDIAN_16(ref, op, ip);
+			ip += 2;
+			length = token & ML_MASK;
+			if (length != ML_MASK && op - ref >= 8 &&
+			    ref >= (BYTE * const) dest) {
+				(void) memcpy(op, ref, 8);
+				(void) memcpy(op + 8, ref + 8, 8);
+				(void) memcpy(op + 16, ref + 16, 2);
+				op += length + MINMATCH;
+				continue;
+			}
+			goto _copy_match;
+		}
+
+		if (length == RUN_MASK) {
 			int s = 255;
 			while ((ip < iend) && (s == 255)) {
 				s = *ip++;
@@ -994,6 +1021,7 @@ LZ4_uncompress_unknownOutputSize(const char *source, char *dest, int isize,
 		/* get offset */
 		LZ4_READ_LITTLEENDIAN_16(ref, cpy, ip);
 		ip += 2;
+	_copy_match:
 		if (ref < (BYTE * const) dest)
 			/*
 			 * Error: offset creates reference outside of
@@ -99,11 +99,21 @@ struct vdev_cache {
 	kmutex_t	vc_lock;
 };
 
+typedef struct vdev_queue_class {
+	avl_tree_t	vqc_queued_tree;	/* waiting, sorted by offset */
+	uint32_t	vqc_active;		/* issued to the device */
+} vdev_queue_class_t;
+
 struct vdev_queue {
-	avl_tree_t	vq_deadline_tree;
-	avl_tree_t	vq_read_tree;
-	avl_tree_t	vq_write_tree;
-	avl_tree_t	vq_pending_tree;
+	vdev_t		*vq_vdev;
+	vdev_queue_class_t vq_class[ZIO_QUEUE_CLASSES];
+	avl_tree_t	vq_active_tree;
+	uint64_t	vq_last_offset;
+	uint64_t	vq_agg_limit;		/* largest i/o the device takes */
+	uint32_t	vq_async_limit;		/* adaptive async queue depth */
+	hrtime_t	vq_sync_latency;	/* moving average of sync i/os */
+	hrtime_t	vq_sync_time;		/* last sync i/o completion */
+	hrtime_t	vq_adjust_time;		/* last vq_async_limit change */
 	kmutex_t	vq_lock;
 };
 
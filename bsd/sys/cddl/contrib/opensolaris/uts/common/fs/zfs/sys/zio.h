@@ -139,6 +139,19 @@ enum zio_compress {
 #define	ZIO_PRIORITY_DDT_PREFETCH	(zio_priority_table[11])
 #define	ZIO_PRIORITY_TABLE_SIZE		12
 
+/*
+ * Classes of leaf vdev i/o, each queued and limited separately by the
+ * vdev queue (see vdev_queue.c).
+ */
+typedef enum zio_queue_class {
+	ZIO_QUEUE_SYNC_READ,
+	ZIO_QUEUE_SYNC_WRITE,
+	ZIO_QUEUE_ASYNC_READ,
+	ZIO_QUEUE_ASYNC_WRITE,
+	ZIO_QUEUE_SCRUB,
+	ZIO_QUEUE_CLASSES
+} zio_queue_class_t;
+
 #define	ZIO_PIPELINE_CONTINUE		0x100
 #define	ZIO_PIPELINE_STOP		0x101
 
@@ -407,10 +420,10 @@ struct zio {
 	const zio_vsd_ops_t *io_vsd_ops;
 
 	uint64_t	io_offset;
-	uint64_t	io_deadline;
+	hrtime_t	io_timestamp;
 	avl_node_t	io_offset_node;
-	avl_node_t	io_deadline_node;
 	avl_tree_t	*io_vdev_tree;
+	zio_queue_class_t io_queue_class;
 
 	/* Internal pipeline state */
 	enum zio_flag	io_flags;
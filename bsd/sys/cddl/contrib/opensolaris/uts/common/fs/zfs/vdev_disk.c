@@ -87,6 +87,14 @@ vdev_disk_open(vdev_t *vd, uint64_t *psize, uint64_t *max_psize,
 	 */
 	*max_psize = *psize = dvd->device->size;
 	*ashift = highbit(MAX(DEV_BSIZE, SPA_MINBLOCKSIZE)) - 1;
+
+	/*
+	 * Don't let the queue aggregate i/os into requests larger than the
+	 * device can take, e.g. in more segments than virtio-blk allows.
+	 */
+	if (dvd->device->max_io_size)
+		vd->vdev_queue.vq_agg_limit = MIN(dvd->device->max_io_size,
+		    SPA_MAXBLOCKSIZE);
 	return 0;
 }
 
@@ -27,49 +27,130 @@
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 #include <sys/avl.h>
+#include <osv/bio.h>
 
 /*
- * These tunables are for performance analysis.
+ * ZFS I/O scheduler
+ * -----------------
+ *
+ * Every i/o to a leaf vdev belongs to one of five classes: sync read, sync
+ * write, async read, async write and scrub (scrub and resilver).  Each
+ * class has its own queue, sorted by offset, and its own limits on the
+ * number of i/os it has active (issued to the device and not yet done):
+ *
+ *  - Whenever a slot frees up, a class which has fewer than its
+ *    zfs_vdev_*_min_active i/os active is served first, in the order of
+ *    the classes above, so sync i/o never waits behind a backlog of async
+ *    writes, and no class is starved.
+ *  - Otherwise the first class with queued i/os and fewer than its
+ *    zfs_vdev_*_max_active active is served.
+ *  - The device never has more than zfs_vdev_max_active i/os in total.
+ *
+ * Within a class, i/os are issued in elevator order, starting at the
+ * offset where the last issued i/o ended.
+ *
+ * The async classes are further limited by a per-vdev queue depth which
+ * adapts to the latency of the device: the completion time of sync i/os
+ * is averaged, and when it exceeds zfs_vdev_sync_latency_target the depth
+ * allowed to the async classes is halved; while sync i/o meets the target
+ * (or there is none), the depth grows by one per target period as long as
+ * the async classes have i/os waiting for it.  So a fast device (e.g.
+ * NVMe or virtio-blk on a fast host) is kept busy with a deep async queue,
+ * while a slow one is not flooded with writes that sync reads would have
+ * to queue behind inside the device.
  */
+int zfs_vdev_max_active = 1000;
+int zfs_vdev_sync_read_min_active = 10;
+int zfs_vdev_sync_read_max_active = 32;
+int zfs_vdev_sync_write_min_active = 10;
+int zfs_vdev_sync_write_max_active = 32;
+int zfs_vdev_async_read_min_active = 1;
+int zfs_vdev_async_read_max_active = 16;
+int zfs_vdev_async_write_min_active = 1;
+int zfs_vdev_async_write_max_active = 32;
+int zfs_vdev_scrub_min_active = 1;
+int zfs_vdev_scrub_max_active = 2;
+
 /*
- * zfs_vdev_max_pending is the maximum number of i/os concurrently
- * pending to each device.  zfs_vdev_min_pending is the initial number
- * of i/os pending to each device (before it starts ramping up to
- * max_pending).
+ * Sync i/o completion time (in microseconds) above which the async queue
+ * depth is cut, and the weight (1 / 2^shift) of each completion in the
+ * moving average of that time.
  */
-int zfs_vdev_max_pending = 10;
-int zfs_vdev_min_pending = 4;
-
-/* deadline = pri + ddi_get_lbolt64() >> time_shift) */
-int zfs_vdev_time_shift = 6;
-
-/* exponential I/O issue ramp-up rate */
-int zfs_vdev_ramp_rate = 2;
+int zfs_vdev_sync_latency_target = 5000;
+int zfs_vdev_latency_shift = 3;
 
 /*
  * To reduce IOPs, we aggregate small adjacent I/Os into one large I/O.
  * For read I/Os, we also aggregate across small adjacency gaps; for writes
  * we include spans of optional I/Os to aid aggregation at the disk even when
- * they aren't able to help us aggregate at this level.
+ * they aren't able to help us aggregate at this level.  An aggregate is
+ * never larger than the device can take in one request (vq_agg_limit,
+ * which reflects e.g. the virtio-blk segment limit).
  */
 int zfs_vdev_aggregation_limit = SPA_MAXBLOCKSIZE;
 int zfs_vdev_read_gap_limit = 32 << 10;
 int zfs_vdev_write_gap_limit = 4 << 10;
 
 SYSCTL_DECL(_vfs_zfs_vdev);
-TUNABLE_INT("vfs.zfs.vdev.max_pending", &zfs_vdev_max_pending);
-SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, max_pending, CTLFLAG_RW,
-    &zfs_vdev_max_pending, 0, "Maximum I/O requests pending on each device");
-TUNABLE_INT("vfs.zfs.vdev.min_pending", &zfs_vdev_min_pending);
-SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, min_pending, CTLFLAG_RW,
-    &zfs_vdev_min_pending, 0,
-    "Initial number of I/O requests pending to each device");
-TUNABLE_INT("vfs.zfs.vdev.time_shift", &zfs_vdev_time_shift);
-SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, time_shift, CTLFLAG_RW,
-    &zfs_vdev_time_shift, 0, "Used for calculating I/O request deadline");
-TUNABLE_INT("vfs.zfs.vdev.ramp_rate", &zfs_vdev_ramp_rate);
-SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, ramp_rate, CTLFLAG_RW,
-    &zfs_vdev_ramp_rate, 0, "Exponential I/O issue ramp-up rate");
+TUNABLE_INT("vfs.zfs.vdev.max_active", &zfs_vdev_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, max_active, CTLFLAG_RW,
+    &zfs_vdev_max_active, 0, "Maximum I/O requests active on each device");
+TUNABLE_INT("vfs.zfs.vdev.sync_read_min_active",
+    &zfs_vdev_sync_read_min_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, sync_read_min_active, CTLFLAG_RW,
+    &zfs_vdev_sync_read_min_active, 0,
+    "Sync read I/O requests always allowed to be active");
+TUNABLE_INT("vfs.zfs.vdev.sync_read_max_active",
+    &zfs_vdev_sync_read_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, sync_read_max_active, CTLFLAG_RW,
+    &zfs_vdev_sync_read_max_active, 0,
+    "Maximum sync read I/O requests active");
+TUNABLE_INT("vfs.zfs.vdev.sync_write_min_active",
+    &zfs_vdev_sync_write_min_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, sync_write_min_active, CTLFLAG_RW,
+    &zfs_vdev_sync_write_min_active, 0,
+    "Sync write I/O requests always allowed to be active");
+TUNABLE_INT("vfs.zfs.vdev.sync_write_max_active",
+    &zfs_vdev_sync_write_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, sync_write_max_active, CTLFLAG_RW,
+    &zfs_vdev_sync_write_max_active, 0,
+    "Maximum sync write I/O requests active");
+TUNABLE_INT("vfs.zfs.vdev.async_read_min_active",
+    &zfs_vdev_async_read_min_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, async_read_min_active, CTLFLAG_RW,
+    &zfs_vdev_async_read_min_active, 0,
+    "Async read I/O requests always allowed to be active");
+TUNABLE_INT("vfs.zfs.vdev.async_read_max_active",
+    &zfs_vdev_async_read_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, async_read_max_active, CTLFLAG_RW,
+    &zfs_vdev_async_read_max_active, 0,
+    "Maximum async read I/O requests active");
+TUNABLE_INT("vfs.zfs.vdev.async_write_min_active",
+    &zfs_vdev_async_write_min_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, async_write_min_active, CTLFLAG_RW,
+    &zfs_vdev_async_write_min_active, 0,
+    "Async write I/O requests always allowed to be active");
+TUNABLE_INT("vfs.zfs.vdev.async_write_max_active",
+    &zfs_vdev_async_write_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, async_write_max_active, CTLFLAG_RW,
+    &zfs_vdev_async_write_max_active, 0,
+    "Maximum async write I/O requests active");
+TUNABLE_INT("vfs.zfs.vdev.scrub_min_active", &zfs_vdev_scrub_min_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, scrub_min_active, CTLFLAG_RW,
+    &zfs_vdev_scrub_min_active, 0,
+    "Scrub I/O requests always allowed to be active");
+TUNABLE_INT("vfs.zfs.vdev.scrub_max_active", &zfs_vdev_scrub_max_active);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, scrub_max_active, CTLFLAG_RW,
+    &zfs_vdev_scrub_max_active, 0, "Maximum scrub I/O requests active");
+TUNABLE_INT("vfs.zfs.vdev.sync_latency_target",
+    &zfs_vdev_sync_latency_target);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, sync_latency_target, CTLFLAG_RW,
+    &zfs_vdev_sync_latency_target, 0,
+    "Sync I/O latency (usec) above which the async queue depth is reduced");
+TUNABLE_INT("vfs.zfs.vdev.latency_shift", &zfs_vdev_latency_shift);
+SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, latency_shift, CTLFLAG_RW,
+    &zfs_vdev_latency_shift, 0,
+    "Weight of each I/O in the sync latency average, as a shift");
 TUNABLE_INT("vfs.zfs.vdev.aggregation_limit", &zfs_vdev_aggregation_limit);
 SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, aggregation_limit, CTLFLAG_RW,
     &zfs_vdev_aggregation_limit, 0,
@@ -87,16 +168,11 @@ SYSCTL_INT(_vfs_zfs_vdev, OID_AUTO, write_gap_limit, CTLFLAG_RW,
  * Virtual device vector for disk I/O scheduling.
  */
 int
-vdev_queue_deadline_compare(const void *x1, const void *x2)
+vdev_queue_offset_compare(const void *x1, const void *x2)
 {
 	const zio_t *z1 = x1;
 	const zio_t *z2 = x2;
 
-	if (z1->io_deadline < z2->io_deadline)
-		return (-1);
-	if (z1->io_deadline > z2->io_deadline)
-		return (1);
-
 	if (z1->io_offset < z2->io_offset)
 		return (-1);
 	if (z1->io_offset > z2->io_offset)
@@ -110,23 +186,80 @@ vdev_queue_deadline_compare(const void *x1, const void *x2)
 	return (0);
 }
 
-int
-vdev_queue_offset_compare(const void *x1, const void *x2)
+static int
+vdev_queue_class_min_active(zio_queue_class_t c)
 {
-	const zio_t *z1 = x1;
-	const zio_t *z2 = x2;
+	switch (c) {
+	case ZIO_QUEUE_SYNC_READ:
+		return (zfs_vdev_sync_read_min_active);
+	case ZIO_QUEUE_SYNC_WRITE:
+		return (zfs_vdev_sync_write_min_active);
+	case ZIO_QUEUE_ASYNC_READ:
+		return (zfs_vdev_async_read_min_active);
+	case ZIO_QUEUE_ASYNC_WRITE:
+		return (zfs_vdev_async_write_min_active);
+	case ZIO_QUEUE_SCRUB:
+		return (zfs_vdev_scrub_min_active);
+	default:
+		panic("invalid queue class %d", c);
+	}
+}
 
-	if (z1->io_offset < z2->io_offset)
-		return (-1);
-	if (z1->io_offset > z2->io_offset)
-		return (1);
+static int
+vdev_queue_async_max_active(void)
+{
+	return (MAX(MAX(zfs_vdev_async_read_max_active,
+	    zfs_vdev_async_write_max_active), zfs_vdev_scrub_max_active));
+}
 
-	if (z1 < z2)
-		return (-1);
-	if (z1 > z2)
-		return (1);
+static int
+vdev_queue_class_max_active(vdev_queue_t *vq, zio_queue_class_t c)
+{
+	int max;
+
+	switch (c) {
+	case ZIO_QUEUE_SYNC_READ:
+		return (zfs_vdev_sync_read_max_active);
+	case ZIO_QUEUE_SYNC_WRITE:
+		return (zfs_vdev_sync_write_max_active);
+	case ZIO_QUEUE_ASYNC_READ:
+		max = zfs_vdev_async_read_max_active;
+		break;
+	case ZIO_QUEUE_ASYNC_WRITE:
+		max = zfs_vdev_async_write_max_active;
+		break;
+	case ZIO_QUEUE_SCRUB:
+		max = zfs_vdev_scrub_max_active;
+		break;
+	default:
+		panic("invalid queue class %d", c);
+	}
 
-	return (0);
+	/* The async classes are also held to the adaptive depth. */
+	return (MAX(MIN(max, (int)vq->vq_async_limit),
+	    vdev_queue_class_min_active(c)));
+}
+
+/*
+ * The class of an i/o follows from its type and its priority.  Cache fills
+ * are done on behalf of sync reads, and resilver writes are scheduled with
+ * the scrub reads which produce them.
+ */
+static zio_queue_class_t
+vdev_queue_class(const zio_t *zio)
+{
+	if (zio->io_priority >= ZIO_PRIORITY_RESILVER)
+		return (ZIO_QUEUE_SCRUB);
+
+	if (zio->io_type == ZIO_TYPE_READ) {
+		if (zio->io_priority <= ZIO_PRIORITY_CACHE_FILL)
+			return (ZIO_QUEUE_SYNC_READ);
+		return (ZIO_QUEUE_ASYNC_READ);
+	}
+
+	if (zio->io_priority <= ZIO_PRIORITY_LOG_WRITE)
+		return (ZIO_QUEUE_SYNC_WRITE);
+	return (ZIO_QUEUE_ASYNC_WRITE);
 }
 
 void
@@ -135,18 +268,24 @@ vdev_queue_init(vdev_t *vd)
 	vdev_queue_t *vq = &vd->vdev_queue;
 
 	mutex_init(&vq->vq_lock, NULL, MUTEX_DEFAULT, NULL);
+	vq->vq_vdev = vd;
 
-	avl_create(&vq->vq_deadline_tree, vdev_queue_deadline_compare,
-	    sizeof (zio_t), offsetof(struct zio, io_deadline_node));
-
-	avl_create(&vq->vq_read_tree, vdev_queue_offset_compare,
-	    sizeof (zio_t), offsetof(struct zio, io_offset_node));
+	for (int c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		avl_create(&vq->vq_class[c].vqc_queued_tree,
+		    vdev_queue_offset_compare, sizeof (zio_t),
+		    offsetof(struct zio, io_offset_node));
+		vq->vq_class[c].vqc_active = 0;
+	}
 
-	avl_create(&vq->vq_write_tree, vdev_queue_offset_compare,
+	avl_create(&vq->vq_active_tree, vdev_queue_offset_compare,
 	    sizeof (zio_t), offsetof(struct zio, io_offset_node));
 
-	avl_create(&vq->vq_pending_tree, vdev_queue_offset_compare,
-	    sizeof (zio_t), offsetof(struct zio, io_offset_node));
+	vq->vq_last_offset = 0;
+	vq->vq_agg_limit = SPA_MAXBLOCKSIZE;
+	vq->vq_async_limit = vdev_queue_async_max_active();
+	vq->vq_sync_latency = 0;
+	vq->vq_sync_time = 0;
+	vq->vq_adjust_time = 0;
 }
 
 void
@@ -154,10 +293,9 @@ vdev_queue_fini(vdev_t *vd)
 {
 	vdev_queue_t *vq = &vd->vdev_queue;
 
-	avl_destroy(&vq->vq_deadline_tree);
-	avl_destroy(&vq->vq_read_tree);
-	avl_destroy(&vq->vq_write_tree);
-	avl_destroy(&vq->vq_pending_tree);
+	for (int c = 0; c < ZIO_QUEUE_CLASSES; c++)
+		avl_destroy(&vq->vq_class[c].vqc_queued_tree);
+	avl_destroy(&vq->vq_active_tree);
 
 	mutex_destroy(&vq->vq_lock);
 }
@@ -165,17 +303,120 @@ vdev_queue_fini(vdev_t *vd)
 static void
 vdev_queue_io_add(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_add(&vq->vq_deadline_tree, zio);
+	zio->io_vdev_tree = &vq->vq_class[zio->io_queue_class].vqc_queued_tree;
 	avl_add(zio->io_vdev_tree, zio);
 }
 
 static void
 vdev_queue_io_remove(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_remove(&vq->vq_deadline_tree, zio);
 	avl_remove(zio->io_vdev_tree, zio);
 }
 
+static void
+vdev_queue_pending_add(vdev_queue_t *vq, zio_t *zio)
+{
+	ASSERT(MUTEX_HELD(&vq->vq_lock));
+	vq->vq_class[zio->io_queue_class].vqc_active++;
+	avl_add(&vq->vq_active_tree, zio);
+	zio->io_timestamp = gethrtime();
+}
+
+static void
+vdev_queue_pending_remove(vdev_queue_t *vq, zio_t *zio)
+{
+	ASSERT(MUTEX_HELD(&vq->vq_lock));
+	ASSERT(vq->vq_class[zio->io_queue_class].vqc_active > 0);
+	vq->vq_class[zio->io_queue_class].vqc_active--;
+	avl_remove(&vq->vq_active_tree, zio);
+}
+
+static boolean_t
+vdev_queue_async_saturated(vdev_queue_t *vq)
+{
+	for (int c = ZIO_QUEUE_ASYNC_READ; c < ZIO_QUEUE_CLASSES; c++) {
+		vdev_queue_class_t *vqc = &vq->vq_class[c];
+		if (avl_numnodes(&vqc->vqc_queued_tree) > 0 &&
+		    vqc->vqc_active >= vdev_queue_class_max_active(vq, c))
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Adapts the async queue depth to the latency of a completed i/o: halve it
+ * when recent sync i/o is slower than the target, grow it by one when the
+ * async classes are held back by it.  Either happens at most once per
+ * target period, so the effect of a change is seen before the next one.
+ */
+static void
+vdev_queue_adapt(vdev_queue_t *vq, zio_t *zio)
+{
+	hrtime_t now = gethrtime();
+	hrtime_t target = (hrtime_t)zfs_vdev_sync_latency_target *
+	    (NANOSEC / MICROSEC);
+	boolean_t congested;
+
+	ASSERT(MUTEX_HELD(&vq->vq_lock));
+
+	if (zio->io_queue_class == ZIO_QUEUE_SYNC_READ ||
+	    zio->io_queue_class == ZIO_QUEUE_SYNC_WRITE) {
+		hrtime_t latency = now - zio->io_timestamp;
+		vq->vq_sync_latency += (latency - vq->vq_sync_latency) >>
+		    zfs_vdev_latency_shift;
+		vq->vq_sync_time = now;
+	}
+
+	if (now - vq->vq_adjust_time < target)
+		return;
+
+	/* An average which no sync i/o refreshed lately means nothing. */
+	congested = vq->vq_sync_latency > target &&
+	    now - vq->vq_sync_time < 16 * target;
+
+	if (congested && vq->vq_async_limit > 1) {
+		vq->vq_async_limit /= 2;
+		vq->vq_adjust_time = now;
+	} else if (!congested &&
+	    vq->vq_async_limit < vdev_queue_async_max_active() &&
+	    vdev_queue_async_saturated(vq)) {
+		vq->vq_async_limit++;
+		vq->vq_adjust_time = now;
+	}
+}
+
+/*
+ * Returns the class to issue the next i/o from, or ZIO_QUEUE_CLASSES if
+ * none may issue now.
+ */
+static zio_queue_class_t
+vdev_queue_class_to_issue(vdev_queue_t *vq)
+{
+	vdev_queue_class_t *vqc;
+	int c;
+
+	if (avl_numnodes(&vq->vq_active_tree) >= zfs_vdev_max_active)
+		return (ZIO_QUEUE_CLASSES);
+
+	/* Find a class which has not reached its minimum of active i/os. */
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		vqc = &vq->vq_class[c];
+		if (avl_numnodes(&vqc->vqc_queued_tree) > 0 &&
+		    vqc->vqc_active < vdev_queue_class_min_active(c))
+			return (c);
+	}
+
+	/* Otherwise, one which has not reached its maximum. */
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		vqc = &vq->vq_class[c];
+		if (avl_numnodes(&vqc->vqc_queued_tree) > 0 &&
+		    vqc->vqc_active < vdev_queue_class_max_active(vq, c))
+			return (c);
+	}
+
+	return (ZIO_QUEUE_CLASSES);
+}
+
 static void
 vdev_queue_agg_io_done(zio_t *aio)
 {
@@ -198,172 +439,205 @@ vdev_queue_agg_io_done(zio_t *aio)
 #define	IO_SPAN(fio, lio) ((lio)->io_offset + (lio)->io_size - (fio)->io_offset)
 #define	IO_GAP(fio, lio) (-IO_SPAN(lio, fio))
 
+/*
+ * Aggregates the queued i/os of the same class around zio into one, and
+ * returns the aggregate, or NULL if there was nothing to aggregate with.
+ */
 static zio_t *
-vdev_queue_io_to_issue(vdev_queue_t *vq, uint64_t pending_limit)
+vdev_queue_aggregate(vdev_queue_t *vq, zio_t *zio)
 {
 	zio_t *fio, *lio, *aio, *dio, *nio, *mio;
 	avl_tree_t *t;
 	int flags;
-	uint64_t maxspan = zfs_vdev_aggregation_limit;
+	uint64_t maxspan = MIN(zfs_vdev_aggregation_limit, vq->vq_agg_limit);
 	uint64_t maxgap;
 	int stretch;
 
-again:
 	ASSERT(MUTEX_HELD(&vq->vq_lock));
 
-	if (avl_numnodes(&vq->vq_pending_tree) >= pending_limit ||
-	    avl_numnodes(&vq->vq_deadline_tree) == 0)
-		return (NULL);
-
-	fio = lio = avl_first(&vq->vq_deadline_tree);
-
+	fio = lio = zio;
 	t = fio->io_vdev_tree;
 	flags = fio->io_flags & ZIO_FLAG_AGG_INHERIT;
-	maxgap = (t == &vq->vq_read_tree) ? zfs_vdev_read_gap_limit : 0;
+	maxgap = (fio->io_type == ZIO_TYPE_READ) ? zfs_vdev_read_gap_limit : 0;
 
-	if (!(flags & ZIO_FLAG_DONT_AGGREGATE)) {
-		/*
-		 * We can aggregate I/Os that are sufficiently adjacent and of
-		 * the same flavor, as expressed by the AGG_INHERIT flags.
-		 * The latter requirement is necessary so that certain
-		 * attributes of the I/O, such as whether it's a normal I/O
-		 * or a scrub/resilver, can be preserved in the aggregate.
-		 * We can include optional I/Os, but don't allow them
-		 * to begin a range as they add no benefit in that situation.
-		 */
+	if (flags & ZIO_FLAG_DONT_AGGREGATE)
+		return (NULL);
 
-		/*
-		 * We keep track of the last non-optional I/O.
-		 */
-		mio = (fio->io_flags & ZIO_FLAG_OPTIONAL) ? NULL : fio;
+	/*
+	 * We can aggregate I/Os that are sufficiently adjacent and of
+	 * the same flavor, as expressed by the AGG_INHERIT flags.
+	 * The latter requirement is necessary so that certain
+	 * attributes of the I/O, such as whether it's a normal I/O
+	 * or a scrub/resilver, can be preserved in the aggregate.
+	 * We can include optional I/Os, but don't allow them
+	 * to begin a range as they add no benefit in that situation.
+	 */
 
-		/*
-		 * Walk backwards through sufficiently contiguous I/Os
-		 * recording the last non-option I/O.
-		 */
-		while ((dio = AVL_PREV(t, fio)) != NULL &&
-		    (dio->io_flags & ZIO_FLAG_AGG_INHERIT) == flags &&
-		    IO_SPAN(dio, lio) <= maxspan &&
-		    IO_GAP(dio, fio) <= maxgap) {
-			fio = dio;
-			if (mio == NULL && !(fio->io_flags & ZIO_FLAG_OPTIONAL))
-				mio = fio;
-		}
+	/*
+	 * We keep track of the last non-optional I/O.
+	 */
+	mio = (fio->io_flags & ZIO_FLAG_OPTIONAL) ? NULL : fio;
 
-		/*
-		 * Skip any initial optional I/Os.
-		 */
-		while ((fio->io_flags & ZIO_FLAG_OPTIONAL) && fio != lio) {
-			fio = AVL_NEXT(t, fio);
-			ASSERT(fio != NULL);
-		}
+	/*
+	 * Walk backwards through sufficiently contiguous I/Os
+	 * recording the last non-option I/O.
+	 */
+	while ((dio = AVL_PREV(t, fio)) != NULL &&
+	    (dio->io_flags & ZIO_FLAG_AGG_INHERIT) == flags &&
+	    IO_SPAN(dio, lio) <= maxspan &&
+	    IO_GAP(dio, fio) <= maxgap) {
+		fio = dio;
+		if (mio == NULL && !(fio->io_flags & ZIO_FLAG_OPTIONAL))
+			mio = fio;
+	}
 
-		/*
-		 * Walk forward through sufficiently contiguous I/Os.
-		 */
-		while ((dio = AVL_NEXT(t, lio)) != NULL &&
-		    (dio->io_flags & ZIO_FLAG_AGG_INHERIT) == flags &&
-		    IO_SPAN(fio, dio) <= maxspan &&
-		    IO_GAP(lio, dio) <= maxgap) {
-			lio = dio;
-			if (!(lio->io_flags & ZIO_FLAG_OPTIONAL))
-				mio = lio;
-		}
+	/*
+	 * Skip any initial optional I/Os.
+	 */
+	while ((fio->io_flags & ZIO_FLAG_OPTIONAL) && fio != lio) {
+		fio = AVL_NEXT(t, fio);
+		ASSERT(fio != NULL);
+	}
 
-		/*
-		 * Now that we've established the range of the I/O aggregation
-		 * we must decide what to do with trailing optional I/Os.
-		 * For reads, there's nothing to do. While we are unable to
-		 * aggregate further, it's possible that a trailing optional
-		 * I/O would allow the underlying device to aggregate with
-		 * subsequent I/Os. We must therefore determine if the next
-		 * non-optional I/O is close enough to make aggregation
-		 * worthwhile.
-		 */
-		stretch = B_FALSE;
-		if (t != &vq->vq_read_tree && mio != NULL) {
-			nio = lio;
-			while ((dio = AVL_NEXT(t, nio)) != NULL &&
-			    IO_GAP(nio, dio) == 0 &&
-			    IO_GAP(mio, dio) <= zfs_vdev_write_gap_limit) {
-				nio = dio;
-				if (!(nio->io_flags & ZIO_FLAG_OPTIONAL)) {
-					stretch = B_TRUE;
-					break;
-				}
+	/*
+	 * Walk forward through sufficiently contiguous I/Os.
+	 */
+	while ((dio = AVL_NEXT(t, lio)) != NULL &&
+	    (dio->io_flags & ZIO_FLAG_AGG_INHERIT) == flags &&
+	    IO_SPAN(fio, dio) <= maxspan &&
+	    IO_GAP(lio, dio) <= maxgap) {
+		lio = dio;
+		if (!(lio->io_flags & ZIO_FLAG_OPTIONAL))
+			mio = lio;
+	}
+
+	/*
+	 * Now that we've established the range of the I/O aggregation
+	 * we must decide what to do with trailing optional I/Os.
+	 * For reads, there's nothing to do. While we are unable to
+	 * aggregate further, it's possible that a trailing optional
+	 * I/O would allow the underlying device to aggregate with
+	 * subsequent I/Os. We must therefore determine if the next
+	 * non-optional I/O is close enough to make aggregation
+	 * worthwhile.
+	 */
+	stretch = B_FALSE;
+	if (fio->io_type == ZIO_TYPE_WRITE && mio != NULL) {
+		nio = lio;
+		while ((dio = AVL_NEXT(t, nio)) != NULL &&
+		    IO_GAP(nio, dio) == 0 &&
+		    IO_GAP(mio, dio) <= zfs_vdev_write_gap_limit) {
+			nio = dio;
+			if (!(nio->io_flags & ZIO_FLAG_OPTIONAL)) {
+				stretch = B_TRUE;
+				break;
 			}
 		}
+	}
 
-		if (stretch) {
-			/* This may be a no-op. */
-			VERIFY((dio = AVL_NEXT(t, lio)) != NULL);
-			dio->io_flags &= ~ZIO_FLAG_OPTIONAL;
-		} else {
-			while (lio != mio && lio != fio) {
-				ASSERT(lio->io_flags & ZIO_FLAG_OPTIONAL);
-				lio = AVL_PREV(t, lio);
-				ASSERT(lio != NULL);
-			}
+	if (stretch) {
+		/* This may be a no-op. */
+		VERIFY((dio = AVL_NEXT(t, lio)) != NULL);
+		dio->io_flags &= ~ZIO_FLAG_OPTIONAL;
+	} else {
+		while (lio != mio && lio != fio) {
+			ASSERT(lio->io_flags & ZIO_FLAG_OPTIONAL);
+			lio = AVL_PREV(t, lio);
+			ASSERT(lio != NULL);
 		}
 	}
 
-	if (fio != lio) {
-		uint64_t size = IO_SPAN(fio, lio);
-		ASSERT(size <= zfs_vdev_aggregation_limit);
-
-		aio = zio_vdev_delegated_io(fio->io_vd, fio->io_offset,
-		    zio_buf_alloc(size), size, fio->io_type, ZIO_PRIORITY_AGG,
-		    flags | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE,
-		    vdev_queue_agg_io_done, NULL);
-
-		nio = fio;
-		do {
-			dio = nio;
-			nio = AVL_NEXT(t, dio);
-			ASSERT(dio->io_type == aio->io_type);
-			ASSERT(dio->io_vdev_tree == t);
-
-			if (dio->io_flags & ZIO_FLAG_NODATA) {
-				ASSERT(dio->io_type == ZIO_TYPE_WRITE);
-				bzero((char *)aio->io_data + (dio->io_offset -
-				    aio->io_offset), dio->io_size);
-			} else if (dio->io_type == ZIO_TYPE_WRITE) {
-				bcopy(dio->io_data, (char *)aio->io_data +
-				    (dio->io_offset - aio->io_offset),
-				    dio->io_size);
-			}
+	if (fio == lio)
+		return (NULL);
 
-			zio_add_child(dio, aio);
-			vdev_queue_io_remove(vq, dio);
-			zio_vdev_io_bypass(dio);
-			zio_execute(dio);
-		} while (dio != lio);
+	uint64_t size = IO_SPAN(fio, lio);
+	ASSERT(size <= maxspan);
+
+	aio = zio_vdev_delegated_io(fio->io_vd, fio->io_offset,
+	    zio_buf_alloc(size), size, fio->io_type, ZIO_PRIORITY_AGG,
+	    flags | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE,
+	    vdev_queue_agg_io_done, NULL);
+	aio->io_queue_class = fio->io_queue_class;
+
+	nio = fio;
+	do {
+		dio = nio;
+		nio = AVL_NEXT(t, dio);
+		ASSERT(dio->io_type == aio->io_type);
+		ASSERT(dio->io_vdev_tree == t);
+
+		if (dio->io_flags & ZIO_FLAG_NODATA) {
+			ASSERT(dio->io_type == ZIO_TYPE_WRITE);
+			bzero((char *)aio->io_data + (dio->io_offset -
+			    aio->io_offset), dio->io_size);
+		} else if (dio->io_type == ZIO_TYPE_WRITE) {
+			bcopy(dio->io_data, (char *)aio->io_data +
+			    (dio->io_offset - aio->io_offset),
+			    dio->io_size);
+		}
 
-		avl_add(&vq->vq_pending_tree, aio);
+		zio_add_child(dio, aio);
+		vdev_queue_io_remove(vq, dio);
+		zio_vdev_io_bypass(dio);
+		zio_execute(dio);
+	} while (dio != lio);
 
-		return (aio);
-	}
+	return (aio);
+}
 
-	ASSERT(fio->io_vdev_tree == t);
-	vdev_queue_io_remove(vq, fio);
+static zio_t *
+vdev_queue_io_to_issue(vdev_queue_t *vq)
+{
+	zio_t *zio, *aio;
+	zio_queue_class_t c;
+	avl_tree_t *tree;
+	avl_index_t idx;
+	zio_t search;
+
+again:
+	ASSERT(MUTEX_HELD(&vq->vq_lock));
+
+	c = vdev_queue_class_to_issue(vq);
+	if (c == ZIO_QUEUE_CLASSES)
+		return (NULL);
 
 	/*
-	 * If the I/O is or was optional and therefore has no data, we need to
-	 * simply discard it. We need to drop the vdev queue's lock to avoid a
-	 * deadlock that we could encounter since this I/O will complete
-	 * immediately.
+	 * Continue the elevator from where the last i/o ended, wrapping
+	 * around to the lowest offset queued.
 	 */
-	if (fio->io_flags & ZIO_FLAG_NODATA) {
-		mutex_exit(&vq->vq_lock);
-		zio_vdev_io_bypass(fio);
-		zio_execute(fio);
-		mutex_enter(&vq->vq_lock);
-		goto again;
+	tree = &vq->vq_class[c].vqc_queued_tree;
+	search.io_offset = vq->vq_last_offset;
+	VERIFY(avl_find(tree, &search, &idx) == NULL);
+	zio = avl_nearest(tree, idx, AVL_AFTER);
+	if (zio == NULL)
+		zio = avl_first(tree);
+	ASSERT3U(zio->io_queue_class, ==, c);
+
+	aio = vdev_queue_aggregate(vq, zio);
+	if (aio != NULL) {
+		zio = aio;
+	} else {
+		vdev_queue_io_remove(vq, zio);
+
+		/*
+		 * If the I/O is or was optional and therefore has no data, we
+		 * need to simply discard it. We need to drop the vdev queue's
+		 * lock to avoid a deadlock that we could encounter since this
+		 * I/O will complete immediately.
+		 */
+		if (zio->io_flags & ZIO_FLAG_NODATA) {
+			mutex_exit(&vq->vq_lock);
+			zio_vdev_io_bypass(zio);
+			zio_execute(zio);
+			mutex_enter(&vq->vq_lock);
+			goto again;
+		}
 	}
 
-	avl_add(&vq->vq_pending_tree, fio);
+	vdev_queue_pending_add(vq, zio);
+	vq->vq_last_offset = zio->io_offset + zio->io_size;
 
-	return (fio);
+	return (zio);
 }
 
 zio_t *
@@ -378,20 +652,13 @@ vdev_queue_io(zio_t *zio)
 		return (zio);
 
 	zio->io_flags |= ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE;
-
-	if (zio->io_type == ZIO_TYPE_READ)
-		zio->io_vdev_tree = &vq->vq_read_tree;
-	else
-		zio->io_vdev_tree = &vq->vq_write_tree;
+	zio->io_queue_class = vdev_queue_class(zio);
 
 	mutex_enter(&vq->vq_lock);
 
-	zio->io_deadline = (ddi_get_lbolt64() >> zfs_vdev_time_shift) +
-	    zio->io_priority;
-
 	vdev_queue_io_add(vq, zio);
 
-	nio = vdev_queue_io_to_issue(vq, zfs_vdev_min_pending);
+	nio = vdev_queue_io_to_issue(vq);
 
 	mutex_exit(&vq->vq_lock);
 
@@ -410,15 +677,16 @@ void
 vdev_queue_io_done(zio_t *zio)
 {
 	vdev_queue_t *vq = &zio->io_vd->vdev_queue;
+	zio_t *nio;
 
 	mutex_enter(&vq->vq_lock);
 
-	avl_remove(&vq->vq_pending_tree, zio);
+	vdev_queue_pending_remove(vq, zio);
+	vdev_queue_adapt(vq, zio);
 
-	for (int i = 0; i < zfs_vdev_ramp_rate; i++) {
-		zio_t *nio = vdev_queue_io_to_issue(vq, zfs_vdev_max_pending);
-		if (nio == NULL)
-			break;
+	/* Let the device see all the new I/Os at once. */
+	bio_plug();
+	while ((nio = vdev_queue_io_to_issue(vq)) != NULL) {
 		mutex_exit(&vq->vq_lock);
 		if (nio->io_done == vdev_queue_agg_io_done) {
 			zio_nowait(nio);
@@ -430,4 +698,5 @@ vdev_queue_io_done(zio_t *zio)
 	}
 
 	mutex_exit(&vq->vq_lock);
+	bio_unplug();
 }
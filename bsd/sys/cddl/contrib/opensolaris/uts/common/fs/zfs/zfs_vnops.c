@@ -764,6 +764,32 @@ zfs_arc(vnode_t *vp, struct file* fp, uio_t *uio)
 	return (error);
 }
 
+/*
+ * Start reading a range of a file into the ARC, without waiting for it.
+ * Called by the VFS readahead, ahead of sequential and strided readers.
+ *
+ *	IN:	vp	- vnode of file to be read.
+ *		off	- offset of the range.
+ *		len	- length of the range.
+ *
+ *	RETURN:	0 (readahead is a hint)
+ */
+static int
+zfs_readahead(vnode_t *vp, off_t off, off_t len)
+{
+	znode_t		*zp = VTOZ(vp);
+	zfsvfs_t	*zfsvfs = zp->z_zfsvfs;
+
+	ZFS_ENTER(zfsvfs);
+	ZFS_VERIFY_ZP(zp);
+	if (off >= 0 && len > 0 && (uint64_t)off < zp->z_size) {
+		dmu_prefetch(zfsvfs->z_os, zp->z_id, off,
+		    MIN((uint64_t)len, zp->z_size - off));
+	}
+	ZFS_EXIT(zfsvfs);
+	return (0);
+}
+
 /*
  * Write the bytes to a file.
  *
@@ -5114,4 +5140,5 @@ struct vnops zfs_vnops = {
 	zfs_fallocate,			/* fallocate */
 	zfs_readlink,			/* read link */
 	zfs_symlink,			/* symbolic link */
+	zfs_readahead,			/* readahead */
 };
@@ -505,6 +505,19 @@ static void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+void SHA256_Transform_blocks_generic(SHA256_CTX* context, const sha2_byte *data, size_t nblocks) {
+	while (nblocks--) {
+		SHA256_Transform(context, (const sha2_word32*)data);
+		data += SHA256_BLOCK_LENGTH;
+	}
+}
+
+#if !defined(__x86_64__)
+void SHA256_Transform_blocks(SHA256_CTX* context, const sha2_byte *data, size_t nblocks) {
+	SHA256_Transform_blocks_generic(context, data, nblocks);
+}
+#endif
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -537,12 +550,13 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
-	while (len >= SHA256_BLOCK_LENGTH) {
+	if (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA256_Transform(context, (const sha2_word32*)data);
-		context->bitcount += SHA256_BLOCK_LENGTH << 3;
-		len -= SHA256_BLOCK_LENGTH;
-		data += SHA256_BLOCK_LENGTH;
+		size_t nblocks = len / SHA256_BLOCK_LENGTH;
+		SHA256_Transform_blocks(context, data, nblocks);
+		context->bitcount += (sha2_word64)nblocks * SHA256_BLOCK_LENGTH << 3;
+		len -= nblocks * SHA256_BLOCK_LENGTH;
+		data += nblocks * SHA256_BLOCK_LENGTH;
 	}
 	if (len > 0) {
 		/* There's left-overs, so save 'em */
@@ -120,6 +120,13 @@ void SHA256_Update(SHA256_CTX*, const u_int8_t*, size_t);
 void SHA256_Final(u_int8_t[SHA256_DIGEST_LENGTH], SHA256_CTX*);
 char* SHA256_End(SHA256_CTX*, char[SHA256_DIGEST_STRING_LENGTH]);
 char* SHA256_Data(const u_int8_t*, size_t, char[SHA256_DIGEST_STRING_LENGTH]);
+/*
+ * Hash nblocks whole blocks into the context's state (not its bit count).
+ * On x64, SHA256_Transform_blocks() uses the SHA extensions when the cpu
+ * has them; SHA256_Transform_blocks_generic() is the portable version.
+ */
+void SHA256_Transform_blocks(SHA256_CTX*, const u_int8_t*, size_t);
+void SHA256_Transform_blocks_generic(SHA256_CTX*, const u_int8_t*, size_t);
 
 void SHA384_Init(SHA384_CTX*);
 void SHA384_Update(SHA384_CTX*, const u_int8_t*, size_t);
@@ -1119,7 +1119,8 @@ xn_rxeof(struct netfront_info *np)
                  * If LRO fails, pass up to the stack
                  * directly.
                  */
-                (*ifp->if_input)(ifp, m);
+                if (!ifp->if_classifier.post_packet(m))
+                    (*ifp->if_input)(ifp, m);
             }
 #else
             (*ifp->if_input)(ifp, m);
@@ -39,12 +39,14 @@
 #include <osv/socket.hh>
 #include <osv/initialize.hh>
 #include <osv/poll.h>
+#include <osv/pagecache.hh>
 
 #include <bsd/sys/sys/libkern.h>
 #include <bsd/sys/sys/param.h>
 #include <bsd/sys/sys/protosw.h>
 #include <bsd/sys/sys/socket.h>
 #include <bsd/sys/sys/socketvar.h>
+#include <bsd/sys/sys/mbuf.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/net/route.h>
 #include <bsd/sys/net/vnet.h>
@@ -56,6 +58,7 @@
 #include <bsd/sys/netinet/tcp_fsm.h>
 
 #include <mutex>
+#include <algorithm>
 
 using namespace std;
 
@@ -99,6 +102,69 @@ socket_file::write(struct uio *uio, int flags)
     return (error);
 }
 
+static void
+sendfile_free_page(void *arg1, void *arg2)
+{
+    pagecache::unlend(static_cast<pagecache::page_lender*>(arg1));
+}
+
+/*
+ * Wrap len bytes of fp's page cache, from offset, in a chain of read-only
+ * external mbufs. Each mbuf holds a page lent by the page cache, which is
+ * returned when the mbuf is freed, i.e. when TCP has the data acked.
+ */
+static struct mbuf *
+sendfile_lend_pages(vfs_file *fp, off_t offset, size_t len)
+{
+    struct mbuf *top = nullptr, **tail = &top;
+
+    while (len) {
+        size_t page_off = offset % mmu::page_size;
+        size_t n = std::min(len, mmu::page_size - page_off);
+        auto loan = pagecache::lend(fp, offset - page_off);
+        struct mbuf *m = top ? m_get(M_WAITOK, MT_DATA) :
+            m_gethdr(M_WAITOK, MT_DATA);
+        m_extadd(m, static_cast<caddr_t>(loan.addr), mmu::page_size,
+            sendfile_free_page, loan.lender, nullptr, M_RDONLY, EXT_MOD_TYPE);
+        m->m_hdr.mh_data += page_off;
+        m->m_hdr.mh_len = n;
+        *tail = m;
+        tail = &m->m_hdr.mh_next;
+        top->M_dat.MH.MH_pkthdr.len += n;
+        offset += n;
+        len -= n;
+    }
+    return top;
+}
+
+/*
+ * sendfile() without copying: lends the page cache pages of fp to the
+ * socket's send buffer. On return, sent holds the number of bytes queued;
+ * an error is only returned if nothing could be.
+ */
+int
+socket_file::sendfile(vfs_file *fp, off_t offset, size_t count, size_t& sent)
+{
+    sent = 0;
+    while (sent < count) {
+        /*
+         * sosend() queues a chain of mbufs all at once, so don't hand it
+         * more than fits (or will soon fit) in the send buffer.
+         */
+        long space = std::max(sbspace(&so->so_snd), (long)so->so_snd.sb_lowat);
+        size_t chunk = std::min({count - sent, (size_t)space,
+            (size_t)so->so_snd.sb_hiwat});
+        struct mbuf *top = sendfile_lend_pages(fp, offset + sent, chunk);
+        /* sosend() frees top on failure */
+        int error = sosend(so, nullptr, nullptr, top, nullptr, 0, nullptr);
+        if (error) {
+            return sent ? 0 : error;
+        }
+        sent += chunk;
+    }
+    return 0;
+}
+
 int
 socket_file::truncate(off_t length)
 {
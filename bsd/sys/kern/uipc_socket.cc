@@ -588,6 +588,52 @@ static void flush_net_channel(struct socket *so)
 	}
 }
 
+/*
+ * Make the socket consume packets from a net channel, and let the channel
+ * wake up the socket's pollers directly.  Called with the socket locked.
+ */
+void
+so_set_net_channel(struct socket *so, net_channel *nc)
+{
+	SOCK_LOCK_ASSERT(so);
+	so->so_nc = nc;
+	if (so->fp) {
+		WITH_LOCK(so->fp->f_lock) {
+			for (auto&& pl : so->fp->f_poll_list) {
+				nc->add_poller(*pl._req);
+			}
+			if (so->fp->f_epolls) {
+				for (auto&& ep : *so->fp->f_epolls) {
+					nc->add_epoll(ep);
+				}
+			}
+		}
+	}
+}
+
+void
+so_clear_net_channel(struct socket *so)
+{
+	SOCK_LOCK_ASSERT(so);
+	auto nc = so->so_nc;
+	if (!nc) {
+		return;
+	}
+	if (so->fp) {
+		WITH_LOCK(so->fp->f_lock) {
+			for (auto&& pl : so->fp->f_poll_list) {
+				nc->del_poller(*pl._req);
+			}
+			if (so->fp->f_epolls) {
+				for (auto&& ep : *so->fp->f_epolls) {
+					nc->del_epoll(ep);
+				}
+			}
+		}
+	}
+	so->so_nc = nullptr;
+}
+
 /*
  * Close a socket on last file table reference removal.  Initiate disconnect
  * if connected.  Free socket when disconnect complete.
@@ -2394,6 +2440,7 @@ soreceive_dgram(struct socket *so, struct bsd_sockaddr **psa, struct uio *uio,
 	 * Loop blocking while waiting for a datagram.
 	 */
 	SOCK_LOCK(so);
+	flush_net_channel(so);
 	while ((m = so->so_rcv.sb_mb) == NULL) {
 		KASSERT(so->so_rcv.sb_cc == 0,
 		    ("soreceive_dgram: sb_mb NULL but sb_cc %u",
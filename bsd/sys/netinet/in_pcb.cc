@@ -121,6 +121,7 @@ static VNET_DEFINE(int, ipport_tcplastcount);
 #define	V_ipport_tcplastcount		VNET(ipport_tcplastcount)
 
 static void	in_pcbremlists(struct inpcb *inp);
+static void	in_pcbunhash(struct inpcb *inp);
 #ifdef INET
 static struct inpcb	*in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo,
 			    struct in_addr faddr, u_int fport_arg,
@@ -219,6 +220,11 @@ in_pcbinfo_init(struct inpcbinfo *pcbinfo, const char *name,
 	pcbinfo->ipi_count = 0;
 	pcbinfo->ipi_hashbase = (inpcbhead *)hashinit(hash_nelements, 0,
 	    &pcbinfo->ipi_hashmask);
+	pcbinfo->ipi_hashlockmask = MIN(INP_HASHLOCKS, pcbinfo->ipi_hashmask + 1) - 1;
+	pcbinfo->ipi_hashlocks = (inpcbhashlock *)malloc(
+	    (pcbinfo->ipi_hashlockmask + 1) * sizeof(struct inpcbhashlock));
+	for (u_long i = 0; i <= pcbinfo->ipi_hashlockmask; i++)
+		mutex_init(&pcbinfo->ipi_hashlocks[i].ihl_lock);
 	pcbinfo->ipi_porthashbase = (inpcbporthead *)hashinit(porthash_nelements, 0,
 	    &pcbinfo->ipi_porthashmask);
 	// FIXME: uma_zone_set_max(pcbinfo->ipi_zone, maxsockets);
@@ -237,6 +243,9 @@ in_pcbinfo_destroy(struct inpcbinfo *pcbinfo)
 	hashdestroy(pcbinfo->ipi_hashbase, 0, pcbinfo->ipi_hashmask);
 	hashdestroy(pcbinfo->ipi_porthashbase, 0,
 	    pcbinfo->ipi_porthashmask);
+	for (u_long i = 0; i <= pcbinfo->ipi_hashlockmask; i++)
+		mutex_destroy(&pcbinfo->ipi_hashlocks[i].ihl_lock);
+	free(pcbinfo->ipi_hashlocks);
 	INP_HASH_LOCK_DESTROY(pcbinfo);
 	INP_INFO_LOCK_DESTROY(pcbinfo);
 }
@@ -1087,17 +1096,9 @@ in_pcbdrop(struct inpcb *inp)
 	 */
 	inp->inp_flags |= INP_DROPPED;
 	if (inp->inp_flags & INP_INHASHLIST) {
-		struct inpcbport *phd = inp->inp_phd;
-
 		INP_HASH_WLOCK(inp->inp_pcbinfo);
-		LIST_REMOVE(inp, inp_hash);
-		LIST_REMOVE(inp, inp_portlist);
-		if (LIST_FIRST(&phd->phd_pcblist) == NULL) {
-			LIST_REMOVE(phd, phd_hash);
-			free(phd);
-		}
+		in_pcbunhash(inp);
 		INP_HASH_WUNLOCK(inp->inp_pcbinfo);
-		inp->inp_flags &= ~INP_INHASHLIST;
 	}
 }
 
@@ -1341,30 +1342,15 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 #undef INP_LOOKUP_MAPPED_PCB_COST
 
 /*
- * Lookup PCB in hash list, using pcbinfo tables.  This variation assumes
- * that the caller has locked the hash list, and will not perform any further
- * locking or reference operations on either the hash list or the connection.
+ * Look for a connected PCB matching the 4-tuple in the connection hash
+ * chain head, which the caller has locked.
  */
 static struct inpcb *
-in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
-    u_int fport_arg, struct in_addr laddr, u_int lport_arg, int lookupflags,
-    struct ifnet *ifp)
+in_pcblookup_exact(struct inpcbhead *head, struct in_addr faddr,
+    u_short fport, struct in_addr laddr, u_short lport)
 {
-	struct inpcbhead *head;
-	struct inpcb *inp, *tmpinp;
-	u_short fport = fport_arg, lport = lport_arg;
-
-	KASSERT((lookupflags & ~(INPLOOKUP_WILDCARD)) == 0,
-	    ("%s: invalid lookup flags %d", __func__, lookupflags));
-
-	INP_HASH_LOCK_ASSERT(pcbinfo);
+	struct inpcb *inp;
 
-	/*
-	 * First look for an exact match.
-	 */
-	tmpinp = NULL;
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
 	LIST_FOREACH(inp, head, inp_hash) {
 #ifdef INET6
 		/* XXX inp locking */
@@ -1374,118 +1360,205 @@ in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		if (inp->inp_faddr.s_addr == faddr.s_addr &&
 		    inp->inp_laddr.s_addr == laddr.s_addr &&
 		    inp->inp_fport == fport &&
-		    inp->inp_lport == lport) {
-			/*
-			 * XXX We should be able to directly return
-			 * the inp here, without any checks.
-			 * Well unless both bound with SO_REUSEPORT?
-			 */
-			if (tmpinp == NULL)
-				tmpinp = inp;
-		}
+		    inp->inp_lport == lport)
+			return (inp);
 	}
-	if (tmpinp != NULL)
-		return (tmpinp);
+	return (NULL);
+}
 
-	/*
-	 * Then look for a wildcard match, if requested.
-	 */
-	if ((lookupflags & INPLOOKUP_WILDCARD) != 0) {
-		struct inpcb *local_wild = NULL, *local_exact = NULL;
-#ifdef INET6
-		struct inpcb *local_wild_mapped = NULL;
-#endif
-		struct inpcb *jail_wild = NULL;
-		int injail;
+/*
+ * Listening TCP sockets bound to the same address and port with
+ * SO_REUSEPORT form a group, and new connections are spread over its
+ * members by a hash of the 4-tuple, so that each listener - typically one
+ * per worker thread - gets its own share of the connections in its own
+ * accept queue.  The same 4-tuple selects the same member as long as the
+ * group does not change, so the ACK completing a handshake finds the
+ * listener which got the SYN.
+ */
+static inline int
+in_pcbgroup_member(struct inpcb *inp, struct in_addr laddr, u_short lport)
+{
 
-		/*
-		 * Order of socket selection - we always prefer jails.
-		 *      1. jailed, non-wild.
-		 *      2. jailed, wild.
-		 *      3. non-jailed, non-wild.
-		 *      4. non-jailed, wild.
-		 */
+	return ((inp->inp_flags2 & INP_REUSEPORT) != 0 &&
+	    inp->inp_socket != NULL &&
+	    (inp->inp_socket->so_options & SO_ACCEPTCONN) != 0 &&
+	    inp->inp_faddr.s_addr == INADDR_ANY &&
+	    inp->inp_laddr.s_addr == laddr.s_addr &&
+	    inp->inp_lport == lport);
+}
 
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport,
-		    0, pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+static struct inpcb *
+in_pcbgroup_select(struct inpcbhead *head, struct inpcb *first,
+    struct in_addr faddr, u_short fport, struct in_addr laddr, u_short lport)
+{
+	struct inpcb *inp;
+	u_int members = 0, n;
+
+	if (!in_pcbgroup_member(first, laddr, lport))
+		return (first);
+	LIST_FOREACH(inp, head, inp_hash) {
+		if (in_pcbgroup_member(inp, laddr, lport))
+			members++;
+	}
+	if (members < 2)
+		return (first);
+	n = (faddr.s_addr ^ laddr.s_addr ^ (fport << 16 | lport)) *
+	    2654435761u;
+	n = (n >> 16) % members;
+	LIST_FOREACH(inp, head, inp_hash) {
+		if (in_pcbgroup_member(inp, laddr, lport) && n-- == 0)
+			return (inp);
+	}
+	return (first);
+}
+
+/*
+ * Look for an unconnected PCB bound to lport, which would accept a
+ * connection or datagram from { faddr, fport } to laddr, in the wildcard
+ * hash chain head, which the caller has locked.
+ */
+static struct inpcb *
+in_pcblookup_wild(struct inpcbhead *head, struct in_addr faddr,
+    u_short fport, struct in_addr laddr, u_short lport, struct ifnet *ifp)
+{
+	struct inpcb *inp;
+	struct inpcb *local_wild = NULL, *local_exact = NULL;
 #ifdef INET6
-			/* XXX inp locking */
-			if ((inp->inp_vflag & INP_IPV4) == 0)
-				continue;
+	struct inpcb *local_wild_mapped = NULL;
 #endif
-			if (inp->inp_faddr.s_addr != INADDR_ANY ||
-			    inp->inp_lport != lport)
-				continue;
+	struct in_addr any;
 
-			/* XXX inp locking */
-			if (ifp && ifp->if_type == IFT_FAITH &&
-			    (inp->inp_flags & INP_FAITH) == 0)
-				continue;
+	/*
+	 * Order of socket selection:
+	 *      1. non-wild.
+	 *      2. wild.
+	 */
+	LIST_FOREACH(inp, head, inp_hash) {
+#ifdef INET6
+		/* XXX inp locking */
+		if ((inp->inp_vflag & INP_IPV4) == 0)
+			continue;
+#endif
+		if (inp->inp_faddr.s_addr != INADDR_ANY ||
+		    inp->inp_lport != lport)
+			continue;
 
-			injail = 0;
-            if (local_exact != NULL)
-                continue;
+		/* XXX inp locking */
+		if (ifp && ifp->if_type == IFT_FAITH &&
+		    (inp->inp_flags & INP_FAITH) == 0)
+			continue;
 
-			if (inp->inp_laddr.s_addr == laddr.s_addr) {
-				if (injail)
-					return (inp);
-				else
-					local_exact = inp;
-			} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
+		if (inp->inp_laddr.s_addr == laddr.s_addr) {
+			local_exact = inp;
+			break;
+		} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
 #ifdef INET6
-				/* XXX inp locking, NULL check */
-				if (inp->inp_vflag & INP_IPV6PROTO)
-					local_wild_mapped = inp;
-				else
+			/* XXX inp locking, NULL check */
+			if (inp->inp_vflag & INP_IPV6PROTO)
+				local_wild_mapped = inp;
+			else
 #endif /* INET6 */
-					if (injail)
-						jail_wild = inp;
-					else
-						local_wild = inp;
-			}
-		} /* LIST_FOREACH */
-		if (jail_wild != NULL)
-			return (jail_wild);
-		if (local_exact != NULL)
-			return (local_exact);
-		if (local_wild != NULL)
-			return (local_wild);
+				local_wild = inp;
+		}
+	}
+	if (local_exact != NULL)
+		return (in_pcbgroup_select(head, local_exact, faddr, fport,
+		    laddr, lport));
+	if (local_wild != NULL) {
+		any.s_addr = INADDR_ANY;
+		return (in_pcbgroup_select(head, local_wild, faddr, fport,
+		    any, lport));
+	}
 #ifdef INET6
-		if (local_wild_mapped != NULL)
-			return (local_wild_mapped);
+	if (local_wild_mapped != NULL)
+		return (local_wild_mapped);
 #endif /* defined(INET6) */
-	} /* if ((lookupflags & INPLOOKUP_WILDCARD) != 0) */
+	return (NULL);
+}
+
+/*
+ * Lookup PCB in hash list, using pcbinfo tables.  This variation assumes
+ * that the caller has locked the hash list, and will not perform any further
+ * locking or reference operations on either the hash list or the connection.
+ */
+static struct inpcb *
+in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
+    u_int fport_arg, struct in_addr laddr, u_int lport_arg, int lookupflags,
+    struct ifnet *ifp)
+{
+	struct inpcb *inp;
+	u_short fport = fport_arg, lport = lport_arg;
+
+	KASSERT((lookupflags & ~(INPLOOKUP_WILDCARD)) == 0,
+	    ("%s: invalid lookup flags %d", __func__, lookupflags));
+
+	INP_HASH_LOCK_ASSERT(pcbinfo);
+
+	/*
+	 * First look for an exact match.
+	 */
+	inp = in_pcblookup_exact(&pcbinfo->ipi_hashbase[INP_PCBHASH(
+	    faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask)],
+	    faddr, fport, laddr, lport);
+	if (inp != NULL)
+		return (inp);
+
+	/*
+	 * Then look for a wildcard match, if requested.
+	 */
+	if ((lookupflags & INPLOOKUP_WILDCARD) != 0)
+		return (in_pcblookup_wild(&pcbinfo->ipi_hashbase[INP_PCBHASH(
+		    INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask)],
+		    faddr, fport, laddr, lport, ifp));
 
 	return (NULL);
 }
 
 /*
- * Lookup PCB in hash list, using pcbinfo tables.  This variation locks the
- * hash list lock, and will return the inpcb locked (i.e., requires
- * INPLOOKUP_LOCKPCB).
+ * Lookup PCB in hash list, using pcbinfo tables.  This variation only locks
+ * the hash buckets it looks at, and will return the inpcb locked (i.e.,
+ * requires INPLOOKUP_LOCKPCB).  A connection found in neither bucket may be
+ * moving from the wildcard bucket to its own (connect() of a bound socket),
+ * so the wildcard lookup holds both buckets and looks for it again.
  */
 static struct inpcb *
 in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
-    u_int fport, struct in_addr laddr, u_int lport, int lookupflags,
+    u_int fport_arg, struct in_addr laddr, u_int lport_arg, int lookupflags,
     struct ifnet *ifp)
 {
 	struct inpcb *inp;
+	u_short fport = fport_arg, lport = lport_arg;
+	u_long h, wh;
 
-	INP_HASH_RLOCK(pcbinfo);
-	inp = in_pcblookup_hash_locked(pcbinfo, faddr, fport, laddr, lport,
-	    (lookupflags & ~(INPLOOKUP_LOCKPCB)), ifp);
-	if (inp != NULL) {
+	h = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	INP_HASHBUCKET_LOCK(pcbinfo, h);
+	inp = in_pcblookup_exact(&pcbinfo->ipi_hashbase[h], faddr, fport,
+	    laddr, lport);
+	if (inp != NULL)
 		in_pcbref(inp);
-		INP_HASH_RUNLOCK(pcbinfo);
+	INP_HASHBUCKET_UNLOCK(pcbinfo, h);
+
+	if (inp == NULL && (lookupflags & INPLOOKUP_WILDCARD) != 0) {
+		wh = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+		INP_HASHBUCKET_LOCK2(pcbinfo, h, wh);
+		inp = in_pcblookup_exact(&pcbinfo->ipi_hashbase[h], faddr,
+		    fport, laddr, lport);
+		if (inp == NULL)
+			inp = in_pcblookup_wild(&pcbinfo->ipi_hashbase[wh],
+			    faddr, fport, laddr, lport, ifp);
+		if (inp != NULL)
+			in_pcbref(inp);
+		INP_HASHBUCKET_UNLOCK2(pcbinfo, h, wh);
+	}
+
+	if (inp != NULL) {
 		if (lookupflags & INPLOOKUP_LOCKPCB) {
 			INP_LOCK(inp);
 			if (in_pcbrele_locked(inp))
 				return (NULL);
 		} else
 			panic("%s: locking bug", __func__);
-	} else
-		INP_HASH_RUNLOCK(pcbinfo);
+	}
 	return (inp);
 }
 
@@ -1532,9 +1605,10 @@ in_pcbinshash_internal(struct inpcb *inp)
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbport *phd;
 	u_int32_t hashkey_faddr;
+	u_long h;
 
 	INP_LOCK_ASSERT(inp);
-	INP_HASH_LOCK_ASSERT(pcbinfo);
+	INP_HASH_WLOCK_ASSERT(pcbinfo);
 
 	KASSERT((inp->inp_flags & INP_INHASHLIST) == 0,
 	    ("in_pcbinshash: INP_INHASHLIST"));
@@ -1546,8 +1620,9 @@ in_pcbinshash_internal(struct inpcb *inp)
 #endif /* INET6 */
 	hashkey_faddr = inp->inp_faddr.s_addr;
 
-	pcbhash = &pcbinfo->ipi_hashbase[INP_PCBHASH(hashkey_faddr,
-		 inp->inp_lport, inp->inp_fport, pcbinfo->ipi_hashmask)];
+	h = INP_PCBHASH(hashkey_faddr, inp->inp_lport, inp->inp_fport,
+	    pcbinfo->ipi_hashmask);
+	pcbhash = &pcbinfo->ipi_hashbase[h];
 
 	pcbporthash = &pcbinfo->ipi_porthashbase[
 	    INP_PCBPORTHASH(inp->inp_lport, pcbinfo->ipi_porthashmask)];
@@ -1573,7 +1648,10 @@ in_pcbinshash_internal(struct inpcb *inp)
 	}
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
+	INP_HASHBUCKET_LOCK(pcbinfo, h);
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	INP_HASHBUCKET_UNLOCK(pcbinfo, h);
+	inp->inp_hashbucket = h;
 	inp->inp_flags |= INP_INHASHLIST;
 	return (0);
 }
@@ -1597,6 +1675,7 @@ in_pcbrehash_mbuf(struct inpcb *inp, struct mbuf *m)
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbhead *head;
 	u_int32_t hashkey_faddr;
+	u_long h, oh;
 
 	INP_LOCK_ASSERT(inp);
 	INP_HASH_WLOCK_ASSERT(pcbinfo);
@@ -1611,12 +1690,19 @@ in_pcbrehash_mbuf(struct inpcb *inp, struct mbuf *m)
 #endif /* INET6 */
 	hashkey_faddr = inp->inp_faddr.s_addr;
 
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(hashkey_faddr,
-		inp->inp_lport, inp->inp_fport, pcbinfo->ipi_hashmask)];
+	h = INP_PCBHASH(hashkey_faddr, inp->inp_lport, inp->inp_fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[h];
+	oh = inp->inp_hashbucket;
 
+	/*
+	 * Hold both buckets, so a lookup finds the PCB in one of them.
+	 */
+	INP_HASHBUCKET_LOCK2(pcbinfo, oh, h);
 	LIST_REMOVE(inp, inp_hash);
 	LIST_INSERT_HEAD(head, inp, inp_hash);
-
+	inp->inp_hashbucket = h;
+	INP_HASHBUCKET_UNLOCK2(pcbinfo, oh, h);
 }
 
 void
@@ -1639,22 +1725,37 @@ in_pcbremlists(struct inpcb *inp)
 
 	inp->inp_gencnt = ++pcbinfo->ipi_gencnt;
 	if (inp->inp_flags & INP_INHASHLIST) {
-		struct inpcbport *phd = inp->inp_phd;
-
 		INP_HASH_WLOCK(pcbinfo);
-		LIST_REMOVE(inp, inp_hash);
-		LIST_REMOVE(inp, inp_portlist);
-		if (LIST_FIRST(&phd->phd_pcblist) == NULL) {
-			LIST_REMOVE(phd, phd_hash);
-			free(phd);
-		}
+		in_pcbunhash(inp);
 		INP_HASH_WUNLOCK(pcbinfo);
-		inp->inp_flags &= ~INP_INHASHLIST;
 	}
 	LIST_REMOVE(inp, inp_list);
 	pcbinfo->ipi_count--;
 }
 
+/*
+ * Remove PCB from the connection and port hash lists.
+ */
+static void
+in_pcbunhash(struct inpcb *inp)
+{
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	struct inpcbport *phd = inp->inp_phd;
+
+	INP_LOCK_ASSERT(inp);
+	INP_HASH_WLOCK_ASSERT(pcbinfo);
+
+	INP_HASHBUCKET_LOCK(pcbinfo, inp->inp_hashbucket);
+	LIST_REMOVE(inp, inp_hash);
+	INP_HASHBUCKET_UNLOCK(pcbinfo, inp->inp_hashbucket);
+	LIST_REMOVE(inp, inp_portlist);
+	if (LIST_FIRST(&phd->phd_pcblist) == NULL) {
+		LIST_REMOVE(phd, phd_hash);
+		free(phd);
+	}
+	inp->inp_flags &= ~INP_INHASHLIST;
+}
+
 /*
  * A set label operation has occurred at the socket layer, propagate the
  * label change into the in_pcb for the socket.
@@ -203,6 +203,7 @@ struct inpcb {
 	} inp_depend6 = {};
 	LIST_ENTRY(inpcb) inp_portlist = {};	/* (i/p) */
 	struct	inpcbport *inp_phd = {};	/* (i/p) head of this list */
+	u_long	inp_hashbucket = {};	/* (i/p) inp_hash bucket index */
 	inp_gen_t	inp_gencnt;	/* (c) generation count */
 	struct llentry	*inp_lle;	/* cached L2 information */
 	struct rtentry	*inp_rt;	/* cached L3 information */
@@ -267,17 +268,28 @@ struct inpcbport {
  *
  * Each pcbinfo is protected by two locks: ipi_lock and ipi_hash_lock,
  * the former covering mutable global fields (such as the global pcb list),
- * and the latter covering the hashed lookup tables.  The lock order is:
+ * and the latter covering the hashed lookup tables.  In addition, the
+ * chains of the connection hash are covered by an array of bucket locks,
+ * each shared by the buckets with the same low bits, so that looking up a
+ * connection - done for every incoming packet - only locks its own bucket.
+ * The lock order is:
  *
- *    ipi_lock (before) inpcb locks (before) ipi_hash_lock}
+ *    ipi_lock (before) inpcb locks (before) ipi_hash_lock (before)
+ *    bucket locks, in index order
  *
  * Locking key:
  *
+ * (b) Read using either ipi_hash_lock or the bucket lock; write requires
+ *     both
  * (c) Constant or nearly constant after initialisation
  * (g) Locked by ipi_lock
  * (h) Read using either ipi_hash_lock or inpcb lock; write requires both
  * (x) Synchronisation properties poorly defined
  */
+struct inpcbhashlock {
+	mutex			 ihl_lock;
+} __aligned(CACHE_LINE_SIZE);
+
 struct inpcbinfo {
 	/*
 	 * Global lock protecting global inpcb list, inpcb count, etc.
@@ -312,8 +324,14 @@ struct inpcbinfo {
 	 * Global hash of inpcbs, hashed by local and foreign addresses and
 	 * port numbers.
 	 */
-	struct inpcbhead	*ipi_hashbase;		/* (h) */
-	u_long			 ipi_hashmask;		/* (h) */
+	struct inpcbhead	*ipi_hashbase;		/* (b) */
+	u_long			 ipi_hashmask;		/* (c) */
+
+	/*
+	 * Locks for the chains of ipi_hashbase.
+	 */
+	struct inpcbhashlock	*ipi_hashlocks;		/* (c) */
+	u_long			 ipi_hashlockmask;	/* (c) */
 
 	/*
 	 * Global hash of inpcbs, hashed by only local port number.
@@ -394,6 +412,30 @@ void 	inp_4tuple_get(struct inpcb *inp, uint32_t *laddr, uint16_t *lp,
 #define	INP_HASH_WLOCK_ASSERT(ipi)	rw_assert(&(ipi)->ipi_hash_lock, \
 					    RA_WLOCKED)
 
+#define	INP_HASHLOCKS		256
+#define	INP_HASHBUCKET_LOCK(ipi, h) \
+	mutex_lock(&(ipi)->ipi_hashlocks[(h) & (ipi)->ipi_hashlockmask].ihl_lock)
+#define	INP_HASHBUCKET_UNLOCK(ipi, h) \
+	mutex_unlock(&(ipi)->ipi_hashlocks[(h) & (ipi)->ipi_hashlockmask].ihl_lock)
+/*
+ * Lock the buckets h1 and h2 together: their locks are taken in index
+ * order, and only once when both buckets share one.
+ */
+#define	INP_HASHBUCKET_LOCK2(ipi, h1, h2) do {				\
+	u_long _l1 = (h1) & (ipi)->ipi_hashlockmask;			\
+	u_long _l2 = (h2) & (ipi)->ipi_hashlockmask;			\
+	mutex_lock(&(ipi)->ipi_hashlocks[MIN(_l1, _l2)].ihl_lock);	\
+	if (_l1 != _l2)							\
+		mutex_lock(&(ipi)->ipi_hashlocks[MAX(_l1, _l2)].ihl_lock); \
+} while (0)
+#define	INP_HASHBUCKET_UNLOCK2(ipi, h1, h2) do {			\
+	u_long _l1 = (h1) & (ipi)->ipi_hashlockmask;			\
+	u_long _l2 = (h2) & (ipi)->ipi_hashlockmask;			\
+	if (_l1 != _l2)							\
+		mutex_unlock(&(ipi)->ipi_hashlocks[MAX(_l1, _l2)].ihl_lock); \
+	mutex_unlock(&(ipi)->ipi_hashlocks[MIN(_l1, _l2)].ihl_lock);	\
+} while (0)
+
 #define INP_PCBHASH(faddr, lport, fport, mask) \
 	(((faddr) ^ ((faddr) >> 16) ^ ntohs((lport) ^ (fport))) & (mask))
 #define INP_PCBPORTHASH(lport, mask) \
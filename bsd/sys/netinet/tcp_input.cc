@@ -3230,20 +3230,7 @@ tcp_setup_net_channel(tcpcb* tp, struct ifnet* intf)
 	tp->nc = nc;
 	tp->nc_intf = intf;
 	intf->add_net_channel(nc, tcp_connection_id(tp));
-	auto so = tp->t_inpcb->inp_socket;
-	so->so_nc = nc;
-	if (so->fp) {
-		WITH_LOCK(so->fp->f_lock) {
-			for (auto&& pl : so->fp->f_poll_list) {
-				so->so_nc->add_poller(*pl._req);
-			}
-			if (so->fp->f_epolls) {
-				for (auto&& ep : *so->fp->f_epolls) {
-					so->so_nc->add_epoll(ep);
-				}
-			}
-		}
-	}
+	so_set_net_channel(tp->t_inpcb->inp_socket, nc);
 }
 
 void tcp_teardown_net_channel(tcpcb *tp)
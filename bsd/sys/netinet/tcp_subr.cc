@@ -895,8 +895,8 @@ tcp_discardcb(struct tcpcb *tp)
 
 		for (auto& t : *tp->t_timers) {
 			t->cancel_sync();
-			delete t;
 		}
+		destroy_timers(tp->t_timers);
 
 		if (!in_pcbrele_locked(inp)) {
 			INP_UNLOCK(inp);
@@ -630,24 +630,35 @@ void
 init_timers(struct tcp_timer* timers, struct tcpcb *tp, struct inpcb *inp)
 {
 	using namespace std::placeholders;
+	using async::timer_precision;
+
+	auto init = [&] (tcp_timer_type type,
+	    void (*fn)(serial_timer_task&, struct tcpcb *),
+	    timer_precision precision) {
+		timers->timers[type] = new (&timers->storage[type])
+		    serial_timer_task(inp->inp_lock, std::bind(fn, _1, tp),
+		    precision);
+	};
+
+	init(TT_DELACK, tcp_timer_delack, timer_precision::coarse);
+	init(TT_REXMT, tcp_timer_rexmt, timer_precision::coarse);
+	init(TT_PERSIST, tcp_timer_persist, timer_precision::coarse);
+	init(TT_KEEP, tcp_timer_keep, timer_precision::coarse);
+	init(TT_2MSL, tcp_timer_2msl, timer_precision::coarse);
+	/* Armed for a couple of ticks at most, keep it exact */
+	init(TT_TSO_FLUSH, tcp_timer_tso_flush, timer_precision::exact);
+}
 
-	timers->timers[tcp_timer_type::TT_DELACK] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_delack, _1, tp));
-
-	timers->timers[tcp_timer_type::TT_REXMT] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_rexmt, _1, tp));
-
-	timers->timers[tcp_timer_type::TT_PERSIST] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_persist, _1, tp));
-
-	timers->timers[tcp_timer_type::TT_KEEP] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_keep, _1, tp));
-
-	timers->timers[tcp_timer_type::TT_2MSL] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_2msl, _1, tp));
-
-	timers->timers[tcp_timer_type::TT_TSO_FLUSH] =
-		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_tso_flush, _1, tp));
+/*
+ * The timers must have been stopped with cancel_sync().
+ */
+void
+destroy_timers(struct tcp_timer* timers)
+{
+	for (auto& t : *timers) {
+		t->~serial_timer_task();
+		t = nullptr;
+	}
 }
 
 serial_timer_task&
@@ -159,8 +159,15 @@ enum tcp_timer_type {
 	COUNT
 };
 
+/*
+ * The timers are constructed in place in the tcpcb's memory, and kept on
+ * the coarse timer wheels, so arming and cancelling them neither
+ * allocates nor sorts.
+ */
 struct tcp_timer {
 	std::array<serial_timer_task*,tcp_timer_type::COUNT> timers;
+	std::aligned_storage<sizeof(serial_timer_task),
+	    alignof(serial_timer_task)>::type storage[tcp_timer_type::COUNT];
 	serial_timer_task& get(tcp_timer_type timer_type);
 
 	using iterator = decltype(timers)::iterator;
@@ -208,6 +215,7 @@ void tcp_timer_activate(struct tcpcb *tp, tcp_timer_type timer_type, ticks_t del
 int tcp_timer_active(struct tcpcb *tp, tcp_timer_type timer_type);
 
 void init_timers(struct tcp_timer* timers, struct tcpcb *tp, struct inpcb *inp);
+void destroy_timers(struct tcp_timer* timers);
 
 
 #endif /* _KERNEL */
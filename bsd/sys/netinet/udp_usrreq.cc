@@ -50,6 +50,9 @@
 #include <bsd/sys/sys/socketvar.h>
 
 #include <bsd/sys/net/if.h>
+#include <bsd/sys/net/if_types.h>
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/net/netisr.h>
 #include <bsd/sys/net/route.h>
 
 #include <bsd/sys/netinet/in.h>
@@ -69,6 +72,7 @@
 #endif
 #include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/netinet/udp_var.h>
+#include <osv/net_trace.hh>
 
 /*
  * UDP protocol implementation.
@@ -284,8 +288,14 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 		sorwakeup_locked(so);
 }
 
-void
-udp_input(struct mbuf *m, int off)
+static void	udp_setup_net_channel(struct inpcb *, struct ifnet *);
+
+/*
+ * nc_inp is set when the datagram was steered to a socket's net channel by
+ * the interface classifier; the pcb lookup is then skipped.
+ */
+static void
+udp_input_common(struct mbuf *m, int off, struct inpcb *nc_inp)
 {
 	int iphlen = off;
 	struct ip *ip;
@@ -393,6 +403,15 @@ udp_input(struct mbuf *m, int off)
 	} else
 		UDPSTAT_INC(udps_nosum);
 
+	if (nc_inp != NULL) {
+		/* Matched by udp_net_channel_match(), and already locked */
+		if (nc_inp->inp_ip_minttl && nc_inp->inp_ip_minttl > ip->ip_ttl)
+			m_freem(m);
+		else
+			udp_append(nc_inp, ip, m, iphlen, &udp_in);
+		return;
+	}
+
 	if (IN_MULTICAST(ntohl(ip->ip_dst.s_addr)) ||
 	    in_broadcast(ip->ip_dst, ifp)) {
 		struct inpcb *last;
@@ -567,6 +586,8 @@ udp_input(struct mbuf *m, int off)
 		m_freem(m);
 		return;
 	}
+	if (intoudpcb(inp)->u_nc_intf == NULL)
+		udp_setup_net_channel(inp, ifp);
 	udp_append(inp, ip, m, iphlen, &udp_in);
 	INP_UNLOCK(inp);
 	return;
@@ -574,6 +595,150 @@ udp_input(struct mbuf *m, int off)
 badunlocked:
 	m_freem(m);
 }
+
+void
+udp_input(struct mbuf *m, int off)
+{
+	udp_input_common(m, off, NULL);
+}
+
+/*
+ * Net channels.
+ *
+ * An unconnected socket which is the only one bound to its port has its
+ * unicast datagrams steered by the interface classifier into a per-socket
+ * net channel, instead of going through netisr on the driver's receive
+ * thread.  The channel is drained, and the IP and UDP input processing is
+ * done, by the thread reading from or polling the socket.
+ *
+ * The channel is registered on the interface which received the first
+ * datagram through the normal path.  The registration is dropped when the
+ * socket is connected or another socket binds to the same port, and
+ * datagrams then take the normal path again.
+ */
+
+/*
+ * Check that a steered frame is still for this socket: it may have been
+ * classified just before the socket was connected or the port shared.
+ * The classifier checked that the headers are in the first mbuf.
+ */
+static bool
+udp_net_channel_match(struct inpcb *inp, struct mbuf *m)
+{
+	auto ip = reinterpret_cast<struct ip *>(mtod(m, caddr_t) + ETHER_HDR_LEN);
+	auto uh = reinterpret_cast<struct udphdr *>((caddr_t)ip + (ip->ip_hl << 2));
+
+	return (inp->inp_lport == uh->uh_dport &&
+	    inp->inp_faddr.s_addr == INADDR_ANY &&
+	    (inp->inp_laddr.s_addr == INADDR_ANY ||
+	    inp->inp_laddr.s_addr == ip->ip_dst.s_addr) &&
+	    !IN_MULTICAST(ntohl(ip->ip_dst.s_addr)) &&
+	    !in_broadcast(ip->ip_dst, m->M_dat.MH.MH_pkthdr.rcvif));
+}
+
+// INP_LOCK held
+static void
+udp_net_channel_packet(struct inpcb *inp, struct mbuf *m)
+{
+	uint8_t protocol;
+	int hlen;
+
+	log_packet_handling(m, NETISR_ETHER);
+	if (!udp_net_channel_match(inp, m)) {
+		netisr_queue(NETISR_ETHER, m);
+		return;
+	}
+	m_adj(m, ETHER_HDR_LEN);
+	m = ip_preprocess_packet(m, protocol, hlen);
+	if (m == NULL)
+		return;
+	udp_input_common(m, hlen, inp);
+}
+
+static void
+udp_setup_net_channel(struct inpcb *inp, struct ifnet *ifp)
+{
+	struct udpcb *up = intoudpcb(inp);
+	struct socket *so = inp->inp_socket;
+
+	INP_LOCK_ASSERT(inp);
+	if (ifp == NULL || ifp->if_type != IFT_ETHER ||
+	    (inp->inp_vflag & INP_IPV6) ||
+	    inp->inp_faddr.s_addr != INADDR_ANY ||
+	    up->u_tun_func != NULL || up->u_flags != 0)
+		return;
+	/* Unlocked peek, so shared ports don't take the hash lock every time */
+	if (LIST_NEXT(inp, inp_portlist) != NULL)
+		return;
+
+	INP_HASH_WLOCK(&V_udbinfo);
+	if (inp->inp_phd == NULL ||
+	    LIST_FIRST(&inp->inp_phd->phd_pcblist) != inp ||
+	    LIST_NEXT(inp, inp_portlist) != NULL) {
+		INP_HASH_WUNLOCK(&V_udbinfo);
+		return;
+	}
+	if (up->u_nc == NULL) {
+		up->u_nc = new net_channel([=] (mbuf *m) {
+			udp_net_channel_packet(inp, m);
+		});
+		so_set_net_channel(so, up->u_nc);
+	}
+	up->u_nc_intf = ifp;
+	up->u_nc_addr = inp->inp_laddr;
+	up->u_nc_port = ntohs(inp->inp_lport);
+	ifp->add_net_channel(up->u_nc,
+	    ipv4_udp_sock_id{up->u_nc_addr, up->u_nc_port});
+	INP_HASH_WUNLOCK(&V_udbinfo);
+}
+
+static void
+udp_teardown_net_channel_locked(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+
+	INP_HASH_WLOCK_ASSERT(&V_udbinfo);
+	if (up == NULL || up->u_nc_intf == NULL)
+		return;
+	up->u_nc_intf->del_net_channel(ipv4_udp_sock_id{up->u_nc_addr,
+	    up->u_nc_port});
+	up->u_nc_intf = NULL;
+	/* keep up->u_nc, it may still hold packets */
+}
+
+/*
+ * Another socket was bound to inp's port, so datagrams for the port need
+ * the pcb lookup again.
+ */
+static void
+udp_net_channel_port_shared(struct inpcb *inp)
+{
+	struct inpcb *t;
+
+	INP_HASH_WLOCK_ASSERT(&V_udbinfo);
+	if (inp->inp_phd == NULL)
+		return;
+	LIST_FOREACH(t, &inp->inp_phd->phd_pcblist, inp_portlist) {
+		if (t != inp)
+			udp_teardown_net_channel_locked(t);
+	}
+}
+
+static void
+udp_free_net_channel(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+
+	INP_LOCK_ASSERT(inp);
+	if (up->u_nc == NULL)
+		return;
+	INP_HASH_WLOCK(&V_udbinfo);
+	udp_teardown_net_channel_locked(inp);
+	INP_HASH_WUNLOCK(&V_udbinfo);
+	so_clear_net_channel(inp->inp_socket);
+	osv::rcu_dispose(up->u_nc);
+	up->u_nc = NULL;
+}
 #endif /* INET */
 
 /*
@@ -1415,6 +1580,8 @@ udp_bind(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	INP_LOCK(inp);
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbbind(inp, nam, 0);
+	if (error == 0)
+		udp_net_channel_port_shared(inp);
 	INP_HASH_WUNLOCK(&V_udbinfo);
 	INP_UNLOCK(inp);
 	return (error);
@@ -1455,6 +1622,8 @@ udp_connect(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	sin = (struct bsd_sockaddr_in *)nam;
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbconnect(inp, nam, 0);
+	if (error == 0)
+		udp_teardown_net_channel_locked(inp);
 	INP_HASH_WUNLOCK(&V_udbinfo);
 	if (error == 0)
 		soisconnected(so);
@@ -1476,6 +1645,7 @@ udp_detach(struct socket *so)
 	INP_LOCK(inp);
 	up = intoudpcb(inp);
 	KASSERT(up != NULL, ("%s: up == NULL", __func__));
+	udp_free_net_channel(inp);
 	inp->inp_ppcb = NULL;
 	in_pcbdetach(inp);
 	in_pcbfree(inp);
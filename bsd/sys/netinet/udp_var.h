@@ -59,6 +59,10 @@ typedef void(*udp_tun_func_t)(struct mbuf *, int off, struct inpcb *);
 struct udpcb {
 	udp_tun_func_t	u_tun_func;	/* UDP kernel tunneling callback. */
 	u_int		u_flags;	/* Generic UDP flags. */
+	struct net_channel *u_nc;	/* channel feeding this socket */
+	struct ifnet	*u_nc_intf;	/* interface u_nc is registered on */
+	struct in_addr	u_nc_addr;	/* local address and port (host */
+	u_short		u_nc_port;	/*   order) u_nc is registered for */
 };
 
 #define	intoudpcb(ip)	((struct udpcb *)(ip)->inp_ppcb)
@@ -378,6 +378,8 @@ void	soupcall_clear(struct socket *so, int which);
 void	soupcall_set(struct socket *so, int which,
 	    int (*func)(struct socket *, void *, int), void *arg);
 void	sowakeup(struct socket *so, struct sockbuf *sb);
+void	so_set_net_channel(struct socket *so, net_channel *nc);
+void	so_clear_net_channel(struct socket *so);
 int	selsocket(struct socket *so, int events, struct timeval *tv,
 	    struct thread *td);
 
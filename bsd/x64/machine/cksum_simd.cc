@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// SIMD implementations of the checksums ZFS computes on every block it
+// reads or writes: fletcher-4 (the default block checksum) and SHA-256
+// (the dedup checksum). The versions used are picked according to the cpu
+// when the kernel is relocated, with ifunc, like memcpy in arch/x64/string.cc.
+//
+// We only use the SSE and AVX register state which the kernel enables and
+// saves on context switch; AVX-512 would need its ZMM state in XCR0 and in
+// the thread's saved fpu state, which we do not have.
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <immintrin.h>
+#include "cpuid.hh"
+#include "bsd/sys/crypto/sha2/sha2.h"
+
+// zio_cksum_t, without pulling the Solaris headers into C++
+struct zio_cksum {
+    uint64_t zc_word[4];
+};
+
+extern "C" {
+void fletcher_4_scalar_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_incremental_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_sse2_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_avx2_native(const void *buf, uint64_t size, zio_cksum *zcp);
+bool fletcher_4_avx2_supported();
+void SHA256_Transform_blocks_shani(SHA256_CTX *ctx, const u_int8_t *data, size_t nblocks);
+bool sha256_shani_supported();
+}
+
+// Fletcher-4 is inherently serial (a += w; b += a; c += b; d += c), so we
+// run four independent streams, stream j summing words j, j+4, j+8, ...,
+// and combine them at the end. With n words per stream, the serial sums
+// over the whole buffer are:
+//
+//   A = sum(a_j)
+//   B = sum(4 b_j - j a_j)
+//   C = sum(16 c_j - (6 + 4j) b_j + j(j-1)/2 a_j)
+//   D = sum(64 d_j - (48 + 16j) c_j + (4, 10, 20, 34)[j] b_j) - a_3
+//
+// all modulo 2^64, like the serial version. Words left over after the last
+// whole 16-byte group are added serially.
+static void fletcher_4_combine(const uint64_t a[4], const uint64_t b[4],
+                               const uint64_t c[4], const uint64_t d[4],
+                               zio_cksum *zcp)
+{
+    static const uint64_t d_b[4] = { 4, 10, 20, 34 };
+    uint64_t A = 0, B = 0, C = 0, D = 0;
+    for (uint64_t j = 0; j < 4; j++) {
+        A += a[j];
+        B += 4 * b[j] - j * a[j];
+        C += 16 * c[j] - (6 + 4 * j) * b[j] + j * (j - 1) / 2 * a[j];
+        D += 64 * d[j] - (48 + 16 * j) * c[j] + d_b[j] * b[j];
+    }
+    D -= a[3];
+    zcp->zc_word[0] = A;
+    zcp->zc_word[1] = B;
+    zcp->zc_word[2] = C;
+    zcp->zc_word[3] = D;
+}
+
+static void fletcher_4_tail(const void *buf, uint64_t size, zio_cksum *zcp)
+{
+    uint64_t done = size & ~uint64_t(15);
+    if (size - done >= sizeof(uint32_t)) {
+        fletcher_4_incremental_native(static_cast<const char*>(buf) + done,
+                                      size - done, zcp);
+    }
+}
+
+void fletcher_4_sse2_native(const void *buf, uint64_t size, zio_cksum *zcp)
+{
+    auto ip = static_cast<const __m128i*>(buf);
+    auto ipend = ip + size / sizeof(__m128i);
+    const __m128i zero = _mm_setzero_si128();
+    // streams 0 and 1 in the "lo" registers, 2 and 3 in the "hi" ones
+    __m128i alo = zero, ahi = zero, blo = zero, bhi = zero;
+    __m128i clo = zero, chi = zero, dlo = zero, dhi = zero;
+    for (; ip < ipend; ip++) {
+        __m128i w = _mm_loadu_si128(ip);
+        alo = _mm_add_epi64(alo, _mm_unpacklo_epi32(w, zero));
+        ahi = _mm_add_epi64(ahi, _mm_unpackhi_epi32(w, zero));
+        blo = _mm_add_epi64(blo, alo);
+        bhi = _mm_add_epi64(bhi, ahi);
+        clo = _mm_add_epi64(clo, blo);
+        chi = _mm_add_epi64(chi, bhi);
+        dlo = _mm_add_epi64(dlo, clo);
+        dhi = _mm_add_epi64(dhi, chi);
+    }
+    uint64_t a[4], b[4], c[4], d[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(a), alo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(a + 2), ahi);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(b), blo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(b + 2), bhi);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(c), clo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(c + 2), chi);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d), dlo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 2), dhi);
+    fletcher_4_combine(a, b, c, d, zcp);
+    fletcher_4_tail(buf, size, zcp);
+}
+
+__attribute__((target("avx2")))
+void fletcher_4_avx2_native(const void *buf, uint64_t size, zio_cksum *zcp)
+{
+    auto ip = static_cast<const __m128i*>(buf);
+    auto ipend = ip + size / sizeof(__m128i);
+    __m256i va = _mm256_setzero_si256(), vb = va, vc = va, vd = va;
+    for (; ip < ipend; ip++) {
+        va = _mm256_add_epi64(va, _mm256_cvtepu32_epi64(_mm_loadu_si128(ip)));
+        vb = _mm256_add_epi64(vb, va);
+        vc = _mm256_add_epi64(vc, vb);
+        vd = _mm256_add_epi64(vd, vc);
+    }
+    uint64_t a[4], b[4], c[4], d[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(a), va);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(b), vb);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(c), vc);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(d), vd);
+    fletcher_4_combine(a, b, c, d, zcp);
+    fletcher_4_tail(buf, size, zcp);
+}
+
+bool fletcher_4_avx2_supported()
+{
+    // The kernel only enables the AVX state in XCR0 when it has xsave
+    auto& f = processor::features();
+    return f.xsave && f.avx && f.avx2;
+}
+
+extern "C"
+void (*resolve_fletcher_4_native())(const void *, uint64_t, zio_cksum *)
+{
+    if (fletcher_4_avx2_supported()) {
+        return fletcher_4_avx2_native;
+    }
+    return fletcher_4_sse2_native;
+}
+
+extern "C"
+void fletcher_4_native(const void *buf, uint64_t size, zio_cksum *zcp)
+    __attribute__((ifunc("resolve_fletcher_4_native")));
+
+// SHA-256 using the SHA extensions. The state is kept in the ABEF/CDGH
+// layout sha256rnds2 works on, and every group of four rounds computes the
+// next four words of the message schedule with sha256msg1/sha256msg2.
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHANI_TARGET __attribute__((target("sha,ssse3,sse4.1"), always_inline))
+
+// Four rounds with message words w (already scheduled) and constants k
+static inline SHANI_TARGET
+void sha256_rounds4(__m128i& abef, __m128i& cdgh, __m128i w, unsigned k)
+{
+    __m128i msg = _mm_add_epi32(w,
+        _mm_load_si128(reinterpret_cast<const __m128i*>(&sha256_k[k])));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+// The next four schedule words, from the previous sixteen
+static inline SHANI_TARGET
+__m128i sha256_schedule(__m128i w0, __m128i w1, __m128i w2, __m128i w3)
+{
+    __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w0, w1),
+                              _mm_alignr_epi8(w3, w2, 4));
+    return _mm_sha256msg2_epu32(t, w3);
+}
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void SHA256_Transform_blocks_shani(SHA256_CTX *ctx, const u_int8_t *data, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    auto state = reinterpret_cast<__m128i*>(ctx->state);
+
+    __m128i dcba = _mm_loadu_si128(&state[0]);
+    __m128i hgfe = _mm_loadu_si128(&state[1]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; nblocks; nblocks--, data += SHA256_BLOCK_LENGTH) {
+        auto in = reinterpret_cast<const __m128i*>(data);
+        __m128i abef_save = abef, cdgh_save = cdgh;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128(&in[0]), bswap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128(&in[1]), bswap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128(&in[2]), bswap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128(&in[3]), bswap);
+
+        sha256_rounds4(abef, cdgh, w0, 0);
+        sha256_rounds4(abef, cdgh, w1, 4);
+        sha256_rounds4(abef, cdgh, w2, 8);
+        sha256_rounds4(abef, cdgh, w3, 12);
+        for (unsigned k = 16; k < 64; k += 16) {
+            w0 = sha256_schedule(w0, w1, w2, w3);
+            sha256_rounds4(abef, cdgh, w0, k);
+            w1 = sha256_schedule(w1, w2, w3, w0);
+            sha256_rounds4(abef, cdgh, w1, k + 4);
+            w2 = sha256_schedule(w2, w3, w0, w1);
+            sha256_rounds4(abef, cdgh, w2, k + 8);
+            w3 = sha256_schedule(w3, w0, w1, w2);
+            sha256_rounds4(abef, cdgh, w3, k + 12);
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(&state[1], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+bool sha256_shani_supported()
+{
+    auto& f = processor::features();
+    return f.sha && f.ssse3 && f.sse4_1;
+}
+
+extern "C"
+void (*resolve_SHA256_Transform_blocks())(SHA256_CTX *, const u_int8_t *, size_t)
+{
+    if (sha256_shani_supported()) {
+        return SHA256_Transform_blocks_shani;
+    }
+    return SHA256_Transform_blocks_generic;
+}
+
+extern "C"
+void SHA256_Transform_blocks(SHA256_CTX *ctx, const u_int8_t *data, size_t nblocks)
+    __attribute__((ifunc("resolve_SHA256_Transform_blocks")));
@@ -2,6 +2,9 @@ conf-preempt=1
 conf-tracing=0
 conf-debug_memory=0
 
+# Start the other CPUs in lzloader, to decompress the kernel in parallel
+conf-lzloader_smp=0
+
 # debug level logging (enabled automatically in mode=debug)
 conf-logger_debug=0
 
@@ -18,6 +18,7 @@
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/parent_from_member.hpp>
 #include <osv/timer-set.hh>
+#include <osv/timer-wheel.hh>
 
 namespace async {
 
@@ -28,7 +29,7 @@ TRACEPOINT(trace_async_timer_task_cancel, "timer=%x, task=%x", timer_task*, perc
 TRACEPOINT(trace_async_timer_task_shutdown, "timer=%x", timer_task*);
 TRACEPOINT(trace_async_timer_task_fire, "timer=%x, task=%x", timer_task*, percpu_timer_task*);
 TRACEPOINT(trace_async_timer_task_misfire, "timer=%x, task=%x", timer_task*, percpu_timer_task*);
-TRACEPOINT(trace_async_timer_task_insert, "worker=%x, task=%x", async_worker*, percpu_timer_task*);
+TRACEPOINT(trace_async_timer_task_insert, "worker=%x, task=%x, coarse=%d", async_worker*, percpu_timer_task*, bool);
 TRACEPOINT(trace_async_timer_task_remove, "worker=%x, task=%x", async_worker*, percpu_timer_task*);
 
 TRACEPOINT(trace_async_worker_started, "worker=%x", async_worker*);
@@ -93,7 +94,8 @@ TRACEPOINT(trace_async_worker_fire_ret, "");
 class async_worker {
 public:
     async_worker(sched::cpu* cpu)
-        : _thread(std::bind(&async_worker::run, this),
+        : _coarse_timer_tasks(std::chrono::milliseconds(1))
+        , _thread(std::bind(&async_worker::run, this),
             sched::thread::attr().pin(cpu).name(osv::sprintf("async_worker%d", cpu->id)))
         , _timer(_thread)
         , _cpu(cpu)
@@ -104,12 +106,14 @@ public:
     void insert(percpu_timer_task& task)
     {
         WITH_LOCK(preempt_lock) {
-            trace_async_timer_task_insert(this, &task);
+            trace_async_timer_task_insert(this, &task, task.coarse);
 
             assert(!task.queued);
 
-            if (_timer_tasks.insert(task)) {
-                rearm(task.get_timeout());
+            bool earlier = task.coarse ? _coarse_timer_tasks.insert(task)
+                                       : _timer_tasks.insert(task);
+            if (earlier) {
+                rearm(get_next_timeout());
             }
 
             task.queued = true;
@@ -164,8 +168,10 @@ public:
 
                 auto now = clock::now();
                 _timer_tasks.expire(now);
+                _coarse_timer_tasks.expire(now);
                 percpu_timer_task* task;
-                while ((task = _timer_tasks.pop_expired())) {
+                while ((task = _timer_tasks.pop_expired()) ||
+                       (task = _coarse_timer_tasks.pop_expired())) {
                     mark_removed(*task);
 
                     if (task->_state.load(std::memory_order_relaxed) !=
@@ -177,7 +183,7 @@ public:
                     }
                 }
 
-                rearm(_timer_tasks.get_next_timeout());
+                rearm(get_next_timeout());
 
                 while (!_queue.empty()) {
                     auto& task = *_queue.begin();
@@ -194,6 +200,12 @@ public:
     }
 
 private:
+    clock::time_point get_next_timeout() const
+    {
+        return std::min(_timer_tasks.get_next_timeout(),
+                        _coarse_timer_tasks.get_next_timeout());
+    }
+
     void rearm(clock::time_point time_point) {
         assert(sched::cpu::current() == _cpu);
         _timer.reset(time_point);
@@ -209,7 +221,11 @@ private:
     void remove_locked(percpu_timer_task& task)
     {
         mark_removed(task);
-        _timer_tasks.remove(task);
+        if (task.coarse) {
+            _coarse_timer_tasks.remove(task);
+        } else {
+            _timer_tasks.remove(task);
+        }
     }
 
     void fire(percpu_timer_task& task)
@@ -230,6 +246,7 @@ private:
 
 private:
     timer_set<percpu_timer_task, &percpu_timer_task::hook, clock> _timer_tasks;
+    timer_wheel<percpu_timer_task, &percpu_timer_task::hook, clock> _coarse_timer_tasks;
 
     bi::slist<one_shot_task,
         bi::cache_last<true>,
@@ -255,11 +272,12 @@ static inline async_worker& get_worker()
     return **_percpu_worker;
 }
 
-timer_task::timer_task(mutex& lock, callback_t&& callback)
+timer_task::timer_task(mutex& lock, callback_t&& callback, timer_precision precision)
     : _active_task(nullptr)
     , _mutex(lock)
     , _callback(std::move(callback))
     , _terminating(false)
+    , _precision(precision)
 {
     trace_async_timer_task_create(this);
 }
@@ -307,6 +325,7 @@ bool timer_task::reschedule(clock::time_point time_point)
         auto& task = _worker.borrow_task();
         task.fire_at = time_point;
         task.master = this;
+        task.coarse = _precision == timer_precision::coarse;
         task._state.store(percpu_timer_task::state::ACTIVE, std::memory_order_relaxed);
 
         _active_task = &task;
@@ -372,11 +391,12 @@ bool timer_task::is_pending()
     return _active_task != nullptr;
 }
 
-serial_timer_task::serial_timer_task(mutex& lock, callback_t&& callback)
+serial_timer_task::serial_timer_task(mutex& lock, callback_t&& callback,
+        timer_precision precision)
     : _active(false)
     , _n_scheduled(0)
     , _lock(lock)
-    , _task(lock, std::bind(std::move(callback), std::ref(*this)))
+    , _task(lock, std::bind(std::move(callback), std::ref(*this)), precision)
 {
 }
 
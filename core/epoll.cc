@@ -16,8 +16,8 @@
 #include <osv/file.h>
 #include <osv/poll.h>
 #include <fs/fs.hh>
-#include <boost/lockfree/queue.hpp>
-#include <boost/lockfree/policies.hpp>
+#include <osv/rcu.hh>
+#include <atomic>
 
 #include <osv/debug.hh>
 #include <unordered_map>
@@ -30,10 +30,14 @@ TRACEPOINT(trace_epoll_ctl, "epfd=%d, fd=%d, op=%s event=0x%x", int, int, const
 TRACEPOINT(trace_epoll_wait, "epfd=%d, maxevents=%d, timeout=%d", int, int, int);
 TRACEPOINT(trace_epoll_ready, "fd=%d file=%p, event=0x%x", int, file*, int);
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
 // We implement epoll using poll(), and therefore need to convert epoll's
 // event bits to and poll(). These are mostly the same, so the conversion
 // is trivial, but we verify this here with static_asserts. We additionally
-// support the epoll-only EPOLLET and EPOLLONESHOT.
+// support the epoll-only EPOLLET, EPOLLONESHOT and EPOLLEXCLUSIVE.
 static_assert(POLLIN == EPOLLIN, "POLLIN!=EPOLLIN");
 static_assert(POLLOUT == EPOLLOUT, "POLLOUT!=EPOLLOUT");
 static_assert(POLLRDHUP == EPOLLRDHUP, "POLLRDHUP!=EPOLLRDHUP");
@@ -42,11 +46,14 @@ static_assert(POLLERR == EPOLLERR, "POLLERR!=EPOLLERR");
 static_assert(POLLHUP == EPOLLHUP, "POLLHUP!=EPOLLHUP");
 constexpr int SUPPORTED_EVENTS =
         EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
-        EPOLLET | EPOLLONESHOT;
+        EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE;
+// Linux only allows these together with EPOLLEXCLUSIVE
+constexpr int EXCLUSIVE_EVENTS = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR |
+        EPOLLHUP | EPOLLET | EPOLLEXCLUSIVE;
 inline uint32_t events_epoll_to_poll(uint32_t e)
 {
     assert (!(e & ~SUPPORTED_EVENTS));
-    return e;
+    return e & ~EPOLLEXCLUSIVE;
 }
 inline uint32_t events_poll_to_epoll(uint32_t e)
 {
@@ -54,47 +61,89 @@ inline uint32_t events_poll_to_epoll(uint32_t e)
     return e;
 }
 
+// A file descriptor registered with an epoll instance. When the file
+// becomes ready, the registration itself is linked into the instance's
+// ready list, so waking up never allocates or takes a lock. Wakeups can
+// come from under rcu_read_lock (see net_channel), so registrations are
+// freed with rcu_dispose().
+struct epoll_registration {
+    epoll_registration(epoll_key key, const epoll_event& event)
+        : key(key), event(event)
+        , exclusive(event.events & EPOLLEXCLUSIVE) {}
+    static constexpr unsigned queued = 1; // on the ready or pending list
+    static constexpr unsigned dead = 2;   // removed from the epoll
+    static constexpr unsigned polling = 4; // being polled by a waiter
+    epoll_key key;
+    epoll_event event;                    // protected by the epoll's f_lock
+    const bool exclusive;
+    std::atomic<unsigned> state = { 0 };
+    epoll_registration* next = nullptr;   // ready or pending list link
+};
+
 class epoll_file final : public special_file {
 
     // lock ordering (fp == some file being polled):
     //    f_lock > fp->f_lock
     //    fp->f_lock > _activity_lock
     // we never hold both f_lock and activity_lock.
+    //
+    // Waiters are organized as a leader and followers: the leader waits for
+    // registrations to appear on _ready, and the followers wait on _waiters
+    // for the leader to leave or for more work than the leader could take.
+    // Each wakeup therefore wakes a single thread.
 
     // protected by f_lock:
-    std::unordered_map<epoll_key, epoll_event> map;
+    std::unordered_map<epoll_key, epoll_registration*> map;
+    // registrations which became ready, most recent first. Pushed without
+    // a lock, and taken as a whole by a waiter holding _activity_lock.
+    std::atomic<epoll_registration*> _ready = { nullptr };
+    sched::thread_handle _leader;
     mutex _activity_lock;
     // below, all protected by _activity_lock:
-    std::unordered_set<epoll_key> _activity;
+    // ready registrations not yet handed to a waiter, oldest first
+    epoll_registration* _pending = nullptr;
+    epoll_registration** _pending_tail = &_pending;
     waitqueue _waiters;
-    boost::lockfree::queue<epoll_key, boost::lockfree::fixed_sized<true>> _activity_ring{512};
-    std::atomic<bool> _activity_ring_overflow = { false };
-    sched::thread_handle _activity_ring_owner;
+    bool _have_leader = false;
 public:
     epoll_file()
         : special_file(0, DTYPE_UNSPEC)
     {
     }
+    ~epoll_file()
+    {
+        // Anything still on the lists was removed by close(), and its
+        // last wakeup is now past an RCU grace period.
+        free_list(_ready.exchange(nullptr));
+        free_list(_pending);
+    }
     virtual int close() override {
         WITH_LOCK(f_lock) {
             for (auto& e : map) {
-                e.first._file->epoll_del({ this, e.first });
+                e.first._file->epoll_del(ptr(e.second));
+                release(e.second);
             }
+            map.clear();
         }
         return 0;
     }
     int add(epoll_key key, struct epoll_event *event)
     {
+        if ((event->events & EPOLLEXCLUSIVE) &&
+                (event->events & ~EXCLUSIVE_EVENTS)) {
+            return EINVAL;
+        }
         auto fp = key._file;
         WITH_LOCK(f_lock) {
             if (map.count(key)) {
                 return EEXIST;
             }
-            map.emplace(key, *event);
-            fp->epoll_add({ this, key});
-        }
-        if (fp->poll(events_epoll_to_poll(event->events))) {
-            wake(key);
+            auto reg = new epoll_registration(key, *event);
+            map.emplace(key, reg);
+            fp->epoll_add(ptr(reg));
+            if (fp->poll(events_epoll_to_poll(event->events))) {
+                wake(reg);
+            }
         }
         return 0;
     }
@@ -102,27 +151,34 @@ public:
     {
         auto fp = key._file;
         WITH_LOCK(f_lock) {
-            try {
-                map.at(key) = *event;
-            } catch (std::out_of_range &e) {
+            auto i = map.find(key);
+            if (i == map.end()) {
                 return ENOENT;
             }
-            fp->epoll_add({ this, key });
-        }
-        if (fp->poll(events_epoll_to_poll(event->events))) {
-            wake(key);
+            auto reg = i->second;
+            if ((event->events & EPOLLEXCLUSIVE) || reg->exclusive) {
+                return EINVAL;
+            }
+            reg->event = *event;
+            fp->epoll_add(ptr(reg));
+            if (fp->poll(events_epoll_to_poll(event->events))) {
+                wake(reg);
+            }
         }
         return 0;
     }
     int del(epoll_key key)
     {
         WITH_LOCK(f_lock) {
-            if (map.erase(key)) {
-                key._file->epoll_del({ this, key });
-                return 0;
-            } else {
+            auto i = map.find(key);
+            if (i == map.end()) {
                 return ENOENT;
             }
+            auto reg = i->second;
+            map.erase(i);
+            key._file->epoll_del(ptr(reg));
+            release(reg);
+            return 0;
         }
     }
     int wait(struct epoll_event *events, int maxevents, int timeout_ms)
@@ -134,73 +190,151 @@ public:
         }
         int nr = 0;
         WITH_LOCK(_activity_lock) {
-            while (!tmr.expired() && nr == 0) {
-                if (tmo) {
-                    _activity_ring_owner.reset(*sched::thread::current());
-                    sched::thread::wait_for(_activity_lock,
-                            _waiters,
-                            tmr,
-                            [&] { return !_activity.empty(); },
-                            [&] { return !_activity_ring.empty(); },
-                            [&] { return _activity_ring_overflow.load(std::memory_order_relaxed); }
-                    );
-                    _activity_ring_owner.clear();
+            while (true) {
+                collect_ready();
+                if (_pending) {
+                    auto batch = take_pending(maxevents);
+                    if (_pending) {
+                        // more than we can return, let another waiter help
+                        _waiters.wake_one(_activity_lock);
+                    }
+                    epoll_registration* requeue = nullptr;
+                    DROP_LOCK(_activity_lock) {
+                        nr = process_activity(batch, events, requeue);
+                    }
+                    if (requeue) {
+                        // Level-triggered registrations which were ready
+                        // are polled again by the next wait.
+                        append_pending(requeue);
+                        _waiters.wake_one(_activity_lock);
+                    }
+                    if (nr) {
+                        break;
+                    }
+                    continue;
                 }
-
-                flush_activity_ring();
-                // We need to drop _activity_lock and take f_lock in process_activity(),
-                // so move _activity to local storage for processing.
-                auto activity = std::move(_activity);
-                assert(_activity.empty());
-                DROP_LOCK(_activity_lock) {
-                    nr = process_activity(activity, events, maxevents);
+                if (!tmo || tmr.expired()) {
+                    break;
                 }
-                // move back !EPOLLET back to main storage
-                if (_activity.empty()) {
-                    // nothing happened, move entire set back in
-                    _activity = std::move(activity);
+                if (!_have_leader) {
+                    _have_leader = true;
+                    _leader.reset(*sched::thread::current());
+                    sched::thread::wait_for(_activity_lock, _waiters, tmr,
+                            [&] { return _ready.load(std::memory_order_relaxed) || _pending; });
+                    _leader.clear();
+                    _have_leader = false;
+                    // hand leadership over to a waiter still sleeping
+                    _waiters.wake_one(_activity_lock);
                 } else {
-                    // move item by item (realistically a copy)
-                    std::move(activity.begin(), activity.end(),
-                            std::inserter(_activity, _activity.begin()));
-                }
-                if (!tmo) {
-                    break;
+                    sched::thread::wait_for(_activity_lock, _waiters, tmr,
+                            [&] { return !_have_leader || _pending; });
                 }
             }
         }
         return nr;
     }
-    int process_activity(std::unordered_set<epoll_key>& activity,
-                         epoll_event* events, int maxevents) {
+    void wake(epoll_registration* reg) {
+        auto old = reg->state.fetch_or(epoll_registration::queued);
+        if (old & (epoll_registration::queued | epoll_registration::dead)) {
+            return;
+        }
+        auto head = _ready.load(std::memory_order_relaxed);
+        do {
+            reg->next = head;
+        } while (!_ready.compare_exchange_weak(head, reg,
+                std::memory_order_release, std::memory_order_relaxed));
+        if (!head) {
+            _leader.wake();
+        }
+    }
+private:
+    epoll_ptr ptr(epoll_registration* reg) {
+        return { this, reg->key, reg, reg->exclusive };
+    }
+    // f_lock held. A registration on the ready or pending list is freed by
+    // whoever takes it off.
+    static void release(epoll_registration* reg) {
+        auto old = reg->state.fetch_or(epoll_registration::dead);
+        if (!(old & epoll_registration::queued)) {
+            osv::rcu_dispose(reg);
+        }
+    }
+    static void free_list(epoll_registration* reg) {
+        while (reg) {
+            auto next = reg->next;
+            delete reg;
+            reg = next;
+        }
+    }
+    void append_pending(epoll_registration* list) {
+        *_pending_tail = list;
+        while (*_pending_tail) {
+            _pending_tail = &(*_pending_tail)->next;
+        }
+    }
+    void collect_ready() {
+        auto reg = _ready.exchange(nullptr, std::memory_order_acquire);
+        epoll_registration* oldest_first = nullptr;
+        while (reg) {
+            auto next = reg->next;
+            reg->next = oldest_first;
+            oldest_first = reg;
+            reg = next;
+        }
+        append_pending(oldest_first);
+    }
+    // Each registration yields at most one event, so take at most
+    // maxevents of them.
+    epoll_registration* take_pending(int maxevents) {
+        auto batch = _pending;
+        auto tail = &_pending;
+        for (int i = 0; i < maxevents && *tail; i++) {
+            tail = &(*tail)->next;
+        }
+        _pending = *tail;
+        *tail = nullptr;
+        if (!_pending) {
+            _pending_tail = &_pending;
+        }
+        return batch;
+    }
+    int process_activity(epoll_registration* batch, epoll_event* events,
+                         epoll_registration*& requeue) {
         int nr = 0;
+        auto requeue_tail = &requeue;
         WITH_LOCK(f_lock) {
-            auto i = activity.begin();
-            while (i != activity.end() && nr < maxevents) {
-                epoll_key key = *i;
-                auto found = map.find(key);
-                auto cur = i++;
-                if (found == map.end()) {
-                    activity.erase(cur);
-                    continue; // raced
+            while (batch) {
+                auto reg = batch;
+                batch = reg->next;
+                reg->next = nullptr;
+                // from here on, a new wakeup queues the registration again
+                reg->state.fetch_or(epoll_registration::polling);
+                auto state = reg->state.fetch_and(~epoll_registration::queued);
+                if (state & epoll_registration::dead) {
+                    osv::rcu_dispose(reg);
+                    continue;
                 }
-                epoll_event& evt = found->second;
+                auto key = reg->key;
+                epoll_event& evt = reg->event;
                 int active = 0;
                 if (evt.events) {
                     active = key._file->poll(events_epoll_to_poll(evt.events));
                 }
+                reg->state.fetch_and(~epoll_registration::polling);
                 active = events_poll_to_epoll(active);
-                if (!active || (evt.events & EPOLLET)) {
-                    activity.erase(cur);
-                } else {
-                    key._file->epoll_add({ this, key });
-                }
                 if (!active) {
                     continue;
                 }
                 if (evt.events & EPOLLONESHOT) {
                     evt.events = 0;
-                    key._file->epoll_del({ this, key });
+                    key._file->epoll_del(ptr(reg));
+                } else if (!(evt.events & EPOLLET)) {
+                    key._file->epoll_add(ptr(reg));
+                    auto old = reg->state.fetch_or(epoll_registration::queued);
+                    if (!(old & epoll_registration::queued)) {
+                        *requeue_tail = reg;
+                        requeue_tail = &reg->next;
+                    }
                 }
                 trace_epoll_ready(key._fd, key._file, active);
                 events[nr].data = evt.data;
@@ -210,40 +344,6 @@ public:
         }
         return nr;
     }
-    void flush_activity_ring() {
-        epoll_key ep;
-        while (_activity_ring.pop(ep)) {
-            _activity.insert(ep);
-        }
-        if (_activity_ring_overflow.load(std::memory_order_relaxed)) {
-            _activity_ring_overflow.store(false, std::memory_order_relaxed);
-            for (auto&& x : map) {
-                _activity.insert(x.first);
-            }
-        }
-        // events on _activity_ring only wake up one waiter, so wake up all the rest  now.
-        // we need to do this even if no events were received, since if we exit, then
-        // _activity_ring_owner will remain unset.
-        _waiters.wake_all(_activity_lock);
-    }
-    void wake(epoll_key key) {
-        if (_activity_ring.push(key)) {
-            _activity_ring_owner.wake();
-            return;
-        }
-        WITH_LOCK(_activity_lock) {
-            auto ins = _activity.insert(key);
-            if (ins.second) {
-                _waiters.wake_all(_activity_lock);
-            }
-        }
-    }
-    void wake_in_rcu(epoll_key key) {
-        if (!_activity_ring.push(key)) {
-            _activity_ring_overflow.store(true, std::memory_order_relaxed);
-        }
-        _activity_ring_owner.wake();
-    }
 };
 
 int epoll_create(int size)
@@ -344,10 +444,16 @@ void epoll_file_closed(epoll_ptr ptr)
 
 void epoll_wake(const epoll_ptr& ep)
 {
-    ep.epoll->wake(ep.key);
+    ep.epoll->wake(ep.reg);
 }
 
 void epoll_wake_in_rcu(const epoll_ptr& ep)
 {
-    ep.epoll->wake_in_rcu(ep.key);
+    ep.epoll->wake(ep.reg);
+}
+
+bool epoll_in_flight(const epoll_ptr& ep)
+{
+    return ep.reg->state.load(std::memory_order_relaxed) &
+            (epoll_registration::queued | epoll_registration::polling);
 }
@@ -7,24 +7,583 @@
 
 // This is the Linux-specific asynchronous I/O API / ABI from libaio.
 // Note that this API is different the Posix AIO API.
+//
+// Every io_context owns a completion ring of nr_events io_event entries.
+// io_submit() reserves a slot in the ring for each iocb, so completions
+// never have to allocate or block. Requests are dispatched in one of two
+// ways:
+//
+//  * Reads and writes on a block device whose buffers are sector aligned
+//    and linearly mapped are turned into struct bio and handed directly to
+//    the driver's strategy routine. Completion happens in bio_done, from
+//    the driver's interrupt thread, without any thread of our own.
+//
+//  * Everything else (regular files on ZFS or ramfs, fsync, unaligned
+//    block I/O) goes to a per-CPU aio worker which runs the synchronous
+//    file operation. Requests from one io_submit() call are queued to the
+//    worker as a batch, with a single wakeup.
+//
+// When an iocb carries IOCB_FLAG_RESFD, the given eventfd is signalled
+// after the completion is placed in the ring.
 
 #include <api/libaio.h>
 
-#include <osv/stubbing.hh>
+#include <atomic>
+#include <limits.h>
+#include <vector>
 
-int io_setup(int nr_events, io_context_t *ctxp_idp) {
-    // This is a stub that doesn't actually do anything. If the caller tries
-    // to follow the io_setup() call with any other libaio call, those will
-    // fail.
-    WARN_STUBBED();
-    if (nr_events < 0) {
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/prex.h>
+#include <osv/vnode.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/sched.hh>
+#include <osv/percpu.hh>
+#include <osv/migration-lock.hh>
+#include <osv/mmu.hh>
+#include <osv/trace.hh>
+#include <osv/clock.hh>
+#include <fs/fs.hh>
+#include <fs/vfs/vfs.h>
+
+#include <boost/intrusive/list.hpp>
+
+TRACEPOINT(trace_aio_setup, "nr_events=%d ctx=%p", int, io_context*);
+TRACEPOINT(trace_aio_submit, "ctx=%p nr=%d", io_context*, long);
+TRACEPOINT(trace_aio_submit_ret, "%d", int);
+TRACEPOINT(trace_aio_dispatch_bio, "ctx=%p iocb=%p nbios=%d", io_context*, iocb*, unsigned);
+TRACEPOINT(trace_aio_dispatch_worker, "ctx=%p iocb=%p", io_context*, iocb*);
+TRACEPOINT(trace_aio_complete, "ctx=%p iocb=%p res=%ld", io_context*, iocb*, long);
+TRACEPOINT(trace_aio_getevents, "ctx=%p min_nr=%d nr=%d", io_context*, long, long);
+TRACEPOINT(trace_aio_getevents_ret, "%d", int);
+
+namespace bi = boost::intrusive;
+
+// Same limit as Linux's default fs.aio-max-nr
+static constexpr int aio_max_nr = 65536;
+
+// Largest bio we hand to a driver at once. Drivers with multiplex_strategy
+// split larger requests themselves, but others (virtio-blk) are limited by
+// their segment count, so stay well below that.
+static constexpr size_t aio_max_bio_size = 128 * 1024;
+
+struct aio_request {
+    aio_request(io_context* c, iocb* cb) : ctx(c), cb(cb) {}
+
+    io_context* ctx;
+    iocb* cb;
+    fileref fp;
+    fileref resfd;
+    std::vector<iovec> iov;
+    off_t offset = 0;
+    size_t bytes = 0;
+    // Outstanding bios, for the block device path
+    std::atomic<unsigned> pending_bios { 0 };
+    std::atomic<int> error { 0 };
+    bi::list_member_hook<> hook;
+};
+
+typedef bi::list<aio_request,
+                 bi::member_hook<aio_request, bi::list_member_hook<>,
+                                 &aio_request::hook>,
+                 bi::constant_time_size<false>> aio_request_list;
+
+struct io_context {
+    explicit io_context(unsigned nr_events)
+        : _ring(nr_events) {}
+
+    int submit(long nr, iocb* ios[]);
+    int getevents(long min_nr, long nr, io_event* events,
+                  const timespec* timeout);
+    int cancel(iocb* cb, io_event* evt);
+    void drain();
+    void complete(aio_request* req, long res);
+    // Completes a request which was never dispatched or was cancelled:
+    // releases its ring reservation without producing an event.
+    void unreserve(aio_request* req);
+private:
+    int prepare(aio_request* req);
+    bool dispatch_bio(aio_request* req);
+
+    mutex _mtx;
+    condvar _completion;
+    condvar _drained;
+    std::vector<io_event> _ring;
+    // Index of the oldest unreaped event
+    unsigned _head = 0;
+    // Number of unreaped events in the ring
+    unsigned _ready = 0;
+    // Number of submitted requests that have not completed yet. Together
+    // with _ready this never exceeds the size of the ring.
+    unsigned _inflight = 0;
+};
+
+// Per-CPU thread executing requests that cannot be dispatched directly to
+// a block driver.
+struct aio_worker {
+    aio_worker(sched::cpu* cpu)
+        : _thread([this] { run(); },
+                  sched::thread::attr().pin(cpu).name("aio-worker"))
+    {
+        _thread.start();
+    }
+
+    void queue(aio_request_list& batch);
+    bool cancel(io_context* ctx, iocb* cb, aio_request*& req);
+private:
+    void run();
+    void execute(aio_request* req);
+
+    mutex _mtx;
+    condvar _cond;
+    aio_request_list _queue;
+    sched::thread _thread;
+};
+
+static PERCPU(aio_worker*, _percpu_aio_worker);
+
+static sched::cpu::notifier _aio_notifier([] () {
+    *_percpu_aio_worker = new aio_worker(sched::cpu::current());
+});
+
+static void signal_eventfd(file* efd)
+{
+    uint64_t one = 1;
+    struct iovec iov = { &one, sizeof(one) };
+    struct uio uio = { &iov, 1, 0, sizeof(one), UIO_WRITE };
+    efd->write(&uio, 0);
+}
+
+void io_context::complete(aio_request* req, long res)
+{
+    trace_aio_complete(this, req->cb, res);
+    WITH_LOCK(_mtx) {
+        auto& ev = _ring[(_head + _ready) % _ring.size()];
+        ev.data = req->cb->data;
+        ev.obj = req->cb;
+        ev.res = res;
+        ev.res2 = 0;
+        _ready++;
+        assert(_inflight > 0);
+        if (--_inflight == 0) {
+            _drained.wake_all();
+        }
+        _completion.wake_all();
+    }
+    if (req->resfd) {
+        signal_eventfd(req->resfd.get());
+    }
+    delete req;
+}
+
+void io_context::unreserve(aio_request* req)
+{
+    WITH_LOCK(_mtx) {
+        assert(_inflight > 0);
+        if (--_inflight == 0) {
+            _drained.wake_all();
+        }
+    }
+    delete req;
+}
+
+// Validate an iocb and fill in the file and buffer details of the request.
+// Returns 0 or an errno.
+int io_context::prepare(aio_request* req)
+{
+    auto cb = req->cb;
+    struct file* fp;
+    int error = fget(cb->aio_fildes, &fp);
+    if (error) {
+        return error;
+    }
+    req->fp = fileref(fp, false);
+
+    if (cb->u.c.flags & IOCB_FLAG_RESFD) {
+        error = fget(cb->u.c.resfd, &fp);
+        if (error) {
+            return error;
+        }
+        req->resfd = fileref(fp, false);
+    }
+
+    switch (cb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PWRITE:
+        req->iov.push_back({cb->u.c.buf, cb->u.c.nbytes});
+        req->offset = cb->u.c.offset;
+        break;
+    case IO_CMD_PREADV:
+    case IO_CMD_PWRITEV:
+        if (cb->u.v.nr < 0 || cb->u.v.nr > IOV_MAX) {
+            return EINVAL;
+        }
+        req->iov.assign(cb->u.v.vec, cb->u.v.vec + cb->u.v.nr);
+        req->offset = cb->u.v.offset;
+        break;
+    case IO_CMD_FSYNC:
+    case IO_CMD_FDSYNC:
+    case IO_CMD_NOOP:
+        return 0;
+    default:
+        return EINVAL;
+    }
+    if (req->offset < 0) {
+        return EINVAL;
+    }
+    for (auto& iov : req->iov) {
+        req->bytes += iov.iov_len;
+    }
+    return 0;
+}
+
+static void aio_bio_done(struct bio* bio)
+{
+    auto req = static_cast<aio_request*>(bio->bio_caller1);
+    if (bio->bio_flags & BIO_ERROR) {
+        req->error.store(bio->bio_error ? bio->bio_error : EIO,
+                         std::memory_order_relaxed);
+    }
+    destroy_bio(bio);
+    if (req->pending_bios.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        int error = req->error.load(std::memory_order_relaxed);
+        req->ctx->complete(req, error ? -error : req->bytes);
+    }
+}
+
+// Try to turn the request into bios for the underlying block driver.
+// Returns false if the request is not eligible, in which case it should
+// be handed to a worker.
+bool io_context::dispatch_bio(aio_request* req)
+{
+    auto fp = req->fp.get();
+    if (fp->f_type != DTYPE_VNODE || !fp->f_dentry) {
+        return false;
+    }
+    auto vp = fp->f_dentry->d_vnode;
+    if (vp->v_type != VBLK) {
+        return false;
+    }
+    auto dev = static_cast<struct device*>(vp->v_data);
+    if (!dev->driver->devops->strategy) {
+        return false;
+    }
+
+    uint8_t cmd;
+    switch (req->cb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PREADV:
+        if (!(fp->f_flags & FREAD)) {
+            return false;
+        }
+        cmd = BIO_READ;
+        break;
+    case IO_CMD_PWRITE:
+    case IO_CMD_PWRITEV:
+        if (!(fp->f_flags & FWRITE)) {
+            return false;
+        }
+        cmd = BIO_WRITE;
+        break;
+    default:
+        return false;
+    }
+
+    if (req->offset % BSIZE || req->offset + req->bytes > (size_t)dev->size) {
+        return false;
+    }
+    size_t max_bio = aio_max_bio_size;
+    if (dev->max_io_size) {
+        max_bio = std::min(max_bio, (size_t)dev->max_io_size);
+    }
+    unsigned nbios = 0;
+    for (auto& iov : req->iov) {
+        if (iov.iov_len % BSIZE ||
+            !mmu::is_linear_mapped(iov.iov_base, iov.iov_len)) {
+            return false;
+        }
+        nbios += (iov.iov_len + max_bio - 1) / max_bio;
+    }
+    if (nbios == 0) {
+        return false;
+    }
+
+    trace_aio_dispatch_bio(this, req->cb, nbios);
+    // Count all bios up front, so an early completion cannot retire the
+    // request while we are still issuing the rest.
+    req->pending_bios.store(nbios, std::memory_order_relaxed);
+    off_t offset = req->offset;
+    for (auto& iov : req->iov) {
+        auto buf = static_cast<char*>(iov.iov_base);
+        size_t len = iov.iov_len;
+        while (len > 0) {
+            size_t n = std::min(len, max_bio);
+            auto bio = alloc_bio();
+            if (!bio) {
+                // Account for the bios we will not issue; the ones already
+                // in flight will complete the request with the error.
+                req->error.store(ENOMEM, std::memory_order_relaxed);
+                if (req->pending_bios.fetch_sub(nbios) == nbios) {
+                    complete(req, -ENOMEM);
+                }
+                return true;
+            }
+            bio->bio_cmd = cmd;
+            bio->bio_dev = dev;
+            bio->bio_data = buf;
+            bio->bio_offset = offset;
+            bio->bio_bcount = n;
+            bio->bio_caller1 = req;
+            bio->bio_done = aio_bio_done;
+            nbios--;
+            dev->driver->devops->strategy(bio);
+            buf += n;
+            offset += n;
+            len -= n;
+        }
+    }
+    return true;
+}
+
+int io_context::submit(long nr, iocb* ios[])
+{
+    trace_aio_submit(this, nr);
+    if (nr < 0) {
+        return -EINVAL;
+    }
+    if (nr == 0) {
+        return 0;
+    }
+    WITH_LOCK(_mtx) {
+        nr = std::min<long>(nr, _ring.size() - _inflight - _ready);
+        if (nr == 0) {
+            return -EAGAIN;
+        }
+        _inflight += nr;
+    }
+
+    aio_request_list batch;
+    long submitted = 0;
+    int error = 0;
+    // The bios of all the iocbs reach the device with one notification
+    bio_plug();
+    for (; submitted < nr; submitted++) {
+        auto req = new aio_request(this, ios[submitted]);
+        error = prepare(req);
+        if (error) {
+            unreserve(req);
+            break;
+        }
+        if (req->cb->aio_lio_opcode == IO_CMD_NOOP) {
+            complete(req, 0);
+        } else if (!dispatch_bio(req)) {
+            trace_aio_dispatch_worker(this, req->cb);
+            batch.push_back(*req);
+        }
+    }
+    bio_unplug();
+    // Give back the reservations for iocbs we did not get to
+    long unused = nr - submitted - (error ? 1 : 0);
+    if (unused > 0) {
+        WITH_LOCK(_mtx) {
+            _inflight -= unused;
+            if (_inflight == 0) {
+                _drained.wake_all();
+            }
+        }
+    }
+    if (!batch.empty()) {
+        WITH_LOCK(migration_lock) {
+            (*_percpu_aio_worker)->queue(batch);
+        }
+    }
+    int ret = submitted ? submitted : -error;
+    trace_aio_submit_ret(ret);
+    return ret;
+}
+
+int io_context::getevents(long min_nr, long nr, io_event* events,
+                          const timespec* timeout)
+{
+    trace_aio_getevents(this, min_nr, nr);
+    if (min_nr < 0 || nr < min_nr) {
+        return -EINVAL;
+    }
+    using clock = osv::clock::uptime;
+    clock::time_point deadline;
+    if (timeout) {
+        deadline = clock::now() + std::chrono::seconds(timeout->tv_sec)
+                 + std::chrono::nanoseconds(timeout->tv_nsec);
+    }
+    long n = 0;
+    WITH_LOCK(_mtx) {
+        while (_ready < (unsigned long)min_nr) {
+            if (timeout) {
+                if (clock::now() >= deadline ||
+                    _completion.wait(&_mtx, deadline)) {
+                    break;
+                }
+            } else {
+                _completion.wait(&_mtx);
+            }
+        }
+        n = std::min<long>(nr, _ready);
+        for (long i = 0; i < n; i++) {
+            events[i] = _ring[_head];
+            _head = (_head + 1) % _ring.size();
+        }
+        _ready -= n;
+    }
+    trace_aio_getevents_ret(n);
+    return n;
+}
+
+int io_context::cancel(iocb* cb, io_event* evt)
+{
+    // Only requests still waiting for a worker can be cancelled; those
+    // already handed to a driver or being executed run to completion.
+    aio_request* req = nullptr;
+    for (auto cpu : sched::cpus) {
+        auto worker = *_percpu_aio_worker.for_cpu(cpu);
+        if (worker->cancel(this, cb, req)) {
+            break;
+        }
+    }
+    if (!req) {
+        return -EAGAIN;
+    }
+    evt->data = cb->data;
+    evt->obj = cb;
+    evt->res = -ECANCELED;
+    evt->res2 = 0;
+    unreserve(req);
+    return 0;
+}
+
+void io_context::drain()
+{
+    WITH_LOCK(_mtx) {
+        while (_inflight) {
+            _drained.wait(&_mtx);
+        }
+    }
+}
+
+void aio_worker::queue(aio_request_list& batch)
+{
+    WITH_LOCK(_mtx) {
+        _queue.splice(_queue.end(), batch);
+        _cond.wake_one();
+    }
+}
+
+bool aio_worker::cancel(io_context* ctx, iocb* cb, aio_request*& req)
+{
+    WITH_LOCK(_mtx) {
+        for (auto it = _queue.begin(); it != _queue.end(); ++it) {
+            if (it->ctx == ctx && it->cb == cb) {
+                req = &*it;
+                _queue.erase(it);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void aio_worker::execute(aio_request* req)
+{
+    auto fp = req->fp.get();
+    size_t bytes = 0;
+    int error;
+    switch (req->cb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PREADV:
+        error = sys_read(fp, req->iov.data(), req->iov.size(),
+                         req->offset, &bytes);
+        break;
+    case IO_CMD_PWRITE:
+    case IO_CMD_PWRITEV:
+        error = sys_write(fp, req->iov.data(), req->iov.size(),
+                          req->offset, &bytes);
+        break;
+    case IO_CMD_FSYNC:
+    case IO_CMD_FDSYNC:
+        error = sys_fsync(fp);
+        break;
+    default:
+        error = EINVAL;
+        break;
+    }
+    // Like pread(), a partial transfer is reported as success
+    req->ctx->complete(req, (error && !bytes) ? -error : bytes);
+}
+
+void aio_worker::run()
+{
+    for (;;) {
+        aio_request_list work;
+        WITH_LOCK(_mtx) {
+            while (_queue.empty()) {
+                _cond.wait(&_mtx);
+            }
+            work.swap(_queue);
+        }
+        while (!work.empty()) {
+            auto& req = work.front();
+            work.pop_front();
+            execute(&req);
+        }
+    }
+}
+
+int io_setup(int nr_events, io_context_t *ctxp_idp)
+{
+    if (nr_events <= 0 || nr_events > aio_max_nr || !ctxp_idp) {
         return -EINVAL;
     }
+    auto ctx = new (std::nothrow) io_context(nr_events);
+    if (!ctx) {
+        return -ENOMEM;
+    }
+    trace_aio_setup(nr_events, ctx);
+    *ctxp_idp = ctx;
     return 0;
 }
 
-UNIMPL(int io_submit(io_context_t ctx, long nr, struct iocb *ios[]))
-UNIMPL(int io_getevents(io_context_t ctx_id, long min_nr, long nr,
-        struct io_event *events, struct timespec *timeout))
-UNIMPL(int io_destroy(io_context_t ctx))
-UNIMPL(int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt))
+int io_submit(io_context_t ctx, long nr, struct iocb *ios[])
+{
+    if (!ctx) {
+        return -EINVAL;
+    }
+    return ctx->submit(nr, ios);
+}
+
+int io_getevents(io_context_t ctx_id, long min_nr, long nr,
+        struct io_event *events, struct timespec *timeout)
+{
+    if (!ctx_id) {
+        return -EINVAL;
+    }
+    return ctx_id->getevents(min_nr, nr, events, timeout);
+}
+
+int io_destroy(io_context_t ctx)
+{
+    if (!ctx) {
+        return -EINVAL;
+    }
+    // Like Linux, wait for all outstanding requests before going away
+    ctx->drain();
+    delete ctx;
+    return 0;
+}
+
+int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt)
+{
+    if (!ctx || !iocb || !evt) {
+        return -EINVAL;
+    }
+    return ctx->cancel(iocb, evt);
+}
@@ -37,6 +37,8 @@
 #include <boost/lockfree/stack.hpp>
 #include <boost/lockfree/policies.hpp>
 #include <osv/migration-lock.hh>
+#include <osv/numa.hh>
+#include <osv/semaphore.hh>
 
 TRACEPOINT(trace_memory_malloc, "buf=%p, len=%d, align=%d", void *, size_t,
            size_t);
@@ -51,6 +53,7 @@ TRACEPOINT(trace_memory_realloc, "in=%p, newlen=%d, out=%p", void *, size_t, voi
 TRACEPOINT(trace_memory_page_alloc, "page=%p", void*);
 TRACEPOINT(trace_memory_page_free, "page=%p", void*);
 TRACEPOINT(trace_memory_huge_failure, "page ranges=%d", unsigned long);
+TRACEPOINT(trace_memory_compact, "free huge pages=%d", size_t);
 TRACEPOINT(trace_memory_reclaim, "shrinker %s, target=%d, delta=%d", const char *, long, long);
 TRACEPOINT(trace_memory_wait, "allocation size=%d", size_t);
 
@@ -165,15 +168,22 @@ static void garbage_collector_fn()
 // allocator was used for allocation and, therefore, which one should be used
 // to free the memory block.
 //
-// Small objects (< page size / 4) are stored in pages.  The beginning of the
+// Small objects (<= page size / 4) are stored in pages.  The beginning of the
 // page contains a header with a pointer to a pool, consisting of all free
 // objects of that size.  The pool maintains a singly linked list of free
-// objects, and adds or frees pages as needed.
+// objects, and adds or frees pages as needed.  There are four size classes
+// per power of two (e.g. 640, 768, 896 and 1024 bytes), so rounding up
+// wastes at most a fifth of an object.
 //
-// Objects which size is in range (page size / 4, page size] are given a whole
-// page from per-CPU page buffer.  Such objects don't need header they are
-// known to be not larger than a single page.  Page buffer is refilled by
-// allocating memory from large allocator.
+// Mid-size objects (up to 7/8 of a page) are stored the same way, in slabs of
+// several pages, aligned to their size, so the header is still found by
+// rounding the object's address down.  They are addressed through their own
+// memory area, which tells free() that the slab is not a single page.
+//
+// Larger objects up to a page are given a whole page from per-CPU page
+// buffer.  Such objects don't need header they are known to be not larger
+// than a single page.  Page buffer is refilled by allocating memory from
+// large allocator.
 //
 // Large objects are rounded up to page size.  They have a header in front that
 // contains the page size.  There is gap between the header and the acutal
@@ -185,11 +195,12 @@ static void garbage_collector_fn()
 // contains page ranges large enough. If there is no such list then it is a
 // worst-fit allocation form the page ranges in the tree.
 
-pool::pool(unsigned size)
+pool::pool(unsigned size, size_t slab_size)
     : _size(size)
+    , _slab_size(slab_size)
     , _free()
 {
-    assert(size + sizeof(page_header) <= page_size);
+    assert(size + sizeof(page_header) <= slab_size);
 }
 
 pool::~pool()
@@ -198,11 +209,16 @@ pool::~pool()
 
 const size_t pool::max_object_size = page_size / 4;
 const size_t pool::min_object_size = sizeof(free_object);
+constexpr size_t pool::mid_slab_size;
 
 pool::page_header* pool::to_header(free_object* object)
 {
+    auto slab_size = page_size;
+    if (mmu::get_mem_area(object) == mmu::mem_area::mempool_slab) {
+        slab_size = mid_slab_size;
+    }
     return reinterpret_cast<page_header*>(
-                 reinterpret_cast<std::uintptr_t>(object) & ~(page_size - 1));
+                 reinterpret_cast<std::uintptr_t>(object) & ~(slab_size - 1));
 }
 
 TRACEPOINT(trace_pool_alloc, "this=%p, obj=%p", void*, void*);
@@ -229,6 +245,7 @@ void* pool::alloc()
         page_header *header = &(*it);
         free_object* obj = header->local_free;
         ++header->nalloc;
+        _counters->allocs++;
         header->local_free = obj->next;
         if (!header->local_free) {
             _free->erase(it);
@@ -247,20 +264,42 @@ unsigned pool::get_size()
 
 static inline void* untracked_alloc_page();
 static inline void untracked_free_page(void *v);
+static void* alloc_slab(size_t size);
+static void free_slab(void* v, size_t size);
+
+pool_stats pool::get_stats()
+{
+    counters sum;
+    for (auto c : sched::cpus) {
+        auto* cnt = _counters.for_cpu(c);
+        sum.allocs += cnt->allocs;
+        sum.frees += cnt->frees;
+        sum.slabs += cnt->slabs;
+    }
+    return pool_stats{_size, _slab_size, sum.slabs, sum.allocs - sum.frees,
+                      sum.allocs};
+}
 
 void pool::add_page()
 {
     // FIXME: this function allocated a page and set it up but on rare cases
     // we may add this page to the free list of a different cpu, due to the
     // enablment of preemption
-    void* page = untracked_alloc_page();
+    void* page;
+    if (_slab_size == page_size) {
+        page = untracked_alloc_page();
+    } else {
+        page = mmu::translate_mem_area(mmu::mem_area::main,
+                mmu::mem_area::mempool_slab, alloc_slab(_slab_size));
+    }
     WITH_LOCK(preempt_lock) {
         page_header* header = new (page) page_header;
         header->cpu_id = mempool_cpuid();
         header->owner = this;
         header->nalloc = 0;
         header->local_free = nullptr;
-        for (auto p = page + page_size - _size; p >= header + 1; p -= _size) {
+        _counters->slabs++;
+        for (auto p = page + _slab_size - _size; p >= header + 1; p -= _size) {
             auto obj = static_cast<free_object*>(p);
             obj->next = header->local_free;
             header->local_free = obj;
@@ -279,18 +318,30 @@ inline bool pool::have_full_pages()
     return !_free->empty() && _free->back().nalloc == 0;
 }
 
+void pool::free_slab(page_header* header)
+{
+    if (_slab_size == page_size) {
+        untracked_free_page(header);
+    } else {
+        memory::free_slab(mmu::translate_mem_area(mmu::mem_area::mempool_slab,
+                mmu::mem_area::main, header), _slab_size);
+    }
+}
+
 void pool::free_same_cpu(free_object* obj, unsigned cpu_id)
 {
     void* object = static_cast<void*>(obj);
     trace_pool_free_same_cpu(this, object);
 
+    _counters->frees++;
     page_header* header = to_header(obj);
     if (!--header->nalloc && have_full_pages()) {
         if (header->local_free) {
             _free->erase(_free->iterator_to(*header));
         }
+        _counters->slabs--;
         DROP_LOCK(preempt_lock) {
-            untracked_free_page(header);
+            free_slab(header);
         }
     } else {
         if (!header->local_free) {
@@ -346,13 +397,54 @@ pool* pool::from_object(void* object)
 class malloc_pool : public pool {
 public:
     malloc_pool();
+    size_t alignment() { return get_size() & -get_size(); }
 private:
     static size_t compute_object_size(unsigned pos);
 };
 
-malloc_pool malloc_pools[ilog2_roundup_constexpr(page_size) + 1]
+// malloc()'s size classes are 8, 16, 32, 48 and 64 bytes, then four per
+// power of two up to 7/8 of a page.
+static constexpr unsigned nr_tiny_size_classes = 5;
+static constexpr unsigned nr_size_classes = nr_tiny_size_classes +
+        4 * (ilog2_roundup_constexpr(page_size) - 6) - 1;
+static constexpr size_t max_pool_object_size = page_size / 8 * 7;
+
+static unsigned size_class(size_t size)
+{
+    if (size <= 16) {
+        return size > 8;
+    } else if (size <= 64) {
+        return (size + 15) / 16;
+    }
+    // size is in (2^n, 2^(n+1)], in a class 2^(n-2) wide
+    unsigned n = ilog2(size - 1);
+    return nr_tiny_size_classes + 4 * (n - 6) + (((size - 1) >> (n - 2)) & 3);
+}
+
+malloc_pool malloc_pools[nr_size_classes]
     __attribute__((init_priority((int)init_prio::malloc_pools)));
 
+// The pool for a malloc() of size bytes aligned to alignment, or nullptr if
+// these need a whole page or more. Objects are aligned to the largest power
+// of two dividing their size (the end of a slab being aligned to a page),
+// so an alignment larger than that is served by a power of two class.
+static malloc_pool* malloc_pool_for(size_t size, size_t alignment)
+{
+    size = std::max(size, pool::min_object_size);
+    if (size > max_pool_object_size) {
+        return nullptr;
+    }
+    auto* pool = &malloc_pools[size_class(size)];
+    if (alignment > pool->alignment()) {
+        size = size_t(1) << ilog2_roundup(std::max(size, alignment));
+        if (size > max_pool_object_size) {
+            return nullptr;
+        }
+        pool = &malloc_pools[size_class(size)];
+    }
+    return pool;
+}
+
 struct mark_smp_allocator_intialized {
     mark_smp_allocator_intialized() {
         // FIXME: Handle CPU hot-plugging.
@@ -377,17 +469,21 @@ struct mark_smp_allocator_intialized {
 } s_mark_smp_alllocator_initialized __attribute__((init_priority((int)init_prio::malloc_pools)));
 
 malloc_pool::malloc_pool()
-    : pool(compute_object_size(this - malloc_pools))
+    : pool(compute_object_size(this - malloc_pools),
+           compute_object_size(this - malloc_pools) > max_object_size ?
+                   mid_slab_size : page_size)
 {
 }
 
 size_t malloc_pool::compute_object_size(unsigned pos)
 {
-    size_t size = 1 << pos;
-    if (size > max_object_size) {
-        size = max_object_size;
+    static constexpr unsigned tiny[nr_tiny_size_classes] = { 8, 16, 32, 48, 64 };
+    if (pos < nr_tiny_size_classes) {
+        return tiny[pos];
     }
-    return size;
+    pos -= nr_tiny_size_classes;
+    unsigned n = 6 + pos / 4;
+    return (size_t(1) << n) + (pos % 4 + 1) * (size_t(1) << (n - 2));
 }
 
 page_range::page_range(size_t _size)
@@ -475,6 +571,15 @@ namespace stats {
         current_jvm_heap_memory.fetch_sub(mem);
     }
     size_t jvm_heap() { return current_jvm_heap_memory.load(); }
+
+    std::vector<pool_stats> pools()
+    {
+        std::vector<pool_stats> ret;
+        for (auto& pool : malloc_pools) {
+            ret.push_back(pool.get_stats());
+        }
+        return ret;
+    }
 }
 
 void reclaimer::wake()
@@ -537,7 +642,8 @@ class page_range_allocator {
 public:
     static constexpr unsigned max_order = 16;
 
-    page_range_allocator() : _deferred_free(nullptr) { }
+    page_range_allocator()
+        : _bitmap(bitmap_allocator<unsigned long>(this)), _deferred_free(nullptr) { }
 
     template<bool UseBitmap = true>
     page_range* alloc(size_t size);
@@ -546,6 +652,20 @@ public:
     void free(page_range* pr);
 
     void initial_add(page_range* pr);
+    // Size the bitmap, when initial_add() next grows it, for all the pages
+    // below end: the allocator may be freed pages there which it was never
+    // given, allocated before it existed.
+    void cover(void* end) {
+        auto idx = get_bitmap_idx(*static_cast<page_range*>(end)) + 1;
+        _bitmap_min_size = std::max(_bitmap_min_size, idx);
+    }
+    // Whether the bitmap has room for the range, so it can be freed here
+    bool covers(page_range& pr) const {
+        return get_bitmap_idx(pr) + pr.size / page_size < _bitmap.size();
+    }
+    size_t bitmap_pages() const {
+        return _bitmap.size();
+    }
 
     template<typename Func>
     void for_each(unsigned min_order, Func f);
@@ -553,6 +673,12 @@ public:
     void for_each(Func f) {
         for_each<Func>(0, f);
     }
+    // Remove every free range, largest first, and hand it to f.
+    template<typename Func>
+    void drain(Func f);
+
+    // Number of free, naturally aligned blocks of the given size
+    size_t aligned_blocks(size_t block_size);
 
     bool empty() const {
         return _not_empty.none();
@@ -634,22 +760,39 @@ private:
 
     std::bitset<max_order + 1> _not_empty;
 
+    // The bitmap has a bit for every page from physical address 0 up to the
+    // highest one the allocator was given or told to cover(), so the ones of
+    // an allocator of a higher node mostly describe other nodes' memory. It
+    // lives in memory taken from the allocator it describes.
     template<typename T>
     class bitmap_allocator {
     public:
         typedef T value_type;
+        explicit bitmap_allocator(page_range_allocator* owner) : _owner(owner) { }
+        template<typename U>
+        bitmap_allocator(const bitmap_allocator<U>& other) : _owner(other._owner) { }
         T* allocate(size_t n);
         void deallocate(T* p, size_t n);
         size_t get_size(size_t n) {
             return align_up(sizeof(T) * n, page_size);
         }
+        bool operator==(const bitmap_allocator& other) const {
+            return _owner == other._owner;
+        }
+        bool operator!=(const bitmap_allocator& other) const {
+            return _owner != other._owner;
+        }
+        page_range_allocator* _owner;
     };
     boost::dynamic_bitset<unsigned long,
                           bitmap_allocator<unsigned long>> _bitmap;
+    unsigned _bitmap_min_size = 0;
     page_range* _deferred_free;
 };
 
-page_range_allocator free_page_ranges
+// One allocator per NUMA node, all protected by free_page_ranges_lock. Until
+// the firmware describes more than one node everything lives in node 0.
+page_range_allocator free_page_ranges[numa::max_nodes]
     __attribute__((init_priority((int)init_prio::fpranges)));
 
 template<typename T>
@@ -657,7 +800,7 @@ T* page_range_allocator::bitmap_allocator<T>::allocate(size_t n)
 {
     auto size = get_size(n);
     on_alloc(size);
-    auto pr = free_page_ranges.alloc<false>(size);
+    auto pr = _owner->alloc<false>(size);
     return reinterpret_cast<T*>(pr);
 }
 
@@ -667,8 +810,8 @@ void page_range_allocator::bitmap_allocator<T>::deallocate(T* p, size_t n)
     auto size = get_size(n);
     on_free(size);
     auto pr = new (p) page_range(size);
-    assert(!free_page_ranges._deferred_free);
-    free_page_ranges._deferred_free = pr;
+    assert(!_owner->_deferred_free);
+    _owner->_deferred_free = pr;
 }
 
 template<bool UseBitmap>
@@ -713,6 +856,23 @@ page_range* page_range_allocator::alloc(size_t size)
 
     auto& pr = *range;
     if (pr.size > size) {
+        // Carve a small allocation out of the end of the range if its start
+        // is huge page aligned (or too little short of it) and its end is
+        // not: taking the front would break up a free, aligned huge page
+        // which alloc_huge_page() could have used.
+        auto start = reinterpret_cast<uintptr_t>(&pr);
+        auto end = start + pr.size;
+        if (size < mmu::huge_page_size && pr.size >= mmu::huge_page_size &&
+                align_up(start, mmu::huge_page_size) - start < size &&
+                end - align_down(end, mmu::huge_page_size) >= size) {
+            pr.size -= size;
+            insert<UseBitmap>(pr);
+            auto& tail = *new (reinterpret_cast<void*>(end - size)) page_range(size);
+            if (UseBitmap) {
+                set_bits(tail, false);
+            }
+            return &tail;
+        }
         auto& np = *new (static_cast<void*>(&pr) + size)
                         page_range(pr.size - size);
         insert<UseBitmap>(np);
@@ -772,7 +932,8 @@ void page_range_allocator::free(page_range* pr)
 
 void page_range_allocator::initial_add(page_range* pr)
 {
-    auto idx = get_bitmap_idx(*pr) + pr->size / page_size;
+    auto idx = std::max<size_t>(get_bitmap_idx(*pr) + pr->size / page_size,
+                                _bitmap_min_size);
     if (idx > _bitmap.size()) {
         auto prev_idx = get_bitmap_idx(*pr) - 1;
         if (_bitmap.size() > prev_idx && _bitmap[prev_idx]) {
@@ -812,6 +973,409 @@ void page_range_allocator::for_each(unsigned min_order, Func f)
     }
 }
 
+template<typename Func>
+void page_range_allocator::drain(Func f)
+{
+    while (!empty()) {
+        page_range* pr;
+        if (_not_empty[max_order]) {
+            pr = &*_free_huge.rbegin();
+            remove_huge(*pr);
+        } else {
+            auto order = ilog2(_not_empty.to_ulong());
+            pr = &_free[order].front();
+            remove_list(order, *pr);
+        }
+        set_bits(*pr, false);
+        f(pr);
+    }
+}
+
+size_t page_range_allocator::aligned_blocks(size_t block_size)
+{
+    size_t n = 0;
+    for_each(ilog2(block_size / page_size), [&] (page_range& pr) {
+        auto start = align_up(reinterpret_cast<uintptr_t>(&pr), block_size);
+        auto end = align_down(reinterpret_cast<uintptr_t>(&pr) + pr.size, block_size);
+        if (end > start) {
+            n += (end - start) / block_size;
+        }
+        return true;
+    });
+    return n;
+}
+
+namespace numa {
+
+// Physical memory ranges as described by the SRAT. Anything not covered
+// belongs to node 0.
+struct memory_affinity {
+    u64 start;
+    u64 end;
+    unsigned node;
+};
+
+static constexpr unsigned max_memory_affinities = 64;
+static memory_affinity memory_affinities[max_memory_affinities];
+static unsigned nr_memory_affinities;
+
+struct cpu_affinity {
+    u32 apic_id;
+    unsigned node;
+};
+
+static constexpr unsigned max_cpu_affinities = 256;
+static cpu_affinity cpu_affinities[max_cpu_affinities];
+static unsigned nr_cpu_affinities;
+
+static u32 node_domains[max_nodes];
+static unsigned nr_known_domains;
+static unsigned nodes = 1;
+static u8 distances[max_nodes][max_nodes];
+static unsigned fallback[max_nodes][max_nodes] = { { 0 } };
+static u8 cpu_nodes[sched::max_cpus];
+
+struct thread_policy {
+    policy_mode mode;
+    unsigned long nodes;
+    unsigned next;
+};
+
+static __thread thread_policy policy;
+
+static bool find_domain(u32 domain, unsigned& node)
+{
+    for (unsigned i = 0; i < nr_known_domains; i++) {
+        if (node_domains[i] == domain) {
+            node = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static unsigned node_of_domain(u32 domain)
+{
+    unsigned node;
+    if (find_domain(domain, node)) {
+        return node;
+    }
+    if (nr_known_domains == max_nodes) {
+        debugf("numa: too many proximity domains, folding domain %d into node 0\n",
+               domain);
+        return 0;
+    }
+    node_domains[nr_known_domains] = domain;
+    return nr_known_domains++;
+}
+
+void add_memory_affinity(u32 domain, u64 base, u64 length)
+{
+    auto node = node_of_domain(domain);
+    if (nr_memory_affinities == max_memory_affinities) {
+        return;
+    }
+    auto start = align_up(base, page_size);
+    auto end = align_down(base + length, page_size);
+    if (start >= end) {
+        return;
+    }
+    memory_affinities[nr_memory_affinities++] = { start, end, node };
+}
+
+void add_cpu_affinity(u32 domain, u32 apic_id)
+{
+    auto node = node_of_domain(domain);
+    if (nr_cpu_affinities < max_cpu_affinities) {
+        cpu_affinities[nr_cpu_affinities++] = { apic_id, node };
+    }
+}
+
+void set_distance(u32 from_domain, u32 to_domain, u8 distance)
+{
+    unsigned from, to;
+    if (find_domain(from_domain, from) && find_domain(to_domain, to)) {
+        distances[from][to] = distance;
+    }
+}
+
+void attach_cpu(unsigned cpu_id, u32 apic_id)
+{
+    for (unsigned i = 0; i < nr_cpu_affinities; i++) {
+        if (cpu_affinities[i].apic_id == apic_id) {
+            cpu_nodes[cpu_id] = cpu_affinities[i].node;
+            return;
+        }
+    }
+}
+
+unsigned nr_nodes()
+{
+    return nodes;
+}
+
+nodemask all_nodes()
+{
+    return nodemask((1UL << nodes) - 1);
+}
+
+unsigned node_of_cpu(unsigned cpu_id)
+{
+    return cpu_nodes[cpu_id];
+}
+
+unsigned current_node()
+{
+    if (nodes == 1 || !smp_allocator) {
+        return 0;
+    }
+    return cpu_nodes[sched::cpu::current()->id];
+}
+
+static const memory_affinity* find_affinity(u64 paddr)
+{
+    for (unsigned i = 0; i < nr_memory_affinities; i++) {
+        auto& ma = memory_affinities[i];
+        if (paddr >= ma.start && paddr < ma.end) {
+            return &ma;
+        }
+    }
+    return nullptr;
+}
+
+static u64 phys_of(const void* addr)
+{
+    return reinterpret_cast<uintptr_t>(addr) -
+           reinterpret_cast<uintptr_t>(mmu::phys_mem);
+}
+
+unsigned node_of_addr(const void* addr)
+{
+    if (nodes == 1) {
+        return 0;
+    }
+    auto ma = find_affinity(phys_of(addr));
+    return ma ? ma->node : 0;
+}
+
+size_t node_extent(const void* addr, size_t size)
+{
+    if (nodes == 1) {
+        return size;
+    }
+    auto paddr = phys_of(addr);
+    auto ma = find_affinity(paddr);
+    u64 end;
+    if (ma) {
+        end = ma->end;
+    } else {
+        // In a hole of the SRAT: up to the next described range
+        end = paddr + size;
+        for (unsigned i = 0; i < nr_memory_affinities; i++) {
+            auto start = memory_affinities[i].start;
+            if (start > paddr && start < end) {
+                end = start;
+            }
+        }
+    }
+    return std::min<u64>(size, end - paddr);
+}
+
+const unsigned* fallback_order(unsigned node)
+{
+    return fallback[node];
+}
+
+int set_policy(policy_mode mode, nodemask mask)
+{
+    mask &= all_nodes();
+    switch (mode) {
+    case mpol_default:
+    case mpol_local:
+        mask.reset();
+        break;
+    case mpol_preferred:
+        // An empty mask means "local allocation", as in Linux
+        break;
+    case mpol_bind:
+    case mpol_interleave:
+        if (mask.none()) {
+            return EINVAL;
+        }
+        break;
+    default:
+        return EINVAL;
+    }
+    policy.mode = mode;
+    policy.nodes = mask.to_ulong();
+    policy.next = 0;
+    return 0;
+}
+
+void get_policy(policy_mode& mode, nodemask& mask)
+{
+    mode = policy.mode;
+    mask = nodemask(policy.nodes);
+}
+
+static unsigned first_node(unsigned long mask)
+{
+    return count_trailing_zeros(mask);
+}
+
+unsigned policy_node(nodemask& allowed)
+{
+    allowed = all_nodes();
+    if (nodes == 1) {
+        return 0;
+    }
+    auto mask = policy.nodes;
+    switch (policy.mode) {
+    case mpol_preferred:
+        return mask ? first_node(mask) : current_node();
+    case mpol_bind: {
+        allowed = nodemask(mask);
+        auto node = current_node();
+        return allowed[node] ? node : first_node(mask);
+    }
+    case mpol_interleave: {
+        // Round-robin over the nodes in the mask
+        auto rest = mask & ~((2UL << policy.next) - 1);
+        policy.next = rest ? first_node(rest) : first_node(mask);
+        return policy.next;
+    }
+    default:
+        return current_node();
+    }
+}
+
+void setup()
+{
+    if (nr_known_domains <= 1 || !nr_memory_affinities) {
+        return;
+    }
+    nodes = nr_known_domains;
+
+    // Without a SLIT, all remote nodes are equally far away.
+    for (unsigned i = 0; i < nodes; i++) {
+        for (unsigned j = 0; j < nodes; j++) {
+            if (!distances[i][j]) {
+                distances[i][j] = i == j ? 10 : 20;
+            }
+        }
+        for (unsigned j = 0; j < nodes; j++) {
+            fallback[i][j] = j;
+        }
+        std::stable_sort(fallback[i], fallback[i] + nodes,
+                [&] (unsigned a, unsigned b) {
+                    return distances[i][a] < distances[i][b];
+                });
+    }
+
+    // All the memory was handed to node 0 by arch_setup_free_memory(), before
+    // the topology was known. Move every free range (split on node
+    // boundaries) to the allocator of the node it belongs to. Ranges already
+    // allocated will find their way to the right node when freed, so each
+    // node's bitmap must cover all of the node's memory, not only what is
+    // free now.
+    WITH_LOCK(free_page_ranges_lock) {
+        // Node 0's bitmap still covers all the memory; the SRAT may also
+        // describe hotpluggable ranges above it, which we don't have.
+        u64 top = free_page_ranges[0].bitmap_pages() * page_size;
+        for (unsigned i = 0; i < nr_memory_affinities; i++) {
+            auto& ma = memory_affinities[i];
+            if (ma.start < top) {
+                free_page_ranges[ma.node].cover(mmu::phys_mem + std::min(ma.end, top));
+            }
+        }
+        bi::list<page_range,
+                 bi::member_hook<page_range,
+                                 bi::list_member_hook<>,
+                                 &page_range::list_hook>,
+                 bi::constant_time_size<false>> ranges;
+        free_page_ranges[0].drain([&] (page_range* pr) {
+            ranges.push_back(*pr);
+        });
+        while (!ranges.empty()) {
+            auto& pr = ranges.front();
+            ranges.pop_front();
+            void* addr = &pr;
+            size_t size = pr.size;
+            while (size) {
+                auto len = node_extent(addr, size);
+                auto node = node_of_addr(addr);
+                free_page_ranges[node].initial_add(new (addr) page_range(len));
+                addr += len;
+                size -= len;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < nodes; i++) {
+        size_t bytes = 0;
+        for (unsigned j = 0; j < nr_memory_affinities; j++) {
+            auto& ma = memory_affinities[j];
+            if (ma.node == i) {
+                bytes += ma.end - ma.start;
+            }
+        }
+        debugf("numa: node %d: %d MB\n", i, bytes >> 20);
+    }
+}
+
+}
+
+// Run alloc on the allocator of the given node and, if it fails, on the
+// other allowed nodes in order of increasing distance.
+// Must be called with free_page_ranges_lock held.
+template<typename Alloc>
+static page_range* alloc_on_node(unsigned node, numa::nodemask allowed,
+                                 Alloc alloc)
+{
+    auto order = numa::fallback_order(node);
+    for (unsigned i = 0; i < numa::nr_nodes(); i++) {
+        auto n = order[i];
+        if (!allowed[n]) {
+            continue;
+        }
+        auto pr = alloc(free_page_ranges[n]);
+        if (pr) {
+            return pr;
+        }
+    }
+    return nullptr;
+}
+
+template<typename Func>
+static void for_each_free_range(Func f)
+{
+    bool more = true;
+    for (unsigned n = 0; more && n < numa::nr_nodes(); n++) {
+        free_page_ranges[n].for_each([&] (page_range& pr) {
+            return more = f(pr);
+        });
+    }
+}
+
+static bool free_page_ranges_empty()
+{
+    for (unsigned n = 0; n < numa::nr_nodes(); n++) {
+        if (!free_page_ranges[n].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t free_page_ranges_size()
+{
+    size_t size = 0;
+    for (unsigned n = 0; n < numa::nr_nodes(); n++) {
+        size += free_page_ranges[n].size();
+    }
+    return size;
+}
+
 static void* malloc_large(size_t size, size_t alignment, bool block = true)
 {
     auto requested_size = size;
@@ -827,12 +1391,16 @@ static void* malloc_large(size_t size, size_t alignment, bool block = true)
     while (true) {
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
-            page_range* ret_header;
-            if (alignment > page_size) {
-                ret_header = free_page_ranges.alloc_aligned(size, page_size, alignment);
-            } else {
-                ret_header = free_page_ranges.alloc(size);
-            }
+            numa::nodemask allowed;
+            auto node = numa::policy_node(allowed);
+            auto ret_header = alloc_on_node(node, allowed,
+                    [=] (page_range_allocator& a) -> page_range* {
+                if (alignment > page_size) {
+                    return a.alloc_aligned(size, page_size, alignment);
+                } else {
+                    return a.alloc(size);
+                }
+            });
             if (ret_header) {
                 on_alloc(size);
                 void* obj = ret_header;
@@ -882,7 +1450,7 @@ bool reclaimer_waiters::wake_waiters()
 {
     bool woken = false;
     assert(mutex_owned(&free_page_ranges_lock));
-    free_page_ranges.for_each([&] (page_range& fp) {
+    for_each_free_range([&] (page_range& fp) {
         // We won't do the allocations, so simulate. Otherwise we can have
         // 10Mb available in the whole system, and 4 threads that wait for
         // it waking because they all believe that memory is available
@@ -1033,7 +1601,26 @@ void reclaimer::_do_reclaim()
 static void free_page_range_locked(page_range *range)
 {
     on_free(range->size);
-    free_page_ranges.free(range);
+    if (numa::nr_nodes() == 1) {
+        free_page_ranges[0].free(range);
+        return;
+    }
+    // A range allocated before the topology was known may straddle nodes
+    void* addr = range;
+    size_t size = range->size;
+    while (size) {
+        auto len = numa::node_extent(addr, size);
+        auto node = numa::node_of_addr(addr);
+        auto pr = new (addr) page_range(len);
+        // Node 0's bitmap covers all the memory there was at boot; another
+        // node's may be too small if it had no free memory at setup()
+        if (!free_page_ranges[node].covers(*pr)) {
+            node = 0;
+        }
+        free_page_ranges[node].free(pr);
+        addr += len;
+        size -= len;
+    }
 }
 
 // Return a page range back to free_page_ranges. Note how the size of the
@@ -1104,9 +1691,15 @@ struct l1 {
     void push(void* page) { _pages[nr++] = page; }
     void* top() { return _pages[nr - 1]; }
     void wake_thread() { _fill_thread.wake(); }
+    // May be called from any CPU. drained is posted once the pool is empty.
+    void request_drain()
+    {
+        _drain_requested.store(true, std::memory_order_relaxed);
+        _fill_thread.wake();
+    }
     static void fill_thread();
     static void refill();
-    static void unfill();
+    static void unfill(size_t keep = max / 2);
 
     static constexpr size_t max = 512;
     static constexpr size_t watermark_lo = max * 1 / 4;
@@ -1114,6 +1707,7 @@ struct l1 {
     size_t nr = 0;
 
 private:
+    std::atomic<bool> _drain_requested { false };
     sched::thread _fill_thread;
     void* _pages[max];
 };
@@ -1124,7 +1718,7 @@ struct page_batch {
     void* pages[nr_pages];
 };
 
-// L2-pool (Global page buffer pool)
+// L2-pool (Per-NUMA-node page buffer pool)
 //
 // if nr < max * 1 / 4
 //    refill
@@ -1136,18 +1730,21 @@ struct page_batch {
 // L2-pool.
 //
 // When L2-pool needs refill or unfill, it moves a batch of pages from or to
-// global free page list.
+// free page list of its node. Each CPU's L1-pool is backed by the L2-pool of
+// the CPU's node, so page allocations are node-local by default.
 //
-// Single thread is created to help filling the L2-pool.
+// A thread per node is created to help filling the L2-pool.
 class l2 {
 public:
-    l2()
-        : _max(sched::cpus.size() * (l1::max / page_batch::nr_pages))
+    explicit l2(unsigned node)
+        : _node(node)
+        , _max(cpus_on_node(node) * (l1::max / page_batch::nr_pages))
         , _nr(0)
         , _watermark_lo(_max * 1 / 4)
         , _watermark_hi(_max * 3 / 4)
         , _stack(_max)
-        , _fill_thread([=] { fill_thread(); }, sched::thread::attr().name("page_pool_l2"))
+        , _fill_thread([=] { fill_thread(); }, sched::thread::attr().name(
+                node ? osv::sprintf("page_pool_l2_%d", node) : "page_pool_l2"))
     {
        _fill_thread.start();
     }
@@ -1204,14 +1801,26 @@ public:
     }
 
     void fill_thread();
+    void wake_thread() { _fill_thread.wake(); }
     void refill();
     void unfill();
+    void drain();
     void free_batch(page_batch& batch);
     size_t get_nr() { return _nr.load(std::memory_order_relaxed); }
     void inc_nr() { _nr.fetch_add(1, std::memory_order_relaxed); }
     void dec_nr() { _nr.fetch_sub(1, std::memory_order_relaxed); }
 
 private:
+    static unsigned cpus_on_node(unsigned node)
+    {
+        unsigned n = 0;
+        for (auto c : sched::cpus) {
+            n += numa::node_of_cpu(c->id) == node;
+        }
+        return std::max(n, 1u);
+    }
+
+    unsigned _node;
     size_t _max;
     std::atomic<size_t> _nr;
     size_t _watermark_lo;
@@ -1220,21 +1829,51 @@ private:
     sched::thread _fill_thread;
 };
 
+// N per-cpu threads for L1 page pool, one thread per node for L2 page pool.
+// Switch to smp_allocator only when all these threads are ready.
+static void pool_thread_ready()
+{
+    if (smp_allocator_cnt++ == sched::cpus.size() + numa::nr_nodes() - 1) {
+        smp_allocator = true;
+    }
+}
+
+// While a compaction is in effect, the pools only refill when a page is
+// asked for, not in the background, so the pages it gave back to the page
+// range allocators stay there.
+static std::atomic<unsigned> compactions { 0 };
+static semaphore drained { 0 };
+
+static bool background_refill()
+{
+    return !compactions.load(std::memory_order_relaxed);
+}
+
 PERCPU(l1*, percpu_l1);
 static sched::cpu::notifier _notifier([] () {
     *percpu_l1 = new l1(sched::cpu::current());
-    // N per-cpu threads for L1 page pool, 1 thread for L2 page pool
-    // Switch to smp_allocator only when all the N + 1 threads are ready
-    if (smp_allocator_cnt++ == sched::cpus.size()) {
-        smp_allocator = true;
-    }
+    pool_thread_ready();
 });
 static inline l1& get_l1()
 {
     return **percpu_l1;
 }
 
-class l2 global_l2;
+struct l2_pools {
+    l2_pools()
+    {
+        for (unsigned n = 0; n < numa::nr_nodes(); n++) {
+            pools[n] = new l2(n);
+        }
+    }
+    l2* pools[numa::max_nodes];
+} node_l2;
+
+// The L2-pool of the current CPU's node. Callers hold preempt_lock.
+static inline l2& get_l2()
+{
+    return *node_l2.pools[numa::current_node()];
+}
 
 // Percpu thread for L1 page pool
 void l1::fill_thread()
@@ -1244,10 +1883,16 @@ void l1::fill_thread()
     for (;;) {
         sched::thread::wait_until([&] {
                 WITH_LOCK(preempt_lock) {
-                    return pbuf.nr < pbuf.watermark_lo || pbuf.nr > pbuf.watermark_hi;
+                    return (pbuf.nr < pbuf.watermark_lo && background_refill()) ||
+                           pbuf.nr > pbuf.watermark_hi ||
+                           pbuf._drain_requested.load(std::memory_order_relaxed);
                 }
         });
-        if (pbuf.nr < pbuf.watermark_lo) {
+        if (pbuf._drain_requested.exchange(false, std::memory_order_relaxed)) {
+            unfill(0);
+            drained.post();
+        }
+        if (pbuf.nr < pbuf.watermark_lo && background_refill()) {
             refill();
         }
         if (pbuf.nr > pbuf.watermark_hi) {
@@ -1261,7 +1906,7 @@ void l1::refill()
     SCOPE_LOCK(preempt_lock);
     auto& pbuf = get_l1();
     while (pbuf.nr + page_batch::nr_pages < pbuf.max / 2) {
-        auto* pb = global_l2.alloc_page_batch(pbuf);
+        auto* pb = get_l2().alloc_page_batch(pbuf);
         if (pb) {
             for (auto& page : pb->pages) {
                 pbuf.push(page);
@@ -1270,16 +1915,16 @@ void l1::refill()
     }
 }
 
-void l1::unfill()
+void l1::unfill(size_t keep)
 {
     SCOPE_LOCK(preempt_lock);
     auto& pbuf = get_l1();
-    while (pbuf.nr > page_batch::nr_pages + pbuf.max / 2) {
+    while (pbuf.nr > page_batch::nr_pages + keep) {
         auto* pb = static_cast<page_batch*>(pbuf.top());
         for (size_t i = 0 ; i < page_batch::nr_pages; i++) {
             pb->pages[i] = pbuf.pop();
         }
-        global_l2.free_page_batch(pb);
+        get_l2().free_page_batch(pb);
     }
 }
 
@@ -1310,20 +1955,19 @@ bool l1::free_page_local(void* v)
     return true;
 }
 
-// Global thread for L2 page pool
+// Per-node thread for L2 page pool
 void l2::fill_thread()
 {
-    if (smp_allocator_cnt++ == sched::cpus.size()) {
-        smp_allocator = true;
-    }
+    pool_thread_ready();
 
     sched::thread::wait_until([] {return smp_allocator;});
     for (;;) {
         sched::thread::wait_for([=] {
                 auto nr = get_nr();
-                return nr < _watermark_lo || nr > _watermark_hi;
+                return (nr < _watermark_lo && background_refill()) ||
+                       nr > _watermark_hi;
         });
-        if (get_nr() < _watermark_lo) {
+        if (get_nr() < _watermark_lo && background_refill()) {
             refill();
         }
         if (get_nr() > _watermark_hi) {
@@ -1339,7 +1983,7 @@ void l2::refill()
     while (get_nr() < _max / 2) {
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
-            if (free_page_ranges.empty()) {
+            if (free_page_ranges_empty()) {
                 // That is almost a guaranteed oom, but we can still have some hope
                 // if we the current allocation is a small one. Another advantage
                 // of waiting here instead of oom'ing directly is that we can have
@@ -1349,7 +1993,10 @@ void l2::refill()
             }
             auto total_size = 0;
             for (size_t i = 0 ; i < page_batch::nr_pages; i++) {
-                batch.pages[i] = free_page_ranges.alloc(page_size);
+                batch.pages[i] = alloc_on_node(_node, numa::all_nodes(),
+                        [] (page_range_allocator& a) {
+                    return a.alloc(page_size);
+                });
                 total_size += page_size;
             }
             on_alloc(total_size);
@@ -1381,6 +2028,50 @@ void l2::unfill()
     }
 }
 
+void l2::drain()
+{
+    page_batch batch;
+    page_batch* pb;
+    while (_stack.pop(pb)) {
+        batch = *pb;
+        dec_nr();
+        free_batch(batch);
+    }
+}
+
+// Hand the pages cached by all the pools back to the page range allocators,
+// and stop refilling them in the background until end_compaction().
+// Concurrent calls are not allowed.
+void begin_compaction()
+{
+    compactions.fetch_add(1, std::memory_order_relaxed);
+    if (!smp_allocator) {
+        return;
+    }
+    for (auto c : sched::cpus) {
+        (*percpu_l1.for_cpu(c))->request_drain();
+    }
+    // The L1 pools drain into the L2 pools
+    drained.wait(sched::cpus.size());
+    for (unsigned n = 0; n < numa::nr_nodes(); n++) {
+        node_l2.pools[n]->drain();
+    }
+}
+
+void end_compaction()
+{
+    if (compactions.fetch_sub(1, std::memory_order_relaxed) != 1 ||
+            !smp_allocator) {
+        return;
+    }
+    for (auto c : sched::cpus) {
+        (*percpu_l1.for_cpu(c))->wake_thread();
+    }
+    for (unsigned n = 0; n < numa::nr_nodes(); n++) {
+        node_l2.pools[n]->wake_thread();
+    }
+}
+
 void l2::free_batch(page_batch& batch)
 {
     WITH_LOCK(free_page_ranges_lock) {
@@ -1395,28 +2086,103 @@ void l2::free_batch(page_batch& batch)
 
 }
 
-static void* early_alloc_page()
+static void* alloc_page_on_node(unsigned node, numa::nodemask allowed)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        on_alloc(page_size);
-        return static_cast<void*>(free_page_ranges.alloc(page_size));
+        auto pr = alloc_on_node(node, allowed, [] (page_range_allocator& a) {
+            return a.alloc(page_size);
+        });
+        if (pr) {
+            on_alloc(page_size);
+        }
+        return static_cast<void*>(pr);
     }
 }
 
+static void* early_alloc_page()
+{
+    return alloc_page_on_node(0, numa::all_nodes());
+}
+
 static void early_free_page(void* v)
 {
     auto pr = new (v) page_range(page_size);
     free_page_range(pr);
 }
 
+// Whether the calling thread's placement policy asks for a page from a node
+// other than the one backing this CPU's page pools.
+static bool remote_placement(unsigned& node, numa::nodemask& allowed)
+{
+    if (numa::nr_nodes() == 1) {
+        return false;
+    }
+    node = numa::policy_node(allowed);
+    return node != numa::current_node();
+}
+
+// Pages of other nodes are taken from them a batch at a time, and kept per
+// cpu, so a thread interleaving over the nodes doesn't take
+// free_page_ranges_lock for each page of another node.
+struct remote_pages {
+    static constexpr unsigned batch = 16;
+    unsigned nr[numa::max_nodes];
+    void* pages[numa::max_nodes][batch];
+};
+PERCPU(remote_pages, percpu_remote_pages);
+
+static void* alloc_remote_page(unsigned node, numa::nodemask allowed)
+{
+    WITH_LOCK(preempt_lock) {
+        auto& rp = *percpu_remote_pages;
+        if (rp.nr[node]) {
+            return rp.pages[node][--rp.nr[node]];
+        }
+    }
+    void* batch[remote_pages::batch];
+    unsigned n = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        while (n < remote_pages::batch) {
+            auto pr = free_page_ranges[node].alloc(page_size);
+            if (!pr) {
+                break;
+            }
+            batch[n++] = pr;
+        }
+        on_alloc(n * page_size);
+    }
+    if (!n) {
+        // The node is out of pages; take one wherever the policy allows
+        return alloc_page_on_node(node, allowed);
+    }
+    WITH_LOCK(preempt_lock) {
+        // Perhaps another cpu's, if we moved
+        auto& rp = *percpu_remote_pages;
+        while (n > 1 && rp.nr[node] < remote_pages::batch) {
+            rp.pages[node][rp.nr[node]++] = batch[--n];
+        }
+    }
+    while (n > 1) {
+        early_free_page(batch[--n]);
+    }
+    return batch[0];
+}
+
 static void* untracked_alloc_page()
 {
-    void* ret;
+    void* ret = nullptr;
+    unsigned node;
+    numa::nodemask allowed;
 
     if (!smp_allocator) {
         ret = early_alloc_page();
     } else {
-        ret = page_pool::l1::alloc_page();
+        if (remote_placement(node, allowed)) {
+            ret = alloc_remote_page(node, allowed);
+        }
+        if (!ret) {
+            ret = page_pool::l1::alloc_page();
+        }
     }
     trace_memory_page_alloc(ret);
     return ret;
@@ -1429,12 +2195,34 @@ void* alloc_page()
     return p;
 }
 
+void* alloc_page_noblock()
+{
+    void* p = nullptr;
+    if (smp_allocator) {
+        p = page_pool::l1::alloc_page_local();
+    }
+    if (!p) {
+        p = alloc_page_on_node(smp_allocator ? numa::current_node() : 0,
+                               numa::all_nodes());
+    }
+    if (p) {
+        trace_memory_page_alloc(p);
+        tracker_remember(p, page_size);
+    }
+    return p;
+}
+
 static inline void untracked_free_page(void *v)
 {
     trace_memory_page_free(v);
     if (!smp_allocator) {
         return early_free_page(v);
     }
+    // Keep the page pools node-local: a page of another node goes straight
+    // back to its own node's allocator.
+    if (numa::nr_nodes() > 1 && numa::node_of_addr(v) != numa::current_node()) {
+        return early_free_page(v);
+    }
     page_pool::l1::free_page(v);
 }
 
@@ -1452,7 +2240,11 @@ void free_page(void* v)
 void* alloc_huge_page(size_t N)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        auto pr = free_page_ranges.alloc_aligned(N, 0, N, true);
+        numa::nodemask allowed;
+        auto node = numa::policy_node(allowed);
+        auto pr = alloc_on_node(node, allowed, [=] (page_range_allocator& a) {
+            return a.alloc_aligned(N, 0, N, true);
+        });
         if (pr) {
             on_alloc(N);
             return static_cast<void*>(pr);
@@ -1465,7 +2257,7 @@ void* alloc_huge_page(size_t N)
         // just to be sure, and if this is not real pressure, it will just go back to
         // sleep
         reclaimer_thread.wake();
-        trace_memory_huge_failure(free_page_ranges.size());
+        trace_memory_huge_failure(free_page_ranges_size());
         return nullptr;
     }
 }
@@ -1475,6 +2267,62 @@ void free_huge_page(void* v, size_t N)
     free_page_range(v, N);
 }
 
+// A slab of a mid-size malloc() pool: size bytes (a power of two) of memory
+// aligned to their size. Like malloc_large(), waits for memory to be freed
+// if there is none.
+static void* alloc_slab(size_t size)
+{
+    while (true) {
+        WITH_LOCK(free_page_ranges_lock) {
+            reclaimer_thread.wait_for_minimum_memory();
+            numa::nodemask allowed;
+            auto node = numa::policy_node(allowed);
+            auto pr = alloc_on_node(node, allowed, [=] (page_range_allocator& a) {
+                return a.alloc_aligned(size, 0, size, true);
+            });
+            if (pr) {
+                on_alloc(size);
+                return static_cast<void*>(pr);
+            }
+            reclaimer_thread.wait_for_memory(size);
+        }
+    }
+}
+
+static void free_slab(void* v, size_t size)
+{
+    free_page_range(v, size);
+}
+
+/*
+ * Free pages sitting in the page pools keep their free neighbours from
+ * coalescing into huge pages, so give them back to the page range
+ * allocators, and keep the pools from taking them again in the background
+ * until compact_done() (the pools then refill from the smallest free ranges
+ * first). Returns the number of huge pages which can now be allocated.
+ */
+static mutex compact_mutex;
+
+size_t compact()
+{
+    WITH_LOCK(compact_mutex) {
+        page_pool::begin_compaction();
+    }
+    size_t n = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        for (unsigned node = 0; node < numa::nr_nodes(); node++) {
+            n += free_page_ranges[node].aligned_blocks(mmu::huge_page_size);
+        }
+    }
+    trace_memory_compact(n);
+    return n;
+}
+
+void compact_done()
+{
+    page_pool::end_compaction();
+}
+
 void free_initial_memory_range(void* addr, size_t size)
 {
     if (!size) {
@@ -1500,8 +2348,10 @@ void free_initial_memory_range(void* addr, size_t size)
 
     on_free(size);
 
+    // The NUMA topology isn't known yet at this point; numa::setup() later
+    // moves the memory of other nodes to their own allocators.
     auto pr = new (addr) page_range(size);
-    free_page_ranges.initial_add(pr);
+    free_page_ranges[0].initial_add(pr);
 }
 
 void  __attribute__((constructor(init_prio::mempool))) setup()
@@ -1522,13 +2372,18 @@ static inline void* std_malloc(size_t size, size_t alignment)
     if ((ssize_t)size < 0)
         return libc_error_ptr<void *>(ENOMEM);
     void *ret;
-    if (size <= memory::pool::max_object_size && alignment <= size && smp_allocator) {
-        size = std::max(size, memory::pool::min_object_size);
-        unsigned n = ilog2_roundup(size);
-        ret = memory::malloc_pools[n].alloc();
-        ret = translate_mem_area(mmu::mem_area::main, mmu::mem_area::mempool,
-                                 ret);
-        trace_memory_malloc_mempool(ret, size, 1 << n, alignment);
+    memory::malloc_pool* pool = nullptr;
+    if (smp_allocator) {
+        pool = memory::malloc_pool_for(size, alignment);
+    }
+    if (pool) {
+        ret = pool->alloc();
+        // mid-size pools' objects are already in their own area
+        if (mmu::get_mem_area(ret) == mmu::mem_area::main) {
+            ret = translate_mem_area(mmu::mem_area::main, mmu::mem_area::mempool,
+                                     ret);
+        }
+        trace_memory_malloc_mempool(ret, size, pool->get_size(), alignment);
     } else if (size <= mmu::page_size && alignment <= mmu::page_size) {
         ret = mmu::translate_mem_area(mmu::mem_area::main, mmu::mem_area::page,
                                        memory::alloc_page());
@@ -1561,6 +2416,8 @@ static size_t object_size(void *object)
         object = mmu::translate_mem_area(mmu::mem_area::mempool,
                                          mmu::mem_area::main, object);
         return memory::pool::from_object(object)->get_size();
+    case mmu::mem_area::mempool_slab:
+        return memory::pool::from_object(object)->get_size();
     case mmu::mem_area::page:
         return mmu::page_size;
     case mmu::mem_area::debug:
@@ -1608,6 +2465,8 @@ void free(void* object)
         object = mmu::translate_mem_area(mmu::mem_area::mempool,
                                          mmu::mem_area::main, object);
         return memory::pool::from_object(object)->free(object);
+    case mmu::mem_area::mempool_slab:
+        return memory::pool::from_object(object)->free(object);
     case mmu::mem_area::debug:
         return dbg::free(object);
     default:
@@ -28,6 +28,8 @@
 #include "dump.hh"
 #include <osv/rcu.hh>
 #include <osv/rwlock.h>
+#include <osv/sched.hh>
+#include <fcntl.h>
 
 extern void* elf_start;
 extern size_t elf_size;
@@ -75,8 +77,35 @@ vma_list_type vma_list;
 // protects vma list and page table modifications.
 // anything that may add, remove, split vma, zaps pte or changes pte permission
 // should hold the lock for write
+//
+// vm_fault() does not take it: it walks vma_list without a lock, and then
+// validates just the vma it found, with that vma's fault lock (see vma in
+// mmu.hh). So a fault only waits for a writer changing the vma it faults on.
 rwlock_t vma_list_mutex;
 
+// A vma removed from vma_list may still be looked at by a speculative lookup
+// in vm_fault(), so it may only be freed after an RCU grace period. What it
+// holds on to is let go of now: a speculative fault cannot lock the vma, so
+// it won't use it. So munmap() has closed a mapped file when it returns.
+static void dispose_vma(vma* v)
+{
+    if (v->has_flags(mmap_jvm_balloon)) {
+        // Maps the range back in, so it has to be done with vma_list_mutex
+        // held
+        static_cast<jvm_balloon_vma*>(v)->release();
+    } else if (auto fv = dynamic_cast<file_vma*>(v)) {
+        fv->release_file();
+    }
+    osv::rcu_dispose(v);
+}
+
+// A vma must be completely set up before vm_fault() can find it on the tree
+static void vma_list_insert(vma& v)
+{
+    std::atomic_thread_fence(std::memory_order_release);
+    vma_list.insert(v);
+}
+
 // A mutex serializing modifications to the high part of the page table
 // (linear map, etc.) which are not part of vma_list.
 mutex page_table_high_mutex;
@@ -740,6 +769,161 @@ public:
     }
 };
 
+// Counts the small and huge pages mapped in a range, without touching them.
+class count_pages :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::yes, once_opt::no, split_opt::no> {
+private:
+    size_t& _small;
+    size_t& _huge;
+public:
+    count_pages(size_t& small, size_t& huge) : _small(small), _huge(huge) {}
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        if (pt_level_traits<N>::large_capable::value) {
+            ++_huge;
+        } else {
+            ++_small;
+        }
+        return true;
+    }
+    // A huge page sticking out of the range is not counted
+    bool tlb_flush_needed() { return false; }
+    void finalize() {}
+    ulong account_results(void) { return 0; }
+};
+
+/*
+ * Finds huge page sized ranges which are mapped by small pages, at least
+ * min_ptes of them, and remembers up to max_ranges of their addresses.
+ * Huge pages and empty ranges are skipped.
+ */
+class find_collapsible :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::no, once_opt::no, split_opt::no> {
+private:
+    uintptr_t _vma_start;
+    unsigned _min_ptes;
+    uintptr_t* _ranges;
+    unsigned _max_ranges;
+    unsigned& _nr_ranges;
+public:
+    find_collapsible(uintptr_t vma_start, unsigned min_ptes, uintptr_t* ranges,
+                     unsigned max_ranges, unsigned& nr_ranges)
+        : _vma_start(vma_start), _min_ptes(min_ptes), _ranges(ranges)
+        , _max_ranges(max_ranges), _nr_ranges(nr_ranges) {}
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<1> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        if (pte.large() || _nr_ranges == _max_ranges) {
+            return true;
+        }
+        auto pt = hw_ptep<0>::force(phys_cast<pt_element<0>>(pte.next_pt_addr()));
+        unsigned present = 0;
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            present += !pt.at(i).read().empty();
+        }
+        if (present >= _min_ptes) {
+            _ranges[_nr_ranges++] = _vma_start + offset;
+        }
+        return true;
+    }
+    bool tlb_flush_needed() { return false; }
+    void finalize() {}
+    ulong account_results(void) { return 0; }
+};
+
+struct collapse_result {
+    bool collapsed = false;
+    bool no_memory = false;
+    // bytes of the huge page which were not backed by a small page
+    size_t filled = 0;
+};
+
+/*
+ * Replaces the small pages mapping a huge page sized range of an anonymous
+ * vma with a single huge page holding a copy of them. Pages which were never
+ * touched are zero filled, as long as there are no more than max_ptes_none
+ * of them. Ranges with copy-on-write, mprotect()ed or otherwise special
+ * ptes are left alone.
+ *
+ * The caller holds vma_list_mutex for write and the vma's faults off, so
+ * nobody else can change the page table under us. Other threads may still
+ * be using the small pages through their TLBs, so they are only copied
+ * after their ptes are cleared and the TLBs flushed; until the huge pte is
+ * in place, an access just faults and waits for us.
+ */
+class collapse_huge_page :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::no, once_opt::no, split_opt::no> {
+private:
+    unsigned _perm;
+    unsigned _max_ptes_none;
+    pt_element<0>* _old;
+    collapse_result& _result;
+public:
+    // "old" is scratch space for pte_per_page ptes
+    collapse_huge_page(unsigned perm, unsigned max_ptes_none, pt_element<0>* old,
+                       collapse_result& result)
+        : _perm(perm), _max_ptes_none(max_ptes_none), _old(old), _result(result) {}
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<1> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        if (pte.large()) {
+            return true;
+        }
+        auto pt = hw_ptep<0>::force(phys_cast<pt_element<0>>(pte.next_pt_addr()));
+        unsigned none = 0;
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            auto small = pt.at(i).read();
+            if (small.empty()) {
+                ++none;
+            } else if (!small.valid() || pte_is_cow(small) ||
+                       small.writable() != bool(_perm & perm_write)) {
+                return true;
+            }
+        }
+        if (none > _max_ptes_none) {
+            return true;
+        }
+        auto huge = static_cast<char*>(memory::alloc_huge_page(huge_page_size));
+        if (!huge) {
+            _result.no_memory = true;
+            return true;
+        }
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            _old[i] = clear_pte(pt.at(i));
+        }
+        mmu::flush_tlb_all();
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            if (_old[i].empty()) {
+                memset(huge + i * page_size, 0, page_size);
+            } else {
+                memcpy(huge + i * page_size, phys_to_virt(_old[i].addr()), page_size);
+            }
+        }
+        ptep.write(make_leaf_pte(ptep, virt_to_phys(huge), _perm));
+        mmu::flush_tlb_all();
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            if (!_old[i].empty()) {
+                memory::free_page(phys_to_virt(_old[i].addr()));
+            }
+        }
+        // virt_visit_pte_rcu() may still be walking the old page table
+        osv::rcu_defer([](void *page) { memory::free_page(page); }, phys_to_virt(pte.next_pt_addr()));
+        _result.collapsed = true;
+        _result.filled = none * page_size;
+        return true;
+    }
+    bool tlb_flush_needed() { return false; }
+    void finalize() {}
+    ulong account_results(void) { return 0; }
+};
+
 template<typename T> ulong operate_range(T mapper, void *vma_start, void *start, size_t size)
 {
     start = align_down(start, page_size);
@@ -865,12 +1049,14 @@ static error protect(const void *addr, size_t size, unsigned int perm)
         if (err != 0) {
             return make_error(err);
         }
+        i->lock_fault_exclusive();
         i->split(end);
         i->split(start);
         if (contains(start, end, *i)) {
             i->protect(perm);
             i->operate_range(protection(perm));
         }
+        i->unlock_fault_exclusive();
     }
     return no_error();
 }
@@ -910,6 +1096,7 @@ ulong evacuate(uintptr_t start, uintptr_t end)
     auto range = find_intersecting_vmas(addr_range(start, end));
     ulong ret = 0;
     for (auto i = range.first; i != range.second; ++i) {
+        i->lock_fault_exclusive();
         i->split(end);
         i->split(start);
         if (contains(start, end, *i)) {
@@ -920,7 +1107,9 @@ ulong evacuate(uintptr_t start, uintptr_t end)
                 memory::stats::on_jvm_heap_free(size);
             }
             vma_list.erase(dead);
-            delete &dead;
+            dispose_vma(&dead);
+        } else {
+            i->unlock_fault_exclusive();
         }
     }
     return ret;
@@ -1060,7 +1249,7 @@ uintptr_t allocate(vma *v, uintptr_t start, size_t size, bool search)
     }
     v->set(start, start+size);
 
-    vma_list.insert(*v);
+    vma_list_insert(*v);
 
     return start;
 }
@@ -1103,7 +1292,9 @@ static void depopulate(void* addr, size_t length)
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto range = find_intersecting_vmas(addr_range(start, start + length));
     for (auto i = range.first; i != range.second; ++i) {
+        i->lock_fault_exclusive();
         i->operate_range(unpopulate<>(i->page_ops()), reinterpret_cast<void*>(start), std::min(length, i->size()));
+        i->unlock_fault_exclusive();
         start += i->size();
         length -= i->size();
     }
@@ -1116,16 +1307,52 @@ static void nohugepage(void* addr, size_t length)
     auto range = find_intersecting_vmas(addr_range(start, start + length));
     for (auto i = range.first; i != range.second; ++i) {
         if (!i->has_flags(mmap_small)) {
+            i->lock_fault_exclusive();
             i->update_flags(mmap_small);
             i->operate_range(splithugepages(), reinterpret_cast<void*>(start), std::min(length, i->size()));
+            i->unlock_fault_exclusive();
         }
         start += i->size();
         length -= i->size();
     }
 }
 
+// Passes readahead hints for file mappings on to the file; they are
+// meaningless for anonymous memory.
+static void file_advise(void* addr, size_t length, int advice)
+{
+    int fadv;
+    switch (advice) {
+    case advise_sequential: fadv = POSIX_FADV_SEQUENTIAL; break;
+    case advise_random:     fadv = POSIX_FADV_RANDOM; break;
+    case advise_willneed:   fadv = POSIX_FADV_WILLNEED; break;
+    default:                fadv = POSIX_FADV_NORMAL; break;
+    }
+    length = align_up(length, mmu::page_size);
+    auto start = reinterpret_cast<uintptr_t>(addr);
+    auto end = start + length;
+    auto range = find_intersecting_vmas(addr_range(start, end));
+    for (auto i = range.first; i != range.second; ++i) {
+        if (!i->has_flags(mmap_file)) {
+            continue;
+        }
+        auto& f_vma = static_cast<file_vma&>(*i);
+        auto s = std::max(start, i->start());
+        auto e = std::min(end, i->end());
+        f_vma.file()->fadvise(f_vma.offset() + (s - i->start()), e - s, fadv);
+    }
+}
+
 error advise(void* addr, size_t size, int advice)
 {
+    if (advice & (advise_normal | advise_sequential | advise_random | advise_willneed)) {
+        SCOPE_LOCK(vma_list_mutex.for_read());
+        if (!ismapped(addr, size)) {
+            return make_error(ENOMEM);
+        }
+        file_advise(addr, size, advice);
+        return no_error();
+    }
     WITH_LOCK(vma_list_mutex.for_write()) {
         if (!ismapped(addr, size)) {
             return make_error(ENOMEM);
@@ -1247,6 +1474,7 @@ bool access_fault(vma& vma, unsigned int error_code)
 TRACEPOINT(trace_mmu_vm_fault, "addr=%p, error_code=%x", uintptr_t, unsigned int);
 TRACEPOINT(trace_mmu_vm_fault_sigsegv, "addr=%p, error_code=%x, %s", uintptr_t, unsigned int, const char*);
 TRACEPOINT(trace_mmu_vm_fault_ret, "addr=%p, error_code=%x", uintptr_t, unsigned int);
+TRACEPOINT(trace_mmu_vm_fault_slowpath, "addr=%p", uintptr_t);
 
 static void vm_sigsegv(uintptr_t addr, exception_frame* ef)
 {
@@ -1264,6 +1492,60 @@ static void vm_sigbus(uintptr_t addr, exception_frame* ef)
     osv::handle_mmap_fault(addr, SIGBUS, ef);
 }
 
+// Find the vma with the greatest start <= addr, without vma_list_mutex.
+// Must be called in an RCU read section, so vmas we pass by are not freed.
+// A concurrent writer may be rebalancing the tree, in which case we may
+// return the wrong vma, or none at all: the caller has to validate the
+// result. Since we only ever walk down the tree, and for a bounded number
+// of steps, we at least cannot loop.
+static vma* find_vma_speculative(uintptr_t addr)
+{
+    typedef vma_list_base::node_traits node_traits;
+    typedef vma_list_base::value_traits value_traits;
+    // the header's parent is the root of the tree
+    auto node = node_traits::get_parent(vma_list.end().pointed_node());
+    vma* ret = nullptr;
+    for (unsigned depth = 0; node && depth < 128; depth++) {
+        auto v = value_traits::to_value_ptr(node);
+        if (v->start() <= addr) {
+            ret = v;
+            node = node_traits::get_right(node);
+        } else {
+            node = node_traits::get_left(node);
+        }
+    }
+    return ret;
+}
+
+// Service a fault holding only the faulting vma's fault lock, so faults on
+// different vmas (and on the same one) do not contend with each other, nor
+// wait behind mmap()/munmap() elsewhere in the address space. Returns false
+// if the fault must be retried under vma_list_mutex.
+//
+// The lookup is validated on the vma alone: whoever changes a vma holds its
+// fault lock exclusively, and a vma taken off the list keeps it until it
+// is freed. So once we hold the fault lock of a vma which contains addr,
+// it is the one vma mapping addr, whatever else happened to the tree.
+static bool vm_fault_speculative(uintptr_t addr, exception_frame* ef)
+{
+    vma* v;
+    WITH_LOCK(osv::rcu_read_lock) {
+        v = find_vma_speculative(addr);
+        if (!v || v->has_flags(mmap_jvm_balloon) || !v->try_lock_fault()) {
+            return false;
+        }
+    }
+    // v can no longer be split, changed or freed until we unlock it
+    if (addr < v->start() || addr >= v->end() ||
+        access_fault(*v, ef->get_error())) {
+        v->unlock_fault();
+        return false;
+    }
+    v->fault(addr, ef);
+    v->unlock_fault();
+    return true;
+}
+
 void vm_fault(uintptr_t addr, exception_frame* ef)
 {
     trace_mmu_vm_fault(addr, ef->get_error());
@@ -1273,6 +1555,11 @@ void vm_fault(uintptr_t addr, exception_frame* ef)
         return;
     }
     addr = align_down(addr, mmu::page_size);
+    if (vm_fault_speculative(addr, ef)) {
+        trace_mmu_vm_fault_ret(addr, ef->get_error());
+        return;
+    }
+    trace_mmu_vm_fault_slowpath(addr);
     WITH_LOCK(vma_list_mutex.for_read()) {
         auto vma = find_intersecting_vma(addr);
         if (vma == vma_list.end() || access_fault(*vma, ef->get_error())) {
@@ -1298,6 +1585,47 @@ vma::~vma()
 {
 }
 
+bool vma::try_lock_fault()
+{
+    auto s = _fault_state.load(std::memory_order_relaxed);
+    do {
+        if (s & fault_writer) {
+            return false;
+        }
+    } while (!_fault_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire));
+    return true;
+}
+
+void vma::unlock_fault()
+{
+    auto s = _fault_state.load(std::memory_order_relaxed);
+    while (!(s & fault_writer)) {
+        if (_fault_state.compare_exchange_weak(s, s - 1, std::memory_order_release)) {
+            return;
+        }
+    }
+    // A writer is waiting for the readers to drain. wake_with() keeps it
+    // from returning (and perhaps freeing us) before we're done waking it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    _fault_writer->wake_with([&] { _fault_state.fetch_sub(1, std::memory_order_release); });
+}
+
+// Callers hold vma_list_mutex for write, so there is at most one writer.
+void vma::lock_fault_exclusive()
+{
+    assert(vma_list_mutex.wowned());
+    _fault_writer = sched::thread::current();
+    _fault_state.fetch_or(fault_writer, std::memory_order_acq_rel);
+    sched::thread::wait_until([&] {
+        return _fault_state.load(std::memory_order_acquire) == fault_writer;
+    });
+}
+
+void vma::unlock_fault_exclusive()
+{
+    _fault_state.store(0, std::memory_order_release);
+}
+
 void vma::set(uintptr_t start, uintptr_t end)
 {
     _range = addr_range(align_down(start, mmu::page_size), align_up(end, mmu::page_size));
@@ -1406,7 +1734,7 @@ void anon_vma::split(uintptr_t edge)
     }
     vma* n = new anon_vma(addr_range(edge, _range.end()), _perm, _flags);
     set(_range.start(), edge);
-    vma_list.insert(*n);
+    vma_list_insert(*n);
 }
 
 error anon_vma::sync(uintptr_t start, uintptr_t end)
@@ -1508,7 +1836,7 @@ void jvm_balloon_vma::fault(uintptr_t fault_addr, exception_frame *ef)
     vma::fault(fault_addr, ef);
 }
 
-jvm_balloon_vma::~jvm_balloon_vma()
+void jvm_balloon_vma::release()
 {
     // it believes the objects are no longer valid. It could be the case
     // for a dangling mapping representing a balloon that was already moved
@@ -1588,7 +1916,7 @@ ulong map_jvm(unsigned char* jvm_addr, size_t size, size_t align, balloon_ptr b)
                         assert(jvma->partial() >= (end - jvma->start()));
                         jvma->set(end, jvma->end());
                     }
-                    vma_list.insert(*jvma);
+                    vma_list_insert(*jvma);
                 } else {
                     // Note how v and jvma are different. This is because this one,
                     // we will delete.
@@ -1599,13 +1927,13 @@ ulong map_jvm(unsigned char* jvm_addr, size_t size, size_t align, balloon_ptr b)
                     // complicate the code to optimize it. There are no
                     // guarantees that we are talking about the same balloon If
                     // this is the old balloon
-                    delete &v;
+                    dispose_vma(&v);
                 }
             }
         }
 
         evacuate(start, start + size);
-        vma_list.insert(*vma);
+        vma_list_insert(*vma);
         return vma->size();
     }
     return 0;
@@ -1657,7 +1985,7 @@ void file_vma::split(uintptr_t edge)
     auto off = offset(edge);
     vma *n = _file->mmap(addr_range(edge, _range.end()), _flags, _perm, off).release();
     set(_range.start(), edge);
-    vma_list.insert(*n);
+    vma_list_insert(*n);
 }
 
 error file_vma::sync(uintptr_t start, uintptr_t end)
@@ -1822,6 +2150,149 @@ error mincore(const void *addr, size_t length, unsigned char *vec)
     return no_error();
 }
 
+TRACEPOINT(trace_mmu_khugepaged_scan, "candidates=%u, collapsed=%u, alloc failed=%u", unsigned, unsigned, unsigned);
+TRACEPOINT(trace_mmu_khugepaged_collapse, "addr=%p, filled=%u", uintptr_t, size_t);
+
+static bool collapsible(vma& v)
+{
+    return v.perm() && !v.has_flags(mmap_small | mmap_jvm_balloon | mmap_file) &&
+           dynamic_cast<anon_vma*>(&v);
+}
+
+/*
+ * Anonymous memory is faulted in by huge pages where possible, but falls
+ * back to small pages when no huge page is free, and is left in small pages
+ * by a partial MADV_DONTNEED and the like. The khugepaged thread goes over
+ * the anonymous vmas a chunk at a time, and collapses huge page ranges
+ * which are (mostly) mapped by small pages back into huge pages, so TLB
+ * reach recovers once memory is available again. When it cannot get a
+ * huge page, it asks the page allocator to compact its free memory, once
+ * per pass.
+ */
+static class khugepaged {
+    static constexpr auto _interval = std::chrono::seconds(1);
+    // huge page ranges looked at, and collapsed at most, per pass
+    static constexpr unsigned _scan_ranges = 64;
+    static constexpr unsigned _max_collapse = 16;
+    // untouched small pages which may be zero filled into a huge page
+    static constexpr unsigned _max_ptes_none = pte_per_page / 2;
+    uintptr_t _cursor = 0;
+    pt_element<0> _old[pte_per_page];
+    sched::thread _thread;
+public:
+    khugepaged() : _thread(std::bind(&khugepaged::run, this), sched::thread::attr().name("khugepaged")) {
+        _thread.start();
+    }
+private:
+    unsigned find_candidates(uintptr_t* candidates)
+    {
+        unsigned n = 0;
+        unsigned budget = _scan_ranges;
+        SCOPE_LOCK(vma_list_mutex.for_read());
+        for (auto& v : vma_list) {
+            if (v.end() <= _cursor || !collapsible(v)) {
+                continue;
+            }
+            auto start = std::max(align_up(v.start(), huge_page_size), _cursor);
+            auto end = align_down(v.end(), huge_page_size);
+            if (start >= end) {
+                continue;
+            }
+            auto len = std::min(end - start, budget * huge_page_size);
+            v.operate_range(find_collapsible(v.start(), pte_per_page - _max_ptes_none,
+                                             candidates, _max_collapse, n),
+                            reinterpret_cast<void*>(start), len);
+            _cursor = start + len;
+            budget -= len / huge_page_size;
+            if (!budget || n == _max_collapse) {
+                return n;
+            }
+        }
+        _cursor = 0;
+        return n;
+    }
+    collapse_result collapse(uintptr_t addr)
+    {
+        collapse_result result;
+        SCOPE_LOCK(vma_list_mutex.for_write());
+        auto v = find_intersecting_vma(addr);
+        if (v == vma_list.end() || !collapsible(*v) ||
+            addr < v->start() || addr + huge_page_size > v->end()) {
+            return result;
+        }
+        v->lock_fault_exclusive();
+        v->operate_range(collapse_huge_page(v->perm(), _max_ptes_none, _old, result),
+                         reinterpret_cast<void*>(addr), huge_page_size);
+        v->unlock_fault_exclusive();
+        if (result.collapsed && v->has_flags(mmap_jvm_heap)) {
+            memory::stats::on_jvm_heap_alloc(result.filled);
+        }
+        return result;
+    }
+    void run()
+    {
+        uintptr_t candidates[_max_collapse];
+        while (true) {
+            sched::thread::sleep(_interval);
+            unsigned n = find_candidates(candidates);
+            unsigned collapsed = 0, failed = 0;
+            bool compacted = false;
+            for (unsigned i = 0; i < n; i++) {
+                auto result = collapse(candidates[i]);
+                if (result.collapsed) {
+                    trace_mmu_khugepaged_collapse(candidates[i], result.filled);
+                    ++collapsed;
+                } else if (result.no_memory) {
+                    ++failed;
+                    if (compacted) {
+                        break;
+                    }
+                    compacted = true;
+                    if (!memory::compact()) {
+                        break;
+                    }
+                    --i;
+                }
+            }
+            if (compacted) {
+                memory::compact_done();
+            }
+            trace_mmu_khugepaged_scan(n, collapsed, failed);
+        }
+    }
+} s_khugepaged;
+
+// Like procfs_maps(), with how much of each vma is mapped, and how much of
+// that by huge pages.
+std::string procfs_smaps()
+{
+    std::ostringstream os;
+    WITH_LOCK(vma_list_mutex.for_read()) {
+        for (auto& vma : vma_list) {
+            char read    = vma.perm() & perm_read  ? 'r' : '-';
+            char write   = vma.perm() & perm_write ? 'w' : '-';
+            char execute = vma.perm() & perm_exec  ? 'x' : '-';
+            char priv    = 'p';
+            osv::fprintf(os, "%x-%x %c%c%c%c ", vma.start(), vma.end(), read, write, execute, priv);
+            if (vma.flags() & mmap_file) {
+                const file_vma &f_vma = static_cast<file_vma&>(vma);
+                osv::fprintf(os, "%08x 00:00 0 %s\n", f_vma.offset(), f_vma.file()->f_dentry->d_path);
+            } else {
+                osv::fprintf(os, "00000000 00:00 0\n");
+            }
+            size_t small = 0, huge = 0;
+            if (vma.size()) {
+                vma.operate_range(count_pages(small, huge));
+            }
+            osv::fprintf(os, "Size:          %8d kB\n", vma.size() >> 10);
+            osv::fprintf(os, "Rss:           %8d kB\n", (small * page_size + huge * huge_page_size) >> 10);
+            osv::fprintf(os, "AnonHugePages: %8d kB\n",
+                         vma.flags() & mmap_file ? 0 : (huge * huge_page_size) >> 10);
+        }
+    }
+    return os.str();
+}
+
 std::string procfs_maps()
 {
     std::ostringstream os;
@@ -12,6 +12,7 @@
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/net/ethernet.h>
 #include <bsd/sys/net/netisr.h>
 
@@ -30,6 +31,19 @@ std::ostream& operator<<(std::ostream& os, ipv4_tcp_conn_id id)
     return osv::fprintf(os, "{ ipv4 %s:%d -> %s:%d }", id.src_addr, id.src_port, id.dst_addr, id.dst_port);
 }
 
+std::ostream& operator<<(std::ostream& os, ipv4_udp_sock_id id)
+{
+    return osv::fprintf(os, "{ ipv4 udp %s:%d }", id.addr, id.port);
+}
+
+net_channel::~net_channel()
+{
+    mbuf* m;
+    while (_queue.pop(m)) {
+        m_freem(m);
+    }
+}
+
 void net_channel::process_queue()
 {
     mbuf* m;
@@ -51,9 +65,21 @@ void net_channel::wake_pollers()
         }
         // can't call epoll_wake from rcu, so copy the data
         if (!_epollers.empty()) {
+            // Wake one exclusive registration, preferring one that is
+            // already in flight: file::wake_epoll() makes the same choice
+            // once the packet is processed, so the event wakes it only once.
+            const epoll_ptr* exclusive = nullptr;
             _epollers.reader_for_each([&] (const epoll_ptr& ep) {
-                epoll_wake_in_rcu(ep);
+                if (!ep.exclusive) {
+                    epoll_wake_in_rcu(ep);
+                } else if (!exclusive ||
+                        (!epoll_in_flight(*exclusive) && epoll_in_flight(ep))) {
+                    exclusive = &ep;
+                }
             });
+            if (exclusive) {
+                epoll_wake_in_rcu(*exclusive);
+            }
         }
     }
 }
@@ -120,16 +146,33 @@ void classifier::remove(ipv4_tcp_conn_id id)
 {
     WITH_LOCK(_mtx) {
         auto i = _ipv4_tcp_channels.owner_find(id,
-                std::hash<ipv4_tcp_conn_id>(), key_item_compare());
+                std::hash<ipv4_tcp_conn_id>(), key_item_compare<ipv4_tcp_conn_id>());
         assert(i);
         _ipv4_tcp_channels.erase(i);
     }
 }
 
+void classifier::add(ipv4_udp_sock_id id, net_channel* channel)
+{
+    WITH_LOCK(_mtx) {
+        _ipv4_udp_channels.emplace(id, channel);
+    }
+}
+
+void classifier::remove(ipv4_udp_sock_id id)
+{
+    WITH_LOCK(_mtx) {
+        auto i = _ipv4_udp_channels.owner_find(id,
+                std::hash<ipv4_udp_sock_id>(), key_item_compare<ipv4_udp_sock_id>());
+        assert(i);
+        _ipv4_udp_channels.erase(i);
+    }
+}
+
 bool classifier::post_packet(mbuf* m)
 {
     WITH_LOCK(osv::rcu_read_lock) {
-        if (auto nc = classify_ipv4_tcp(m)) {
+        if (auto nc = classify_ipv4(m)) {
             log_packet_in(m, NETISR_ETHER);
             if (!nc->push(m)) {
                 return false;
@@ -143,7 +186,7 @@ bool classifier::post_packet(mbuf* m)
 }
 
 // must be called with rcu lock held
-net_channel* classifier::classify_ipv4_tcp(mbuf* m)
+net_channel* classifier::classify_ipv4(mbuf* m)
 {
     caddr_t h = m->m_hdr.mh_data;
     if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + sizeof(ip)) {
@@ -159,24 +202,63 @@ net_channel* classifier::classify_ipv4_tcp(mbuf* m)
     if (ip_size < sizeof(ip)) {
         return nullptr;
     }
-    if (ip_hdr->ip_p != IPPROTO_TCP) {
-        return nullptr;
-    }
     if (ntohs(ip_hdr->ip_off) & ~IP_DF) {
         return nullptr;
     }
-    auto src_addr = ip_hdr->ip_src;
-    auto dst_addr = ip_hdr->ip_dst;
     h += ip_size;
+    switch (ip_hdr->ip_p) {
+    case IPPROTO_TCP:
+        return classify_ipv4_tcp(ip_hdr, h);
+    case IPPROTO_UDP:
+        // broadcast and multicast datagrams may have several receivers
+        if (ETHER_IS_MULTICAST(ether_hdr->ether_dhost)) {
+            return nullptr;
+        }
+        if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + ip_size + sizeof(udphdr)) {
+            return nullptr;
+        }
+        return classify_ipv4_udp(ip_hdr, h);
+    default:
+        return nullptr;
+    }
+}
+
+// must be called with rcu lock held
+net_channel* classifier::classify_ipv4_tcp(ip* ip_hdr, caddr_t h)
+{
     auto tcp_hdr = reinterpret_cast<tcphdr*>(h);
     if (tcp_hdr->th_flags & (TH_SYN | TH_FIN | TH_RST)) {
 	    return nullptr;
     }
     auto src_port = ntohs(tcp_hdr->th_sport);
     auto dst_port = ntohs(tcp_hdr->th_dport);
-    auto id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
+    auto id = ipv4_tcp_conn_id{ip_hdr->ip_src, ip_hdr->ip_dst, src_port, dst_port};
     auto i = _ipv4_tcp_channels.reader_find(id,
-            std::hash<ipv4_tcp_conn_id>(), key_item_compare());
+            std::hash<ipv4_tcp_conn_id>(), key_item_compare<ipv4_tcp_conn_id>());
+    if (!i) {
+        return nullptr;
+    }
+    return i->chan;
+}
+
+// must be called with rcu lock held
+net_channel* classifier::classify_ipv4_udp(ip* ip_hdr, caddr_t h)
+{
+    if (_ipv4_udp_channels.empty()) {
+        return nullptr;
+    }
+    auto udp_hdr = reinterpret_cast<udphdr*>(h);
+    auto dst_port = ntohs(udp_hdr->uh_dport);
+    // A socket bound to a specific address takes precedence over one
+    // bound to the wildcard address, as in in_pcblookup().
+    auto id = ipv4_udp_sock_id{ip_hdr->ip_dst, dst_port};
+    auto i = _ipv4_udp_channels.reader_find(id,
+            std::hash<ipv4_udp_sock_id>(), key_item_compare<ipv4_udp_sock_id>());
+    if (!i) {
+        id.addr.s_addr = INADDR_ANY;
+        i = _ipv4_udp_channels.reader_find(id,
+                std::hash<ipv4_udp_sock_id>(), key_item_compare<ipv4_udp_sock_id>());
+    }
     if (!i) {
         return nullptr;
     }
@@ -189,10 +189,18 @@ public:
     }
 };
 
-class cached_page_write : public cached_page {
+class page_lender {
+public:
+    virtual ~page_lender() {}
+    virtual void unlend() = 0;
+};
+
+class cached_page_write : public cached_page, public page_lender {
 private:
     struct vnode* _vp;
     bool _dirty = false;
+    unsigned _lent = 0;
+    bool _evicted = false;
 public:
     cached_page_write(hashkey key, vfs_file* fp) : cached_page(key, memory::alloc_page()) {
         _vp = fp->f_dentry->d_vnode;
@@ -234,8 +242,87 @@ public:
     bool flush_check_dirty() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) { return mmu::clear_pte(pte).dirty(); }, std::logical_or<bool>(), false);
     }
+    void lend() {
+        _lent++;
+    }
+    virtual void unlend() override;
+    // Called when the page is dropped from the write cache. Returns false
+    // if the page is lent out; the last unlend() then frees it.
+    bool evict() {
+        _evicted = true;
+        return _lent == 0;
+    }
+};
+
+// Pages of an ARC buffer lent out by the page cache. While there are any,
+// the buffer stays shared with ARC (so ARC won't recycle its data), and if
+// ARC drops the buffer anyway it leaves freeing the data to us.
+class arc_loan : public page_lender {
+public:
+    explicit arc_loan(arc_buf_t* ab) : _ab(ab) {}
+    void lend() {
+        _lent++;
+    }
+    virtual void unlend() override;
+    void orphan(void* data, size_t size, void (*free)(void*, size_t)) {
+        _ab = nullptr;
+        _data = data;
+        _size = size;
+        _free = free;
+    }
+private:
+    arc_buf_t* _ab; // nullptr once ARC has dropped the buffer
+    unsigned _lent = 0;
+    void* _data = nullptr;
+    size_t _size = 0;
+    void (*_free)(void*, size_t) = nullptr;
 };
 
+static std::unordered_map<arc_buf_t*, arc_loan*> arc_loans;
+
+// A page of file data owned by a filesystem which keeps its files in whole
+// pages of memory (ramfs). There is nothing to copy such a page from, so it
+// is mapped as is. The filesystem calls unmap_ram_page() before it frees
+// the page; if the page is lent out then, the last unlend() frees it (unless
+// the page was never the filesystem's to free, as the bootfs pages in the
+// kernel image).
+class cached_page_ram : public cached_page, public page_lender {
+private:
+    unsigned _lent = 0;
+    bool _orphaned = false;
+    bool _free = false;
+public:
+    cached_page_ram(hashkey key, void* page) : cached_page(key, page) {}
+    ~cached_page_ram() {
+        if (_orphaned && _free) {
+            memory::free_page(_page);
+        }
+    }
+    bool mapped() {
+        return boost::get<std::nullptr_t>(&_ptes) == nullptr;
+    }
+    // Clears all the ptes mapping the page, and forgets them
+    int unmap_all() {
+        int flushed = flush();
+        _ptes = nullptr;
+        return flushed;
+    }
+    void lend() {
+        _lent++;
+    }
+    bool lent() {
+        return _lent != 0;
+    }
+    virtual void unlend() override;
+    // The filesystem gave up the page while it is lent; free tells whether
+    // the page is ours to free once the last loan is returned.
+    void orphan(bool free) {
+        _orphaned = true;
+        _free = free;
+    }
+};
+
+
 class cached_page_arc;
 
 unsigned drop_read_cached_page(cached_page_arc* cp, bool flush = true);
@@ -268,10 +355,13 @@ private:
 public:
     cached_page_arc(hashkey key, void* page, arc_buf_t* ab) : cached_page(key, page), _ab(ref(ab, this)) {}
     ~cached_page_arc() {
-        if (!_removed && unref(_ab, this)) {
+        if (!_removed && unref(_ab, this) && !arc_loans.count(_ab)) {
             arc_unshare_buf(_ab);
         }
     }
+    static bool mapped(arc_buf_t* ab) {
+        return arc_cache_map.count(ab);
+    }
     arc_buf_t* arcbuf() {
         return _ab;
     }
@@ -297,6 +387,7 @@ static bool operator==(const cached_page_arc::arc_map::value_type& l, const cach
 
 std::unordered_multimap<arc_buf_t*, cached_page_arc*> cached_page_arc::arc_cache_map;
 static std::unordered_map<hashkey, cached_page_arc*> read_cache;
+static std::unordered_map<hashkey, cached_page_ram*> ram_cache; // protected by arc_lock
 static std::unordered_map<hashkey, cached_page_write*> write_cache;
 static std::deque<cached_page_write*> write_lru;
 static mutex arc_lock; // protects against parallel access to the read cache
@@ -331,6 +422,15 @@ void remove_read_mapping(cached_page_arc* cp, mmu::hw_ptep<0> ptep)
     }
 }
 
+static void remove_ram_mapping(cached_page_ram* cp, mmu::hw_ptep<0> ptep)
+{
+    trace_remove_mapping(nullptr, cp->addr(), ptep.release());
+    if (cp->unmap(ptep) == 0 && !cp->lent()) {
+        ram_cache.erase(cp->key());
+        delete cp;
+    }
+}
+
 void remove_read_mapping(hashkey& key, mmu::hw_ptep<0> ptep)
 {
     SCOPE_LOCK(arc_lock);
@@ -338,6 +438,13 @@ void remove_read_mapping(hashkey& key, mmu::hw_ptep<0> ptep)
     if (cp) {
         remove_read_mapping(cp, ptep);
     }
+    cached_page_ram* rp = find_in_cache(ram_cache, key);
+    if (rp) {
+        auto old = ptep.read();
+        if (old.valid() && old.addr() == mmu::virt_to_phys(rp->addr())) {
+            remove_ram_mapping(rp, ptep);
+        }
+    }
 }
 
 TRACEPOINT(trace_drop_read_cached_page, "buf=%p, addr=%p", void*, void*);
@@ -356,6 +463,20 @@ unsigned drop_read_cached_page(cached_page_arc* cp, bool flush)
     return flushed;
 }
 
+// The filesystem still owns the page, so unless it is lent out, we just
+// forget about it.
+static void drop_ram_page(cached_page_ram* cp)
+{
+    trace_drop_read_cached_page(nullptr, cp->addr());
+    if (cp->unmap_all() > 1) {
+        mmu::flush_tlb_all();
+    }
+    if (!cp->lent()) {
+        ram_cache.erase(cp->key());
+        delete cp;
+    }
+}
+
 void drop_read_cached_page(hashkey& key)
 {
     SCOPE_LOCK(arc_lock);
@@ -363,14 +484,25 @@ void drop_read_cached_page(hashkey& key)
     if (cp) {
         drop_read_cached_page(cp, true);
     }
+    cached_page_ram* rp = find_in_cache(ram_cache, key);
+    if (rp) {
+        drop_ram_page(rp);
+    }
 }
 
 TRACEPOINT(trace_unmap_arc_buf, "buf=%p", void*);
-void unmap_arc_buf(arc_buf_t* ab)
+bool unmap_arc_buf(arc_buf_t* ab, void* data, size_t size, void (*free)(void*, size_t))
 {
     trace_unmap_arc_buf(ab);
     SCOPE_LOCK(arc_lock);
     cached_page_arc::unmap_arc_buf(ab);
+    auto it = arc_loans.find(ab);
+    if (it == arc_loans.end()) {
+        return false;
+    }
+    it->second->orphan(data, size, free);
+    arc_loans.erase(it);
+    return true;
 }
 
 TRACEPOINT(trace_map_arc_buf, "buf=%p page=%p", void*, void*);
@@ -383,6 +515,43 @@ void map_arc_buf(hashkey *key, arc_buf_t* ab, void *page)
     arc_share_buf(ab);
 }
 
+TRACEPOINT(trace_map_ram_page, "addr=%p", void*);
+void map_ram_page(hashkey* key, void* page)
+{
+    trace_map_ram_page(page);
+    SCOPE_LOCK(arc_lock);
+    if (!ram_cache.count(*key)) {
+        ram_cache.emplace(*key, new cached_page_ram(*key, page));
+    }
+}
+
+TRACEPOINT(trace_unmap_ram_page, "addr=%p", void*);
+bool unmap_ram_page(hashkey* key, void* page, bool free)
+{
+    SCOPE_LOCK(arc_lock);
+    cached_page_ram* cp = find_in_cache(ram_cache, *key);
+    if (!cp || cp->addr() != page) {
+        return false;
+    }
+    trace_unmap_ram_page(page);
+    ram_cache.erase(*key);
+    if (cp->unmap_all()) {
+        mmu::flush_tlb_all();
+    }
+    if (cp->lent()) {
+        if (!free) {
+            // The page outlives the loans anyway; the last unlend()
+            // just forgets about it.
+            cp->orphan(false);
+            return false;
+        }
+        cp->orphan(true);
+        return true;
+    }
+    delete cp;
+    return false;
+}
+
 static int create_read_cached_page(vfs_file* fp, hashkey& key)
 {
     return fp->get_arcbuf(&key, key.offset);
@@ -417,7 +586,9 @@ static void insert(cached_page_write* cp) {
         }
         mmu::flush_tlb_all();
         for (auto p: tofree) {
-            delete p;
+            if (p && p->evict()) {
+                delete p;
+            }
         }
     }
 }
@@ -462,6 +633,12 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
                     add_read_mapping(cp, ptep);
                     return mmu::write_pte(cp->addr(), ptep, mmu::pte_mark_cow(pte, true));
                 }
+                cached_page_ram* rp = find_in_cache(ram_cache, key);
+                if (rp) {
+                    trace_add_read_mapping(nullptr, rp->addr(), ptep.release());
+                    rp->map(ptep);
+                    return mmu::write_pte(rp->addr(), ptep, mmu::pte_mark_cow(pte, true));
+                }
             }
 
             DROP_LOCK(write_lock) {
@@ -489,6 +666,102 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
     return mmu::write_pte(wcp->addr(), ptep, mmu::pte_mark_cow(pte, !shared));
 }
 
+void cached_page_write::unlend()
+{
+    bool free;
+    WITH_LOCK(write_lock) {
+        free = --_lent == 0 && _evicted;
+    }
+    if (free) {
+        delete this;
+    }
+}
+
+void cached_page_ram::unlend()
+{
+    WITH_LOCK(arc_lock) {
+        if (--_lent || (!_orphaned && mapped())) {
+            return;
+        }
+        if (!_orphaned) {
+            ram_cache.erase(_key);
+        }
+    }
+    delete this;
+}
+
+void arc_loan::unlend()
+{
+    WITH_LOCK(arc_lock) {
+        if (--_lent) {
+            return;
+        }
+        if (_ab) {
+            arc_loans.erase(_ab);
+            if (!cached_page_arc::mapped(_ab)) {
+                arc_unshare_buf(_ab);
+            }
+        }
+    }
+    // Nobody can find us any more
+    if (_data) {
+        _free(_data, _size);
+    }
+    delete this;
+}
+
+TRACEPOINT(trace_pagecache_lend, "addr=%p, lender=%p", void*, void*);
+page_loan lend(vfs_file* fp, off_t offset)
+{
+    struct stat st;
+    fp->stat(&st);
+    hashkey key {st.st_dev, st.st_ino, offset};
+    SCOPE_LOCK(write_lock);
+    int ret;
+    do {
+        // mapped shared and written to: the write cache has the latest data
+        cached_page_write* wcp = find_in_cache(write_cache, key);
+        if (wcp) {
+            wcp->lend();
+            trace_pagecache_lend(wcp->addr(), wcp);
+            return page_loan{wcp->addr(), wcp};
+        }
+
+        WITH_LOCK(arc_lock) {
+            cached_page_arc* cp = find_in_cache(read_cache, key);
+            if (cp) {
+                auto& loan = arc_loans[cp->arcbuf()];
+                if (!loan) {
+                    loan = new arc_loan(cp->arcbuf());
+                }
+                loan->lend();
+                trace_pagecache_lend(cp->addr(), loan);
+                return page_loan{cp->addr(), loan};
+            }
+            cached_page_ram* rp = find_in_cache(ram_cache, key);
+            if (rp) {
+                rp->lend();
+                trace_pagecache_lend(rp->addr(), rp);
+                return page_loan{rp->addr(), rp};
+            }
+        }
+
+        DROP_LOCK(write_lock) {
+            ret = create_read_cached_page(fp, key);
+        }
+    } while (ret != -1);
+
+    // a hole in the file
+    return page_loan{zero_page, nullptr};
+}
+
+void unlend(page_lender* lender)
+{
+    if (lender) {
+        lender->unlend();
+    }
+}
+
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
 {
     struct stat st;
@@ -497,7 +770,7 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
 
     auto old = clear_pte(ptep);
 
-    // page is either in ARC cache or write cache or zero page or private page
+    // page is either in ARC cache, ram cache or write cache, or zero page or private page
 
     WITH_LOCK(write_lock) {
         cached_page_write* wcp = find_in_cache(write_cache, key);
@@ -520,6 +793,12 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
             remove_read_mapping(rcp, ptep);
             return false;
         }
+        cached_page_ram* ramcp = find_in_cache(ram_cache, key);
+        if (ramcp && mmu::virt_to_phys(ramcp->addr()) == old.addr()) {
+            // page belongs to the filesystem
+            remove_ram_mapping(ramcp, ptep);
+            return false;
+        }
     }
 
     // if a private page, caller will free it
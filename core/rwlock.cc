@@ -10,7 +10,7 @@
 #include <osv/rwlock.h>
 
 rwlock::rwlock()
-    : _readers(0),
+    : _state(0),
       _wowner(nullptr),
       _wrecurse(0)
 { }
@@ -18,41 +18,69 @@ rwlock::rwlock()
 rwlock::~rwlock()
 {
     assert(_wowner == nullptr);
-    assert(_readers == 0);
+    assert(_state.load(std::memory_order_relaxed) == 0);
     assert(_read_waiters.empty());
     assert(_write_waiters.empty());
+    assert(_drain_waiters.empty());
 }
 
 void rwlock::rlock()
 {
-    std::lock_guard<mutex> guard(_mtx);
-    reader_wait_lockable();
+    auto s = _state.load(std::memory_order_relaxed);
+    while (!(s & writer)) {
+        if (_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+            return;
+        }
+    }
+    rlock_slow();
+}
 
-    _readers++;
+// A writer owns the lock or is about to: wait until it releases it. The
+// writer bit is only cleared with _mtx held, so we can't miss the wakeup.
+void rwlock::rlock_slow()
+{
+    WITH_LOCK(_mtx) {
+        while (true) {
+            auto s = _state.load(std::memory_order_relaxed);
+            if (!(s & writer)) {
+                if (_state.compare_exchange_weak(s, s + 1,
+                        std::memory_order_acquire)) {
+                    return;
+                }
+                continue;
+            }
+            _read_waiters.wait(_mtx);
+        }
+    }
 }
 
 bool rwlock::try_rlock()
 {
-    std::lock_guard<mutex> guard(_mtx);
-    if (!read_lockable()) {
-        return false;
+    auto s = _state.load(std::memory_order_relaxed);
+    while (!(s & writer)) {
+        if (_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+            return true;
+        }
     }
-
-    _readers++;
-    return true;
+    return false;
 }
 
 void rwlock::runlock()
 {
-    WITH_LOCK(_mtx) {
-        assert(_wowner == nullptr);
-        assert(_readers > 0);
+    auto s = _state.fetch_sub(1, std::memory_order_release);
+    assert(s & readers_mask);
 
-        // If we are the last reader and we have a write waiter,
-        // then wake up one writer
-        if (--_readers == 0) {
-            _write_waiters.wake_one(_mtx);
-        }
+    // If we are the last reader and a writer is waiting for the readers
+    // to leave, wake it up
+    if (s == (writer | 1)) {
+        runlock_slow();
+    }
+}
+
+void rwlock::runlock_slow()
+{
+    WITH_LOCK(_mtx) {
+        _drain_waiters.wake_one(_mtx);
     }
 }
 
@@ -61,9 +89,10 @@ bool rwlock::try_upgrade()
     std::lock_guard<mutex> guard(_mtx);
 
     // if we don't have any write waiters and we are the only reader
-    if ((_readers == 1) && (_write_waiters.empty())) {
+    unsigned s = 1;
+    if (_write_waiters.empty() &&
+            _state.compare_exchange_strong(s, writer, std::memory_order_acquire)) {
         assert(_wowner == nullptr);
-        _readers = 0;
         _wowner = sched::thread::current();
         return true;
     }
@@ -74,32 +103,59 @@ bool rwlock::try_upgrade()
 void rwlock::wlock()
 {
     std::lock_guard<mutex> guard(_mtx);
-    writer_wait_lockable();
 
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return;
     }
 
+    while (_wowner) {
+        _write_waiters.wait(_mtx);
+    }
     _wowner = sched::thread::current();
+
+    // Keep new readers out, and wait for the current ones to leave
+    auto s = _state.fetch_or(writer, std::memory_order_acquire);
+    while (s & readers_mask) {
+        _drain_waiters.wait(_mtx);
+        s = _state.load(std::memory_order_acquire);
+    }
 }
 
 bool rwlock::try_wlock()
 {
     std::lock_guard<mutex> guard(_mtx);
-    if (!write_lockable()) {
-        return false;
-    }
 
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return true;
+    }
+
+    unsigned s = 0;
+    if (_wowner || !_state.compare_exchange_strong(s, writer,
+            std::memory_order_acquire)) {
+        return false;
     }
 
     _wowner = sched::thread::current();
     return true;
 }
 
+// Called with _mtx held, when the writer gave up the lock. Waiting writers
+// go first, and the writer bit stays set for them, so a steady stream of
+// readers can't starve them.
+void rwlock::writer_release()
+{
+    if (!_write_waiters.empty()) {
+        _write_waiters.wake_one(_mtx);
+    } else {
+        _state.fetch_and(~writer, std::memory_order_release);
+        _read_waiters.wake_all(_mtx);
+    }
+}
+
 void rwlock::wunlock()
 {
     WITH_LOCK(_mtx) {
@@ -107,15 +163,11 @@ void rwlock::wunlock()
 
         if (_wrecurse > 0) {
             _wrecurse--;
-        } else {
-            _wowner = nullptr;
+            return;
         }
 
-        if (!_write_waiters.empty()) {
-            _write_waiters.wake_one(_mtx);
-        } else {
-            _read_waiters.wake_all(_mtx);
-        }
+        _wowner = nullptr;
+        writer_release();
     }
 }
 
@@ -124,17 +176,12 @@ void rwlock::downgrade()
     WITH_LOCK(_mtx) {
         assert(_wowner == sched::thread::current());
 
-        // I'm aware this implementation is ugly but it does the trick for the
-        // time being.
-        while (_wrecurse) this->wunlock();
-        this->wunlock();
+        // Become a reader before letting anyone else in, so this can't block
+        _wrecurse = 0;
+        _wowner = nullptr;
+        _state.fetch_add(1, std::memory_order_relaxed);
+        writer_release();
     }
-
-    // FIXME: Writers that already wait get precedence, so this function can
-    // block, there's only one user in sys/netinet/if_ether.c
-    // and we need to make sure that it's ok to block here.
-
-    this->rlock();
 }
 
 bool rwlock::wowned()
@@ -142,42 +189,9 @@ bool rwlock::wowned()
     return (sched::thread::current() == _wowner);
 }
 
-bool rwlock::read_lockable()
-{
-    return ((!_wowner) && (_write_waiters.empty()));
-}
-
-bool rwlock::write_lockable()
-{
-    return ((_wowner == sched::thread::current()) ||
-            ((!_readers) && (!_wowner)));
-}
-
-void rwlock::writer_wait_lockable()
-{
-    while (true) {
-        if (write_lockable()) {
-            return;
-        }
-
-        _write_waiters.wait(_mtx);
-    }
-}
-
-void rwlock::reader_wait_lockable()
-{
-    while (true) {
-        if (read_lockable()) {
-            return;
-        }
-
-        _read_waiters.wait(_mtx);
-    }
-}
-
 bool rwlock::has_readers()
 {
-    return _readers;
+    return _state.load(std::memory_order_relaxed) & readers_mask;
 }
 
 void rwlock_init(rwlock_t* rw)
@@ -54,6 +54,7 @@ TRACEPOINT(trace_sched_queue, "thread=%p", thread*);
 TRACEPOINT(trace_sched_load, "load=%d", size_t);
 TRACEPOINT(trace_sched_preempt, "");
 TRACEPOINT(trace_sched_ipi, "cpu %d", unsigned);
+TRACEPOINT(trace_sched_balance_request, "cpu %d", unsigned);
 TRACEPOINT(trace_sched_yield, "");
 TRACEPOINT(trace_sched_yield_switch, "");
 TRACEPOINT(trace_sched_sched, "");
@@ -142,6 +143,7 @@ cpu::cpu(unsigned _id)
     , preemption_timer(*this)
     , idle_thread()
     , terminating_thread(nullptr)
+    , topology{_id, 0, 0}
     , c(cinitial)
     , renormalize_count(0)
 {
@@ -235,8 +237,12 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
     assert(sched::exception_depth <= 1);
     need_reschedule = false;
     handle_incoming_wakeups();
+    if (balance_requests) {
+        handle_balance_requests();
+    }
 
     auto now = osv::clock::uptime::now();
+    update_load(now);
     auto interval = now - running_since;
     running_since = now;
     if (interval <= 0) {
@@ -250,6 +256,12 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
     const auto p_status = p->_detached_state->st.load();
     assert(p_status != thread::status::queued);
 
+    // Runnable threads, other than the idle thread, from now on. The idle
+    // thread is on the runqueue unless it's p.
+    _load_nr.store(runqueue.size() -
+            (p != idle_thread && p_status != thread::status::running),
+            std::memory_order_relaxed);
+
     p->_total_cpu_time += interval;
     p->_runtime.ran_for(interval);
 
@@ -383,11 +395,11 @@ void cpu::send_wakeup_ipi()
 void cpu::do_idle()
 {
     do {
+        request_work();
         idle_poll_lock_type idle_poll_lock{*this};
         WITH_LOCK(idle_poll_lock) {
             // spin for a bit before halting
             for (unsigned ctr = 0; ctr < 10000; ++ctr) {
-                // FIXME: can we pull threads from loaded cpus?
                 handle_incoming_wakeups();
                 if (!runqueue.empty()) {
                     return;
@@ -476,6 +488,134 @@ unsigned cpu::load()
     return runqueue.size();
 }
 
+// load_avg() follows the number of runnable threads with this time constant
+constexpr s64 load_tau = std::chrono::duration_cast<std::chrono::nanoseconds>(10_ms).count();
+
+static float decay_load(float avg, unsigned nr, s64 dt)
+{
+    auto a = std::min(1.0f, float(std::max(dt, s64(0))) / load_tau);
+    return avg + a * (nr - avg);
+}
+
+void cpu::update_load(osv::clock::uptime::time_point now)
+{
+    auto t = now.time_since_epoch().count();
+    auto avg = decay_load(_load_avg.load(std::memory_order_relaxed),
+            _load_nr.load(std::memory_order_relaxed),
+            t - _load_stamp.load(std::memory_order_relaxed));
+    _load_avg.store(avg, std::memory_order_relaxed);
+    _load_stamp.store(t, std::memory_order_relaxed);
+}
+
+// May be called from any CPU. The fields may be caught mid-update, but the
+// result is only a balancing heuristic anyway.
+float cpu::load_avg()
+{
+    auto t = osv::clock::uptime::now().time_since_epoch().count();
+    return decay_load(_load_avg.load(std::memory_order_relaxed),
+            _load_nr.load(std::memory_order_relaxed),
+            t - _load_stamp.load(std::memory_order_relaxed));
+}
+
+void cpu::init_domains()
+{
+    for (auto c : cpus) {
+        for (auto o : cpus) {
+            bool same_package = o->topology.package == c->topology.package;
+            bool same_llc = same_package && o->topology.llc == c->topology.llc;
+            bool same_core = same_llc && o->topology.core == c->topology.core;
+            if (same_core) {
+                c->domains[smt_domain].push_back(o);
+            }
+            if (same_llc) {
+                c->domains[llc_domain].push_back(o);
+            }
+            if (same_package) {
+                c->domains[package_domain].push_back(o);
+            }
+            c->domains[machine_domain].push_back(o);
+        }
+    }
+}
+
+// Called by the idle thread. Rather than waiting for the next periodic
+// balancing round, ask the nearest CPU which has a thread waiting to run to
+// push it to us right away. Only a runqueue's owner may touch it, so we can't
+// just take the thread.
+void cpu::request_work()
+{
+    for (auto& domain : domains) {
+        cpu* busiest = nullptr;
+        // a runqueue always holds the idle thread, unless it's running
+        unsigned max = 1;
+        for (auto c : domain) {
+            auto l = c->load();
+            if (c != this && l > max) {
+                busiest = c;
+                max = l;
+            }
+        }
+        if (busiest) {
+            if (!busiest->balance_requests.test_and_set(id)) {
+                trace_sched_balance_request(busiest->id);
+                wakeup_ipi.send(busiest);
+            }
+            return;
+        }
+    }
+}
+
+void cpu::handle_balance_requests()
+{
+    cpu_set requesters{balance_requests.fetch_clear()};
+    for (auto i : requesters) {
+        // Keep a thread for ourselves if the current one is about to sleep.
+        // The runqueue holds the idle thread too, unless that is current.
+        auto p = thread::current();
+        unsigned keep = p->_detached_state->st.load() == thread::status::running ? 1 : 2;
+        if (runqueue.size() <= keep) {
+            break;
+        }
+        auto c = cpus[i];
+        // someone may have fed it already
+        if (c->load() <= 1) {
+            push_thread(c);
+        }
+    }
+}
+
+// Move the thread at the tail of our runqueue, the one which would wait the
+// longest to run here, to the target CPU. Must be called on this CPU, with
+// interrupts disabled.
+bool cpu::push_thread(cpu* target)
+{
+    auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
+            [](thread& t) { return t._migration_lock_counter == 0; });
+    if (i == runqueue.rend()) {
+        return false;
+    }
+    auto& mig = *i;
+    trace_sched_migrate(&mig, target->id);
+    runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
+    // we won't race with wake(), since we're not thread::waiting
+    assert(mig._detached_state->st.load() == thread::status::queued);
+    mig._detached_state->st.store(thread::status::waking);
+    mig.suspend_timers();
+    mig._detached_state->_cpu = target;
+    // Convert the CPU-local runtime measure to a globally meaningful
+    // measure
+    mig._runtime.export_runtime();
+    mig.remote_thread_local_var(::percpu_base) = target->percpu_base;
+    mig.remote_thread_local_var(current_cpu) = target;
+    mig.stat_migrations.incr();
+    target->incoming_wakeups[id].push_back(mig);
+    target->incoming_wakeups_mask.set(id);
+    // FIXME: avoid if the cpu is alive and if the priority does not
+    // FIXME: warrant an interruption
+    target->send_wakeup_ipi();
+    return true;
+}
+
 void thread::pin(cpu *target_cpu)
 {
     thread &t = *current();
@@ -515,6 +655,10 @@ void thread::pin(cpu *target_cpu)
     // wakeme will be implicitly join()ed here.
 }
 
+// Extra imbalance, in threads, needed before we migrate a thread across
+// each domain level and lose its warm caches.
+static constexpr float balance_threshold[cpu::nr_domains] = { 0, 0, 0.5, 1 };
+
 void cpu::load_balance()
 {
     notifier::fire();
@@ -525,41 +669,26 @@ void cpu::load_balance()
         if (runqueue.empty()) {
             continue;
         }
-        auto min = *std::min_element(cpus.begin(), cpus.end(),
-                [](cpu* c1, cpu* c2) { return c1->load() < c2->load(); });
-        if (min == this) {
-            continue;
+        // Moving one thread only helps if we run more than one thread more
+        // than the target does. Look in the nearest domains first.
+        auto mine = load_avg();
+        cpu* min = nullptr;
+        float min_load = 0;
+        for (unsigned level = 0; level < nr_domains && !min; level++) {
+            for (auto c : domains[level]) {
+                auto l = c->load_avg();
+                if (c != this && l + 1 + balance_threshold[level] < mine &&
+                        (!min || l < min_load)) {
+                    min = c;
+                    min_load = l;
+                }
+            }
         }
-        // This CPU is temporarily running one extra thread (this thread),
-        // so don't migrate a thread away if the difference is only 1.
-        if (min->load() >= (load() - 1)) {
+        if (!min) {
             continue;
         }
         WITH_LOCK(irq_lock) {
-            auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
-                    [](thread& t) { return t._migration_lock_counter == 0; });
-            if (i == runqueue.rend()) {
-                continue;
-            }
-            auto& mig = *i;
-            trace_sched_migrate(&mig, min->id);
-            runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
-            // we won't race with wake(), since we're not thread::waiting
-            assert(mig._detached_state->st.load() == thread::status::queued);
-            mig._detached_state->st.store(thread::status::waking);
-            mig.suspend_timers();
-            mig._detached_state->_cpu = min;
-            // Convert the CPU-local runtime measure to a globally meaningful
-            // measure
-            mig._runtime.export_runtime();
-            mig.remote_thread_local_var(::percpu_base) = min->percpu_base;
-            mig.remote_thread_local_var(current_cpu) = min;
-            mig.stat_migrations.incr();
-            min->incoming_wakeups[id].push_back(mig);
-            min->incoming_wakeups_mask.set(id);
-            // FIXME: avoid if the cpu is alive and if the priority does not
-            // FIXME: warrant an interruption
-            min->send_wakeup_ipi();
+            push_thread(min);
         }
     }
 }
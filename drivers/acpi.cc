@@ -30,6 +30,8 @@ extern "C" {
 #include <osv/interrupt.hh>
 
 #include <osv/prio.hh>
+#include <osv/numa.hh>
+#include <boost/intrusive/parent_from_member.hpp>
 
 #define acpi_tag "acpi"
 #define acpi_d(...)   tprintf_d(acpi_tag, __VA_ARGS__)
@@ -539,6 +541,84 @@ namespace acpi {
 
 static ACPI_TABLE_DESC TableArray[ACPI_MAX_INIT_TABLES];
 
+using boost::intrusive::get_parent_from_member;
+
+// The System Resource Affinity Table assigns CPUs (by APIC id) and physical
+// memory ranges to proximity domains, i.e., NUMA nodes.
+static void parse_srat()
+{
+    char srat_sig[] = ACPI_SIG_SRAT;
+    ACPI_TABLE_HEADER* srat_header;
+    if (AcpiGetTable(srat_sig, 0, &srat_header) != AE_OK) {
+        return;
+    }
+    auto srat = get_parent_from_member(srat_header, &ACPI_TABLE_SRAT::Header);
+    void* subtable = srat + 1;
+    void* srat_end = static_cast<void*>(srat) + srat->Header.Length;
+    while (subtable + sizeof(ACPI_SUBTABLE_HEADER) <= srat_end) {
+        auto s = static_cast<ACPI_SUBTABLE_HEADER*>(subtable);
+        if (!s->Length) {
+            break;
+        }
+        switch (s->Type) {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+            auto cpu = get_parent_from_member(s, &ACPI_SRAT_CPU_AFFINITY::Header);
+            if (!(cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY)) {
+                break;
+            }
+            u32 domain = cpu->ProximityDomainLo |
+                         cpu->ProximityDomainHi[0] << 8 |
+                         cpu->ProximityDomainHi[1] << 16 |
+                         cpu->ProximityDomainHi[2] << 24;
+            memory::numa::add_cpu_affinity(domain, cpu->ApicId);
+            break;
+        }
+        case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+            auto cpu = get_parent_from_member(s, &ACPI_SRAT_X2APIC_CPU_AFFINITY::Header);
+            if (!(cpu->Flags & ACPI_SRAT_CPU_ENABLED)) {
+                break;
+            }
+            memory::numa::add_cpu_affinity(cpu->ProximityDomain, cpu->ApicId);
+            break;
+        }
+        case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+            auto mem = get_parent_from_member(s, &ACPI_SRAT_MEM_AFFINITY::Header);
+            if (!(mem->Flags & ACPI_SRAT_MEM_ENABLED)) {
+                break;
+            }
+            memory::numa::add_memory_affinity(mem->ProximityDomain,
+                    mem->BaseAddress, mem->Length);
+            break;
+        }
+        default:
+            break;
+        }
+        subtable += s->Length;
+    }
+}
+
+// The System Locality Information Table holds the relative distance between
+// every pair of proximity domains.
+static void parse_slit()
+{
+    char slit_sig[] = ACPI_SIG_SLIT;
+    ACPI_TABLE_HEADER* slit_header;
+    if (AcpiGetTable(slit_sig, 0, &slit_header) != AE_OK) {
+        return;
+    }
+    auto slit = get_parent_from_member(slit_header, &ACPI_TABLE_SLIT::Header);
+    auto n = slit->LocalityCount;
+    if (sizeof(*slit) - 1 + n * n > slit->Header.Length) {
+        acpi_e("SLIT too short for %d localities\n", n);
+        return;
+    }
+    for (u64 i = 0; i < n; i++) {
+        for (u64 j = 0; j < n; j++) {
+            memory::numa::set_distance(i, j, slit->Entry[i * n + j]);
+        }
+    }
+}
+
 void early_init()
 {
     ACPI_STATUS status;
@@ -569,6 +649,10 @@ void early_init()
         acpi_e("AcpiLoadTables failed: %s\n", AcpiFormatException(status));
         return;
     }
+
+    parse_srat();
+    parse_slit();
+    memory::numa::setup();
 }
 
 UINT32 acpi_poweroff(void *unused)
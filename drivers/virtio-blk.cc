@@ -36,6 +36,7 @@ TRACEPOINT(trace_virtio_blk_read_config_blk_size, "blk_size=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_topology, "physical_block_exp=%u, alignment_offset=%u, min_io_size=%u, opt_io_size=%u", u32, u32, u32, u32);
 TRACEPOINT(trace_virtio_blk_read_config_wce, "wce=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_ro, "readonly=true");
+TRACEPOINT(trace_virtio_blk_read_config_num_queues, "num_queues=%u", u32);
 TRACEPOINT(trace_virtio_blk_make_request_seg_max, "request of size %d needs more segment than the max %d", size_t, u32);
 TRACEPOINT(trace_virtio_blk_make_request_readonly, "write on readonly device");
 TRACEPOINT(trace_virtio_blk_wake, "");
@@ -101,10 +102,11 @@ struct driver blk_driver = {
 bool blk::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
-    auto queue = get_virt_queue(0);
 
     if (isr) {
-        queue->disable_interrupts();
+        for (auto& q : _queues) {
+            q->vqueue->disable_interrupts();
+        }
         return true;
     } else {
         return false;
@@ -123,22 +125,42 @@ blk::blk(pci::device& pci_dev)
     setup_features();
     read_config();
 
-    //register the single irq callback for the block
-    sched::thread* t = new sched::thread([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-blk"));
-    t->start();
-    auto queue = get_virt_queue(0);
+    // One completion thread per request queue. With several queues each
+    // serves the cpu whose requests it carries, so it is pinned there.
+    unsigned nqueues = negotiate_queues();
+    for (unsigned i = 0; i < nqueues; i++) {
+        auto* q = new request_queue(get_virt_queue(i));
+        auto attr = sched::thread::attr().name("virtio-blk");
+        if (nqueues > 1) {
+            attr.pin(sched::cpus[i]);
+        }
+        q->thread = new sched::thread([this, q] { this->req_done(*q); }, attr);
+        _queues.emplace_back(q);
+    }
+    for (auto& q : _queues) {
+        q->thread->start();
+        // Enable indirect descriptor
+        q->vqueue->set_use_indirect(true);
+    }
+
     if (pci_dev.is_msix()) {
-        _msi.easy_register({ { 0, [=] { queue->disable_interrupts(); }, t } });
+        std::vector<msix_binding> bindings;
+        for (unsigned i = 0; i < nqueues; i++) {
+            auto* queue = _queues[i]->vqueue;
+            bindings.push_back({ i, [=] { queue->disable_interrupts(); },
+                                 _queues[i]->thread });
+        }
+        _msi.easy_register(bindings);
     } else {
         _irq.reset(new pci_interrupt(pci_dev,
                                      [=] { return ack_irq(); },
-                                     [=] { t->wake(); }));
+                                     [=] {
+                                         for (auto& q : _queues) {
+                                             q->thread->wake();
+                                         }
+                                     }));
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
-
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
     struct blk_priv* prv;
@@ -150,6 +172,11 @@ blk::blk(pci::device& pci_dev)
     prv = reinterpret_cast<struct blk_priv*>(dev->private_data);
     prv->drv = this;
     dev->size = prv->drv->size();
+    // make_request() needs a segment per page, plus one for a buffer
+    // which does not start on a page boundary
+    if (get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX) && _config.seg_max > 1) {
+        dev->max_io_size = (_config.seg_max - 1) * mmu::page_size;
+    }
     read_partition_table(dev);
 
     debugf("virtio-blk: Add blk device instances %d as %s, devsize=%lld\n", _id, dev_name.c_str(), dev->size);
@@ -186,11 +213,30 @@ void blk::read_config()
         set_readonly();
         trace_virtio_blk_read_config_ro();
     }
+    _mq = get_guest_feature_bit(VIRTIO_BLK_F_MQ);
+    if (_mq) {
+        trace_virtio_blk_read_config_num_queues(_config.num_queues);
+    }
 }
 
-void blk::req_done()
+unsigned blk::negotiate_queues()
 {
-    auto* queue = get_virt_queue(0);
+    unsigned nqueues = 1;
+
+    // Each queue needs its own MSI-X vector to be completed on its cpu
+    if (_mq && _dev.is_msix()) {
+        nqueues = std::min<unsigned>(_config.num_queues, sched::cpus.size());
+        nqueues = std::min(nqueues, _num_queues);
+        nqueues = std::max(nqueues, 1U);
+    }
+    virtio_i("virtio-blk: using %d request queues", nqueues);
+
+    return nqueues;
+}
+
+void blk::req_done(request_queue& q)
+{
+    auto* queue = q.vqueue;
     blk_req* req;
 
     while (1) {
@@ -235,17 +281,21 @@ static const int sector_size = 512;
 
 int blk::make_request(struct bio* bio)
 {
-    // The lock is here for parallel requests protection
-    WITH_LOCK(_lock) {
+    if (!bio) return EIO;
+
+    // Requests go to the queue of the submitting cpu, so submitters on
+    // different cpus neither share a lock nor a ring.
+    auto& q = *_queues[sched::cpu::current()->id % _queues.size()];
 
-        if (!bio) return EIO;
+    // The lock is here for parallel requests protection
+    WITH_LOCK(q.lock) {
 
         if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
             trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
             return EIO;
         }
 
-        auto* queue = get_virt_queue(0);
+        auto* queue = q.vqueue;
         blk_request_type type;
 
         switch (bio->bio_cmd) {
@@ -288,12 +338,24 @@ int blk::make_request(struct bio* bio)
 
         queue->add_buf_wait(req);
 
-        queue->kick();
+        // Within a bio_plug() section, the host is notified once for the
+        // whole batch, when the submitter unplugs.
+        if (!bio_plug_defer(unplug_queue, &q)) {
+            queue->kick();
+        }
 
         return 0;
     }
 }
 
+void blk::unplug_queue(void* arg)
+{
+    auto* q = static_cast<request_queue*>(arg);
+    WITH_LOCK(q->lock) {
+        q->vqueue->kick();
+    }
+}
+
 u32 blk::get_driver_features()
 {
     auto base = virtio_driver::get_driver_features();
@@ -303,7 +365,8 @@ u32 blk::get_driver_features()
                  | ( 1 << VIRTIO_BLK_F_RO)
                  | ( 1 << VIRTIO_BLK_F_BLK_SIZE)
                  | ( 1 << VIRTIO_BLK_F_CONFIG_WCE)
-                 | ( 1 << VIRTIO_BLK_F_WCE));
+                 | ( 1 << VIRTIO_BLK_F_WCE)
+                 | ( 1 << VIRTIO_BLK_F_MQ));
 }
 
 hw_driver* blk::probe(hw_device* dev)
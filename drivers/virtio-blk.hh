@@ -10,6 +10,8 @@
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 #include <osv/bio.h>
+#include <vector>
+#include <memory>
 
 namespace virtio {
 
@@ -28,6 +30,7 @@ public:
         VIRTIO_BLK_F_WCE        = 9,  /* Writeback mode enabled after reset */
         VIRTIO_BLK_F_TOPOLOGY   = 10, /* Topology information is available */
         VIRTIO_BLK_F_CONFIG_WCE = 11, /* Writeback mode available in config */
+        VIRTIO_BLK_F_MQ         = 12, /* Support more than one vq */
     };
 
     enum {
@@ -95,6 +98,10 @@ public:
 
             /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
             u8 wce;
+            u8 unused;
+
+            /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+            u16 num_queues;
     } __attribute__((packed));
 
     /* This is the first element of the read scatter-gather list. */
@@ -128,7 +135,6 @@ public:
 
     int make_request(struct bio*);
 
-    void req_done();
     int64_t size();
 
     void set_readonly() {_ro = true;}
@@ -148,6 +154,19 @@ private:
         struct bio* bio;
     };
 
+    /* A request virtqueue and the thread completing its requests */
+    struct request_queue {
+        explicit request_queue(vring* q) : vqueue(q) {}
+        vring* vqueue;
+        // This mutex protects parallel make_request invocations on the queue
+        mutex lock;
+        sched::thread* thread = nullptr;
+    };
+
+    unsigned negotiate_queues();
+    void req_done(request_queue& q);
+    static void unplug_queue(void* arg);
+
     std::string _driver_name;
     blk_config _config;
 
@@ -155,8 +174,9 @@ private:
     static int _instance;
     int _id;
     bool _ro;
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    bool _mq = false;
+    // With VIRTIO_BLK_F_MQ, one queue per cpu (as far as the host allows)
+    std::vector<std::unique_ptr<request_queue>> _queues;
     std::unique_ptr<pci_interrupt> _irq;
 };
 
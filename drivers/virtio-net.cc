@@ -50,6 +50,8 @@ TRACEPOINT(trace_virtio_net_tx_no_space_calling_gc, "if=%d", int);
 TRACEPOINT(trace_virtio_net_tx_packet_size, "vring %p vec_sz %d", void*, int);
 TRACEPOINT(trace_virtio_net_tx_xmit_one_failed_to_post, "vring %p vec_sz %d",
            void*, int);
+TRACEPOINT(trace_virtio_net_ctrl_cmd, "if=%d, class=%d, cmd=%d, ack=%d",
+           int, u8, u8, u8);
 
 using namespace memory;
 
@@ -136,10 +138,11 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 inline int net::xmit(struct mbuf* buff)
 {
     //
-    // We currently have only a single TX queue. Select a proper TXq here when
-    // we implement a multi-queue.
+    // Use the Tx queue of the current CPU. If we get migrated after this
+    // point the packet still goes out on this queue: its xmitter takes care
+    // of the ordering.
     //
-    return _txq.xmit(buff);
+    return _txq[sched::cpu::current()->id % _active_pairs]->xmit(buff);
 }
 
 inline int net::txq::xmit(mbuf* buff)
@@ -186,9 +189,13 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support only a single Tx/Rx queue so no iteration so far
-    fill_qstats(_rxq, out_data);
-    fill_qstats(_txq, out_data);
+    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
+    for (auto&& rxq : _rxq) {
+        fill_qstats(*rxq, out_data);
+    }
+    for (auto&& txq : _txq) {
+        fill_qstats(*txq, out_data);
+    }
 }
 
 void net::fill_qstats(const struct rxq& rxq, struct if_data* out_data) const
@@ -197,22 +204,23 @@ void net::fill_qstats(const struct rxq& rxq, struct if_data* out_data) const
     out_data->ifi_ibytes     += rxq.stats.rx_bytes;
     out_data->ifi_iqdrops    += rxq.stats.rx_drops;
     out_data->ifi_ierrors    += rxq.stats.rx_csum_err;
-    out_data->ifi_ibh_wakeups = rxq.stats.rx_bh_wakeups;
-    out_data->ifi_iwakeup_stats = rxq.stats.rx_wakeup_stats;
+    out_data->ifi_ibh_wakeups += rxq.stats.rx_bh_wakeups;
+    out_data->ifi_ilro_queued += rxq.stats.rx_lro_queued;
+    out_data->ifi_ilro_flushed += rxq.stats.rx_lro_flushed;
+    if_add_wakeup_stats(out_data->ifi_iwakeup_stats, rxq.stats.rx_wakeup_stats);
 }
 
 void net::fill_qstats(const struct txq& txq, struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
     out_data->ifi_opackets       += txq.stats.tx_packets;
     out_data->ifi_obytes         += txq.stats.tx_bytes;
     out_data->ifi_oerrors        += txq.stats.tx_err + txq.stats.tx_drops;
-    out_data->ifi_oworker_kicks   = txq.stats.tx_worker_kicks;
-    out_data->ifi_oworker_wakeups = txq.stats.tx_worker_wakeups;
-    out_data->ifi_oworker_packets = txq.stats.tx_worker_packets;
-    out_data->ifi_okicks          = txq.stats.tx_kicks;
-    out_data->ifi_oqueue_is_full  = txq.stats.tx_hw_queue_is_full;
-    out_data->ifi_owakeup_stats   = txq.stats.tx_wakeup_stats;
+    out_data->ifi_oworker_kicks  += txq.stats.tx_worker_kicks;
+    out_data->ifi_oworker_wakeups += txq.stats.tx_worker_wakeups;
+    out_data->ifi_oworker_packets += txq.stats.tx_worker_packets;
+    out_data->ifi_okicks         += txq.stats.tx_kicks;
+    out_data->ifi_oqueue_is_full += txq.stats.tx_hw_queue_is_full;
+    if_add_wakeup_stats(out_data->ifi_owakeup_stats, txq.stats.tx_wakeup_stats);
 }
 
 bool net::ack_irq()
@@ -220,7 +228,7 @@ bool net::ack_irq()
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
 
     if (isr) {
-        _rxq.vqueue->disable_interrupts();
+        _rxq[0]->vqueue->disable_interrupts();
         return true;
     } else {
         return false;
@@ -229,14 +237,8 @@ bool net::ack_irq()
 }
 
 net::net(pci::device& dev)
-    : virtio_driver(dev),
-      _rxq(get_virt_queue(0), [this] { this->receiver(); }),
-      _txq(this, get_virt_queue(1))
+    : virtio_driver(dev)
 {
-    sched::thread* poll_task = &_rxq.poll_task;
-
-    poll_task->set_priority(sched::thread::priority_infinity);
-
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
@@ -246,6 +248,19 @@ net::net(pci::device& dev)
 
     _hdr_size = _mergeable_bufs ? sizeof(net_hdr_mrg_rxbuf) : sizeof(net_hdr);
 
+    unsigned pairs = negotiate_queue_pairs();
+    for (unsigned i = 0; i < pairs; i++) {
+        auto attr = sched::thread::attr();
+        if (pairs > 1) {
+            attr.pin(sched::cpus[i]);
+        }
+        _rxq.emplace_back(new rxq(get_virt_queue(2 * i),
+                                  [this, i] { this->receiver(*_rxq[i]); },
+                                  attr));
+        _rxq[i]->poll_task.set_priority(sched::thread::priority_infinity);
+        _txq.emplace_back(new txq(this, get_virt_queue(2 * i + 1)));
+    }
+
     //initialize the BSD interface _if
     _ifn = if_alloc(IFT_ETHER);
     if (_ifn == NULL) {
@@ -264,7 +279,7 @@ net::net(pci::device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
-    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
+    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq[0]->vqueue->size());
 
     _ifn->if_capabilities = 0;
 
@@ -276,34 +291,151 @@ net::net(pci::device& dev)
         }
     }
 
+    // Segments whose checksum the host vouches for can be coalesced in
+    // software; with GUEST_TSO4 the host already merges most of them.
     if (_guest_csum) {
-        _ifn->if_capabilities |= IFCAP_RXCSUM;
-        if (_guest_tso4)
-            _ifn->if_capabilities |= IFCAP_LRO;
+        _ifn->if_capabilities |= IFCAP_RXCSUM | IFCAP_LRO;
     }
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-    poll_task->start();
-    _txq.start();
+    for (auto&& rxq : _rxq) {
+        if (tcp_lro_init(&rxq->lro) == 0) {
+            rxq->lro.ifp = _ifn;
+        }
+    }
 
     ether_ifattach(_ifn, _config.mac);
 
+    //Start the polling threads before attaching them to the Rx interrupts
+    for (unsigned i = 0; i < pairs; i++) {
+        _rxq[i]->poll_task.start();
+        _txq[i]->start();
+    }
+
     if (dev.is_msix()) {
-        _msi.easy_register({
-            { 0, [&] { _rxq.vqueue->disable_interrupts(); }, poll_task },
-            { 1, [&] { _txq.vqueue->disable_interrupts(); }, nullptr }
-        });
+        // Every queue got the MSI-X entry equal to its index in
+        // probe_virt_queues(). The vector of each Rx queue follows its
+        // (pinned) poll thread.
+        std::vector<msix_binding> bindings;
+        for (unsigned i = 0; i < pairs; i++) {
+            auto rx = _rxq[i].get();
+            auto tx = _txq[i].get();
+            bindings.push_back({ 2 * i, [rx] { rx->vqueue->disable_interrupts(); },
+                                 &rx->poll_task });
+            bindings.push_back({ 2 * i + 1, [tx] { tx->vqueue->disable_interrupts(); },
+                                 nullptr });
+        }
+        if (_ctrl_vq) {
+            auto ctrl = _ctrl_vq;
+            bindings.push_back({ _ctrl_vq_index, [ctrl] {
+                                     ctrl->disable_interrupts();
+                                     ctrl->wakeup_waiter();
+                                 }, nullptr });
+        }
+        _msi.easy_register(bindings);
     } else {
+        sched::thread* poll_task = &_rxq[0]->poll_task;
+        auto ctrl = _ctrl_vq;
         _irq.reset(new pci_interrupt(dev,
                                      [=] { return this->ack_irq(); },
-                                     [=] { poll_task->wake(); }));
+                                     [=] {
+                                         poll_task->wake();
+                                         if (ctrl) {
+                                             ctrl->wakeup_waiter();
+                                         }
+                                     }));
     }
 
-    fill_rx_ring();
+    for (unsigned i = 0; i < pairs; i++) {
+        fill_rx_ring(*_rxq[i]);
+    }
 
+    // Every queue can be used by the device from here on
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    // The device uses the first queue pair only until told otherwise. If
+    // it doesn't agree to use more, the others stay idle.
+    if (pairs > 1) {
+        net_ctrl_mq mq = { static_cast<u16>(pairs) };
+        if (ctrl_send(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                      &mq, sizeof(mq))) {
+            _active_pairs = pairs;
+        } else {
+            net_w("Failed to enable %d queue pairs, using a single one",
+                  pairs);
+        }
+    }
+
+    net_i("Using %d Rx/Tx queue pair(s)", _active_pairs);
+}
+
+unsigned net::negotiate_queue_pairs()
+{
+    unsigned pairs = 1;
+
+    if (_mq && _ctrl_vq_cap && _dev.is_msix()) {
+        pairs = std::min<unsigned>(_config.max_virtqueue_pairs,
+                                   sched::cpus.size());
+        // Rx/Tx queues of all the pairs plus the control queue
+        pairs = std::min(pairs, (_num_queues - 1) / 2);
+        pairs = std::max(pairs, 1U);
+    }
+
+    if (_ctrl_vq_cap) {
+        // The control queue follows the Rx/Tx queues of all the pairs the
+        // device supports, not only of those we are going to use.
+        _ctrl_vq_index = _mq ? 2 * _config.max_virtqueue_pairs : 2;
+        _ctrl_vq = get_virt_queue(_ctrl_vq_index);
+        if (_ctrl_vq) {
+            _ctrl_vq->disable_interrupts();
+        } else {
+            pairs = 1;
+        }
+    }
+
+    return pairs;
+}
+
+bool net::ctrl_send(u8 cls, u8 cmd, const void* data, u32 len)
+{
+    if (!_ctrl_vq) {
+        return false;
+    }
+
+    // The device accesses these by their physical address, so keep them
+    // off the stack.
+    struct ctrl_req {
+        net_ctrl_hdr hdr;
+        net_ctrl_ack ack;
+        u8 data[];
+    };
+    std::unique_ptr<ctrl_req, void (*)(void*)> req(
+        static_cast<ctrl_req*>(malloc(sizeof(ctrl_req) + len)), free);
+    req->hdr.class_t = cls;
+    req->hdr.cmd = cmd;
+    req->ack = VIRTIO_NET_ERR;
+    memcpy(req->data, data, len);
+
+    vring* vq = _ctrl_vq;
+    vq->init_sg();
+    vq->add_out_sg(&req->hdr, sizeof(req->hdr));
+    vq->add_out_sg(req->data, len);
+    vq->add_in_sg(&req->ack, sizeof(req->ack));
+    vq->add_buf_wait(req.get());
+    vq->kick();
+
+    // The control queue's interrupt wakes its waiter
+    vq->_waiter.reset(*sched::thread::current());
+    virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
+    vq->_waiter.clear();
+    u32 used_len;
+    vq->get_buf_elem(&used_len);
+    vq->get_buf_finalize();
+    vq->get_buf_gc();
+
+    trace_virtio_net_ctrl_cmd(_id, cls, cmd, req->ack);
+    return req->ack == VIRTIO_NET_OK;
 }
 
 net::~net()
@@ -344,11 +476,17 @@ void net::read_config()
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
+    _ctrl_vq_cap = get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
+    _mq = get_guest_feature_bit(VIRTIO_NET_F_MQ);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
     net_i("Features: %s=%d", "host tso4", _host_tso4);
+    net_i("Features: %s=%d,%s=%d", "ctrl vq", _ctrl_vq_cap, "MQ", _mq);
+    if (_mq) {
+        net_i("Max virtqueue pairs: %d", _config.max_virtqueue_pairs);
+    }
 }
 
 /**
@@ -411,9 +549,9 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
     return false;
 }
 
-void net::receiver()
+void net::receiver(struct rxq& rxq)
 {
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
     std::vector<iovec> packet;
     u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
     u64 csum_err = 0, rx_bytes = 0;
@@ -425,8 +563,8 @@ void net::receiver()
         virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
         trace_virtio_net_rx_wake();
 
-        _rxq.stats.rx_bh_wakeups++;
-        _rxq.update_wakeup_stats(rx_packets);
+        rxq.stats.rx_bh_wakeups++;
+        rxq.update_wakeup_stats(rx_packets);
 
         u32 len;
         int nbufs;
@@ -442,7 +580,7 @@ void net::receiver()
             vq->get_buf_finalize();
 
             if (vq->effective_avail_ring_count() >= refill_thresh)
-                fill_rx_ring();
+                fill_rx_ring(rxq);
 
             // Bad packet/buffer - discard and continue to the next one
             if (len < _hdr_size + ETHER_HDR_LEN) {
@@ -487,14 +625,30 @@ void net::receiver()
                 else
                     csum_ok++;
 
+            } else if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
+                       (mhdr->hdr.flags &
+                        net_hdr::VIRTIO_NET_HDR_F_DATA_VALID)) {
+                // The host (or the NIC behind it) checked it already
+                m_head->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+                m_head->M_dat.MH.MH_pkthdr.csum_data = 0xFFFF;
+                csum_ok++;
             }
 
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
+            // Coalesce in-order TCP segments of a flow; they are passed up
+            // when the flow breaks the sequence, or at the end of the batch.
+            // LRO can only merge segments with a verified checksum.
+            bool queued = (_ifn->if_capenable & IFCAP_LRO) &&
+                          rxq.lro.lro_cnt != 0 &&
+                          (m_head->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) &&
+                          tcp_lro_rx(&rxq.lro, m_head, 0) == 0;
+            if (!queued) {
+                bool fast_path = _ifn->if_classifier.post_packet(m_head);
+                if (!fast_path) {
+                    (*_ifn->if_input)(_ifn, m_head);
+                }
             }
 
             trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
@@ -505,13 +659,28 @@ void net::receiver()
                 break;
         }
 
+        lro_flush(rxq);
+
         // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_drops      += rx_drops;
+        rxq.stats.rx_packets    += rx_packets;
+        rxq.stats.rx_csum       += csum_ok;
+        rxq.stats.rx_csum_err   += csum_err;
+        rxq.stats.rx_bytes      += rx_bytes;
+    }
+}
+
+void net::lro_flush(struct rxq& rxq)
+{
+    auto lro = &rxq.lro;
+    while (!SLIST_EMPTY(&lro->lro_active)) {
+        auto queued = SLIST_FIRST(&lro->lro_active);
+        SLIST_REMOVE_HEAD(&lro->lro_active, next);
+        tcp_lro_flush(lro, queued);
     }
+    rxq.stats.rx_lro_queued  += lro->lro_queued;
+    rxq.stats.rx_lro_flushed += lro->lro_flushed;
+    lro->lro_queued = lro->lro_flushed = 0;
 }
 
 mbuf* net::packet_to_mbuf(const std::vector<iovec>& packet)
@@ -558,11 +727,11 @@ void net::do_free_buffer(void* buffer)
     memory::free_page(buffer);
 }
 
-void net::fill_rx_ring()
+void net::fill_rx_ring(struct rxq& rxq)
 {
     trace_virtio_net_fill_rx_ring(_ifn->if_index);
     int added = 0;
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     while (vq->avail_ring_not_empty()) {
         auto page = memory::alloc_page();
@@ -851,6 +1020,8 @@ u32 net::get_driver_features()
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)
                  | (1 << VIRTIO_NET_F_GUEST_UFO)
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)
+                 | (1 << VIRTIO_NET_F_MQ)
             );
 }
 
@@ -12,6 +12,9 @@
 #include <bsd/sys/net/if_var.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 #include <osv/percpu_xmit.hh>
 
@@ -214,8 +217,6 @@ public:
 
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
-    void fill_rx_ring();
     mbuf* packet_to_mbuf(const std::vector<iovec>& iovec);
     static void free_buffer_and_refcnt(void* buffer, void* refcnt);
     static void free_buffer(iovec iov) { do_free_buffer(iov.iov_base); }
@@ -266,6 +267,8 @@ private:
     bool _guest_tso4 = false;
     bool _host_tso4 = false;
     bool _guest_ufo = false;
+    bool _ctrl_vq_cap = false;
+    bool _mq = false;
 
     u32 _hdr_size;
 
@@ -278,6 +281,8 @@ private:
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
         u64 rx_bh_wakeups;
+        u64 rx_lro_queued;  /* segments passed up through software LRO */
+        u64 rx_lro_flushed; /* coalesced packets LRO passed up */
 
         wakeup_stats rx_wakeup_stats;
     };
@@ -301,12 +306,14 @@ private:
 
     /* Single Rx queue object */
     struct rxq {
-        rxq(vring* vq, std::function<void ()> poll_func)
-            : vqueue(vq), poll_task(poll_func, sched::thread::attr().
-                                    name("virtio-net-rx")) {};
+        rxq(vring* vq, std::function<void ()> poll_func,
+            sched::thread::attr attr = sched::thread::attr())
+            : vqueue(vq), poll_task(poll_func, attr.name("virtio-net-rx")) {};
         vring* vqueue;
         sched::thread  poll_task;
         struct rxq_stats stats = { 0 };
+        // Software LRO state, only touched by poll_task
+        struct lro_ctrl lro = {};
 
         void update_wakeup_stats(const u64 wakeup_packets) {
             if_update_wakeup_stats(stats.rx_wakeup_stats, wakeup_packets);
@@ -474,9 +481,40 @@ private:
      */
     void fill_qstats(const struct txq& txq, struct if_data* out_data) const;
 
-    /* We currently support only a single Rx+Tx queue */
-    struct rxq _rxq;
-    struct txq _txq;
+    void receiver(struct rxq& rxq);
+    void lro_flush(struct rxq& rxq);
+    void fill_rx_ring(struct rxq& rxq);
+
+    /**
+     * Send a command on the control virtqueue and wait for its completion.
+     * @param cls command class (VIRTIO_NET_CTRL_*)
+     * @param cmd command within the class
+     * @param data command specific data
+     * @param len length of the data
+     *
+     * @return true if the device acknowledged the command with
+     *         VIRTIO_NET_OK.
+     */
+    bool ctrl_send(u8 cls, u8 cmd, const void* data, u32 len);
+
+    /**
+     * Pick the number of Rx/Tx queue pairs to use: one per CPU, bounded by
+     * what the device offers (VIRTIO_NET_F_MQ) and by the virtqueues that
+     * were actually found.
+     */
+    unsigned negotiate_queue_pairs();
+
+    /**
+     * Rx/Tx queue pairs. Pair i uses virtqueues 2i (Rx) and 2i+1 (Tx) and,
+     * with VIRTIO_NET_F_MQ, its Rx poll thread is pinned to CPU i.
+     */
+    std::vector<std::unique_ptr<rxq>> _rxq;
+    std::vector<std::unique_ptr<txq>> _txq;
+    // Number of queue pairs the device has agreed to use, which Tx is
+    // spread over
+    unsigned _active_pairs = 1;
+    vring* _ctrl_vq = nullptr;
+    unsigned _ctrl_vq_index = 0;
 
     //maintains the virtio instance number for multiple drives
     static int _instance;
@@ -324,6 +324,10 @@ namespace virtio {
         while (!add_buf(cookie)) {
             _waiter.reset(*sched::thread::current());
             while (!avail_ring_has_room(_sg_vec.size())) {
+                // The caller may be holding back the notification of what
+                // it already queued (see bio_plug()); the host cannot free
+                // any room before it hears about those buffers.
+                kick();
                 sched::thread::wait_until([this] {return this->used_ring_can_gc();});
                 get_buf_gc();
             }
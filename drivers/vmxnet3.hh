@@ -13,6 +13,9 @@
 #include <bsd/sys/net/if_var.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 #include "drivers/driver.hh"
 #include "drivers/vmxnet3-queues.hh"
@@ -233,6 +236,8 @@ public:
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
         u64 rx_bh_wakeups; /* number of timer Rx BH has been woken up */
+        u64 rx_lro_queued;  /* segments passed up through software LRO */
+        u64 rx_lro_flushed; /* coalesced packets LRO passed up */
         wakeup_stats rx_wakeup_stats;
     } stats = { 0 };
     sched::thread task;
@@ -245,6 +250,7 @@ private:
     void newbuf(int rid);
     void input(vmxnet3_rx_compdesc *rxcd, struct mbuf *m);
     void checksum(vmxnet3_rx_compdesc *rxcd, struct mbuf *m);
+    void lro_flush();
 
     typedef vmxnet3_ring<vmxnet3_rx_desc, VMXNET3_MAX_RX_NDESC> cmdRingT;
     typedef vmxnet3_ring<vmxnet3_rx_compdesc, VMXNET3_MAX_RX_NCOMPDESC> compRingT;
@@ -254,6 +260,8 @@ private:
     struct mbuf *_buf[VMXNET3_RXRINGS_PERQ][VMXNET3_MAX_RX_NDESC] = {};
     struct mbuf *_m_currpkt_head = nullptr;
     struct mbuf *_m_currpkt_tail = nullptr;
+    // Software LRO, for segments the device did not coalesce itself
+    struct lro_ctrl _lro = {};
     struct ifnet* _ifn;
     pci::bar *_bar0;
 };
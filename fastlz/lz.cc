@@ -4,18 +4,115 @@
  * This work is open source software, licensed under the terms of the
  * BSD license as described in the LICENSE file in the top-level directory.
  */
-#include "fastlz.h"
+#include "lz4.h"
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 
 using namespace std;
 
-// Compress the Kernel using fastlz algorithm
+typedef unsigned char u8;
+
+// Chunks are compressed independently, so that lzloader can decompress
+// them in parallel; matches never cross a chunk boundary.
+static const size_t chunk_size = 64 * 1024;
+
+// LZ4 block format constraints: the last 5 bytes of a block are literals,
+// and the last match starts at least 12 bytes before the end.
+static const size_t min_match = 4;
+static const size_t last_literals = 5;
+static const size_t mflimit = 12;
+static const size_t max_offset = 65535;
+static const unsigned hash_log = 16;
+
+static inline uint32_t read32(const u8* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - hash_log);
+}
+
+static void put_length(u8*& op, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+}
+
+static void put_literals(u8*& op, u8*& token, const u8* lit, size_t len)
+{
+    token = op++;
+    *token = (len < 15 ? len : 15) << 4;
+    if (len >= 15) {
+        put_length(op, len - 15);
+    }
+    memcpy(op, lit, len);
+    op += len;
+}
+
+// Greedy LZ4 block compression with a single hash table probe per
+// position. Returns the compressed size; out must hold at least
+// len + len / 255 + 16 bytes.
+static size_t lz4_compress(const u8* in, size_t len, u8* out)
+{
+    vector<uint32_t> table(1 << hash_log);
+    const u8* ip = in;
+    const u8* anchor = in;
+    const u8* iend = in + len;
+    u8* op = out;
+    u8* token;
+
+    if (len > mflimit) {
+        const u8* mlimit = iend - mflimit;
+        const u8* matchlimit = iend - last_literals;
+        while (ip < mlimit) {
+            auto h = hash4(read32(ip));
+            const u8* ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || size_t(ip - ref) > max_offset ||
+                    read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = min_match;
+            while (ip + mlen < matchlimit && ip[mlen] == ref[mlen]) {
+                mlen++;
+            }
+
+            put_literals(op, token, anchor, ip - anchor);
+            size_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            size_t ml = mlen - min_match;
+            *token |= ml < 15 ? ml : 15;
+            if (ml >= 15) {
+                put_length(op, ml - 15);
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    put_literals(op, token, anchor, iend - anchor);
+    return op - out;
+}
+
+// Compress the kernel into the chunked LZ4 image read by lzloader
 int main(int argc, char* argv[])
 {
-    size_t input_length, output_length;
-    char *input, *output;
+    size_t input_length;
+    char *input;
 
     if (argc != 2) {
         cout << "usage: lz inputfile\n";
@@ -37,13 +134,43 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    output = new char[(int)(input_length*2)];
-    output_length = fastlz_compress(input, input_length, output);
+    uint32_t nchunks = (input_length + chunk_size - 1) / chunk_size;
+    size_t header_size = sizeof(lz_image_header) + (nchunks + 1) * sizeof(uint32_t);
+    vector<u8> output(header_size);
+    vector<u8> chunk(chunk_size + chunk_size / 255 + 16);
+    vector<u8> check(chunk_size);
+
+    for (uint32_t i = 0; i < nchunks; i++) {
+        auto in = reinterpret_cast<const u8*>(input) + i * chunk_size;
+        size_t len = min(chunk_size, input_length - i * chunk_size);
+        size_t clen = lz4_compress(in, len, chunk.data());
+        uint32_t offset = output.size();
+        if (clen >= len) {
+            output.insert(output.end(), in, in + len);
+            offset |= LZ_CHUNK_STORED;
+        } else {
+            if (lz4_decompress(chunk.data(), clen, check.data(), len) != int(len) ||
+                    memcmp(check.data(), in, len) != 0) {
+                cout << "Chunk " << i << " does not decompress correctly\n";
+                return EXIT_FAILURE;
+            }
+            output.insert(output.end(), chunk.begin(), chunk.begin() + clen);
+        }
+        memcpy(&output[sizeof(lz_image_header) + i * sizeof(uint32_t)],
+               &offset, sizeof(offset));
+    }
+
+    lz_image_header header = { LZ_IMAGE_MAGIC, uint32_t(chunk_size), nchunks,
+                               uint32_t(input_length) };
+    memcpy(output.data(), &header, sizeof(header));
+    uint32_t end = output.size();
+    memcpy(&output[sizeof(lz_image_header) + nchunks * sizeof(uint32_t)],
+           &end, sizeof(end));
 
     ofstream output_file((std::string(argv[1]) + ".lz").c_str(), ios::out|ios::binary|ios::trunc);
 
     if (output_file) {
-        output_file.write(output, output_length);
+        output_file.write(reinterpret_cast<char*>(output.data()), output.size());
         output_file.close();
     }
     else {
@@ -52,7 +179,6 @@ int main(int argc, char* argv[])
     }
 
     delete[] input;
-    delete[] output;
 
     return 0;
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// LZ4 block decoder, used by lzloader before anything else is set up:
+// there is no libc here besides the memset() and memcpy() lzloader
+// provides.
+//
+// A block is a series of sequences, each a token byte (literal length in
+// the high nibble, match length - 4 in the low nibble; 15 means more
+// length bytes follow, up to a byte which is not 255), the literals, and
+// a little endian 16 bit match offset. The last sequence only has
+// literals.
+
+#include "lz4.h"
+#include <cstddef>
+
+typedef unsigned char u8;
+
+// Compiles to a single unaligned SSE load and store
+static inline void copy16(u8* dst, const u8* src)
+{
+    __builtin_memcpy(dst, src, 16);
+}
+
+static inline bool read_length(const u8*& ip, const u8* iend, size_t& len)
+{
+    unsigned b;
+    do {
+        if (ip == iend) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+int lz4_decompress(const void* input, int length, void* output, int maxout)
+{
+    auto ip = static_cast<const u8*>(input);
+    auto iend = ip + length;
+    auto obase = static_cast<u8*>(output);
+    auto op = obase;
+    auto oend = obase + maxout;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !read_length(ip, iend, lit)) {
+            return 0;
+        }
+        if (lit > size_t(iend - ip) || lit > size_t(oend - op)) {
+            return 0;
+        }
+        // Copy 16 bytes at a time when over-copying stays inside both
+        // buffers; the tail of a block is copied exactly.
+        if (lit + 16 <= size_t(oend - op) && lit + 16 <= size_t(iend - ip)) {
+            auto src = ip;
+            for (auto d = op; d < op + lit; d += 16, src += 16) {
+                copy16(d, src);
+            }
+        } else {
+            __builtin_memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > size_t(op - obase)) {
+            return 0;
+        }
+        size_t len = token & 15;
+        if (len == 15 && !read_length(ip, iend, len)) {
+            return 0;
+        }
+        len += 4;
+        if (len > size_t(oend - op)) {
+            return 0;
+        }
+        const u8* match = op - offset;
+        if (offset >= 16 && len + 16 <= size_t(oend - op)) {
+            // Each 16 byte source block lies before its destination, so
+            // bytes of an overlapping match are copied in order.
+            for (auto d = op; d < op + len; d += 16, match += 16) {
+                copy16(d, match);
+            }
+        } else {
+            for (size_t i = 0; i < len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += len;
+    }
+    return op - obase;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+/**
+  Decompress a block in the LZ4 block format and return the size of the
+  decompressed data, or 0 if the input is corrupted or does not fit in
+  maxout bytes.
+
+  Nothing is written outside [output, output + maxout), so independent
+  blocks can be decompressed into adjacent buffers concurrently. The
+  input buffer and the output buffer can not overlap.
+ */
+int lz4_decompress(const void* input, int length, void* output, int maxout);
+
+/**
+  The compressed kernel image written by the lz tool: the kernel is cut
+  into chunks of chunk_size bytes (the last one may be shorter), each
+  compressed on its own so that they can be decompressed in any order.
+
+  offsets[i] is the offset of chunk i from the start of the header, and
+  offsets[nchunks] the end of the last chunk. A chunk which does not
+  compress is stored as is, and marked with LZ_CHUNK_STORED.
+ */
+struct lz_image_header {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint32_t size;
+    uint32_t offsets[];
+};
+
+#define LZ_IMAGE_MAGIC 0x345a4c4f /* "OLZ4" */
+#define LZ_CHUNK_STORED 0x80000000u
+
+#endif /* LZ4_H */
@@ -4,26 +4,282 @@
  * This work is open source software, licensed under the terms of the
  * BSD license as described in the LICENSE file in the top-level directory.
  */
-#include "fastlz.h"
+#include "lz4.h"
+#include "lzloader.h"
 #include <cstddef>
 #include <stdint.h>
 
 #define BUFFER_OUT (char *)OSV_KERNEL_BASE
 #define MAX_BUFFER 0x1600000
 
-extern char _binary_loader_stripped_elf_lz_start;
+// boot16.S keeps OSv's own boot timestamps after the 88 byte multiboot
+// info; we add the end of decompression (see arch-setup.cc).
+#define MB_INFO 0x1000
+#define MB_TSC_UNCOMPRESS_DONE (MB_INFO + 88 + 16)
+
+extern char _binary_loader_stripped_elf_lz_start[];
 extern char _binary_loader_stripped_elf_lz_end;
 extern char _binary_loader_stripped_elf_lz_size;
 
-// std libraries used by fastlz.
+// std libraries used by the decompressor.
 extern "C" void *memset(void *s, int c, size_t n)
 {
     return __builtin_memset(s, c, n);
 }
 
-extern "C" void uncompress_loader()
+extern "C" void *memcpy(void *dest, const void *src, size_t n)
+{
+    void *ret = dest;
+    asm volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+    return ret;
+}
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (uint64_t(hi) << 32);
+}
+
+static inline void pause()
+{
+    asm volatile ("pause");
+}
+
+// Chunks are handed out to whichever CPU asks first. lzloader is run in
+// place from its file image, so .bss is not cleared for us.
+static unsigned next_chunk;
+static unsigned done_chunks;
+static bool bad_chunk;
+
+static void uncompress_chunks()
+{
+    auto hdr = reinterpret_cast<const lz_image_header*>(_binary_loader_stripped_elf_lz_start);
+    auto base = reinterpret_cast<const char*>(hdr);
+    unsigned i;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < hdr->nchunks) {
+        auto start = hdr->offsets[i] & ~LZ_CHUNK_STORED;
+        auto end = hdr->offsets[i + 1] & ~LZ_CHUNK_STORED;
+        auto out = BUFFER_OUT + i * hdr->chunk_size;
+        auto out_len = hdr->size - i * hdr->chunk_size;
+        if (out_len > hdr->chunk_size) {
+            out_len = hdr->chunk_size;
+        }
+        if (hdr->offsets[i] & LZ_CHUNK_STORED) {
+            memcpy(out, base + start, out_len);
+        } else if (lz4_decompress(base + start, end - start, out, out_len) !=
+                   int(out_len)) {
+            __atomic_store_n(&bad_chunk, true, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&done_chunks, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// With conf-lzloader_smp, the application processors are started early
+// (INIT-SIPI-SIPI to all but ourselves) and join in the decompression.
+// Once done they halt with interrupts disabled, until the kernel starts
+// them again with its own INIT-SIPI-SIPI sequence.
+extern char lz_ap_trampoline[], lz_ap_trampoline_end[];
+char lz_ap_stacks[LZ_MAX_APS][LZ_AP_STACK_SIZE] __attribute__((aligned(16)));
+unsigned lz_ap_count;
+unsigned lz_aps_parked;
+
+extern "C" void lz_ap_main()
+{
+    uncompress_chunks();
+    __atomic_fetch_add(&lz_aps_parked, 1, __ATOMIC_RELEASE);
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t v;
+    asm volatile ("inb %1, %0" : "=a"(v) : "dN"(port));
+    return v;
+}
+
+static inline void outb(uint8_t v, uint16_t port)
+{
+    asm volatile ("outb %0, %1" : : "a"(v), "dN"(port));
+}
+
+// Busy wait using PIT channel 2 in one-shot mode, since the TSC frequency
+// is not known yet.
+static void pit_wait_us(unsigned us)
+{
+    unsigned ticks = us * 1193 / 1000 + 1;
+    while (ticks) {
+        unsigned n = ticks > 0xffff ? 0xffff : ticks;
+        outb((inb(0x61) & ~0x02) | 0x01, 0x61); // gate on, speaker off
+        outb(0xb0, 0x43);                       // channel 2, mode 0
+        outb(n & 0xff, 0x42);
+        outb(n >> 8, 0x42);
+        while (!(inb(0x61) & 0x20)) {
+            pause();
+        }
+        ticks -= n;
+    }
+}
+
+// Nothing is set up to report errors with yet, so write to the first
+// serial port and the VGA text screen, and stop.
+static void __attribute__((noreturn)) fail(const char* msg)
+{
+    auto vga = reinterpret_cast<volatile uint16_t*>(0xb8000);
+    for (unsigned i = 0; msg[i]; i++) {
+        while (!(inb(0x3fd) & 0x20)) {
+            pause();
+        }
+        outb(msg[i], 0x3f8);
+        vga[i] = 0x4f00 | uint8_t(msg[i]);
+    }
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+static bool acpi_checksum_ok(const char* p, unsigned len)
+{
+    uint8_t sum = 0;
+    for (unsigned i = 0; i < len; i++) {
+        sum += p[i];
+    }
+    return sum == 0;
+}
+
+static const char* find_rsdp(uintptr_t start, uintptr_t end)
+{
+    for (auto p = start; p + 20 <= end; p += 16) {
+        auto rsdp = reinterpret_cast<const char*>(p);
+        if (!__builtin_memcmp(rsdp, "RSD PTR ", 8) && acpi_checksum_ok(rsdp, 20)) {
+            return rsdp;
+        }
+    }
+    return nullptr;
+}
+
+// The number of enabled processors the ACPI MADT lists, or 0 without one.
+// Paging is off, so the tables are read at their physical addresses.
+static unsigned count_cpus()
+{
+    auto ebda = uintptr_t(*reinterpret_cast<const uint16_t*>(0x40e)) << 4;
+    auto rsdp = ebda ? find_rsdp(ebda, ebda + 1024) : nullptr;
+    if (!rsdp) {
+        rsdp = find_rsdp(0xe0000, 0x100000);
+    }
+    if (!rsdp) {
+        return 0;
+    }
+    auto rsdt = reinterpret_cast<const char*>(
+            *reinterpret_cast<const uint32_t*>(rsdp + 16));
+    auto rsdt_len = *reinterpret_cast<const uint32_t*>(rsdt + 4);
+    for (unsigned off = 36; off + 4 <= rsdt_len; off += 4) {
+        auto madt = reinterpret_cast<const char*>(
+                *reinterpret_cast<const uint32_t*>(rsdt + off));
+        if (__builtin_memcmp(madt, "APIC", 4)) {
+            continue;
+        }
+        auto madt_len = *reinterpret_cast<const uint32_t*>(madt + 4);
+        unsigned cpus = 0;
+        for (unsigned e = 44; e + 2 <= madt_len && madt[e + 1]; e += uint8_t(madt[e + 1])) {
+            // Processor local APIC and local x2APIC entries, with their
+            // "enabled" flag
+            if ((madt[e] == 0 && *reinterpret_cast<const uint32_t*>(madt + e + 4) & 1) ||
+                (madt[e] == 9 && *reinterpret_cast<const uint32_t*>(madt + e + 8) & 1)) {
+                cpus++;
+            }
+        }
+        return cpus;
+    }
+    return 0;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t& a, uint32_t& d)
 {
-    fastlz_decompress(&_binary_loader_stripped_elf_lz_start,
-            (size_t) &_binary_loader_stripped_elf_lz_size,
-            BUFFER_OUT, MAX_BUFFER);
+    uint32_t b, c;
+    asm volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdmsr(uint32_t index)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(index));
+    return lo | (uint64_t(hi) << 32);
+}
+
+// Returns how many APs were started
+static unsigned start_aps()
+{
+    uint32_t a, d;
+    cpuid(1, a, d);
+    if (!(d & (1 << 9))) {
+        return 0;
+    }
+    auto apic_base = rdmsr(0x1b);
+    if (!(apic_base & (1 << 11))) {
+        return 0;
+    }
+    // Without knowing how many APs will show up, we could not tell when
+    // they are all out of the way
+    auto cpus = count_cpus();
+    if (cpus < 2) {
+        return 0;
+    }
+    auto apic = reinterpret_cast<volatile uint32_t*>(uint32_t(apic_base) & ~0xfffu);
+    auto ipi = [apic] (uint32_t icr) {
+        apic[0x310 / 4] = 0;
+        apic[0x300 / 4] = icr;
+        while (apic[0x300 / 4] & (1 << 12)) {
+            pause();
+        }
+    };
+
+    memcpy(reinterpret_cast<void*>(LZ_AP_TRAMPOLINE), lz_ap_trampoline,
+           lz_ap_trampoline_end - lz_ap_trampoline);
+    // All excluding self, level assert: INIT, then SIPI twice
+    ipi(0xc4500);
+    pit_wait_us(10000);
+    ipi(0xc4600 | (LZ_AP_TRAMPOLINE >> 12));
+    pit_wait_us(200);
+    ipi(0xc4600 | (LZ_AP_TRAMPOLINE >> 12));
+    pit_wait_us(200);
+    return cpus - 1;
+}
+
+extern "C" void lz_uncompress_loader()
+{
+    next_chunk = 0;
+    done_chunks = 0;
+    bad_chunk = false;
+    lz_ap_count = 0;
+    lz_aps_parked = 0;
+
+    auto hdr = reinterpret_cast<const lz_image_header*>(_binary_loader_stripped_elf_lz_start);
+    if (hdr->magic != LZ_IMAGE_MAGIC || hdr->size > MAX_BUFFER) {
+        fail("lzloader: bad kernel image header");
+    }
+
+    unsigned aps = CONF_lzloader_smp ? start_aps() : 0;
+    uncompress_chunks();
+    if (aps) {
+        // Wait for chunks still being decompressed, and for every AP to be
+        // out of the way (off the trampoline and its stack) before the
+        // kernel takes over. An AP which doesn't show up in time, say its
+        // vCPU is not being run, is given up on.
+        while (__atomic_load_n(&done_chunks, __ATOMIC_ACQUIRE) != hdr->nchunks) {
+            pause();
+        }
+        for (unsigned waited = 0;
+             __atomic_load_n(&lz_aps_parked, __ATOMIC_ACQUIRE) < aps &&
+             waited < LZ_AP_TIMEOUT_US; waited += 100) {
+            pit_wait_us(100);
+        }
+    }
+    if (__atomic_load_n(&bad_chunk, __ATOMIC_RELAXED)) {
+        fail("lzloader: corrupt kernel image");
+    }
+
+    *reinterpret_cast<volatile uint64_t*>(MB_TSC_UNCOMPRESS_DONE) = rdtsc();
 }
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef LZLOADER_H
+#define LZLOADER_H
+
+// Shared by lzloader.cc and lzentry.S
+
+// The application processor trampoline is copied here; it must be page
+// aligned, below 1MB, and out of the way of boot16.S (mb_info, e820 data,
+// the boot sector and its stack).
+#define LZ_AP_TRAMPOLINE 0x4000
+
+#define LZ_MAX_APS 63
+#define LZ_AP_STACK_SHIFT 12
+#define LZ_AP_STACK_SIZE (1 << LZ_AP_STACK_SHIFT)
+// How long to wait for the APs to park once decompression is done
+#define LZ_AP_TIMEOUT_US 1000000
+
+#endif
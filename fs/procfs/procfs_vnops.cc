@@ -26,6 +26,9 @@
 
 #include "cpuid.hh"
 
+// Statistics of the object caches of ZFS's kmem compatibility layer
+extern std::string kmem_cache_stats();
+
 namespace procfs {
 
 using namespace std;
@@ -350,6 +353,20 @@ static std::string procfs_mounts()
 	return rstr;
 }
 
+static std::string procfs_malloc_pools()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "%8s %8s %8s %12s %12s %8s\n",
+                 "size", "slab_kb", "slabs", "in_use", "allocs", "used%");
+    for (auto& p : memory::stats::pools()) {
+        auto bytes = p.slabs * p.slab_size;
+        osv::fprintf(os, "%8lu %8lu %8lu %12lu %12lu %8lu\n",
+                     p.object_size, p.slab_size / 1024, p.slabs, p.in_use,
+                     p.allocs, bytes ? p.in_use * p.object_size * 100 / bytes : 0);
+    }
+    return os.str();
+}
+
 static int
 procfs_mount(mount* mp, const char *dev, int flags, const void* data)
 {
@@ -357,6 +374,7 @@ procfs_mount(mount* mp, const char *dev, int flags, const void* data)
 
     auto self = make_shared<proc_dir_node>(inode_count++);
     self->add("maps", inode_count++, mmu::procfs_maps);
+    self->add("smaps", inode_count++, mmu::procfs_smaps);
     self->add("stat", inode_count++, procfs_stats);
 
     auto* root = new proc_dir_node(vp->v_ino);
@@ -364,6 +382,8 @@ procfs_mount(mount* mp, const char *dev, int flags, const void* data)
     root->add("0", self); // our standard pid
     root->add("mounts", inode_count++, procfs_mounts);
     root->add("cpuinfo", inode_count++, [] { return processor::features_str(); });
+    root->add("kmem_caches", inode_count++, kmem_cache_stats);
+    root->add("malloc_pools", inode_count++, procfs_malloc_pools);
 
     vp->v_data = static_cast<void*>(root);
 
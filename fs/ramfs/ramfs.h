@@ -52,11 +52,29 @@ struct ramfs_node {
 	char	*rn_name;	/* name (null-terminated) */
 	size_t	 rn_namelen;	/* length of name not including terminator */
 	size_t	 rn_size;	/* file size */
-	char	*rn_buf;	/* buffer to the file data */
-	size_t	 rn_bufsize;	/* allocated buffer size */
+	void	***rn_blocks;	/* page table of the file data */
+	size_t	 rn_nblocks;	/* number of entries in rn_blocks */
+	uint64_t rn_ino;	/* inode number */
+	int	 rn_mapped;	/* pages were given to the page cache */
 };
 
+/*
+ * File data is kept in pages, found through a two level page table: each
+ * block of the table holds RAMFS_BLOCK_PAGES page pointers. Appending to
+ * a file never moves its data, and only the small array of blocks is ever
+ * reallocated. Missing blocks and pages are holes, which read as zeros.
+ */
+#define RAMFS_BLOCK_PAGES	(PAGE_SIZE / sizeof(void *))
+
+/*
+ * A page pointer tagged with RAMFS_PAGE_IMAGE refers to file data inside
+ * the kernel image (the bootfs), which the file shares and never frees.
+ * Such a page is replaced by a private copy on the first write to it.
+ */
+#define RAMFS_PAGE_IMAGE	((uintptr_t)1)
+
 struct ramfs_node *ramfs_allocate_node(const char *name, int type);
 void ramfs_free_node(struct ramfs_node *node);
+int ramfs_set_image_data(struct vnode *vp, const char *data, size_t size);
 
 #endif /* !_RAMFS_H */
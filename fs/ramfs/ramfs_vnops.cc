@@ -39,17 +39,222 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/file.h>
 #include <osv/mount.h>
+#include <osv/mempool.hh>
+#include <osv/pagecache.hh>
 
 #include "ramfs.h"
 
 
 static mutex_t ramfs_lock = MUTEX_INITIALIZER;
 static uint64_t inode_count = 1; /* inode 0 is reserved to root */
+static char ramfs_zero_page[PAGE_SIZE];
+
+static inline char *
+ramfs_page_addr(void *page)
+{
+	return (char *)((uintptr_t)page & ~RAMFS_PAGE_IMAGE);
+}
+
+static inline bool
+ramfs_image_page(void *page)
+{
+	return (uintptr_t)page & RAMFS_PAGE_IMAGE;
+}
+
+static char *
+ramfs_get_page(struct ramfs_node *np, size_t idx)
+{
+	size_t blk = idx / RAMFS_BLOCK_PAGES;
+
+	if (blk >= np->rn_nblocks || np->rn_blocks[blk] == NULL)
+		return NULL;
+	return ramfs_page_addr(np->rn_blocks[blk][idx % RAMFS_BLOCK_PAGES]);
+}
+
+/*
+ * Get the slot for the page at index idx, growing the page table as needed.
+ */
+static void **
+ramfs_page_slot(struct ramfs_node *np, size_t idx)
+{
+	size_t blk = idx / RAMFS_BLOCK_PAGES;
+	size_t nblocks;
+	void ***blocks;
+	void **pages;
+
+	if (blk >= np->rn_nblocks) {
+		nblocks = MAX(np->rn_nblocks * 2, blk + 1);
+		blocks = (void ***)realloc(np->rn_blocks,
+		    nblocks * sizeof(void **));
+		if (blocks == NULL)
+			return NULL;
+		memset(blocks + np->rn_nblocks, 0,
+		    (nblocks - np->rn_nblocks) * sizeof(void **));
+		np->rn_blocks = blocks;
+		np->rn_nblocks = nblocks;
+	}
+	pages = np->rn_blocks[blk];
+	if (pages == NULL) {
+		pages = (void **)calloc(RAMFS_BLOCK_PAGES, sizeof(void *));
+		if (pages == NULL)
+			return NULL;
+		np->rn_blocks[blk] = pages;
+	}
+	return &pages[idx % RAMFS_BLOCK_PAGES];
+}
+
+/*
+ * Get the page at index idx, allocating a zeroed one if it is a hole.
+ */
+static char *
+ramfs_fill_page(struct ramfs_node *np, size_t idx)
+{
+	void **slot;
+	void *page;
+
+	slot = ramfs_page_slot(np, idx);
+	if (slot == NULL)
+		return NULL;
+	if (*slot == NULL) {
+		page = memory::alloc_page();
+		if (page == NULL)
+			return NULL;
+		memset(page, 0, PAGE_SIZE);
+		*slot = page;
+	}
+	return ramfs_page_addr(*slot);
+}
+
+static void
+ramfs_free_page(struct ramfs_node *np, size_t idx, void *page)
+{
+	pagecache::hashkey key;
+	bool image = ramfs_image_page(page);
+
+	page = ramfs_page_addr(page);
+	if (np->rn_mapped) {
+		/* What vn_stat() reports: ramfs has no va_fsid */
+		key.dev = 0;
+		key.ino = np->rn_ino;
+		key.offset = (off_t)idx * PAGE_SIZE;
+		if (pagecache::unmap_ram_page(&key, page, !image))
+			return;	/* lent out, the page cache frees it */
+	}
+	if (!image)
+		memory::free_page(page);
+}
+
+/*
+ * Get the page at index idx for writing: like ramfs_fill_page(), but a page
+ * shared with the kernel image is first replaced by a copy.
+ */
+static char *
+ramfs_write_page(struct ramfs_node *np, size_t idx)
+{
+	void **slot;
+	void *page;
+
+	slot = ramfs_page_slot(np, idx);
+	if (slot == NULL)
+		return NULL;
+	if (*slot == NULL || !ramfs_image_page(*slot))
+		return ramfs_fill_page(np, idx);
+
+	page = memory::alloc_page();
+	if (page == NULL)
+		return NULL;
+	memcpy(page, ramfs_page_addr(*slot), PAGE_SIZE);
+	ramfs_free_page(np, idx, *slot);
+	*slot = page;
+	return (char *)page;
+}
+
+/*
+ * Free the pages in [first, end), making a hole.
+ */
+static void
+ramfs_free_pages(struct ramfs_node *np, size_t first, size_t end)
+{
+	size_t blk, i, lo, hi;
+	void **pages;
+
+	for (blk = first / RAMFS_BLOCK_PAGES; blk < np->rn_nblocks &&
+	     blk * RAMFS_BLOCK_PAGES < end; blk++) {
+		pages = np->rn_blocks[blk];
+		if (pages == NULL)
+			continue;
+		lo = MAX(first, blk * RAMFS_BLOCK_PAGES) - blk * RAMFS_BLOCK_PAGES;
+		hi = MIN(end - blk * RAMFS_BLOCK_PAGES, RAMFS_BLOCK_PAGES);
+		for (i = lo; i < hi; i++) {
+			if (pages[i] != NULL) {
+				ramfs_free_page(np, blk * RAMFS_BLOCK_PAGES + i,
+				    pages[i]);
+				pages[i] = NULL;
+			}
+		}
+		if (lo == 0 && hi == RAMFS_BLOCK_PAGES) {
+			free(pages);
+			np->rn_blocks[blk] = NULL;
+		}
+	}
+	if (first == 0 && end == SIZE_MAX) {
+		free(np->rn_blocks);
+		np->rn_blocks = NULL;
+		np->rn_nblocks = 0;
+	}
+}
+
+/*
+ * Zero len bytes of the file from off, within a single page.
+ */
+static int
+ramfs_zero_range(struct ramfs_node *np, off_t off, size_t len)
+{
+	char *page;
+
+	if (ramfs_get_page(np, off / PAGE_SIZE) == NULL)
+		return 0;
+	page = ramfs_write_page(np, off / PAGE_SIZE);
+	if (page == NULL)
+		return ENOSPC;
+	memset(page + (off & PAGE_MASK), 0, len);
+	return 0;
+}
+
+/*
+ * Make the regular file vp share size bytes of data with the kernel image,
+ * instead of holding a copy. The data must be page aligned, and the image
+ * must hold zeros past its end up to the end of the last page.
+ */
+int
+ramfs_set_image_data(struct vnode *vp, const char *data, size_t size)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	size_t idx;
+	void **slot;
+
+	assert(((uintptr_t)data & PAGE_MASK) == 0);
+	if (vp->v_type != VREG)
+		return EINVAL;
+
+	ramfs_free_pages(np, 0, SIZE_MAX);
+	for (idx = 0; idx < round_page(size) / PAGE_SIZE; idx++) {
+		slot = ramfs_page_slot(np, idx);
+		if (slot == NULL)
+			return ENOMEM;
+		*slot = (void *)((uintptr_t)(data + idx * PAGE_SIZE) |
+		    RAMFS_PAGE_IMAGE);
+	}
+	np->rn_size = size;
+	vp->v_size = size;
+	return 0;
+}
 
 struct ramfs_node *
 ramfs_allocate_node(const char *name, int type)
@@ -75,8 +280,7 @@ ramfs_allocate_node(const char *name, int type)
 void
 ramfs_free_node(struct ramfs_node *np)
 {
-	if (np->rn_buf != NULL)
-		free(np->rn_buf);
+	ramfs_free_pages(np, 0, SIZE_MAX);
 
 	free(np->rn_name);
 	free(np);
@@ -93,6 +297,8 @@ ramfs_add_node(struct ramfs_node *dnp, char *name, int type)
 
 	mutex_lock(&ramfs_lock);
 
+	np->rn_ino = inode_count++;
+
 	/* Link to the directory list */
 	if (dnp->rn_child == NULL) {
 		dnp->rn_child = np;
@@ -187,7 +393,7 @@ ramfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
 		mutex_unlock(&ramfs_lock);
 		return ENOENT;
 	}
-	if (vget(dvp->v_mount, inode_count++, &vp)) {
+	if (vget(dvp->v_mount, np->rn_ino, &vp)) {
 		/* found in cache */
 		*vpp = vp;
 		mutex_unlock(&ramfs_lock);
@@ -241,35 +447,27 @@ ramfs_remove(struct vnode *dvp, struct vnode *vp, char *name)
 	return ramfs_remove_node((ramfs_node*)dvp->v_data, (ramfs_node*)vp->v_data);
 }
 
-/* Truncate file */
+/*
+ * Truncate file. Growing a file just makes a hole at its end; everything
+ * beyond the end of file is kept zeroed, so it can grow again.
+ */
 static int
 ramfs_truncate(struct vnode *vp, off_t length)
 {
 	struct ramfs_node *np;
-	void *new_buf;
-	size_t new_size;
+	int error;
 
 	DPRINTF(("truncate %s length=%d\n", vp->v_path, length));
 	np = (ramfs_node*)vp->v_data;
 
-	if (length == 0) {
-		if (np->rn_buf != NULL) {
-			free(np->rn_buf);
-			np->rn_buf = NULL;
-			np->rn_bufsize = 0;
-		}
-	} else if (size_t(length) > np->rn_bufsize) {
-		// XXX: this could use a page level allocator
-		new_size = round_page(length);
-		new_buf = malloc(new_size);
-		if (!new_buf)
-			return EIO;
-		if (np->rn_size != 0) {
-			memcpy(new_buf, np->rn_buf, vp->v_size);
-			free(np->rn_buf);
-		}
-		np->rn_buf = (char*)new_buf;
-		np->rn_bufsize = new_size;
+	if (length < 0)
+		return EINVAL;
+	ramfs_free_pages(np, round_page(length) / PAGE_SIZE, SIZE_MAX);
+	if (length & PAGE_MASK) {
+		error = ramfs_zero_range(np, length,
+		    PAGE_SIZE - (length & PAGE_MASK));
+		if (error)
+			return error;
 	}
 	np->rn_size = length;
 	vp->v_size = length;
@@ -298,7 +496,9 @@ static int
 ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
-	size_t len;
+	size_t len, n;
+	char *page;
+	int error = 0;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -318,13 +518,26 @@ ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 	else
 		len = uio->uio_resid;
 
-	return uiomove(np->rn_buf + uio->uio_offset, len, uio);
+	while (len > 0 && error == 0) {
+		n = MIN(len, (size_t)(PAGE_SIZE - (uio->uio_offset & PAGE_MASK)));
+		page = ramfs_get_page(np, uio->uio_offset / PAGE_SIZE);
+		if (page != NULL)
+			error = uiomove(page + (uio->uio_offset & PAGE_MASK),
+			    n, uio);
+		else
+			error = uiomove(ramfs_zero_page, n, uio);
+		len -= n;
+	}
+	return error;
 }
 
 static int
 ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	size_t n;
+	char *page;
+	int error = 0;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -339,26 +552,22 @@ ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 	if (ioflag & IO_APPEND)
 		uio->uio_offset = np->rn_size;
 
-	if (size_t(uio->uio_offset + uio->uio_resid) > (size_t)vp->v_size) {
-		/* Expand the file size before writing to it */
-		off_t end_pos = uio->uio_offset + uio->uio_resid;
-		if (end_pos > (off_t)np->rn_bufsize) {
-			// XXX: this could use a page level allocator
-			size_t new_size = round_page(end_pos);
-			void *new_buf = malloc(new_size);
-			if (!new_buf)
-				return EIO;
-			if (np->rn_size != 0) {
-				memcpy(new_buf, np->rn_buf, vp->v_size);
-				free(np->rn_buf);
-			}
-			np->rn_buf = (char*)new_buf;
-			np->rn_bufsize = new_size;
+	while (uio->uio_resid > 0 && error == 0) {
+		n = MIN((size_t)uio->uio_resid,
+		    (size_t)(PAGE_SIZE - (uio->uio_offset & PAGE_MASK)));
+		page = ramfs_write_page(np, uio->uio_offset / PAGE_SIZE);
+		if (page == NULL) {
+			error = ENOSPC;
+			break;
 		}
-		np->rn_size = end_pos;
-		vp->v_size = end_pos;
+		error = uiomove(page + (uio->uio_offset & PAGE_MASK), n, uio);
+	}
+	/* Expand the file size to cover what was written */
+	if (uio->uio_offset > (off_t)np->rn_size) {
+		np->rn_size = uio->uio_offset;
+		vp->v_size = uio->uio_offset;
 	}
-	return uiomove(np->rn_buf + uio->uio_offset, uio->uio_resid, uio);
+	return error;
 }
 
 static int
@@ -388,14 +597,22 @@ ramfs_rename(struct vnode *dvp1, struct vnode *vp1, char *name1,
 			return ENOMEM;
 
 		if (vp1->v_type == VREG) {
-			/* Copy file data */
-			np->rn_buf = old_np->rn_buf;
+			/*
+			 * Move file data. The node keeps its inode number,
+			 * which the page cache knows its pages by, so the
+			 * vnode now stands for the new node.
+			 */
+			np->rn_blocks = old_np->rn_blocks;
+			np->rn_nblocks = old_np->rn_nblocks;
 			np->rn_size = old_np->rn_size;
-			np->rn_bufsize = old_np->rn_bufsize;
-			old_np->rn_buf = NULL;
+			np->rn_ino = old_np->rn_ino;
+			np->rn_mapped = old_np->rn_mapped;
+			old_np->rn_blocks = NULL;
+			old_np->rn_nblocks = 0;
+			vp1->v_data = np;
 		}
 		/* Remove source file */
-		ramfs_remove_node((ramfs_node*)dvp1->v_data, (ramfs_node*)vp1->v_data);
+		ramfs_remove_node((ramfs_node*)dvp1->v_data, old_np);
 	}
 	return 0;
 }
@@ -454,6 +671,81 @@ ramfs_init(void)
 	return 0;
 }
 
+/*
+ * Allocate the pages backing a range of the file, or with
+ * FALLOC_FL_PUNCH_HOLE, free them.
+ */
+static int
+ramfs_fallocate(struct vnode *vp, int mode, loff_t offset, loff_t len)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	off_t end = offset + len;
+	size_t idx;
+	int error;
+
+	if (vp->v_type != VREG)
+		return ENODEV;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return EOPNOTSUPP;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		if ((offset & PAGE_MASK) != 0) {
+			off_t edge = MIN(end, (off_t)round_page(offset));
+			error = ramfs_zero_range(np, offset, edge - offset);
+			if (error)
+				return error;
+			offset = edge;
+		}
+		if ((end & PAGE_MASK) != 0 && end > offset) {
+			error = ramfs_zero_range(np, end & ~PAGE_MASK,
+			    end & PAGE_MASK);
+			if (error)
+				return error;
+			end &= ~PAGE_MASK;
+		}
+		if (end > offset)
+			ramfs_free_pages(np, offset / PAGE_SIZE, end / PAGE_SIZE);
+		return 0;
+	}
+
+	for (idx = offset / PAGE_SIZE; idx < (size_t)round_page(end) / PAGE_SIZE;
+	     idx++) {
+		if (ramfs_fill_page(np, idx) == NULL)
+			return ENOSPC;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > (off_t)np->rn_size) {
+		np->rn_size = end;
+		vp->v_size = end;
+	}
+	return 0;
+}
+
+/*
+ * Give a page of the file to the page cache, to be mapped as is. The page
+ * cache passes its key in the iovec; holes are left alone, and mapped with
+ * its zero page.
+ */
+static int
+ramfs_cache(struct vnode *vp, struct file *fp, struct uio *uio)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	char *page;
+
+	if (vp->v_type != VREG)
+		return 0;
+	if (uio->uio_offset < 0 || uio->uio_offset >= (off_t)np->rn_size)
+		return 0;
+
+	page = ramfs_get_page(np, uio->uio_offset / PAGE_SIZE);
+	if (page == NULL)
+		return 0;
+	np->rn_mapped = 1;
+	pagecache::map_ram_page((pagecache::hashkey *)uio->uio_iov->iov_base,
+	    page);
+	uio->uio_resid = 0;
+	return 0;
+}
+
 static int
 ramfs_getattr(struct vnode *vnode, struct vattr *attr)
 {
@@ -470,7 +762,6 @@ ramfs_getattr(struct vnode *vnode, struct vattr *attr)
 #define ramfs_setattr	((vnop_setattr_t)vop_eperm)
 #define ramfs_inactive	((vnop_inactive_t)vop_nullop)
 #define ramfs_link	((vnop_link_t)vop_eperm)
-#define ramfs_fallocate ((vnop_fallocate_t)vop_nullop)
 #define ramfs_readlink	((vnop_readlink_t)vop_nullop)
 #define ramfs_symlink	((vnop_symlink_t)vop_nullop)
 
@@ -497,7 +788,7 @@ struct vnops ramfs_vnops = {
 	ramfs_inactive,		/* inactive */
 	ramfs_truncate,		/* truncate */
 	ramfs_link,		/* link */
-	(vnop_cache_t) nullptr, /* arc */
+	ramfs_cache,		/* arc */
 	ramfs_fallocate,	/* fallocate */
 	ramfs_readlink,		/* read link */
 	ramfs_symlink,		/* symbolic link */
@@ -15,6 +15,7 @@
 #include <osv/mutex.h>
 #include <osv/rcu.hh>
 #include <boost/range/algorithm/find.hpp>
+#include <algorithm>
 
 #include <bsd/sys/sys/queue.h>
 
@@ -173,8 +174,26 @@ void file::wake_epoll(int events)
         if (!f_epolls) {
             return;
         }
-        for (auto&& ep : *f_epolls) {
-            epoll_wake(ep);
+        // Wake a single exclusive registration per event. If one is already
+        // in flight (e.g. woken by the file's net channel), it will see this
+        // event as well, so hand it to that one rather than to another.
+        auto exclusive = f_epolls->end();
+        for (auto i = f_epolls->begin(); i != f_epolls->end(); ++i) {
+            if (!i->exclusive) {
+                epoll_wake(*i);
+            } else if (exclusive == f_epolls->end() ||
+                    (!epoll_in_flight(*exclusive) && epoll_in_flight(*i))) {
+                exclusive = i;
+            }
+        }
+        if (exclusive != f_epolls->end()) {
+            bool fresh = !epoll_in_flight(*exclusive);
+            epoll_wake(*exclusive);
+            // Move a newly woken exclusive registration to the back, so the
+            // next event goes to another one.
+            if (fresh) {
+                std::rotate(exclusive, exclusive + 1, f_epolls->end());
+            }
         }
     }
 }
@@ -241,6 +260,11 @@ void file::epoll_add(epoll_ptr ep)
     }
 }
 
+int file::fadvise(off_t offset, off_t len, int advice)
+{
+    return ESPIPE;
+}
+
 void file::epoll_del(epoll_ptr ep)
 {
     WITH_LOCK(f_lock) {
@@ -34,9 +34,67 @@ destroy_bio(struct bio *bio)
 	delete bio;
 }
 
+/*
+ * Per-thread plug state: the nesting depth, and the distinct notifications
+ * deferred since the outermost bio_plug().  A plugged thread rarely touches
+ * more than a couple of devices, so a short array is enough; when it is
+ * full, bio_plug_defer() fails and the driver notifies right away.
+ */
+struct bio_plug_entry {
+	void (*flush)(void *);
+	void *arg;
+};
+
+#define	BIO_PLUG_MAX	8
+
+static __thread unsigned bio_plug_depth;
+static __thread unsigned bio_plug_nr;
+static __thread struct bio_plug_entry bio_plug_list[BIO_PLUG_MAX];
+
+static void
+bio_plug_flush(void)
+{
+	while (bio_plug_nr > 0) {
+		auto e = bio_plug_list[--bio_plug_nr];
+		e.flush(e.arg);
+	}
+}
+
+void
+bio_plug(void)
+{
+	bio_plug_depth++;
+}
+
+void
+bio_unplug(void)
+{
+	assert(bio_plug_depth > 0);
+	if (--bio_plug_depth == 0)
+		bio_plug_flush();
+}
+
+bool
+bio_plug_defer(void (*flush)(void *), void *arg)
+{
+	if (!bio_plug_depth)
+		return false;
+	for (unsigned i = 0; i < bio_plug_nr; i++) {
+		if (bio_plug_list[i].flush == flush && bio_plug_list[i].arg == arg)
+			return true;
+	}
+	if (bio_plug_nr == BIO_PLUG_MAX)
+		return false;
+	bio_plug_list[bio_plug_nr++] = { flush, arg };
+	return true;
+}
+
 int
 bio_wait(struct bio *bio)
 {
+	/* Waiting on a request we have not told the device about yet would hang */
+	bio_plug_flush();
+
 	SCOPE_LOCK(bio->bio_mutex);
 	while (!(bio->bio_flags & BIO_DONE)) {
 		bio->bio_wait.wait(bio->bio_mutex);
@@ -117,6 +175,7 @@ void multiplex_strategy(struct bio *bio)
 	// finished, and when it drops its refcount to 0, we consider the main bio finished.
 	refcount_init(&bio->bio_refcnt, (len / dev->max_io_size) + !!(len % dev->max_io_size));
 
+	bio_plug();
 	while (len > 0) {
 		uint64_t req_size = MIN(len, dev->max_io_size);
 		struct bio *b = alloc_bio();
@@ -136,4 +195,5 @@ void multiplex_strategy(struct bio *bio)
 		offset += req_size;
 		len -= req_size;
 	}
+	bio_unplug();
 }
@@ -74,9 +74,10 @@
 #include "libc/libc.hh"
 
 #include <mntent.h>
-#include <sys/mman.h>
 
 #include <osv/clock.hh>
+#include <osv/socket.hh>
+#include <osv/vfs_file.hh>
 #include <api/utime.h>
 #include <chrono>
 
@@ -1779,6 +1780,53 @@ int fallocate(int fd, int mode, loff_t offset, loff_t len)
 
 LFS64(fallocate);
 
+TRACEPOINT(trace_vfs_fadvise, "%d 0x%x 0x%x %d", int, off_t, off_t, int);
+TRACEPOINT(trace_vfs_fadvise_ret, "");
+TRACEPOINT(trace_vfs_fadvise_err, "%d", int);
+
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    struct file *fp;
+    int error;
+
+    trace_vfs_fadvise(fd, offset, len, advice);
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_NOREUSE:
+    case POSIX_FADV_WILLNEED:
+    case POSIX_FADV_DONTNEED:
+        break;
+    default:
+        error = EINVAL;
+        goto out_err;
+    }
+    if (offset < 0 || len < 0) {
+        error = EINVAL;
+        goto out_err;
+    }
+
+    error = fget(fd, &fp);
+    if (error)
+        goto out_err;
+
+    error = fp->fadvise(offset, len, advice);
+    fdrop(fp);
+
+    if (error)
+        goto out_err;
+    trace_vfs_fadvise_ret();
+    return 0;
+
+    out_err:
+    // posix_fadvise() returns the error rather than setting errno
+    trace_vfs_fadvise_err(error);
+    return error;
+}
+
+LFS64(posix_fadvise);
+
 TRACEPOINT(trace_vfs_utimes, "\"%s\"", const char*);
 TRACEPOINT(trace_vfs_utimes_ret, "");
 TRACEPOINT(trace_vfs_utimes_err, "%d", int);
@@ -1999,6 +2047,40 @@ int lchown(const char *path, uid_t owner, gid_t group)
 }
 
 
+// Copy through a bounce buffer, for when the data can't be sent straight
+// from the page cache.
+static int sendfile_copy(file* in_fp, file* out_fp, off_t offset, size_t count, size_t* sent)
+{
+    constexpr size_t bufsize = 64 * 1024;
+    std::unique_ptr<char[]> buf(new char[std::min(count, bufsize)]);
+    *sent = 0;
+    while (*sent < count) {
+        struct iovec iov = { buf.get(), std::min(count - *sent, bufsize) };
+        size_t bytes;
+        auto error = sys_read(in_fp, &iov, 1, offset + *sent, &bytes);
+        if (error || bytes == 0) {
+            return *sent ? 0 : error;
+        }
+        size_t written = 0;
+        while (written < bytes) {
+            struct iovec wiov = { buf.get() + written, bytes - written };
+            size_t n;
+            error = sys_write(out_fp, &wiov, 1, -1, &n);
+            if (error || n == 0) {
+                *sent += written;
+                return *sent ? 0 : error;
+            }
+            written += n;
+        }
+        *sent += written;
+    }
+    return 0;
+}
+
+TRACEPOINT(trace_vfs_sendfile, "%d %d 0x%x 0x%x", int, int, off_t, size_t);
+TRACEPOINT(trace_vfs_sendfile_ret, "0x%x %s", ssize_t, const char*);
+TRACEPOINT(trace_vfs_sendfile_err, "%d", int);
+
 extern "C"
 int sendfile(int out_fd, int in_fd, off_t *_offset, size_t count)
 {
@@ -2038,29 +2120,44 @@ int sendfile(int out_fd, int in_fd, off_t *_offset, size_t count)
         /* if _offset is nullptr, we need to read from the present position of in_fd */
         offset = lseek(in_fd, 0, SEEK_CUR);
     }
+    trace_vfs_sendfile(out_fd, in_fd, offset, count);
 
-    size_t bytes_to_mmap = count + (offset % mmu::page_size);
-    off_t offset_for_mmap =  align_down(offset, (off_t)mmu::page_size);
-
-    char *src = static_cast<char *>(mmap(nullptr, bytes_to_mmap, PROT_READ, MAP_SHARED, in_fd, offset_for_mmap));
-
-    if (src == MAP_FAILED) {
-        return -1;
+    struct stat st;
+    auto error = in_fp->stat(&st);
+    if (error) {
+        trace_vfs_sendfile_err(error);
+        return libc_error(error);
+    }
+    // Only a regular file's size says where its data ends; a device's
+    // (st_size 0) doesn't
+    if (S_ISREG(st.st_mode)) {
+        count = offset >= st.st_size ? 0 : std::min(count, size_t(st.st_size - offset));
     }
 
-    auto ret = write(out_fd, src + (offset % PAGESIZE), count);
-
-    if (ret < 0) {
-        return libc_error(errno);
-    } else if(_offset == nullptr) {
-        lseek(in_fd, ret, SEEK_CUR);
+    // Files backed by the page cache can be sent to a socket without
+    // copying: the socket borrows the cached pages until the data is acked.
+    size_t sent;
+    auto sock = dynamic_cast<socket_file*>(out_fp);
+    auto vp = in_fp->f_dentry->d_vnode;
+    bool zero_copy = sock && vp->v_type == VREG && vp->v_op->vop_cache;
+    if (zero_copy) {
+        error = sock->sendfile(static_cast<vfs_file*>(in_fp), offset, count, sent);
     } else {
-        *_offset += ret;
+        error = sendfile_copy(in_fp, out_fp, offset, count, &sent);
+    }
+    if (error) {
+        trace_vfs_sendfile_err(error);
+        return libc_error(error);
     }
 
-    assert(munmap(src, count) == 0);
+    if (_offset == nullptr) {
+        lseek(in_fd, sent, SEEK_CUR);
+    } else {
+        *_offset += sent;
+    }
 
-    return ret;
+    trace_vfs_sendfile_ret(sent, zero_copy ? "zero-copy" : "copy");
+    return sent;
 }
 
 LFS64(sendfile);
@@ -2100,16 +2197,26 @@ fs_debug(struct task *t, struct msg *msg)
 }
 #endif
 
-#define BOOTFS_PATH_MAX 112
+#define BOOTFS_PATH_MAX 111
+
+enum { BOOTFS_FILE = 0, BOOTFS_DIR = 1 };
 
+// Written by scripts/mkbootfs.py: directories come first, parents before
+// their children, then the files, whose data is page aligned in the image.
 struct bootfs_metadata {
     uint64_t size;
     uint64_t offset;
+    uint8_t type;
     char name[BOOTFS_PATH_MAX];
 };
 
 extern char bootfs_start;
 
+int ramfs_set_image_data(struct vnode *vp, const char *data, size_t size);
+
+// The files are created on the ramfs root, but their data is not copied:
+// the ramfs pages point into the kernel image, and are only copied when
+// the file is written to.
 void unpack_bootfs(void)
 {
     struct bootfs_metadata *md = (struct bootfs_metadata *)&bootfs_start;
@@ -2118,15 +2225,12 @@ void unpack_bootfs(void)
     for (i = 0; md[i].name[0]; i++) {
         int ret;
 
-        // mkdir() directories needed for this path name, as necessary
-        char tmp[BOOTFS_PATH_MAX];
-        strncpy(tmp, md[i].name, BOOTFS_PATH_MAX);
-        for (char *p = tmp; *p; ++p) {
-            if (*p == '/') {
-                *p = '\0';
-                mkdir(tmp, 0666);  // silently ignore errors and existing dirs
-                *p = '/';
+        if (md[i].type == BOOTFS_DIR) {
+            if (mkdir(md[i].name, 0666) < 0 && errno != EEXIST) {
+                kprintf("couldn't create %s: %d\n", md[i].name, errno);
+                sys_panic("unpack_bootfs failed");
             }
+            continue;
         }
 
         fd = creat(md[i].name, 0666);
@@ -2136,10 +2240,18 @@ void unpack_bootfs(void)
             sys_panic("unpack_bootfs failed");
         }
 
-        ret = write(fd, &bootfs_start + md[i].offset, md[i].size);
-        if (ret != md[i].size) {
-            kprintf("write failed, ret = %d, errno = %d\n",
-                    ret, errno);
+        struct file *fp;
+        ret = fget(fd, &fp);
+        if (ret == 0) {
+            struct vnode *vp = fp->f_dentry->d_vnode;
+            vn_lock(vp);
+            ret = ramfs_set_image_data(vp, &bootfs_start + md[i].offset,
+                                       md[i].size);
+            vn_unlock(vp);
+            fdrop(fp);
+        }
+        if (ret) {
+            kprintf("couldn't map %s: %d\n", md[i].name, ret);
             sys_panic("unpack_bootfs failed");
         }
 
@@ -2278,7 +2390,7 @@ extern "C" void unmount_rootfs(void)
 }
 
 extern "C" void bio_init(void);
-extern "C" void bio_sync(void);
+extern "C" int bio_sync(void);
 
 int vfs_initialized;
 
@@ -40,78 +40,160 @@
 #include <osv/buf.h>
 #include <osv/bio.h>
 #include <osv/device.h>
+#include <osv/mempool.hh>
+#include <osv/trace.hh>
 
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
 
 #include "vfs.h"
 #include <boost/intrusive/list.hpp>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
 
-/* number of buffer cache */
-#define NBUFS		256
+/*
+ * The buffer cache is split into shards by a hash of (device, block #),
+ * each with its own lock, its own table of cached blocks, and two lists
+ * of the buffers nobody is using: clean ones in LRU order, which may be
+ * reused for another block or freed by the shrinker, and delayed-write
+ * ones, which bio_sync() and binval() write back in batches. A busy buffer
+ * is on neither list, and its owner holds its b_lock.
+ *
+ * The cache grows up to a size derived from the amount of memory, after
+ * which getblk() reuses the least recently used clean buffer of its shard,
+ * or writes back its oldest delayed write if it has no clean one.
+ */
+#define NSHARDS		16
+
+/* minimum number of buffers, and fraction of memory used at most */
+#define NBUFS_MIN	256
+#define NBUFS_MEM_FRACTION	128
+
+/* delayed-write buffers written back per batch */
+#define FLUSH_BATCH	64
 
 /* macros to clear/set/test flags. */
 #define	SET(t, f)	(t) |= (f)
 #define	CLR(t, f)	(t) &= ~(f)
 #define	ISSET(t, f)	((t) & (f))
 
-/*
- * Global lock to access all buffer headers and lists.
- */
-static mutex bio_lock;
+TRACEPOINT(trace_bio_flush, "buffers=%d, dirty left=%d", size_t, size_t);
+TRACEPOINT(trace_bio_shrink, "buffers=%d", size_t);
 
-/* fixed set of buffers */
-static struct buf buf_table[NBUFS];
-boost::intrusive::list<struct buf, boost::intrusive::base_hook<struct buf>> free_list;
+typedef boost::intrusive::list<struct buf,
+	boost::intrusive::base_hook<struct buf>> buf_list;
 
-static sem_t free_sem;
+struct bio_key {
+	struct device	*dev;
+	int		blkno;
+	bool operator==(const bio_key& o) const {
+		return dev == o.dev && blkno == o.blkno;
+	}
+};
+
+struct bio_key_hash {
+	size_t operator()(const bio_key& k) const {
+		return std::hash<void*>()(k.dev) ^ (size_t(k.blkno) * 0x9e3779b97f4a7c15ull);
+	}
+};
+
+struct bio_shard {
+	mutex		lock;
+	std::unordered_map<bio_key, struct buf*, bio_key_hash> table;
+	buf_list	lru;
+	buf_list	dirty;
+} __attribute__((aligned(64)));
+
+static bio_shard shards[NSHARDS];
+
+/* buffers per shard, above which clean buffers are reused */
+static size_t shard_limit;
+/* buffers with B_DELWRI set */
+static std::atomic<size_t> nr_dirty;
+
+/* write-back passes started, see bio_flush() */
+static std::atomic<unsigned> flush_passes;
+
+static bio_shard&
+shard_of(struct device *dev, int blkno)
+{
+	return shards[bio_key_hash()({dev, blkno}) % NSHARDS];
+}
+
+static bio_shard&
+shard_of(struct buf *bp)
+{
+	return shard_of(bp->b_dev, bp->b_blkno);
+}
+
+static struct buf *
+alloc_buf(void)
+{
+	auto bp = new struct buf;
+	bp->b_flags = B_INVAL;
+	bp->b_dev = nullptr;
+	bp->b_blkno = 0;
+	bp->b_waiters = 0;
+	bp->b_flushpass = 0;
+	bp->b_data = malloc(BSIZE);
+	mutex_init(&bp->b_lock);
+	return bp;
+}
 
-/*
- * Insert buffer to the head of free list
- */
 static void
-bio_insert_head(struct buf *bp)
+free_buf(struct buf *bp)
 {
-	free_list.push_front(*bp);
-	sem_post(&free_sem);
+	free(bp->b_data);
+	delete bp;
 }
 
 /*
- * Insert buffer to the tail of free list
+ * Remove buffer from the table, if it is the one cached for its block.
  */
 static void
-bio_insert_tail(struct buf *bp)
+bio_unhash(bio_shard& s, struct buf *bp)
 {
-	free_list.push_back(*bp);
-	sem_post(&free_sem);
+	auto i = s.table.find({bp->b_dev, bp->b_blkno});
+	if (i != s.table.end() && i->second == bp)
+		s.table.erase(i);
 }
 
 /*
- * Remove buffer from free list
+ * Wait for a busy buffer to be released, with the shard lock dropped.
  */
 static void
-bio_remove(struct buf *bp)
+bio_wait_unbusy(bio_shard& s, struct buf *bp)
 {
-	sem_wait(&free_sem);
-	free_list.erase(free_list.iterator_to(*bp));
+	bp->b_waiters++;
+	DROP_LOCK(s.lock) {
+		mutex_lock(&bp->b_lock);
+		mutex_unlock(&bp->b_lock);
+	}
+	bp->b_waiters--;
 }
 
-/*
- * Remove buffer from the head of free list
- */
-static struct buf *
-bio_remove_head(void)
+static void
+set_delwri(struct buf *bp)
 {
-	sem_wait(&free_sem);
-	auto& bp = free_list.front();
-	free_list.pop_front();
-	return &bp;
+	if (!ISSET(bp->b_flags, B_DELWRI)) {
+		SET(bp->b_flags, B_DELWRI);
+		nr_dirty++;
+	}
 }
 
+static void
+clr_delwri(struct buf *bp)
+{
+	if (ISSET(bp->b_flags, B_DELWRI)) {
+		CLR(bp->b_flags, B_DELWRI);
+		nr_dirty--;
+	}
+}
 
 static int
 rw_buf(struct buf *bp, int rw)
@@ -136,62 +218,67 @@ rw_buf(struct buf *bp, int rw)
 	return ret;
 }
 
-/*
- * Determine if a block is in the cache.
- */
-static struct buf *
-incore(struct device *dev, int blkno)
-{
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (bp->b_blkno == blkno && bp->b_dev == dev &&
-		    !ISSET(bp->b_flags, B_INVAL))
-			return bp;
-	}
-	return nullptr;
-}
-
 /*
  * Assign a buffer for the given block.
  *
- * The block is selected from the buffer list with LRU
- * algorithm.  If the appropriate block already exists in the
- * block list, return it.  Otherwise, the least recently used
- * block is used.
+ * If the block is already cached, return its buffer. Otherwise
+ * the least recently used clean buffer of the shard is used, or a
+ * new one while the shard is below its share of the cache. A shard
+ * holding only delayed writes writes back the oldest one and reuses it.
  */
 struct buf *
 getblk(struct device *dev, int blkno)
 {
 	DPRINTF(VFSDB_BIO, ("getblk: dev=%x blkno=%d\n", dev, blkno));
-	SCOPE_LOCK(bio_lock);
+	auto& s = shard_of(dev, blkno);
+	struct buf *bp;
+	SCOPE_LOCK(s.lock);
 start:
-	auto* bp = incore(dev, blkno);
-	if (bp != nullptr) {
+	auto i = s.table.find({dev, blkno});
+	if (i != s.table.end()) {
 		/* Block found in cache. */
+		bp = i->second;
 		if (ISSET(bp->b_flags, B_BUSY)) {
-			/*
-			 * Wait buffer ready.
-			 */
-			DROP_LOCK(bio_lock) {
-				mutex_lock(&bp->b_lock);
-				mutex_unlock(&bp->b_lock);
-			}
-			/* Scan again if it's busy */
+			/* Wait buffer ready, and scan again. */
+			bio_wait_unbusy(s, bp);
 			goto start;
 		}
-		bio_remove(bp);
+		if (ISSET(bp->b_flags, B_DELWRI))
+			s.dirty.erase(s.dirty.iterator_to(*bp));
+		else
+			s.lru.erase(s.lru.iterator_to(*bp));
 		SET(bp->b_flags, B_BUSY);
 	} else {
-		bp = bio_remove_head();
-		if (ISSET(bp->b_flags, B_DELWRI)) {
-			DROP_LOCK(bio_lock) {
-				bwrite(bp);
+		if (s.table.size() >= shard_limit && s.lru.empty() &&
+		    !s.dirty.empty()) {
+			bp = &s.dirty.front();
+			s.dirty.pop_front();
+			SET(bp->b_flags, B_BUSY);
+			mutex_lock(&bp->b_lock);
+			int error = 0;
+			DROP_LOCK(s.lock) {
+				error = bwrite(bp);
+				if (error) {
+					set_delwri(bp);
+					brelse(bp);
+				}
 			}
-			goto start;
+			/* On success it is now the shard's clean LRU buffer */
+			if (!error)
+				goto start;
+		}
+		if (s.table.size() >= shard_limit && !s.lru.empty()) {
+			bp = &s.lru.front();
+			s.lru.pop_front();
+			bio_unhash(s, bp);
+		} else {
+			/* Nothing to reuse, or the write back failed: grow. */
+			bp = alloc_buf();
 		}
 		bp->b_flags = B_BUSY;
 		bp->b_dev = dev;
 		bp->b_blkno = blkno;
+		s.table.emplace(bio_key{dev, blkno}, bp);
 	}
 	mutex_lock(&bp->b_lock);
 	DPRINTF(VFSDB_BIO, ("getblk: done bp=%x\n", bp));
@@ -208,13 +295,18 @@ brelse(struct buf *bp)
 	DPRINTF(VFSDB_BIO, ("brelse: bp=%x dev=%x blkno=%d\n",
 				bp, bp->b_dev, bp->b_blkno));
 
-	SCOPE_LOCK(bio_lock);
+	auto& s = shard_of(bp);
+	SCOPE_LOCK(s.lock);
 	CLR(bp->b_flags, B_BUSY);
 	mutex_unlock(&bp->b_lock);
-	if (ISSET(bp->b_flags, B_INVAL))
-		bio_insert_head(bp);
-	else
-		bio_insert_tail(bp);
+	if (ISSET(bp->b_flags, B_INVAL)) {
+		bio_unhash(s, bp);
+		s.lru.push_front(*bp);
+	} else if (ISSET(bp->b_flags, B_DELWRI)) {
+		s.dirty.push_back(*bp);
+	} else {
+		s.lru.push_back(*bp);
+	}
 }
 
 /*
@@ -261,16 +353,14 @@ bwrite(struct buf *bp)
 	DPRINTF(VFSDB_BIO, ("bwrite: dev=%x blkno=%d\n", bp->b_dev,
 			    bp->b_blkno));
 
-	WITH_LOCK(bio_lock) {
-		CLR(bp->b_flags, (B_READ | B_DONE | B_DELWRI));
-	}
+	/* The buffer is busy, so its flags are ours */
+	CLR(bp->b_flags, (B_READ | B_DONE));
+	clr_delwri(bp);
 
 	auto error = rw_buf(bp, 1);
 	if (error)
 		return error;
-	WITH_LOCK(bio_lock) {
-		SET(bp->b_flags, B_DONE);
-	}
+	SET(bp->b_flags, B_DONE);
 	brelse(bp);
 	return 0;
 }
@@ -280,16 +370,15 @@ bwrite(struct buf *bp)
  *
  * The buffer is marked dirty, but an actual I/O is not
  * performed.  This routine should be used when the buffer
- * is expected to be modified again soon.
+ * is expected to be modified again soon. It is written
+ * back by bio_sync(), or when getblk() needs the buffer.
  */
 void
 bdwrite(struct buf *bp)
 {
-
-	WITH_LOCK(bio_lock) {
-		SET(bp->b_flags, B_DELWRI);
-		CLR(bp->b_flags, B_DONE);
-	}
+	ASSERT(ISSET(bp->b_flags, B_BUSY));
+	set_delwri(bp);
+	CLR(bp->b_flags, B_DONE);
 	brelse(bp);
 }
 
@@ -299,53 +388,177 @@ bdwrite(struct buf *bp)
 void
 bflush(struct buf *bp)
 {
-	WITH_LOCK(bio_lock) {
-		if (ISSET(bp->b_flags, B_DELWRI))
-			bwrite(bp);
+	if (ISSET(bp->b_flags, B_DELWRI))
+		bwrite(bp);
+}
+
+/*
+ * Write back up to FLUSH_BATCH delayed-write buffers (only those of
+ * dev, unless it is null) which write-back pass "pass" has not taken
+ * yet. All the writes are submitted before waiting for any, in block
+ * order. Returns the number of buffers taken, whether their write
+ * succeeded or not; the first error is stored in *error.
+ */
+static size_t
+bio_flush_batch(struct device *dev, unsigned pass, int *error)
+{
+	std::vector<struct buf *> batch;
+	batch.reserve(FLUSH_BATCH);
+	for (auto& s : shards) {
+		SCOPE_LOCK(s.lock);
+		for (auto i = s.dirty.begin(); i != s.dirty.end() &&
+		    batch.size() < FLUSH_BATCH;) {
+			auto bp = &*i++;
+			if ((dev && bp->b_dev != dev) || bp->b_flushpass == pass)
+				continue;
+			bp->b_flushpass = pass;
+			s.dirty.erase(s.dirty.iterator_to(*bp));
+			SET(bp->b_flags, B_BUSY);
+			mutex_lock(&bp->b_lock);
+			batch.push_back(bp);
+		}
+		if (batch.size() == FLUSH_BATCH)
+			break;
+	}
+	if (batch.empty())
+		return 0;
+
+	std::sort(batch.begin(), batch.end(), [] (struct buf *a, struct buf *b) {
+		return a->b_dev < b->b_dev ||
+		    (a->b_dev == b->b_dev && a->b_blkno < b->b_blkno);
+	});
+	std::vector<struct bio *> bios(batch.size());
+	bio_plug();
+	for (size_t i = 0; i < batch.size(); i++) {
+		auto bp = batch[i];
+		auto bio = bios[i] = alloc_bio();
+		bio->bio_cmd = BIO_WRITE;
+		bio->bio_dev = bp->b_dev;
+		bio->bio_data = bp->b_data;
+		bio->bio_offset = bp->b_blkno << 9;
+		bio->bio_bcount = BSIZE;
+		bio->bio_dev->driver->devops->strategy(bio);
 	}
+	bio_unplug();
+	for (size_t i = 0; i < batch.size(); i++) {
+		auto bp = batch[i];
+		auto err = bio_wait(bios[i]);
+		if (err == 0) {
+			CLR(bp->b_flags, B_READ);
+			clr_delwri(bp);
+			SET(bp->b_flags, B_DONE);
+		} else if (*error == 0) {
+			/* It stays dirty, to be retried by a later pass */
+			*error = err;
+		}
+		destroy_bio(bios[i]);
+		brelse(bp);
+	}
+	trace_bio_flush(batch.size(), nr_dirty.load());
+	return batch.size();
+}
+
+/*
+ * Write back the delayed writes (only those of dev, unless it is null)
+ * once: a buffer whose write fails is not retried within the pass, so a
+ * failing device cannot keep us here. Returns the first error.
+ */
+static int
+bio_flush(struct device *dev)
+{
+	unsigned pass = ++flush_passes;
+	int error = 0;
+
+	while (bio_flush_batch(dev, pass, &error))
+		;
+	return error;
 }
 
+/*
+ * Free clean buffers nobody uses, least recently used first.
+ */
+class bio_shrinker : public memory::shrinker {
+public:
+	bio_shrinker() : shrinker("buffer cache") {}
+	size_t request_memory(size_t n, bool hard) {
+		size_t freed = 0, nbufs = 0;
+		for (auto& s : shards) {
+			SCOPE_LOCK(s.lock);
+			for (auto i = s.lru.begin(); i != s.lru.end() && freed < n;) {
+				auto bp = &*i++;
+				if (bp->b_waiters)
+					continue;
+				s.lru.erase(s.lru.iterator_to(*bp));
+				bio_unhash(s, bp);
+				free_buf(bp);
+				freed += BSIZE + sizeof(*bp);
+				nbufs++;
+			}
+		}
+		trace_bio_shrink(nbufs);
+		return freed;
+	}
+};
+
 /*
  * Invalidate buffer for specified device.
  * This is called when unmount.
+ * Returns the error of the write back, if any; the buffers
+ * which could not be written are dropped anyway.
  */
-void
+int
 binval(struct device *dev)
 {
-	SCOPE_LOCK(bio_lock);
-	for (auto i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (bp->b_dev == dev) {
-			if (ISSET(bp->b_flags, B_DELWRI))
-				bwrite(bp);
-			else if (ISSET(bp->b_flags, B_BUSY))
-				brelse(bp);
+	int error = bio_flush(dev);
+
+	for (auto& s : shards) {
+		SCOPE_LOCK(s.lock);
+	start:
+		for (auto i = s.table.begin(); i != s.table.end();) {
+			auto bp = i->second;
+			if (bp->b_dev != dev) {
+				++i;
+				continue;
+			}
+			if (ISSET(bp->b_flags, B_BUSY)) {
+				bio_wait_unbusy(s, bp);
+				goto start;
+			}
+			if (ISSET(bp->b_flags, B_DELWRI)) {
+				/* The write back failed */
+				clr_delwri(bp);
+				s.dirty.erase(s.dirty.iterator_to(*bp));
+			} else {
+				s.lru.erase(s.lru.iterator_to(*bp));
+			}
+			i = s.table.erase(i);
 			bp->b_flags = B_INVAL;
+			s.lru.push_front(*bp);
 		}
 	}
+	return error;
 }
 
 /*
- * Invalidate all buffers.
+ * Write back all delayed writes.
  * This is called when unmount.
+ * Returns the first write error.
  */
-void
+int
 bio_sync(void)
 {
-	SCOPE_LOCK(bio_lock);
-start:
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (ISSET(bp->b_flags, B_BUSY)) {
-			DROP_LOCK(bio_lock) {
-				mutex_lock(&bp->b_lock);
-				mutex_unlock(&bp->b_lock);
+	for (auto& s : shards) {
+		SCOPE_LOCK(s.lock);
+	start:
+		for (auto& e : s.table) {
+			auto bp = e.second;
+			if (ISSET(bp->b_flags, B_BUSY)) {
+				bio_wait_unbusy(s, bp);
+				goto start;
 			}
-			goto start;
 		}
-		if (ISSET(bp->b_flags, B_DELWRI))
-			bwrite(bp);
 	}
+	return bio_flush(nullptr);
 }
 
 /*
@@ -354,15 +567,12 @@ start:
 void
 bio_init(void)
 {
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		bp->b_flags = B_INVAL;
-		bp->b_data = malloc(BSIZE);
-		mutex_init(&bp->b_lock);
-		free_list.push_back(*bp);
-	}
-	sem_init(&free_sem, 0, NBUFS);
+	size_t nbufs = std::max<size_t>(NBUFS_MIN,
+	    memory::stats::total() / NBUFS_MEM_FRACTION / BSIZE);
+	shard_limit = nbufs / NSHARDS;
+
+	new bio_shrinker;
 
 	DPRINTF(VFSDB_BIO, ("bio: Buffer cache size %dK bytes\n",
-			    BSIZE * NBUFS / 1024));
+			    BSIZE * nbufs / 1024));
 }
@@ -40,31 +40,102 @@
 
 #include <osv/dentry.h>
 #include <osv/vnode.h>
+#include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
 #include "vfs.h"
 
 #define DENTRY_BUCKETS 32
 
-static LIST_HEAD(dentry_hash_head, dentry) dentry_hash_table[DENTRY_BUCKETS];
-static LIST_HEAD(fake, dentry) fake;
-static mutex dentry_hash_lock;
-
 /*
- * Get the hash value from the mount point and path name.
- * XXX: replace with a better hash for 64-bit pointers.
+ * The dentry hash table is modified under dentry_hash_lock, but looked up
+ * under RCU only, so path lookups of cached dentries don't serialize on a
+ * lock. The table grows with the number of dentries. dentries are freed
+ * after an RCU grace period, and a lookup only takes a reference to a
+ * dentry which still has one: once d_refcnt drops to zero, it is only
+ * waiting to be removed from the table.
  */
-static u_int
+static size_t
 dentry_hash(struct mount *mp, const char *path)
 {
-    u_int val = 0;
+    /* FNV-1a */
+    size_t val = 14695981039346656037ul;
 
     if (path) {
         while (*path) {
-            val = ((val << 5) + val) + *path++;
+            val = (val ^ (unsigned char)*path++) * 1099511628211ul;
         }
     }
-    return (val ^ (unsigned long) mp) & (DENTRY_BUCKETS - 1);
+    return val ^ (((uintptr_t)mp >> 4) * 0x9e3779b97f4a7c15ul);
+}
+
+struct dentry_hasher {
+    size_t operator()(struct dentry *dp) const {
+        return dentry_hash(dp->d_mount, dp->d_path);
+    }
+};
+
+struct dentry_key {
+    struct mount *mp;
+    const char *path;
+};
+
+static osv::rcu_hashtable<struct dentry *, dentry_hasher>
+    dentry_hash_table(DENTRY_BUCKETS);
+static mutex dentry_hash_lock;
+
+static void
+dentry_hash_insert(struct dentry *dp)
+{
+    dentry_hash_table.insert(dp);
+}
+
+static void
+dentry_hash_remove(struct dentry *dp)
+{
+    auto i = dentry_hash_table.owner_find(dp, dentry_hasher(),
+        [] (struct dentry *a, struct dentry *b) { return a == b; });
+    if (i) {
+        dentry_hash_table.erase(i);
+    }
+}
+
+/*
+ * Take a reference to dp, unless it has already dropped its last one.
+ */
+static bool
+dentry_tryref(struct dentry *dp)
+{
+    int refcnt = dp->d_refcnt.load(std::memory_order_relaxed);
+
+    do {
+        if (refcnt == 0) {
+            return false;
+        }
+    } while (!dp->d_refcnt.compare_exchange_weak(refcnt, refcnt + 1,
+        std::memory_order_acquire));
+    return true;
 }
 
+/*
+ * Find the dentry of path, and take a reference to it. Called under either
+ * the RCU read lock or dentry_hash_lock.
+ */
+static struct dentry *
+dentry_find(struct mount *mp, const char *path)
+{
+    dentry_key key = { mp, path };
+
+    auto i = dentry_hash_table.reader_find(key,
+        [] (const dentry_key &k) { return dentry_hash(k.mp, k.path); },
+        [] (const dentry_key &k, struct dentry *dp) {
+            return dp->d_mount == k.mp &&
+                !strncmp(dp->d_path, k.path, PATH_MAX);
+        });
+    if (i && dentry_tryref(*i)) {
+        return *i;
+    }
+    return nullptr;
+}
 
 struct dentry *
 dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
@@ -96,10 +167,27 @@ dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
 
     vn_add_name(vp, dp);
 
-    mutex_lock(&dentry_hash_lock);
-    LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(mp, path)], dp, d_link);
-    mutex_unlock(&dentry_hash_lock);
-    return dp;
+    // A lockless lookup racing with dentry_move() can miss a dentry which
+    // is only being rehashed; look again under the lock, so the caller
+    // gets that one rather than a second dentry for the same file.
+    struct dentry *existing;
+    bool reuse;
+    WITH_LOCK(dentry_hash_lock) {
+        existing = dentry_find(mp, path);
+        reuse = existing && existing->d_vnode == vp;
+        if (!reuse) {
+            dentry_hash_insert(dp);
+        }
+    }
+    if (!reuse) {
+        if (existing) {
+            drele(existing);
+        }
+        return dp;
+    }
+    // dp was never visible to lookups
+    drele(dp);
+    return existing;
 };
 
 struct dentry *
@@ -107,16 +195,10 @@ dentry_lookup(struct mount *mp, char *path)
 {
     struct dentry *dp;
 
-    mutex_lock(&dentry_hash_lock);
-    LIST_FOREACH(dp, &dentry_hash_table[dentry_hash(mp, path)], d_link) {
-        if (dp->d_mount == mp && !strncmp(dp->d_path, path, PATH_MAX)) {
-            dp->d_refcnt++;
-            mutex_unlock(&dentry_hash_lock);
-            return dp;
-        }
+    WITH_LOCK(osv::rcu_read_lock) {
+        dp = dentry_find(mp, path);
     }
-    mutex_unlock(&dentry_hash_lock);
-    return nullptr;                /* not found */
+    return dp;                     /* nullptr if not found */
 }
 
 static void dentry_children_remove(struct dentry *dp)
@@ -127,7 +209,7 @@ static void dentry_children_remove(struct dentry *dp)
         LIST_FOREACH(entry, &dp->d_children, d_children_link) {
             ASSERT(entry);
             ASSERT(entry->d_refcnt > 0);
-            LIST_REMOVE(entry, d_link);
+            dentry_hash_remove(entry);
         }
     }
 }
@@ -157,30 +239,28 @@ dentry_move(struct dentry *dp, struct dentry *parent_dp, char *path)
         // Remove all dp's child dentries from the hashtable.
         dentry_children_remove(dp);
         // Remove dp with outdated hash info from the hashtable.
-        LIST_REMOVE(dp, d_link);
+        dentry_hash_remove(dp);
         // Update dp.
         dp->d_path = strdup(path);
         dp->d_parent = parent_dp;
         // Insert dp updated hash info into the hashtable.
-        LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(dp->d_mount, path)],
-            dp, d_link);
+        dentry_hash_insert(dp);
     }
 
     if (old_pdp) {
         drele(old_pdp);
     }
 
-    free(old_path);
+    // Lookups may still be comparing against the old path
+    osv::rcu_dispose(static_cast<void*>(old_path));
 }
 
 void
 dentry_remove(struct dentry *dp)
 {
-    mutex_lock(&dentry_hash_lock);
-    LIST_REMOVE(dp, d_link);
-    /* put it on a fake list for drele() to work*/
-    LIST_INSERT_HEAD(&fake, dp, d_link);
-    mutex_unlock(&dentry_hash_lock);
+    WITH_LOCK(dentry_hash_lock) {
+        dentry_hash_remove(dp);
+    }
 }
 
 void
@@ -189,9 +269,7 @@ dref(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
-    mutex_lock(&dentry_hash_lock);
-    dp->d_refcnt++;
-    mutex_unlock(&dentry_hash_lock);
+    dp->d_refcnt.fetch_add(1, std::memory_order_relaxed);
 }
 
 void
@@ -200,15 +278,15 @@ drele(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
-    mutex_lock(&dentry_hash_lock);
-    if (--dp->d_refcnt) {
-        mutex_unlock(&dentry_hash_lock);
+    if (dp->d_refcnt.fetch_sub(1, std::memory_order_release) != 1) {
         return;
     }
-    LIST_REMOVE(dp, d_link);
-    vn_del_name(dp->d_vnode, dp);
+    std::atomic_thread_fence(std::memory_order_acquire);
 
-    mutex_unlock(&dentry_hash_lock);
+    WITH_LOCK(dentry_hash_lock) {
+        dentry_hash_remove(dp);
+        vn_del_name(dp->d_vnode, dp);
+    }
 
     if (dp->d_parent) {
         WITH_LOCK(dp->d_parent->d_lock) {
@@ -220,16 +298,15 @@ drele(struct dentry *dp)
 
     vrele(dp->d_vnode);
 
-    free(dp->d_path);
-    free(dp);
+    // Lookups may still be looking at dp
+    auto path = dp->d_path;
+    osv::rcu_defer([=] {
+        free(path);
+        free(dp);
+    });
 }
 
 void
 dentry_init(void)
 {
-    int i;
-
-    for (i = 0; i < DENTRY_BUCKETS; i++) {
-        LIST_INIT(&dentry_hash_table[i]);
-    }
 }
@@ -14,6 +14,7 @@
 #include <osv/vfs_file.hh>
 #include <osv/mmu.hh>
 #include <osv/pagecache.hh>
+#include <utility>
 
 vfs_file::vfs_file(unsigned flags)
 	: file(flags, DTYPE_VNODE)
@@ -44,6 +45,7 @@ int vfs_file::read(struct uio *uio, int flags)
 	int error;
 	size_t count;
 	ssize_t bytes;
+	off_t offset;
 
 	bytes = uio->uio_resid;
 
@@ -51,11 +53,13 @@ int vfs_file::read(struct uio *uio, int flags)
 	if ((flags & FOF_OFFSET) == 0)
 		uio->uio_offset = fp->f_offset;
 
+	offset = uio->uio_offset;
 	error = VOP_READ(vp, fp, uio, 0);
 	if (!error) {
 		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
 			fp->f_offset += count;
+		readahead_access(vp, offset, count);
 	}
 	vn_unlock(vp);
 
@@ -138,6 +142,63 @@ int vfs_file::chmod(mode_t mode)
 	abort();
 }
 
+// Tells the readahead about a read, or a page fault which missed the page
+// cache, and starts reading what it asks for.
+void vfs_file::readahead_access(struct vnode *vp, off_t offset, size_t len)
+{
+    if (vp->v_type != VREG || !vp->v_op->vop_readahead) {
+        return;
+    }
+    std::pair<off_t, size_t> ranges[osv::readahead::stride_depth];
+    unsigned n = 0;
+    WITH_LOCK(_readahead_lock) {
+        _readahead.access(offset, len, vp->v_size, [&] (off_t off, size_t len) {
+            assert(n < osv::readahead::stride_depth);
+            ranges[n++] = std::make_pair(off, len);
+        });
+    }
+    for (unsigned i = 0; i < n; i++) {
+        VOP_READAHEAD(vp, ranges[i].first, ranges[i].second);
+    }
+}
+
+int vfs_file::fadvise(off_t offset, off_t len, int advice)
+{
+    struct vnode *vp = f_dentry->d_vnode;
+
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+        WITH_LOCK(_readahead_lock) {
+            _readahead.advise(osv::readahead::advice::normal);
+        }
+        break;
+    case POSIX_FADV_SEQUENTIAL:
+        WITH_LOCK(_readahead_lock) {
+            _readahead.advise(osv::readahead::advice::sequential);
+        }
+        break;
+    case POSIX_FADV_RANDOM:
+        WITH_LOCK(_readahead_lock) {
+            _readahead.advise(osv::readahead::advice::random);
+        }
+        break;
+    case POSIX_FADV_WILLNEED:
+        vn_lock(vp);
+        if (vp->v_type == VREG && vp->v_op->vop_readahead && offset < vp->v_size) {
+            if (len == 0 || len > vp->v_size - offset) {
+                len = vp->v_size - offset;
+            }
+            VOP_READAHEAD(vp, offset, len);
+        }
+        vn_unlock(vp);
+        break;
+    default:
+        // POSIX_FADV_DONTNEED and POSIX_FADV_NOREUSE are only hints
+        break;
+    }
+    return 0;
+}
+
 bool vfs_file::map_page(uintptr_t off, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
 {
     return pagecache::get(this, off, ptep, pte, write, shared);
@@ -171,6 +232,12 @@ int vfs_file::get_arcbuf(void* key, off_t offset)
     data.uio_resid = mmu::page_size;
     data.uio_rw = UIO_READ;
 
+    // The page cache only asks for pages it doesn't have, so faults on
+    // mappings of the file are seen by the readahead here, and a fault
+    // which finds its page in the cache costs no more than it did without
+    // readahead.
+    readahead_access(vp, offset, mmu::page_size);
+
     vn_lock(vp);
     assert(VOP_CACHE(vp, this, &data) == 0);
     vn_unlock(vp);
@@ -172,28 +172,35 @@ namei(const char *path, struct dentry **dpp)
              */
             strlcat(node, "/", sizeof(node));
             strlcat(node, name, sizeof(node));
-            dvp = ddp->d_vnode;
-            vn_lock(dvp);
+            /*
+             * Cached components are found without locking the
+             * directory; only a miss goes to the file system.
+             */
             dp = dentry_lookup(mp, node);
             if (dp == nullptr) {
-                /* Find a vnode in this directory. */
-                error = VOP_LOOKUP(dvp, name, &vp);
-                if (error) {
-                    vn_unlock(dvp);
-                    drele(ddp);
-                    return error;
-                }
-
-                dp = dentry_alloc(ddp, vp, node);
-                vput(vp);
-
-                if (!dp) {
-                    vn_unlock(dvp);
-                    drele(ddp);
-                    return ENOMEM;
+                dvp = ddp->d_vnode;
+                vn_lock(dvp);
+                dp = dentry_lookup(mp, node);
+                if (dp == nullptr) {
+                    /* Find a vnode in this directory. */
+                    error = VOP_LOOKUP(dvp, name, &vp);
+                    if (error) {
+                        vn_unlock(dvp);
+                        drele(ddp);
+                        return error;
+                    }
+
+                    dp = dentry_alloc(ddp, vp, node);
+                    vput(vp);
+
+                    if (!dp) {
+                        vn_unlock(dvp);
+                        drele(ddp);
+                        return ENOMEM;
+                    }
                 }
+                vn_unlock(dvp);
             }
-            vn_unlock(dvp);
             drele(ddp);
             ddp = dp;
 
@@ -278,6 +285,12 @@ namei_last_nofollow(char *path, struct dentry *ddp, struct dentry **dpp)
         node.get()[l] = '\0';
     }
 
+    dp = dentry_lookup(mp, node.get());
+    if (dp != nullptr) {
+        *dpp = dp;
+        return 0;
+    }
+
     dvp = ddp->d_vnode;
     vn_lock(dvp);
     dp = dentry_lookup(mp, node.get());
@@ -48,10 +48,12 @@
 #include <osv/device.h>
 #include <osv/debug.h>
 #include <osv/mutex.h>
+#include <osv/rcu.hh>
 #include "vfs.h"
 
 #include <memory>
 #include <list>
+#include <vector>
 
 using namespace std;
 
@@ -65,6 +67,21 @@ static list<mount*> mount_list;
  */
 static std::mutex mount_lock;
 
+/*
+ * Copy of mount_list for vfs_findroot(), which runs on every path lookup
+ * and reads it under RCU. Republished, under mount_lock, whenever
+ * mount_list or a mount point's path changes.
+ */
+static osv::rcu_ptr<vector<mount*>> mount_snapshot;
+
+static void
+publish_mounts()
+{
+    auto old = mount_snapshot.read_by_owner();
+    mount_snapshot.assign(new vector<mount*>(mount_list.begin(), mount_list.end()));
+    osv::rcu_dispose(old);
+}
+
 /*
  * Lookup file system.
  */
@@ -195,6 +212,7 @@ sys_mount(const char *dev, const char *dir, const char *fsname, int flags, const
      * Insert to mount list
      */
     mount_list.push_back(mp);
+    publish_mounts();
 
     return 0;   /* success */
  err4:
@@ -262,10 +280,12 @@ found:
     if ((error = VFS_UNMOUNT(mp, flags)) != 0)
         goto out;
     mount_list.remove(mp);
+    publish_mounts();
+    osv::rcu_synchronize();
 
 #ifdef HAVE_BUFFERS
-    /* Flush all buffers */
-    binval(mp->m_dev);
+    /* Flush all buffers; the file system is gone, but report lost data */
+    error = binval(mp->m_dev);
 #endif
 
     if (mp->m_dev)
@@ -325,6 +345,7 @@ sys_pivot_root(const char *new_root, const char *put_old)
         newmp->m_root->d_parent = nullptr;
 
         strlcpy(newmp->m_path, "/", sizeof(newmp->m_path));
+        publish_mounts();
     }
     return 0;
 }
@@ -339,9 +360,10 @@ sys_sync(void)
         }
     }
 #ifdef HAVE_BUFFERS
-    bio_sync();
-#endif
+    return bio_sync();
+#else
     return 0;
+#endif
 }
 
 /*
@@ -389,12 +411,16 @@ vfs_findroot(const char *path, struct mount **mp, char **root)
         return -1;
 
     /* Find mount point from nearest path */
-    SCOPE_LOCK(mount_lock);
-    for (auto&& tmp : mount_list) {
-        len = count_match(path, tmp->m_path);
-        if (len > max_len) {
-            max_len = len;
-            m = tmp;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto mounts = mount_snapshot.read();
+        if (mounts) {
+            for (auto&& tmp : *mounts) {
+                len = count_match(path, tmp->m_path);
+                if (len > max_len) {
+                    max_len = len;
+                    m = tmp;
+                }
+            }
         }
     }
     if (m == nullptr)
@@ -26,6 +26,17 @@ using callback_t = std::function<void()>;
 class async_worker;
 class timer_task;
 
+/**
+ * Coarse timers are kept in a per-CPU timer wheel with 1ms ticks instead
+ * of the exact timer set. Arming and cancelling them is O(1) and timers
+ * due on the same tick are expired together, but they may fire up to a
+ * tick late. Meant for timeouts which are re-armed or cancelled far more
+ * often than they fire, such as the TCP timers.
+ */
+enum class timer_precision {
+    exact, coarse
+};
+
 struct percpu_timer_task {
     enum class state {
         ACTIVE, FIRING, RELEASED
@@ -37,6 +48,7 @@ struct percpu_timer_task {
         , _state(state::ACTIVE)
         , master(nullptr)
         , queued(false)
+        , coarse(false)
     {
     }
 
@@ -58,6 +70,7 @@ struct percpu_timer_task {
     timer_task* master;
     clock::time_point fire_at;
     bool queued;
+    bool coarse;
 
     friend bool operator<(const percpu_timer_task& a, const percpu_timer_task& b) {
         return a.fire_at < b.fire_at;
@@ -96,7 +109,8 @@ struct percpu_timer_task {
  */
 class timer_task {
 public:
-    timer_task(mutex& lock, callback_t&& callback);
+    timer_task(mutex& lock, callback_t&& callback,
+        timer_precision precision = timer_precision::exact);
     timer_task(const timer_task&) = delete;
     ~timer_task();
 
@@ -148,6 +162,7 @@ private:
 
     callback_t _callback;
     bool _terminating;
+    timer_precision _precision;
 };
 
 /**
@@ -164,7 +179,8 @@ class serial_timer_task {
 public:
     using callback_t = std::function<void(serial_timer_task&)>;
 
-    serial_timer_task(mutex& lock, callback_t&& callback);
+    serial_timer_task(mutex& lock, callback_t&& callback,
+        timer_precision precision = timer_precision::exact);
     ~serial_timer_task();
 
     /**
@@ -126,6 +126,18 @@ void		biodone(struct bio *bio, bool ok);
 struct devstat;
 void    biofinish(struct bio *bp, struct devstat *stat, int error);
 
+/*
+ * Submission batching.  Between bio_plug() and bio_unplug() (which nest),
+ * a driver may use bio_plug_defer() to postpone the device notification of
+ * the requests it queued until the calling thread unplugs, so a burst of
+ * bios costs a single notification.  bio_plug_defer() returns false when
+ * the caller is not plugged, and the driver must then notify at once.
+ * Deferred notifications are also flushed before bio_wait() sleeps.
+ */
+void	bio_plug(void);
+void	bio_unplug(void);
+bool	bio_plug_defer(void (*flush)(void *), void *arg);
+
 __END_DECLS
 
 #endif /* !_SYS_BIO_H_ */
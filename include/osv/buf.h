@@ -46,6 +46,8 @@ struct buf: boost::intrusive::list_base_hook<> {
 	int		b_blkno;	/* block # on device */
 	mutex_t		b_lock;		/* lock for access */
 	void		*b_data;	/* pointer to data buffer */
+	int		b_waiters;	/* threads waiting for b_lock */
+	unsigned	b_flushpass;	/* last write-back pass which took it */
 };
 
 /*
@@ -62,10 +64,10 @@ struct buf *getblk(struct device *, int);
 int	bread(struct device *, int, struct buf **);
 int	bwrite(struct buf *);
 void	bdwrite(struct buf *);
-void	binval(struct device *);
+int	binval(struct device *);
 void	brelse(struct buf *);
 void	bflush(struct buf *);
-void	bio_sync(void);
+int	bio_sync(void);
 void	bio_init(void);
 __END_DECLS
 
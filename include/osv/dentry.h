@@ -10,12 +10,18 @@
 
 #include <osv/mutex.h>
 #include <bsd/sys/sys/queue.h>
+#ifdef __cplusplus
+#include <atomic>
+#endif
 
 struct vnode;
 
 struct dentry {
-	LIST_ENTRY(dentry) d_link;	/* link for hash list */
-	int		d_refcnt;	/* reference count */
+#ifdef __cplusplus
+	std::atomic<int> d_refcnt;	/* reference count */
+#else
+	int		d_refcnt;
+#endif
 	char		*d_path;	/* pointer to path in fs */
 	struct vnode	*d_vnode;
 	struct mount	*d_mount;
@@ -110,14 +110,23 @@ struct hash<epoll_key> : private hash<int>, hash<file*> {
 }
 
 struct epoll_file;
+struct epoll_registration;
 
 struct epoll_ptr {
     epoll_file* epoll;
     epoll_key key;
+    // Not part of the identity: the registration itself, so waking it up
+    // needs no lookup, and whether it was added with EPOLLEXCLUSIVE, in
+    // which case only one of the file's exclusive registrations is woken.
+    epoll_registration* reg;
+    bool exclusive;
 };
 
 void epoll_wake(const epoll_ptr& ep);
 void epoll_wake_in_rcu(const epoll_ptr& ep);
+// Whether the registration was woken and its epoll has yet to finish
+// polling the file, so it is bound to see any event raised meanwhile.
+bool epoll_in_flight(const epoll_ptr& ep);
 
 inline bool operator==(const epoll_ptr& p1, const epoll_ptr& p2) {
     return p1.epoll == p2.epoll && p1.key == p2.key;
@@ -170,6 +179,8 @@ struct file {
 	virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<0> ptep) { throw make_error(ENOSYS); }
 	virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<1> ptep) { throw make_error(ENOSYS); }
 	virtual void sync(off_t start, off_t end) { throw make_error(ENOSYS); }
+	// posix_fadvise(); returns an errno
+	virtual int fadvise(off_t offset, off_t len, int advice);
 
 	int		f_flags;	/* open flags */
 	int		f_count;	/* reference count, see below */
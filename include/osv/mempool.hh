@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <functional>
 #include <list>
+#include <vector>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <osv/mutex.h>
@@ -40,20 +41,35 @@ struct free_object {
     free_object* next;
 };
 
+// Statistics of one of malloc()'s object pools
+struct pool_stats {
+    size_t object_size;
+    size_t slab_size;
+    size_t slabs;
+    size_t in_use;
+    size_t allocs;
+};
+
 class pool {
 public:
-    explicit pool(unsigned size);
+    // Objects are carved from slabs of slab_size bytes: a page, or for the
+    // mid-size pools, a naturally aligned run of pages (mid_slab_size),
+    // whose objects are addressed through mmu::mem_area::mempool_slab.
+    explicit pool(unsigned size, size_t slab_size = page_size);
     ~pool();
     void* alloc();
     void free(void* object);
     unsigned get_size();
+    pool_stats get_stats();
     static pool* from_object(void* object);
     static void collect_garbage();
+    static constexpr size_t mid_slab_size = 8 * page_size;
 private:
     struct page_header;
 private:
     bool have_full_pages();
     void add_page();
+    void free_slab(page_header* header);
     static page_header* to_header(free_object* object);
 
     // should get called with the preemption lock taken
@@ -61,6 +77,7 @@ private:
     void free_different_cpu(free_object* obj, unsigned obj_cpu, unsigned cur_cpu);
 private:
     unsigned _size;
+    size_t _slab_size;
 
     struct page_header {
         pool* owner;
@@ -82,6 +99,15 @@ private:
     };
     // maintain a list of free pages percpu
     dynamic_percpu<free_list_type> _free;
+    // per-cpu counters, updated with preemption disabled; an object or slab
+    // may be freed on a different cpu than the one which allocated it, so
+    // only their sums make sense
+    struct counters {
+        size_t allocs = 0;
+        size_t frees = 0;
+        size_t slabs = 0;
+    };
+    dynamic_percpu<counters> _counters;
 public:
     static const size_t max_object_size;
     static const size_t min_object_size;
@@ -185,6 +211,8 @@ namespace stats {
     size_t jvm_heap();
     void on_jvm_heap_alloc(size_t mem);
     void on_jvm_heap_free(size_t mem);
+    // One entry per malloc() size class
+    std::vector<pool_stats> pools();
 }
 
 class phys_contiguous_memory final {
@@ -33,6 +33,7 @@ enum class mem_area {
     main,
     page,
     mempool,
+    mempool_slab,
     debug,
 };
 
@@ -40,6 +41,7 @@ constexpr mem_area identity_mapped_areas[] = {
     mem_area::main,
     mem_area::page,
     mem_area::mempool,
+    mem_area::mempool_slab,
 };
 
 constexpr uintptr_t mem_area_size = uintptr_t(1) << 44;
@@ -89,6 +91,10 @@ enum {
 enum {
     advise_dontneed = 1ul << 0,
     advise_nohugepage = 1ul << 1,
+    advise_normal = 1ul << 2,
+    advise_sequential = 1ul << 3,
+    advise_random = 1ul << 4,
+    advise_willneed = 1ul << 5,
 };
 
 enum {
@@ -17,11 +17,13 @@
 #include <osv/addr_range.hh>
 #include <unordered_map>
 #include <memory>
+#include <atomic>
 #include <osv/mmu-defs.hh>
 #include <osv/align.hh>
 #include <osv/trace.hh>
 
 struct exception_frame;
+namespace sched { class thread; }
 class balloon;
 typedef std::shared_ptr<balloon> balloon_ptr;
 
@@ -66,12 +68,27 @@ public:
     template<typename T> ulong operate_range(T mapper);
     bool map_dirty();
     class addr_compare;
+    // vm_fault() may service a fault on this vma holding just the fault lock
+    // for read, without vma_list_mutex. Anything changing or freeing a vma
+    // which is on vma_list must therefore hold vma_list_mutex for write *and*
+    // the fault lock exclusively; a vma taken off vma_list keeps the fault
+    // lock until it is freed. try_lock_fault() never sleeps, and neither
+    // does unlock_fault(), so both may be used inside an RCU read section.
+    bool try_lock_fault();
+    void unlock_fault();
+    void lock_fault_exclusive();
+    void unlock_fault_exclusive();
 protected:
     addr_range _range;
     unsigned _perm;
     unsigned _flags;
     bool _map_dirty;
     page_allocator *_page_ops;
+private:
+    static constexpr unsigned fault_writer = 1u << 31;
+    // number of fault readers, plus fault_writer when a writer wants in
+    std::atomic<unsigned> _fault_state { 0 };
+    sched::thread* _fault_writer = nullptr;
 public:
     boost::intrusive::set_member_hook<> _vma_list_hook;
 };
@@ -93,6 +110,8 @@ public:
     virtual void fault(uintptr_t addr, exception_frame *ef) override;
     fileref file() const { return _file; }
     f_offset offset() const { return _offset; }
+    // Drops the file of a vma removed from vma_list
+    void release_file() { _file.reset(); }
 private:
     f_offset offset(uintptr_t addr);
     fileref _file;
@@ -104,7 +123,9 @@ ulong map_jvm(unsigned char* addr, size_t size, size_t align, balloon_ptr b);
 class jvm_balloon_vma : public vma {
 public:
     jvm_balloon_vma(unsigned char *jvm_addr, uintptr_t start, uintptr_t end, balloon_ptr b, unsigned perm, unsigned flags);
-    virtual ~jvm_balloon_vma();
+    // Maps the range of a vma removed from vma_list back in, for the heap
+    // or the moved balloon
+    void release();
     virtual void split(uintptr_t edge) override;
     virtual error sync(uintptr_t start, uintptr_t end) override;
     virtual void fault(uintptr_t addr, exception_frame *ef) override;
@@ -311,6 +332,7 @@ error  advise(void* addr, size_t size, int advice);
 void vm_fault(uintptr_t addr, exception_frame* ef);
 
 std::string procfs_maps();
+std::string procfs_smaps();
 
 unsigned long all_vmas_size();
 
@@ -60,7 +60,10 @@ public:
     // 2. Allocate vectors and assign ISRs
     // 3. Setup entries
     // 4. Unmask interrupts
-    bool easy_register(std::initializer_list<msix_binding> bindings);
+    bool easy_register(std::initializer_list<msix_binding> bindings) {
+        return easy_register(std::vector<msix_binding>(bindings));
+    }
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
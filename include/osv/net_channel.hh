@@ -42,6 +42,8 @@ private:
 public:
     explicit net_channel(std::function<void (mbuf*)> process_packet)
         : _process_packet(std::move(process_packet)) {}
+    // frees any packets which were never consumed
+    ~net_channel();
     // producer: try to push a packet
     bool push(mbuf* m) { return _queue.push(m); }
     // consumer: wake the consumer (best used after multiple push()s)
@@ -100,6 +102,23 @@ struct ipv4_tcp_conn_id {
     }
 };
 
+// A bound, unconnected UDP socket. addr is INADDR_ANY for sockets bound
+// to the wildcard address.
+struct ipv4_udp_sock_id {
+    ipv4_udp_sock_id(in_addr addr, in_port_t port)
+        : addr(addr), port(port) {}
+
+    in_addr addr;
+    in_port_t port;
+
+    size_t hash() const {
+        return addr.s_addr ^ port;
+    }
+    bool operator==(const ipv4_udp_sock_id& x) const {
+        return addr == x.addr && port == x.port;
+    }
+};
+
 namespace std {
 
 template <>
@@ -107,6 +126,11 @@ struct hash<ipv4_tcp_conn_id> {
     size_t operator()(ipv4_tcp_conn_id x) const { return x.hash(); }
 };
 
+template <>
+struct hash<ipv4_udp_sock_id> {
+    size_t operator()(ipv4_udp_sock_id x) const { return x.hash(); }
+};
+
 }
 
 class classifier {
@@ -115,27 +139,36 @@ public:
     // consumer side operations
     void add(ipv4_tcp_conn_id id, net_channel* channel);
     void remove(ipv4_tcp_conn_id id);
+    void add(ipv4_udp_sock_id id, net_channel* channel);
+    void remove(ipv4_udp_sock_id id);
     // producer side operations
     bool post_packet(mbuf* m);
 private:
-    net_channel* classify_ipv4_tcp(mbuf* m);
+    net_channel* classify_ipv4(mbuf* m);
+    net_channel* classify_ipv4_tcp(ip* ip_hdr, caddr_t h);
+    net_channel* classify_ipv4_udp(ip* ip_hdr, caddr_t h);
 private:
+    template <typename Key>
     struct item {
-        item(const ipv4_tcp_conn_id& key, net_channel* chan) : key(key), chan(chan) {}
-        ipv4_tcp_conn_id key;
+        item(const Key& key, net_channel* chan) : key(key), chan(chan) {}
+        Key key;
         net_channel* chan;
     };
-    struct item_hash : private std::hash<ipv4_tcp_conn_id> {
-        size_t operator()(const item& i) const { return std::hash<ipv4_tcp_conn_id>::operator()(i.key); }
+    template <typename Key>
+    struct item_hash : private std::hash<Key> {
+        size_t operator()(const item<Key>& i) const { return std::hash<Key>::operator()(i.key); }
     };
+    template <typename Key>
     struct key_item_compare {
-        bool operator()(const ipv4_tcp_conn_id& key, const item& item) const {
+        bool operator()(const Key& key, const item<Key>& item) const {
             return key == item.key;
         }
     };
-    using ipv4_tcp_channels = osv::rcu_hashtable<item, item_hash>;
+    template <typename Key>
+    using channels = osv::rcu_hashtable<item<Key>, item_hash<Key>>;
     mutex _mtx;
-    ipv4_tcp_channels _ipv4_tcp_channels;
+    channels<ipv4_tcp_conn_id> _ipv4_tcp_channels;
+    channels<ipv4_udp_sock_id> _ipv4_udp_channels;
 };
 
 #endif /* NETCHANNEL_HH_ */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_NUMA_HH
+#define OSV_NUMA_HH
+
+#include <osv/types.h>
+#include <bitset>
+#include <cstddef>
+
+// NUMA topology, as described by the firmware, and the per-thread memory
+// placement policy used by the physical page allocator.
+//
+// Until the firmware tables are parsed (or when they do not describe more
+// than one node) the machine is a single node 0 and all of these functions
+// are trivial.
+
+namespace memory {
+namespace numa {
+
+constexpr unsigned max_nodes = 8;
+
+typedef std::bitset<max_nodes> nodemask;
+
+// Placement policies. The values are those of the Linux MPOL_* constants, so
+// the set_mempolicy()/get_mempolicy() system calls can pass them through.
+enum policy_mode {
+    mpol_default = 0,
+    mpol_preferred = 1,
+    mpol_bind = 2,
+    mpol_interleave = 3,
+    mpol_local = 4,
+};
+
+unsigned nr_nodes();
+nodemask all_nodes();
+unsigned current_node();
+unsigned node_of_cpu(unsigned cpu_id);
+// Node owning the physical memory behind a linear-mapped address
+unsigned node_of_addr(const void* addr);
+// Number of bytes, at most size, from addr which belong to addr's node
+size_t node_extent(const void* addr, size_t size);
+// Nodes ordered by increasing distance from node, starting with node itself.
+// The array holds nr_nodes() entries.
+const unsigned* fallback_order(unsigned node);
+
+// Per-thread placement policy, applied to page allocations made by the
+// calling thread.
+int set_policy(policy_mode mode, nodemask nodes);
+void get_policy(policy_mode& mode, nodemask& nodes);
+// The node the calling thread's next allocation should come from, and the
+// nodes it may fall back to.
+unsigned policy_node(nodemask& allowed);
+
+// Called by the firmware table parsers (ACPI SRAT/SLIT) during early boot,
+// before any other CPU is started. Proximity domains are translated to
+// dense node ids in order of appearance.
+void add_memory_affinity(u32 domain, u64 base, u64 length);
+void add_cpu_affinity(u32 domain, u32 apic_id);
+void set_distance(u32 from_domain, u32 to_domain, u8 distance);
+// Redistribute the free physical memory to the per-node allocators once the
+// affinities have been registered.
+void setup();
+// Bind a CPU, identified by its firmware (APIC) id, to its node.
+void attach_cpu(unsigned cpu_id, u32 apic_id);
+
+}
+}
+
+#endif
@@ -13,9 +13,15 @@
 namespace memory {
 
 void* alloc_page();
+// Like alloc_page(), but returns nullptr rather than wait for memory
+void* alloc_page_noblock();
 void free_page(void* page);
 void* alloc_huge_page(size_t bytes);
 void free_huge_page(void *page, size_t bytes);
+// Let free memory coalesce into huge pages; returns how many are free.
+// Until compact_done(), the page pools don't refill in the background.
+size_t compact();
+void compact_done();
 
 }
 
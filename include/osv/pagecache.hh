@@ -33,6 +33,33 @@ struct arc_hashkey {
 bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared);
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep);
 void sync(vfs_file* fp, off_t start, off_t end);
-void unmap_arc_buf(arc_buf_t* ab);
+// Returns true if some of the buffer's pages are lent out. The page cache
+// then takes over the buffer's data, and frees it with free() once they
+// are all returned.
+bool unmap_arc_buf(arc_buf_t* ab, void* data, size_t size, void (*free)(void*, size_t));
 void map_arc_buf(hashkey* key, arc_buf_t* ab, void* page);
+// For filesystems keeping file data in pages of their own (ramfs), which
+// are mapped without a copy. map_ram_page() is called from vop_cache, and
+// unmap_ram_page() before the page is freed or reused. The latter returns
+// true if the page is lent out; the page cache then frees the page with
+// memory::free_page() once it is returned. Pages which must never be freed
+// (file data in the kernel image) are unmapped with free = false, and then
+// unmap_ram_page() always returns false.
+void map_ram_page(hashkey* key, void* page);
+bool unmap_ram_page(hashkey* key, void* page, bool free = true);
+
+// Zero-copy access to cached file data, for sendfile(). lend() returns the
+// cached page holding a (page aligned) file offset, and guarantees that its
+// memory is neither freed nor reused until it is given back with unlend(),
+// even if the page is dropped from the cache meanwhile. As on Linux, writes
+// to the file may still show through in the lent page.
+class page_lender;
+
+struct page_loan {
+    void* addr;
+    page_lender* lender; // nullptr if there is nothing to give back
+};
+
+page_loan lend(vfs_file* fp, off_t offset);
+void unlend(page_lender* lender);
 }
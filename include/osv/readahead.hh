@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_READAHEAD_HH_
+#define OSV_READAHEAD_HH_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <algorithm>
+
+namespace osv {
+
+/**
+ * Readahead state of an open file.
+ *
+ * Every read of the file, and every page fault on a mapping of it which
+ * misses the page cache, is reported to access(), which decides what to
+ * fetch ahead of the reader, and hands the ranges to an "issue" function
+ * which starts reading them asynchronously. Repeating the last access
+ * changes nothing.
+ *
+ * A sequential reader (one continuing where its last access ended) gets
+ * a window ahead of it, which is requested when the stream is detected,
+ * and doubles, up to max_window, every time the reader reaches the start
+ * of the last window requested; so the next window is in flight while the
+ * reader consumes the previous one. A reader accessing records of a fixed
+ * size at a fixed stride (forwards or backwards) gets the next few records
+ * fetched once the stride repeated. Any other access is random, and ends
+ * the stream; the next one starts with half the window this one reached.
+ *
+ * posix_fadvise()/madvise() hints switch between normal detection,
+ * sequential (streams start with, and may grow to, a larger window) and
+ * random (no readahead at all).
+ */
+class readahead {
+public:
+    enum class advice { normal, sequential, random };
+    static constexpr size_t min_window = 32 << 10;
+    static constexpr size_t max_window = 1 << 20;
+    // records fetched ahead of a strided reader
+    static constexpr unsigned stride_depth = 4;
+
+    readahead() {}
+
+    void advise(advice a)
+    {
+        _advice = a;
+        reset();
+    }
+
+    advice get_advice() const { return _advice; }
+
+    // Size of the next window requested ahead of a sequential reader
+    size_t window() const { return _window; }
+
+    /**
+     * Reports an access of len bytes at offset, and calls
+     * issue(offset, len) for every range which should be read ahead.
+     * size is the file's size: nothing past it is requested.
+     */
+    template <typename Issue>
+    void access(off_t offset, size_t len, off_t size, Issue issue)
+    {
+        if (_advice == advice::random || !len) {
+            return;
+        }
+        off_t end = offset + len;
+        if (offset == _prev && end == _next) {
+            // The same access again, e.g. a page fault retried
+            return;
+        }
+        bool sequential = offset == _next ||
+            (_advice == advice::sequential && _next < 0);
+        bool strided = !sequential && _stride && offset - _prev == _stride;
+
+        if (sequential) {
+            bool start = !_ra_end;
+            if (start) {
+                _window = std::max(_window, initial_window(len));
+            }
+            if (start || end > _ra_end) {
+                // A new stream, or the reader overtook the readahead
+                _trigger = _ra_end = end;
+            }
+            if (end >= _trigger) {
+                if (!start) {
+                    _window = std::min(_window * 2, limit());
+                }
+                _trigger = _ra_end;
+                issue_range(_ra_end, _window, size, issue);
+                _ra_end += _window;
+            }
+            _stride = 0;
+        } else if (strided) {
+            // Fetch the records up to stride_depth ahead which were not
+            // requested yet
+            for (unsigned i = 1; i <= stride_depth; i++) {
+                off_t rec = offset + _stride * off_t(i);
+                if (rec < 0 || rec >= size) {
+                    break;
+                }
+                if (_stride > 0 ? rec <= _ra_stride : rec >= _ra_stride) {
+                    continue;
+                }
+                issue_range(rec, len, size, issue);
+                _ra_stride = rec;
+            }
+        } else {
+            _stride = _prev >= 0 ? offset - _prev : 0;
+            _ra_stride = offset;
+            if (_ra_end) {
+                _window = std::max(_window / 2, initial_window(len));
+                _trigger = _ra_end = 0;
+            }
+        }
+        _prev = offset;
+        _next = end;
+    }
+private:
+    void reset()
+    {
+        _next = _prev = -1;
+        _stride = _ra_stride = 0;
+        _trigger = _ra_end = 0;
+        _window = 0;
+    }
+    size_t limit() const
+    {
+        return _advice == advice::sequential ? max_window * 2 : size_t(max_window);
+    }
+    size_t initial_window(size_t len) const
+    {
+        if (_advice == advice::sequential) {
+            return max_window / 2;
+        }
+        return std::min(std::max(len * 4, size_t(min_window)), size_t(max_window));
+    }
+    template <typename Issue>
+    static void issue_range(off_t offset, size_t len, off_t size, Issue& issue)
+    {
+        if (offset >= size) {
+            return;
+        }
+        issue(offset, std::min(len, size_t(size - offset)));
+    }
+private:
+    advice _advice = advice::normal;
+    // Where the last access started and ended
+    off_t _prev = -1;
+    off_t _next = -1;
+    // Sequential stream: [_trigger, _ra_end) is the last window requested
+    size_t _window = 0;
+    off_t _trigger = 0;
+    off_t _ra_end = 0;
+    // Strided stream: the last record requested
+    off_t _stride = 0;
+    off_t _ra_stride = 0;
+};
+
+}
+
+#endif
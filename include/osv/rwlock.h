@@ -17,6 +17,8 @@
 
 #ifdef __cplusplus
 
+#include <atomic>
+
 class rwlock;
 
 // an rwlock pretending it is an ordinary lock for
@@ -82,22 +84,34 @@ public:
     bool has_readers();
 
 private:
-
-    void writer_wait_lockable();
-    void reader_wait_lockable();
-
-    bool read_lockable();
-    bool write_lockable();
+    // _state holds the number of readers, and the writer bit, which is set
+    // while a writer owns the lock or is waiting for the readers to leave
+    // it. Readers which find it clear take the lock with a single atomic
+    // operation, without touching _mtx; the others, and all writers, go
+    // through _mtx.
+    static constexpr unsigned writer = 1u << 31;
+    static constexpr unsigned readers_mask = writer - 1;
+
+    void rlock_slow();
+    void runlock_slow();
+    void writer_release();
 
     friend class rwlock_for_read;
     friend class rwlock_for_write;
 
+    std::atomic<unsigned> _state;
+
+#else
+
+    unsigned _state;
+
 #endif // __cplusplus
 
     mutex_t _mtx;
-    unsigned _readers;
     waitqueue _read_waiters;
     waitqueue _write_waiters;
+    // the writer owning the lock, waiting for the readers to leave
+    waitqueue _drain_waiters;
 
     void* _wowner;
     unsigned _wrecurse;
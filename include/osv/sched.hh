@@ -77,7 +77,7 @@ public:
         _mask.fetch_or(1UL << c, std::memory_order_release);
     }
     bool test_and_set(unsigned c) {
-        unsigned bit = 1UL << c;
+        unsigned long bit = 1UL << c;
         return _mask.fetch_or(bit, std::memory_order_release) & bit;
     }
     bool test_all_and_set(unsigned c) {
@@ -802,6 +802,28 @@ struct cpu : private timer_base::client {
     void send_wakeup_ipi();
     void load_balance();
     unsigned load();
+    // Where this CPU sits in the machine, filled in by the architecture code
+    // before smp_launch(): CPUs with the same core id are SMT siblings, and
+    // likewise for the last-level cache and the package.
+    struct topology_ids {
+        unsigned core;
+        unsigned llc;
+        unsigned package;
+    } topology;
+    // Load balancing domains, from the closest to the farthest: the CPUs
+    // sharing our core, our last-level cache, our package, and all of them.
+    // Each includes this CPU.
+    enum { smt_domain, llc_domain, package_domain, machine_domain, nr_domains };
+    std::vector<cpu*> domains[nr_domains];
+    static void init_domains();
+    // Average number of runnable threads, over the last few milliseconds
+    float load_avg();
+    void update_load(osv::clock::uptime::time_point now);
+    // Idle CPUs which asked us for a thread to run
+    cpu_set balance_requests;
+    void request_work();
+    void handle_balance_requests();
+    bool push_thread(cpu* target);
     /**
      * Try to reschedule.
      *
@@ -825,6 +847,10 @@ struct cpu : private timer_base::client {
     // For scheduler:
     runtime_t c;
     int renormalize_count;
+    // For load_avg(); written by this CPU, read by everyone
+    std::atomic<float> _load_avg { 0 };
+    std::atomic<unsigned> _load_nr { 0 };
+    std::atomic<s64> _load_stamp { 0 };
 };
 
 class cpu::notifier {
@@ -13,6 +13,7 @@
 
 struct socket;
 struct socket_closer;
+class vfs_file;
 
 extern "C" int soclose(socket* so);
 
@@ -40,6 +41,7 @@ public:
     virtual void poll_install(pollreq& pr) override;
     virtual void poll_uninstall(pollreq& pr) override;
     int bsd_ioctl(u_long cmd, void* data);
+    int sendfile(vfs_file* fp, off_t offset, size_t count, size_t& sent);
     socket* so;
 };
 
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef __OSV_TIMER_WHEEL_HH
+#define __OSV_TIMER_WHEEL_HH
+
+#include <chrono>
+#include <limits>
+#include <osv/bitset-iter.hh>
+#include <osv/debug.hh>
+#include <boost/intrusive/list.hpp>
+
+namespace bi = boost::intrusive;
+
+/**
+ * A hierarchical timing wheel for coarse timers, such as the network
+ * protocol timers, which are armed and cancelled far more often than
+ * they fire.
+ *
+ * Time is cut into ticks of a fixed resolution, and a timer expires
+ * on the first tick at or after its timeout, so it can be expired up to
+ * one tick late but never early. In return insert() and remove() are
+ * O(1), and all timers falling on the same tick are expired together.
+ *
+ * The wheel has a level per 6 bit digit of the tick number, of 64 slots
+ * each. A timer sits on the level of the highest digit in which its
+ * expiry tick differs from the current tick, in the slot given by its
+ * own value of that digit. When the current tick reaches the start of a
+ * slot's range on a higher level, the slot is cascaded: its timers are
+ * spread over the lower levels. So a timer is moved at most once per
+ * level, and the slot a timer is in always follows from its expiry and
+ * the current tick, which is what makes remove() cheap.
+ *
+ * The interface is the same as timer_set's. The template type "Timer"
+ * should have a method named get_timeout() which returns
+ * Clock::time_point which denotes timer's expiration.
+ */
+template<typename Timer, bi::list_member_hook<> Timer::*link, typename Clock>
+class timer_wheel {
+public:
+    using time_point = typename Clock::time_point;
+    using duration = typename Clock::duration;
+private:
+    using tick_t = unsigned long;
+    using timer_list_t = bi::list<Timer, bi::member_hook<Timer, bi::list_member_hook<>, link>>;
+
+    static constexpr int tick_bits = std::numeric_limits<tick_t>::digits;
+    static constexpr int slot_bits = 6;
+    static constexpr int n_slots = 1 << slot_bits;
+    static constexpr int n_levels = (tick_bits + slot_bits - 1) / slot_bits;
+    static constexpr tick_t max_tick = std::numeric_limits<tick_t>::max();
+
+    timer_list_t _slots[n_levels][n_slots];
+    // Bit i of _occupied[level] is set iff _slots[level][i] is not empty
+    tick_t _occupied[n_levels];
+    // Active timers whose expiry tick is not after _now
+    timer_list_t _due;
+    timer_list_t _expired;
+    tick_t _resolution;
+    tick_t _now;
+private:
+    static tick_t get_timestamp(time_point _time_point)
+    {
+        return _time_point.time_since_epoch().count();
+    }
+
+    tick_t get_expiry(Timer& timer) const
+    {
+        auto timestamp = get_timestamp(timer.get_timeout());
+        return timestamp / _resolution + (timestamp % _resolution != 0);
+    }
+
+    static int get_level(tick_t expiry, tick_t now)
+    {
+        int msb = tick_bits - 1 - bitsets::count_leading_zeros(expiry ^ now);
+        return msb / slot_bits;
+    }
+
+    static int get_slot(tick_t expiry, int level)
+    {
+        return (expiry >> (level * slot_bits)) & (n_slots - 1);
+    }
+
+    void place(Timer& timer)
+    {
+        auto expiry = get_expiry(timer);
+        if (expiry <= _now) {
+            _due.push_back(timer);
+            return;
+        }
+        auto level = get_level(expiry, _now);
+        auto slot = get_slot(expiry, level);
+        _slots[level][slot].push_back(timer);
+        _occupied[level] |= tick_t(1) << slot;
+    }
+
+    // Returns the next tick at which a slot needs to be processed, and
+    // the slot's level. Occupied slots are always ahead of _now's digit on
+    // their level, and the lowest occupied level comes first.
+    tick_t get_next_event(int& level) const
+    {
+        if (!_due.empty()) {
+            level = -1;
+            return _now;
+        }
+        for (level = 0; level < n_levels; level++) {
+            if (!_occupied[level]) {
+                continue;
+            }
+            auto slot = bitsets::count_trailing_zeros(_occupied[level]);
+            auto shift = level * slot_bits;
+            auto high = shift + slot_bits;
+            tick_t base = high < tick_bits ? (_now >> high) << high : 0;
+            return base | (tick_t(slot) << shift);
+        }
+        return max_tick;
+    }
+
+    tick_t get_next_event() const
+    {
+        int level;
+        return get_next_event(level);
+    }
+public:
+    explicit timer_wheel(duration resolution)
+        : _occupied()
+        , _resolution(resolution.count())
+        , _now(0)
+    {
+        assert(_resolution > 0);
+    }
+
+    /**
+     * Adds timer to the active set.
+     *
+     * The value returned by timer.get_timeout() is used as timer's expiry. The result
+     * of timer.get_timeout() must not change while the timer is in the active set.
+     *
+     * Preconditions:
+     *  - this timer must not be currently in the active set or in the expired set.
+     *
+     * Postconditions:
+     *  - this timer will be added to the active set until it is expired
+     *    by a call to expire() or removed by a call to remove().
+     *
+     * Returns true if and only if get_next_timeout() moved earlier. When this
+     * function returns true the caller should reschedule expire() to be
+     * called at get_next_timeout().
+     */
+    bool insert(Timer& timer)
+    {
+        auto next = get_next_event();
+        place(timer);
+        return get_next_event() < next;
+    }
+
+    /**
+     * Removes timer from the active set.
+     *
+     * Preconditions:
+     *  - timer must be currently in the active set. Note: it must not be in
+     *    the expired set.
+     *
+     * Postconditions:
+     *  - timer is no longer in the active set.
+     *  - this object will no longer hold any references to this timer.
+     */
+    void remove(Timer& timer)
+    {
+        auto expiry = get_expiry(timer);
+        if (expiry <= _now) {
+            _due.erase(_due.iterator_to(timer));
+            return;
+        }
+        auto level = get_level(expiry, _now);
+        auto slot = get_slot(expiry, level);
+        auto& list = _slots[level][slot];
+        list.erase(list.iterator_to(timer));
+        if (list.empty()) {
+            _occupied[level] &= ~(tick_t(1) << slot);
+        }
+    }
+
+    /**
+     * Expires active timers.
+     *
+     * The time points passed to this function must be monotonically increasing.
+     * Use get_next_timeout() to query for the next time point.
+     *
+     * Postconditons:
+     *  - all timers from the active set whose expiry tick is not after the
+     *    tick of now are moved to the expired set.
+     */
+    void expire(time_point now)
+    {
+        auto target = get_timestamp(now) / _resolution;
+
+        if (target < _now) {
+            abort("%ld < %ld, now=%ld\n", target, _now, Clock::now().time_since_epoch().count());
+        }
+
+        for (;;) {
+            _expired.splice(_expired.end(), _due);
+
+            int level;
+            auto next = get_next_event(level);
+            if (next > target) {
+                break;
+            }
+
+            _now = next;
+            auto slot = get_slot(next, level);
+            auto& list = _slots[level][slot];
+            _occupied[level] &= ~(tick_t(1) << slot);
+            while (!list.empty()) {
+                auto& timer = *list.begin();
+                list.pop_front();
+                place(timer);
+            }
+        }
+
+        _now = target;
+    }
+
+    /**
+     * Removes and returns a timer from the expired set.
+     *
+     * Preconditions:
+     *  - none
+     *
+     * Postconditions:
+     *  - when result == nullptr then there are no timers in the expired set
+     *  - when result != nullptr the returned timer is no longer in the
+     *    expired set and this structure will no longer hold any references
+     *    to this timer.
+     */
+    Timer* pop_expired()
+    {
+        if (_expired.empty()) {
+            return nullptr;
+        }
+        Timer* timer = &*_expired.begin();
+        _expired.pop_front();
+        return timer;
+    }
+
+    /**
+     * Returns a time point at which expire() should be called
+     * in order to ensure timers are expired in a timely manner.
+     *
+     * This is the expiry of the earliest timer, or an earlier tick at which
+     * a slot needs to be cascaded, in which case expire() may find nothing
+     * to expire yet.
+     *
+     * Returned values are monotonically increasing.
+     */
+    time_point get_next_timeout() const
+    {
+        auto next = get_next_event();
+        if (next > tick_t(std::numeric_limits<typename duration::rep>::max()) / _resolution) {
+            return time_point::max();
+        }
+        return time_point(duration(next * _resolution));
+    }
+
+    /**
+     * Clears both active and expired timer sets.
+     */
+    void clear()
+    {
+        for (int level = 0; level < n_levels; level++) {
+            for (int i : bitsets::for_each_set(std::bitset<n_slots>(_occupied[level]))) {
+                _slots[level][i].clear();
+            }
+            _occupied[level] = 0;
+        }
+        _due.clear();
+        _expired.clear();
+    }
+
+    /**
+     * Returns true if and only if there are no timers in the active set.
+     */
+    bool empty() const
+    {
+        if (!_due.empty()) {
+            return false;
+        }
+        for (auto occupied : _occupied) {
+            if (occupied) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
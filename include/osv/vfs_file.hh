@@ -9,6 +9,8 @@
 #define VFS_FILE_HH_
 
 #include <osv/file.h>
+#include <osv/mutex.h>
+#include <osv/readahead.hh>
 
 class vfs_file final : public file {
 public:
@@ -25,8 +27,14 @@ public:
     virtual bool map_page(uintptr_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared);
     virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<0> ptep);
     virtual void sync(off_t start, off_t end);
+    virtual int fadvise(off_t offset, off_t len, int advice) override;
 
     int get_arcbuf(void *key, off_t offset);
+private:
+    void readahead_access(struct vnode *vp, off_t offset, size_t len);
+    // Not the vnode lock, which page faults would otherwise all take
+    mutex _readahead_lock;
+    osv::readahead _readahead;
 };
 
 #endif /* VFS_FILE_HH_ */
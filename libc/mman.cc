@@ -76,6 +76,14 @@ unsigned libc_madvise_to_advise(int advice)
         return mmu::advise_dontneed;
     } else if (advice == MADV_NOHUGEPAGE) {
         return mmu::advise_nohugepage;
+    } else if (advice == MADV_NORMAL) {
+        return mmu::advise_normal;
+    } else if (advice == MADV_SEQUENTIAL) {
+        return mmu::advise_sequential;
+    } else if (advice == MADV_RANDOM) {
+        return mmu::advise_random;
+    } else if (advice == MADV_WILLNEED) {
+        return mmu::advise_willneed;
     }
     return 0;
 }
@@ -11,7 +11,10 @@
 #include <boost/format.hpp>
 #include <osv/sched.hh>
 #include <osv/mutex.h>
-#include <osv/waitqueue.hh>
+#include <osv/wait_record.hh>
+#include <osv/trace.hh>
+#include <osv/numa.hh>
+#include <osv/mmu.hh>
 
 #include <syscall.h>
 #include <stdarg.h>
@@ -23,84 +26,392 @@
 #include <sys/utsname.h>
 #include <sys/mman.h>
 
-#include <unordered_map>
+#include <algorithm>
+#include <boost/intrusive/list.hpp>
 
 extern "C" long gettid()
 {
     return sched::thread::current()->id();
 }
 
-// We don't expect applications to use the Linux futex() system call (it is
-// normally only used to implement higher-level synchronization mechanisms),
-// but unfortunately gcc's C++ runtime uses a subset of futex in the
-// __cxa__guard_* functions, which safeguard the concurrent initialization
-// of function-scope static objects. We only implement here this subset.
-// The __cxa_guard_* functions only call futex in the rare case of contention,
-// in fact so rarely that OSv existed for a year before anyone noticed futex
-// was missing. So the performance of this implementation is not critical.
-static std::unordered_map<void*, waitqueue> queues;
-static mutex queues_mutex;
+// Linux futex() support. Beyond gcc's C++ runtime, which uses a subset of
+// futex in the __cxa_guard_* functions, futex is the building block of
+// glibc-style condition variables and of the JVM's parkers, so it can be
+// heavily contended. Waiters are therefore kept in a fixed table of hashed
+// buckets, each protected by its own lock, so that unrelated futexes never
+// contend with each other. Every waiter sits on a stack-allocated
+// futex_waiter linked into the bucket of the address it waits on; requeue
+// operations move waiters between buckets, so a waiter always remembers
+// which bucket it is currently queued on.
 enum {
     FUTEX_WAIT           = 0,
     FUTEX_WAKE           = 1,
+    FUTEX_FD             = 2,
+    FUTEX_REQUEUE        = 3,
+    FUTEX_CMP_REQUEUE    = 4,
+    FUTEX_WAKE_OP        = 5,
+    FUTEX_LOCK_PI        = 6,
+    FUTEX_UNLOCK_PI      = 7,
+    FUTEX_TRYLOCK_PI     = 8,
+    FUTEX_WAIT_BITSET    = 9,
+    FUTEX_WAKE_BITSET    = 10,
+    FUTEX_WAIT_REQUEUE_PI = 11,
+    FUTEX_CMP_REQUEUE_PI = 12,
     FUTEX_PRIVATE_FLAG   = 128,
     FUTEX_CLOCK_REALTIME = 256,
     FUTEX_CMD_MASK       = ~(FUTEX_PRIVATE_FLAG|FUTEX_CLOCK_REALTIME),
 };
 
-int futex(int *uaddr, int op, int val, const struct timespec *timeout,
-        int *uaddr2, int val3)
+enum {
+    FUTEX_OP_SET         = 0,
+    FUTEX_OP_ADD         = 1,
+    FUTEX_OP_OR          = 2,
+    FUTEX_OP_ANDN        = 3,
+    FUTEX_OP_XOR         = 4,
+    FUTEX_OP_OPARG_SHIFT = 8,
+};
+
+enum {
+    FUTEX_OP_CMP_EQ      = 0,
+    FUTEX_OP_CMP_NE      = 1,
+    FUTEX_OP_CMP_LT      = 2,
+    FUTEX_OP_CMP_LE      = 3,
+    FUTEX_OP_CMP_GT      = 4,
+    FUTEX_OP_CMP_GE      = 5,
+};
+
+static constexpr u32 FUTEX_BITSET_MATCH_ANY = 0xffffffff;
+
+TRACEPOINT(trace_futex_wait, "uaddr=%p val=%d bitset=%x", int*, int, u32);
+TRACEPOINT(trace_futex_wait_ret, "uaddr=%p ret=%d", int*, int);
+TRACEPOINT(trace_futex_wake, "uaddr=%p nr=%d bitset=%x woken=%d", int*, int, u32, int);
+TRACEPOINT(trace_futex_requeue, "uaddr=%p uaddr2=%p woken=%d requeued=%d", int*, int*, int, int);
+
+namespace {
+
+struct futex_bucket;
+
+struct futex_waiter {
+    explicit futex_waiter(int* uaddr, u32 bitset)
+        : uaddr(uaddr), bitset(bitset), wr(sched::thread::current()) {}
+    int* uaddr;
+    u32 bitset;
+    futex_bucket* bucket = nullptr;
+    waiter wr;
+    boost::intrusive::list_member_hook<> hook;
+};
+
+typedef boost::intrusive::list<futex_waiter,
+        boost::intrusive::member_hook<futex_waiter,
+                boost::intrusive::list_member_hook<>,
+                &futex_waiter::hook>,
+        boost::intrusive::constant_time_size<false>> futex_waiter_list;
+
+struct futex_bucket {
+    mutex lock;
+    futex_waiter_list waiters;
+} __attribute__((aligned(64)));
+
+// Enough buckets that, even with many CPUs each hammering its own futexes,
+// the chance of two hot futexes sharing a bucket stays small.
+static constexpr unsigned futex_hash_bits = 10;
+static futex_bucket futex_table[1 << futex_hash_bits];
+
+futex_bucket& futex_hash(int* uaddr)
 {
-    switch (op & FUTEX_CMD_MASK) {
-    case FUTEX_WAIT:
-        WITH_LOCK(queues_mutex) {
-            if (*uaddr == val) {
-                waitqueue &q = queues[uaddr];
-                if (timeout) {
-                    sched::timer tmr(*sched::thread::current());
-                    tmr.set(std::chrono::seconds(timeout->tv_sec) +
-                            std::chrono::nanoseconds(timeout->tv_nsec));
-                    sched::thread::wait_for(queues_mutex, tmr, q);
-                    // FIXME: testing if tmr was expired isn't quite right -
-                    // we could have had both a wakeup and timer expiration
-                    // racing. It would be more correct to check if we were
-                    // waken by a FUTEX_WAKE. But how?
-                    if (tmr.expired()) {
-                        errno = ETIMEDOUT;
-                        return -1;
-                    }
-                } else {
-                    q.wait(queues_mutex);
-                }
-                return 0;
-            } else {
-                errno = EWOULDBLOCK;
-                return -1;
-            }
+    // Fibonacci hashing; futex words are 4-byte aligned so the low bits
+    // carry no information.
+    auto key = (reinterpret_cast<uintptr_t>(uaddr) >> 2) * 0x9E3779B97F4A7C15ULL;
+    return futex_table[key >> (64 - futex_hash_bits)];
+}
+
+// Lock two buckets in a fixed (address) order so that concurrent two-futex
+// operations in opposite directions cannot deadlock.
+void lock_buckets(futex_bucket& b1, futex_bucket& b2)
+{
+    if (&b1 == &b2) {
+        b1.lock.lock();
+    } else if (&b1 < &b2) {
+        b1.lock.lock();
+        b2.lock.lock();
+    } else {
+        b2.lock.lock();
+        b1.lock.lock();
+    }
+}
+
+void unlock_buckets(futex_bucket& b1, futex_bucket& b2)
+{
+    b1.lock.unlock();
+    if (&b1 != &b2) {
+        b2.lock.unlock();
+    }
+}
+
+// Must be called with the bucket locked. The wake happens under the bucket
+// lock, so a timed-out waiter which grabs the lock afterwards sees either
+// that it is still queued or that it was woken, never something in between.
+int wake_waiters(futex_bucket& b, int* uaddr, int nr, u32 bitset)
+{
+    int woken = 0;
+    for (auto it = b.waiters.begin(); it != b.waiters.end() && woken < nr;) {
+        auto& w = *it;
+        if (w.uaddr != uaddr || !(w.bitset & bitset)) {
+            ++it;
+            continue;
         }
-    case FUTEX_WAKE:
-        if(val < 0) {
+        it = b.waiters.erase(it);
+        __atomic_store_n(&w.bucket, nullptr, __ATOMIC_RELEASE);
+        w.wr.wake();
+        ++woken;
+    }
+    return woken;
+}
+
+// Must be called with both buckets locked.
+int requeue_waiters(futex_bucket& b1, int* uaddr, futex_bucket& b2,
+        int* uaddr2, int nr)
+{
+    int requeued = 0;
+    for (auto it = b1.waiters.begin(); it != b1.waiters.end() && requeued < nr;) {
+        auto& w = *it;
+        if (w.uaddr != uaddr) {
+            ++it;
+            continue;
+        }
+        ++requeued;
+        w.uaddr = uaddr2;
+        if (&b1 == &b2) {
+            ++it;
+            continue;
+        }
+        it = b1.waiters.erase(it);
+        __atomic_store_n(&w.bucket, &b2, __ATOMIC_RELEASE);
+        b2.waiters.push_back(w);
+    }
+    return requeued;
+}
+
+// Lock the bucket the waiter is currently queued on (if any), chasing it
+// across concurrent requeues. Returns nullptr, without locking anything, if
+// the waiter has already been dequeued by a waker.
+futex_bucket* lock_waiter_bucket(futex_waiter& w)
+{
+    while (true) {
+        auto b = __atomic_load_n(&w.bucket, __ATOMIC_ACQUIRE);
+        if (!b) {
+            return nullptr;
+        }
+        b->lock.lock();
+        if (w.bucket == b) {
+            return b;
+        }
+        b->lock.unlock();
+    }
+}
+
+int futex_wait(int* uaddr, int val, u32 bitset,
+        const struct timespec* timeout, bool absolute, clockid_t clock)
+{
+    if (!bitset) {
+        errno = EINVAL;
+        return -1;
+    }
+    trace_futex_wait(uaddr, val, bitset);
+    sched::timer tmr(*sched::thread::current());
+    if (timeout) {
+        if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+                timeout->tv_nsec >= 1000000000L) {
             errno = EINVAL;
             return -1;
         }
+        auto t = std::chrono::seconds(timeout->tv_sec) +
+                 std::chrono::nanoseconds(timeout->tv_nsec);
+        if (absolute) {
+            struct timespec now;
+            clock_gettime(clock, &now);
+            t -= std::chrono::seconds(now.tv_sec) +
+                 std::chrono::nanoseconds(now.tv_nsec);
+        }
+        if (t <= t.zero()) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        tmr.set(t);
+    }
 
-        WITH_LOCK(queues_mutex) {
-            auto i = queues.find(uaddr);
-            if (i != queues.end()) {
-                int waken = 0;
-                while( (val > waken) && !(i->second.empty()) ) {
-                    i->second.wake_one(queues_mutex);
-                    waken++;
-                }
-                if(i->second.empty()) {
-                    queues.erase(i);
-                }
-                return waken;
-            }
+    futex_waiter w(uaddr, bitset);
+    auto& b = futex_hash(uaddr);
+    WITH_LOCK(b.lock) {
+        if (__atomic_load_n(uaddr, __ATOMIC_RELAXED) != val) {
+            trace_futex_wait_ret(uaddr, EWOULDBLOCK);
+            errno = EWOULDBLOCK;
+            return -1;
         }
-        return 0;
+        w.bucket = &b;
+        b.waiters.push_back(w);
+    }
+    w.wr.wait(timeout ? &tmr : nullptr);
+    if (!w.wr.woken()) {
+        auto cur = lock_waiter_bucket(w);
+        if (cur) {
+            cur->waiters.erase(cur->waiters.iterator_to(w));
+            cur->lock.unlock();
+            trace_futex_wait_ret(uaddr, ETIMEDOUT);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        // A waker dequeued us just as the timer fired; it is committed to
+        // waking us, so wait for that to finish before w goes out of scope.
+        w.wr.wait();
+    }
+    trace_futex_wait_ret(uaddr, 0);
+    return 0;
+}
+
+int futex_wake(int* uaddr, int nr, u32 bitset)
+{
+    if (nr < 0 || !bitset) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto& b = futex_hash(uaddr);
+    int woken;
+    WITH_LOCK(b.lock) {
+        woken = wake_waiters(b, uaddr, nr, bitset);
+    }
+    trace_futex_wake(uaddr, nr, bitset, woken);
+    return woken;
+}
+
+int futex_requeue(int* uaddr, int nr_wake, int* uaddr2, int nr_requeue,
+        const int* cmpval)
+{
+    if (nr_wake < 0 || nr_requeue < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto& b1 = futex_hash(uaddr);
+    auto& b2 = futex_hash(uaddr2);
+    lock_buckets(b1, b2);
+    if (cmpval && __atomic_load_n(uaddr, __ATOMIC_RELAXED) != *cmpval) {
+        unlock_buckets(b1, b2);
+        errno = EAGAIN;
+        return -1;
+    }
+    int woken = wake_waiters(b1, uaddr, nr_wake, FUTEX_BITSET_MATCH_ANY);
+    int requeued = requeue_waiters(b1, uaddr, b2, uaddr2, nr_requeue);
+    unlock_buckets(b1, b2);
+    trace_futex_requeue(uaddr, uaddr2, woken, requeued);
+    return woken + requeued;
+}
+
+int futex_wake_op(int* uaddr, int nr_wake, int* uaddr2, int nr_wake2,
+        int encoded_op)
+{
+    int op = (encoded_op >> 28) & 7;
+    int cmp = (encoded_op >> 24) & 15;
+    // oparg and cmparg are sign-extended 12-bit fields
+    int oparg = (encoded_op << 8) >> 20;
+    int cmparg = (encoded_op << 20) >> 20;
+    if (encoded_op & (FUTEX_OP_OPARG_SHIFT << 28)) {
+        if (oparg < 0 || oparg > 31) {
+            errno = EINVAL;
+            return -1;
+        }
+        oparg = 1 << oparg;
+    }
+    if (op > FUTEX_OP_XOR || cmp > FUTEX_OP_CMP_GE) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    auto& b1 = futex_hash(uaddr);
+    auto& b2 = futex_hash(uaddr2);
+    lock_buckets(b1, b2);
+    int oldval;
+    switch (op) {
+    case FUTEX_OP_SET:
+        oldval = __atomic_exchange_n(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ADD:
+        oldval = __atomic_fetch_add(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_OR:
+        oldval = __atomic_fetch_or(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ANDN:
+        oldval = __atomic_fetch_and(uaddr2, ~oparg, __ATOMIC_SEQ_CST);
+        break;
+    default:
+        oldval = __atomic_fetch_xor(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    }
+    bool cond;
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: cond = oldval == cmparg; break;
+    case FUTEX_OP_CMP_NE: cond = oldval != cmparg; break;
+    case FUTEX_OP_CMP_LT: cond = oldval < cmparg; break;
+    case FUTEX_OP_CMP_LE: cond = oldval <= cmparg; break;
+    case FUTEX_OP_CMP_GT: cond = oldval > cmparg; break;
+    default:              cond = oldval >= cmparg; break;
+    }
+    int woken = wake_waiters(b1, uaddr, nr_wake, FUTEX_BITSET_MATCH_ANY);
+    if (cond) {
+        woken += wake_waiters(b2, uaddr2, nr_wake2, FUTEX_BITSET_MATCH_ANY);
+    }
+    unlock_buckets(b1, b2);
+    trace_futex_wake(uaddr, nr_wake, FUTEX_BITSET_MATCH_ANY, woken);
+    return woken;
+}
+
+}
+
+int futex(int *uaddr, int op, int val, const struct timespec *timeout,
+        int *uaddr2, int val3)
+{
+    // For the requeue and wake_op commands, the timeout argument actually
+    // carries a second count (val2).
+    int val2 = static_cast<int>(reinterpret_cast<uintptr_t>(timeout));
+    clockid_t clock = (op & FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME
+                                                   : CLOCK_MONOTONIC;
+    // Like Linux, only accept FUTEX_CLOCK_REALTIME on the commands whose
+    // timeout is absolute.
+    if ((op & FUTEX_CLOCK_REALTIME) &&
+            (op & FUTEX_CMD_MASK) != FUTEX_WAIT_BITSET &&
+            (op & FUTEX_CMD_MASK) != FUTEX_WAIT_REQUEUE_PI) {
+        errno = ENOSYS;
+        return -1;
+    }
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val, FUTEX_BITSET_MATCH_ANY, timeout,
+                false, clock);
+    case FUTEX_WAIT_BITSET:
+        return futex_wait(uaddr, val, val3, timeout, true, clock);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return futex_wake(uaddr, val, val3);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, val2, nullptr);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, val2, &val3);
+    case FUTEX_WAKE_OP:
+        return futex_wake_op(uaddr, val, uaddr2, val2, val3);
+    case FUTEX_FD:
+    case FUTEX_LOCK_PI:
+    case FUTEX_UNLOCK_PI:
+    case FUTEX_TRYLOCK_PI:
+    case FUTEX_WAIT_REQUEUE_PI:
+    case FUTEX_CMP_REQUEUE_PI:
+        // Priority inheritance requires knowing which thread owns the
+        // futex word, which OSv's scheduler doesn't track.
+        errno = ENOSYS;
+        return -1;
     default:
-        abort("Unimplemented futex() operation %d\n", op);
+        errno = EINVAL;
+        return -1;
     }
 }
 
@@ -108,38 +419,132 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 // function is not part of glibc (which OSv emulates), but part of a
 // separate library libnuma, which the user can simply load. libnuma's
 // implementation of get_mempolicy() calls syscall(__NR_get_mempolicy,...),
-// so this is what we need to expose, below.
+// so this is what we need to expose, below. The same goes for
+// set_mempolicy() and mbind().
 
-#define MPOL_DEFAULT 0
 #define MPOL_F_NODE         (1<<0)
 #define MPOL_F_ADDR         (1<<1)
 #define MPOL_F_MEMS_ALLOWED (1<<2)
+#define MPOL_MODE_FLAGS     (3<<14)
+
+static memory::numa::nodemask nodemask_from_user(const unsigned long *nmask,
+        unsigned long maxnode)
+{
+    if (!nmask || !maxnode) {
+        return memory::numa::nodemask();
+    }
+    unsigned long bits = nmask[0];
+    if (maxnode < sizeof(bits) * 8) {
+        bits &= (1UL << maxnode) - 1;
+    }
+    return memory::numa::nodemask(bits);
+}
+
+static int nodemask_to_user(memory::numa::nodemask mask, unsigned long *nmask,
+        unsigned long maxnode)
+{
+    if (!nmask) {
+        return 0;
+    }
+    if (maxnode < memory::numa::nr_nodes()) {
+        return EINVAL;
+    }
+    auto words = (maxnode + sizeof(*nmask) * 8 - 1) / (sizeof(*nmask) * 8);
+    std::fill(nmask, nmask + words, 0);
+    nmask[0] = mask.to_ulong();
+    return 0;
+}
 
 static long get_mempolicy(int *policy, unsigned long *nmask,
         unsigned long maxnode, void *addr, int flags)
 {
-    // As OSv has no support for NUMA nodes, we do here the minimum possible,
-    // which is basically to return the same policy (MPOL_DEFAULT) and list
-    // of nodes (just node 0) no matter if the caller asked for the default
-    // policy, the allowed policy, or the policy for a specific address.
-    if ((flags & MPOL_F_NODE)) {
-        *policy = 0; // in this case, store a node id, not a policy
+    memory::numa::policy_mode mode;
+    memory::numa::nodemask mask;
+    memory::numa::get_policy(mode, mask);
+
+    if (flags & MPOL_F_MEMS_ALLOWED) {
+        if (flags & (MPOL_F_NODE | MPOL_F_ADDR)) {
+            errno = EINVAL;
+            return -1;
+        }
+        mode = memory::numa::mpol_default;
+        mask = memory::numa::all_nodes();
+    } else if (flags & MPOL_F_NODE) {
+        // In this case, store a node id, not a policy: the node backing the
+        // given address, or the node we would allocate from next.
+        if (!policy) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (flags & MPOL_F_ADDR) {
+            // Like Linux, fault the page in if it isn't yet
+            if (!mmu::isreadable(addr, 1)) {
+                errno = EFAULT;
+                return -1;
+            }
+            *policy = memory::numa::node_of_addr(
+                    mmu::phys_to_virt(mmu::virt_to_phys(addr)));
+        } else {
+            *policy = memory::numa::current_node();
+        }
         return 0;
     }
+    // We don't keep per-range policies (see mbind() below), so MPOL_F_ADDR
+    // alone reports the calling thread's policy.
     if (policy) {
-        *policy = MPOL_DEFAULT;
+        *policy = mode;
     }
-    if (nmask) {
-        if (maxnode < 1) {
+    auto error = nodemask_to_user(mask, nmask, maxnode);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static long set_mempolicy(int mode, unsigned long *nmask,
+        unsigned long maxnode)
+{
+    auto error = memory::numa::set_policy(
+            static_cast<memory::numa::policy_mode>(mode & ~MPOL_MODE_FLAGS),
+            nodemask_from_user(nmask, maxnode));
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Anonymous memory is populated when first touched, from the pools of the
+// faulting CPU's node, or as directed by the faulting thread's
+// set_mempolicy(). We don't track policies per address range, so mbind()
+// only validates its arguments and is otherwise a hint we cannot act upon.
+static long mbind(void *addr, unsigned long len, int mode,
+        unsigned long *nmask, unsigned long maxnode, unsigned flags)
+{
+    if (reinterpret_cast<uintptr_t>(addr) & (mmu::page_size - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto mask = nodemask_from_user(nmask, maxnode) & memory::numa::all_nodes();
+    switch (mode & ~MPOL_MODE_FLAGS) {
+    case memory::numa::mpol_default:
+    case memory::numa::mpol_local:
+    case memory::numa::mpol_preferred:
+        return 0;
+    case memory::numa::mpol_bind:
+    case memory::numa::mpol_interleave:
+        if (mask.none()) {
             errno = EINVAL;
             return -1;
         }
-        nmask[0] |= 1;
+        return 0;
+    default:
+        errno = EINVAL;
+        return -1;
     }
-    return 0;
 }
 
-
 // As explained in the sched_getaffinity(2) manual page, the interface of the
 // sched_getaffinity() function is slightly different than that of the actual
 // system call we need to implement here.
@@ -280,6 +685,8 @@ long syscall(long number, ...)
     SYSCALL4(epoll_wait, int, struct epoll_event *, int, int);
     SYSCALL4(accept4, int, struct sockaddr *, socklen_t *, int);
     SYSCALL5(get_mempolicy, int *, unsigned long *, unsigned long, void *, int);
+    SYSCALL3(set_mempolicy, int, unsigned long *, unsigned long);
+    SYSCALL6(mbind, void *, unsigned long, int, unsigned long *, unsigned long, unsigned);
     SYSCALL3(sched_getaffinity_syscall, pid_t, unsigned, unsigned long *);
     SYSCALL6(long_mmap, void *, size_t, int, int, int, off_t);
     SYSCALL2(munmap, void *, size_t);
@@ -16,6 +16,7 @@
 #include <osv/power.hh>
 #include <osv/debug.hh>
 #include <osv/sched.hh>
+#include <osv/mempool.hh>
 #include <api/unistd.h>
 #include <osv/commands.hh>
 #include <algorithm>
@@ -79,6 +80,20 @@ void init(routes& routes)
         return memory::get_balloon_size();
     });
 
+    os_memory_malloc.set_handler([](const_req req) {
+        vector<httpserver::json::MallocPool> res;
+        httpserver::json::MallocPool pool;
+        for (auto& p : memory::stats::pools()) {
+            pool.size = p.object_size;
+            pool.slab_size = p.slab_size;
+            pool.slabs = p.slabs;
+            pool.in_use = p.in_use;
+            pool.allocs = p.allocs;
+            res.push_back(pool);
+        }
+        return res;
+    });
+
     os_shutdown.set_handler([](const_req req) {
         osv::shutdown();
         return "";
@@ -31,6 +31,14 @@ class testos(basetest.Basetest):
         val = self.curl(path)
         self.assertGreater(val, 1024 * 1024 * 256, msg="Free memory should be greater than 256Mb")
 
+    def test_os_malloc_pools(self):
+        path = self.path_by_nick(self.os_api, "os_memory_malloc")
+        val = self.curl(path)
+        self.assertGreater(len(val), 0)
+        for pool in val:
+            self.assert_key_in("in_use", pool)
+            self.assertGreater(pool["slab_size"], pool["size"])
+
     def test_os_threads(self):
         path = self.path_by_nick(self.os_api, "os_threads")
         val = self.curl(path)
@@ -215,22 +215,6 @@ int munlockall(void)
     return 0;
 }
 
-int posix_fadvise(int fd, off_t offset, off_t len, int advice)
-{
-    switch (advice) {
-    case POSIX_FADV_NORMAL:
-    case POSIX_FADV_SEQUENTIAL:
-    case POSIX_FADV_RANDOM:
-    case POSIX_FADV_NOREUSE:
-    case POSIX_FADV_WILLNEED:
-    case POSIX_FADV_DONTNEED:
-        return 0;
-    default:
-        return EINVAL;
-    }
-}
-LFS64(posix_fadvise);
-
 int posix_fallocate(int fd, off_t offset, off_t len)
 {
     return ENOSYS;
@@ -316,9 +316,8 @@ class osv_zfs(gdb.Command):
         zfs_no_write_throttle = gdb.parse_and_eval('zfs_no_write_throttle')
         zfs_txg_timeout = gdb.parse_and_eval('zfs_txg_timeout')
         zfs_write_limit_override = gdb.parse_and_eval('zfs_write_limit_override')
-        # Min/Max number of concurrent pending I/O requests on each device
-        vdev_min_pending = gdb.parse_and_eval('zfs_vdev_min_pending')
-        vdev_max_pending = gdb.parse_and_eval('zfs_vdev_max_pending')
+        # Max number of concurrent active I/O requests on each device
+        vdev_max_active = gdb.parse_and_eval('zfs_vdev_max_active')
 
         print (":: ZFS TUNABLES ::")
         print ("\tzil_replay_disable:       %d" % zil_replay_disable)
@@ -327,8 +326,14 @@ class osv_zfs(gdb.Command):
         print ("\tzfs_no_write_throttle:    %d" % zfs_no_write_throttle)
         print ("\tzfs_txg_timeout:          %d" % zfs_txg_timeout)
         print ("\tzfs_write_limit_override: %d" % zfs_write_limit_override)
-        print ("\tvdev_min_pending:         %d" % vdev_min_pending)
-        print ("\tvdev_max_pending:         %d" % vdev_max_pending)
+        print ("\tvdev_max_active:          %d" % vdev_max_active)
+        # Min/Max active I/O requests of each I/O class
+        for c in ['sync_read', 'sync_write', 'async_read', 'async_write', 'scrub']:
+            min_active = gdb.parse_and_eval('zfs_vdev_%s_min_active' % c)
+            max_active = gdb.parse_and_eval('zfs_vdev_%s_max_active' % c)
+            print ("\tvdev_%s_active:%s%d-%d" % (c, ' ' * (13 - len(c)), min_active, max_active))
+        vdev_sync_latency_target = gdb.parse_and_eval('zfs_vdev_sync_latency_target')
+        print ("\tvdev_sync_latency_target: %d us" % vdev_sync_latency_target)
 
         # virtual device read-ahead cache details (device-level prefetch)
         vdev_cache_size = gdb.parse_and_eval('zfs_vdev_cache_size')
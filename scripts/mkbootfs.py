@@ -86,19 +86,44 @@ def unsymlink(f):
 files = list(expand(files.items()))
 files = [(x, unsymlink(y)) for (x, y) in files]
 
-pos = (len(files) + 1) * metadata_size
+# Every entry is a 128 byte (size, offset, type, name) record. Directories
+# come first, parents before their children, so the loader creates each
+# with a single mkdir(). File data is page aligned and the last page of
+# each file zero filled, so the kernel can use the image pages as the file
+# pages instead of copying them.
+BOOTFS_FILE = 0
+BOOTFS_DIR = 1
+page_size = 4096
+
+def page_align(n):
+    return (n + page_size - 1) & ~(page_size - 1)
+
+dirs = set()
+for name, hostname in files:
+    d = os.path.dirname(name)
+    while d not in ('', '/'):
+        dirs.add(d)
+        d = os.path.dirname(d)
+dirs = sorted(dirs, key=lambda d: (d.count('/'), d))
+
+pos = page_align((len(dirs) + len(files) + 1) * metadata_size)
+
+for name in dirs:
+    out.write(struct.pack('QQB111s', 0, 0, BOOTFS_DIR, name.encode()))
 
 for name, hostname in files:
     size = os.stat(hostname).st_size
-    metadata = struct.pack('QQ112s', size, pos, name.encode())
+    metadata = struct.pack('QQB111s', size, pos, BOOTFS_FILE, name.encode())
     out.write(metadata)
-    pos += size
+    pos += page_align(size)
     depends.write(u'\t%s \\\n' % (hostname,))
 
 out.write(struct.pack('128s', b''))
 
 for name, hostname in files:
+    out.write(b'\0' * (page_align(out.tell()) - out.tell()))
     out.write(open(hostname, 'rb').read())
+out.write(b'\0' * (page_align(out.tell()) - out.tell()))
 
 depends.write(u'\n\n')
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures epoll with a large number of idle registrations and a smaller
+// set of active ones, shared by several worker threads waiting on the same
+// epoll fd. Producers signal random active eventfds, and the workers
+// consume them. We report the event throughput, the wakeup latency, and
+// the number of epoll_wait() returns per event - a thundering herd shows
+// up as several returns, most of them empty, for each event.
+//
+// Usage: misc-epoll-perf.so [idle] [active] [workers] [seconds]
+// The number of idle descriptors is clipped to the size of the file
+// descriptor table.
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+using _clock = std::chrono::high_resolution_clock;
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            _clock::now().time_since_epoch()).count();
+}
+
+struct alignas(64) active_fd {
+    int fd;
+    std::atomic<uint64_t> signalled { 0 };
+};
+
+struct alignas(64) worker_stats {
+    unsigned long events = 0;
+    unsigned long returns = 0;
+    unsigned long empty_returns = 0;
+    std::vector<uint64_t> latency;
+};
+
+int main(int argc, char **argv)
+{
+    long nidle = argc > 1 ? atol(argv[1]) : 100000;
+    int nactive = argc > 2 ? atoi(argv[2]) : 1000;
+    int nworkers = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    int secs = argc > 4 ? atoi(argv[4]) : 10;
+
+    long fdmax = sysconf(_SC_OPEN_MAX) - nactive - 64;
+    if (nidle > fdmax) {
+        printf("Clipping idle descriptors from %ld to %ld\n", nidle, fdmax);
+        nidle = fdmax;
+    }
+
+    int ep = epoll_create1(0);
+    std::vector<int> idle;
+    auto start = _clock::now();
+    for (long i = 0; i < nidle; i++) {
+        int fd = eventfd(0, EFD_NONBLOCK);
+        if (fd < 0) {
+            printf("eventfd failed after %ld descriptors\n", i);
+            break;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = ~0ull;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        idle.push_back(fd);
+    }
+    std::chrono::duration<double> reg = _clock::now() - start;
+    printf("%zu idle registrations in %.3f s (%.2f us each)\n", idle.size(),
+            reg.count(), reg.count() * 1e6 / std::max<size_t>(1, idle.size()));
+
+    std::vector<active_fd> active(nactive);
+    for (int i = 0; i < nactive; i++) {
+        active[i].fd = eventfd(0, EFD_NONBLOCK);
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, active[i].fd, &ev);
+    }
+
+    std::atomic<bool> stop { false };
+    std::vector<worker_stats> stats(nworkers);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < nworkers; w++) {
+        threads.emplace_back([&, w] {
+            auto& st = stats[w];
+            epoll_event events[64];
+            while (!stop.load(std::memory_order_relaxed)) {
+                int n = epoll_wait(ep, events, 64, 100);
+                st.returns++;
+                st.empty_returns += n == 0;
+                for (int i = 0; i < n; i++) {
+                    auto& a = active[events[i].data.u64];
+                    uint64_t v;
+                    if (read(a.fd, &v, sizeof(v)) != sizeof(v)) {
+                        continue;
+                    }
+                    auto t = a.signalled.exchange(0);
+                    if (t) {
+                        st.latency.push_back(now_ns() - t);
+                    }
+                    st.events++;
+                }
+            }
+        });
+    }
+
+    // Each producer signals its own slice of the active descriptors, and
+    // waits for a descriptor to be consumed before signalling it again.
+    int nproducers = std::min(nactive, std::max(1, nworkers / 2));
+    std::vector<std::thread> producers;
+    for (int p = 0; p < nproducers; p++) {
+        producers.emplace_back([&, p] {
+            std::mt19937 rand(p);
+            int lo = nactive * p / nproducers;
+            int hi = nactive * (p + 1) / nproducers;
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto& a = active[lo + rand() % (hi - lo)];
+                uint64_t expected = 0;
+                if (a.signalled.compare_exchange_strong(expected, now_ns())) {
+                    uint64_t one = 1;
+                    auto r = write(a.fd, &one, sizeof(one));
+                    (void)r;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(secs));
+    stop.store(true);
+    for (auto& t : producers) {
+        t.join();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    unsigned long events = 0, returns = 0, empty = 0;
+    std::vector<uint64_t> lat;
+    for (auto& st : stats) {
+        events += st.events;
+        returns += st.returns;
+        empty += st.empty_returns;
+        lat.insert(lat.end(), st.latency.begin(), st.latency.end());
+    }
+    std::sort(lat.begin(), lat.end());
+    printf("%zu idle, %d active, %d workers, %d producers\n", idle.size(),
+            nactive, nworkers, nproducers);
+    printf("%.0f events/s, %.3f epoll_wait returns per event (%lu empty)\n",
+            events / double(secs), returns / std::max(1.0, double(events)),
+            empty);
+    if (!lat.empty()) {
+        printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                lat[lat.size() / 2] / 1e3, lat[lat.size() * 99 / 100] / 1e3,
+                lat.back() / 1e3);
+    }
+
+    for (auto& a : active) {
+        close(a.fd);
+    }
+    for (auto fd : idle) {
+        close(fd);
+    }
+    close(ep);
+    return 0;
+}
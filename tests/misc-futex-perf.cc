@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures futex wake latency and throughput as the number of CPUs
+// concurrently using futexes grows. Each pair of threads ping-pongs on its
+// own pair of futex words, so with a scalable futex implementation the
+// aggregate throughput should grow with the number of pairs, and the
+// per-wake latency should stay flat.
+
+#include <unistd.h>
+#include <syscall.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using _clock = std::chrono::high_resolution_clock;
+
+static long futex(std::atomic<int>* uaddr, int op, int val,
+        const struct timespec* timeout = nullptr)
+{
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, timeout,
+            nullptr, 0);
+}
+
+static void wait_for_value(std::atomic<int>& word, int val)
+{
+    int cur;
+    while ((cur = word.load()) != val) {
+        futex(&word, FUTEX_WAIT, cur);
+    }
+}
+
+static void post(std::atomic<int>& word, int val)
+{
+    word.store(val);
+    futex(&word, FUTEX_WAKE, 1);
+}
+
+struct alignas(64) ping_pong {
+    alignas(64) std::atomic<int> ping { 0 };
+    alignas(64) std::atomic<int> pong { 0 };
+};
+
+static void test_ping_pong(unsigned npairs, int iterations)
+{
+    std::vector<ping_pong> pp(npairs);
+    std::vector<std::thread> threads;
+    auto start = _clock::now();
+    for (unsigned i = 0; i < npairs; i++) {
+        auto& p = pp[i];
+        threads.emplace_back([&p, iterations] {
+            for (int j = 1; j <= iterations; j++) {
+                post(p.ping, j);
+                wait_for_value(p.pong, j);
+            }
+        });
+        threads.emplace_back([&p, iterations] {
+            for (int j = 1; j <= iterations; j++) {
+                wait_for_value(p.ping, j);
+                post(p.pong, j);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            _clock::now() - start).count();
+    double wakes = 2.0 * iterations * npairs;
+    printf("%3u pairs: %10.0f wakes/s, %8.3f us/wake\n", npairs,
+            wakes * 1e9 / ns, ns / 1e3 / (2.0 * iterations));
+}
+
+static void test_broadcast(unsigned nwaiters, int iterations)
+{
+    std::atomic<int> word { 0 };
+    std::atomic<unsigned> arrived { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nwaiters; i++) {
+        threads.emplace_back([&] {
+            for (int j = 1; j <= iterations; j++) {
+                arrived++;
+                wait_for_value(word, j);
+            }
+        });
+    }
+    long total_ns = 0;
+    for (int j = 1; j <= iterations; j++) {
+        while (arrived.load() < nwaiters * j) {
+            std::this_thread::yield();
+        }
+        auto start = _clock::now();
+        word.store(j);
+        futex(&word, FUTEX_WAKE, INT_MAX);
+        total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                _clock::now() - start).count();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    printf("%3u waiters: %8.3f us per FUTEX_WAKE(all)\n", nwaiters,
+            total_ns / 1e3 / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned ncpus = std::thread::hardware_concurrency();
+
+    printf("futex ping-pong, %d round trips per pair\n", iterations);
+    for (unsigned npairs = 1; npairs <= std::max(1u, ncpus / 2); npairs *= 2) {
+        test_ping_pong(npairs, iterations);
+    }
+
+    printf("futex broadcast wake\n");
+    for (unsigned nwaiters = 1; nwaiters <= ncpus * 4; nwaiters *= 2) {
+        test_broadcast(nwaiters, 1000);
+    }
+    return 0;
+}
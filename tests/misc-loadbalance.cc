@@ -43,6 +43,12 @@
 //    intermittent thread should take 1/11th of one CPU, and the expected
 //    measurement is x2.1.
 //
+// 6. Wakeup latency under imbalance: four busy loops are started together
+//    (so they initially pile up on one CPU), while a thread repeatedly sleeps
+//    for 1ms and measures how late it gets to run after its timer expires.
+//    An idle CPU should pull work quickly enough that the p99 latency stays
+//    close to the median instead of growing to a scheduler time slice.
+//
 // Unexpected results in any of these tests should be debugged as follows:
 //
 // 1. Running "top" on the host during all these tests should show 200% CPU
@@ -66,6 +72,8 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <algorithm>
 
 void _loop(int iterations)
 {
@@ -161,6 +169,41 @@ private:
     bool _stop = false;
 };
 
+void wakeup_latency(int looplen_1ms, int nbusy, int nsamples)
+{
+    std::cout << "\nMeasuring wakeup latency with " << nbusy <<
+            " busy loops started together.\n";
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nbusy; i++) {
+        threads.push_back(std::thread([&]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                _loop(looplen_1ms);
+            }
+        }));
+    }
+    std::vector<double> lat;
+    std::thread sleeper([&]() {
+        for (int i = 0; i < nsamples; i++) {
+            auto due = std::chrono::high_resolution_clock::now() +
+                    std::chrono::milliseconds(1);
+            std::this_thread::sleep_until(due);
+            std::chrono::duration<double, std::micro> late =
+                    std::chrono::high_resolution_clock::now() - due;
+            lat.push_back(late.count());
+        }
+    });
+    sleeper.join();
+    stop = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::sort(lat.begin(), lat.end());
+    std::cout << "wakeup latency: p50 " << lat[lat.size() / 2] <<
+            "us, p99 " << lat[lat.size() * 99 / 100] <<
+            "us, max " << lat.back() << "us\n";
+}
+
 int main()
 {
     // For expected values below, we assume running on 2 cpus.
@@ -223,5 +266,7 @@ int main()
     concurrent_loops(looplen, 4, secs, 2.0*2/(2-1.0/11));
     bi.stop();
 
+    wakeup_latency(looplen_1ms, 4, 2000);
+
     return 0;
 }
@@ -7,8 +7,12 @@
 
 #include <osv/preempt-lock.hh>
 #include <osv/migration-lock.hh>
+#include <osv/rwlock.h>
+#include <osv/sched.hh>
 #include <future>
 #include <chrono>
+#include <atomic>
+#include <vector>
 
 using _clock = std::chrono::high_resolution_clock;
 
@@ -45,11 +49,68 @@ void test(const char *name, Lock& lock)
     printf("%-10s = %7.3f ns/cycle\n", name, time(lock));
 }
 
+// Takes the lock from nthreads threads, pinned to different cpus, at once,
+// and returns the total number of cycles per second.
+template<typename Lock>
+double scale(Lock& lock, unsigned nthreads)
+{
+    const std::chrono::seconds test_duration(1);
+
+    std::atomic<long> total(0);
+    std::atomic<bool> done(false);
+    std::vector<sched::thread*> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.push_back(new sched::thread([&] {
+            long count = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                for (int j = 0; j < 1000; j++) {
+                    WITH_LOCK(lock) {
+                        count++;
+                    }
+                }
+            }
+            total += count;
+        }, sched::thread::attr().pin(sched::cpus[i])));
+    }
+    auto start = _clock::now();
+    for (auto t : threads) {
+        t->start();
+    }
+    sched::thread::sleep(test_duration);
+    done = true;
+    for (auto t : threads) {
+        t->join();
+        delete t;
+    }
+    auto duration = _clock::now() - start;
+    return total / std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+}
+
+template<typename Lock>
+void test_scaling(const char *name, Lock& lock)
+{
+    unsigned ncpus = std::min(sched::cpus.size(), size_t(64));
+    for (unsigned n = 1; ; n = std::min(n * 2, ncpus)) {
+        printf("%-10s %2d cpus = %8.3f Mcycles/s\n", name, n, scale(lock, n) / 1e6);
+        if (n == ncpus) {
+            break;
+        }
+    }
+}
+
 int main(int argc, char const *argv[])
 {
     test("dummy", *new dummy_lock);
     test("preempt", preempt_lock);
     test("migrate", migration_lock);
     test("mutex", *new mutex);
+    auto rw = new rwlock;
+    test("rwlock-r", rw->for_read());
+    test("rwlock-w", rw->for_write());
+
+    // Readers of an rwlock should scale with the number of cpus, unlike a
+    // mutex, which they all have to take in turn.
+    test_scaling("mutex", *new mutex);
+    test_scaling("rwlock-r", rw->for_read());
     return 0;
 }
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures path lookup scalability: a growing number of threads stat()
+// and open() random files of a directory tree whose dentries are all
+// cached. With a scalable lookup path, the number of lookups per second
+// per thread should stay flat as threads are added.
+//
+// Usage: misc-lookup-perf.so [directory] [dirs] [files per dir] [seconds]
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <random>
+
+using _clock = std::chrono::high_resolution_clock;
+
+static std::vector<std::string> make_tree(const std::string& top, int ndirs, int nfiles)
+{
+    std::vector<std::string> paths;
+    mkdir(top.c_str(), 0777);
+    for (int d = 0; d < ndirs; d++) {
+        auto dir = top + "/dir" + std::to_string(d);
+        mkdir(dir.c_str(), 0777);
+        for (int f = 0; f < nfiles; f++) {
+            auto path = dir + "/file" + std::to_string(f);
+            int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0666);
+            if (fd < 0) {
+                perror("open");
+                exit(1);
+            }
+            close(fd);
+            paths.push_back(path);
+        }
+    }
+    return paths;
+}
+
+static void remove_tree(const std::string& top, int ndirs,
+        const std::vector<std::string>& paths)
+{
+    for (auto& path : paths) {
+        unlink(path.c_str());
+    }
+    for (int d = 0; d < ndirs; d++) {
+        rmdir((top + "/dir" + std::to_string(d)).c_str());
+    }
+    rmdir(top.c_str());
+}
+
+// Every 8th lookup is an open()/close() pair, the rest are stat()s
+static void run(const std::vector<std::string>& paths, unsigned nthreads, int secs)
+{
+    std::atomic<bool> stop { false };
+    std::vector<unsigned long> counts(nthreads * 8);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rand(t);
+            unsigned long n = 0;
+            struct stat st;
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto& path = paths[rand() % paths.size()];
+                if (n % 8 == 7) {
+                    int fd = open(path.c_str(), O_RDONLY);
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                } else {
+                    stat(path.c_str(), &st);
+                }
+                n++;
+            }
+            counts[t * 8] = n;
+        });
+    }
+    auto start = _clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(secs));
+    stop.store(true);
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> sec = _clock::now() - start;
+
+    unsigned long total = 0;
+    for (unsigned t = 0; t < nthreads; t++) {
+        total += counts[t * 8];
+    }
+    printf("%3u threads: %12.0f lookups/s, %10.0f lookups/s per thread\n",
+            nthreads, total / sec.count(), total / sec.count() / nthreads);
+}
+
+int main(int argc, char **argv)
+{
+    std::string top = argc > 1 ? argv[1] : "/tmp/misc-lookup-perf";
+    int ndirs = argc > 2 ? atoi(argv[2]) : 32;
+    int nfiles = argc > 3 ? atoi(argv[3]) : 128;
+    int secs = argc > 4 ? atoi(argv[4]) : 5;
+    unsigned ncpus = std::thread::hardware_concurrency();
+
+    auto paths = make_tree(top, ndirs, nfiles);
+    printf("%zu files in %d directories under %s\n", paths.size(), ndirs,
+            top.c_str());
+
+    // Warm up the dentry cache
+    struct stat st;
+    for (auto& path : paths) {
+        stat(path.c_str(), &st);
+    }
+
+    for (unsigned nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+        run(paths, nthreads, secs);
+    }
+    if (ncpus & (ncpus - 1)) {
+        run(paths, ncpus, secs);
+    }
+
+    remove_tree(top, ndirs, paths);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares the throughput, and the CPU time spent per GB, of sending a file
+// over a loopback TCP connection with sendfile() against doing the same by
+// hand with mmap()+write() (what sendfile() used to do) and read()+write().
+//
+// To be meaningful on OSv the file should live on ZFS, the only file system
+// whose pages sendfile() can send without copying.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
+#include <vector>
+
+static constexpr int port = 5432;
+
+static double now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char* msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static void send_mmap(int sock, int fd, size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        die("mmap");
+    }
+    for (size_t done = 0; done < size; ) {
+        auto n = write(sock, static_cast<char*>(p) + done, size - done);
+        if (n <= 0) {
+            die("write");
+        }
+        done += n;
+    }
+    munmap(p, size);
+}
+
+static void send_read(int sock, int fd, size_t size)
+{
+    std::vector<char> buf(64 * 1024);
+    off_t off = 0;
+    while ((size_t)off < size) {
+        auto n = pread(fd, buf.data(), buf.size(), off);
+        if (n <= 0) {
+            die("pread");
+        }
+        for (ssize_t done = 0; done < n; ) {
+            auto w = write(sock, buf.data() + done, n - done);
+            if (w <= 0) {
+                die("write");
+            }
+            done += w;
+        }
+        off += n;
+    }
+}
+
+static void send_sendfile(int sock, int fd, size_t size)
+{
+    off_t off = 0;
+    while ((size_t)off < size) {
+        if (sendfile(sock, fd, &off, size - off) <= 0) {
+            die("sendfile");
+        }
+    }
+}
+
+static void test(const char* name, void (*sender)(int, int, size_t),
+        int fd, size_t size, int rounds)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listener, 1) < 0) {
+        die("listen");
+    }
+    size_t total = size * rounds;
+    std::thread receiver([&] {
+        int s = accept(listener, nullptr, nullptr);
+        std::vector<char> buf(256 * 1024);
+        size_t got = 0;
+        while (got < total) {
+            auto n = read(s, buf.data(), buf.size());
+            if (n <= 0) {
+                die("read");
+            }
+            got += n;
+        }
+        close(s);
+    });
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        die("connect");
+    }
+    auto start = now(CLOCK_MONOTONIC);
+    auto start_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+    for (int i = 0; i < rounds; i++) {
+        sender(sock, fd, size);
+    }
+    receiver.join();
+    auto secs = now(CLOCK_MONOTONIC) - start;
+    auto cpu = now(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+    close(sock);
+    close(listener);
+    double gb = total / 1e9;
+    printf("%-12s %8.1f MB/s %8.3f CPU s/GB\n", name, total / 1e6 / secs,
+            cpu / gb);
+}
+
+int main(int argc, char **argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/misc-sendfile-perf.dat";
+    size_t size = (argc > 2 ? atoi(argv[2]) : 64) << 20;
+    int rounds = argc > 3 ? atoi(argv[3]) : 16;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        die("open");
+    }
+    std::vector<char> buf(1 << 20);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = i * 7;
+    }
+    for (size_t done = 0; done < size; done += buf.size()) {
+        if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+            die("write");
+        }
+    }
+    fsync(fd);
+
+    printf("sending %zu MiB %d times from %s\n", size >> 20, rounds, path);
+    for (int i = 0; i < 3; i++) {
+        test("mmap+write", send_mmap, fd, size, rounds);
+        test("read+write", send_read, fd, size, rounds);
+        test("sendfile", send_sendfile, fd, size, rounds);
+    }
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the TCP connection rate over the loopback: client threads
+// connect() and close() as fast as they can, while server threads
+// accept() and close(). The servers either share a single listening
+// socket, or each has its own listener on the same port with
+// SO_REUSEPORT, in which case new connections are spread over the
+// listeners and we also report how evenly.
+//
+// Usage: misc-tcp-connect-rate.so [servers] [clients] [seconds] [port]
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using _clock = std::chrono::high_resolution_clock;
+
+static int make_listener(int port, bool reuseport)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(fd, 1024) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return fd;
+}
+
+struct alignas(64) counter {
+    unsigned long n = 0;
+};
+
+static void run(int nservers, int nclients, int secs, int port, bool reuseport)
+{
+    std::vector<int> listeners;
+    for (int i = 0; i < (reuseport ? nservers : 1); i++) {
+        listeners.push_back(make_listener(port, reuseport));
+    }
+
+    std::atomic<bool> stop { false };
+    std::vector<counter> accepted(nservers), connected(nclients);
+    std::vector<std::thread> threads;
+    for (int s = 0; s < nservers; s++) {
+        threads.emplace_back([&, s] {
+            int lfd = listeners[s % listeners.size()];
+            pollfd pfd = { lfd, POLLIN, 0 };
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (poll(&pfd, 1, 100) <= 0) {
+                    continue;
+                }
+                int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK);
+                if (fd >= 0) {
+                    close(fd);
+                    accepted[s].n++;
+                }
+            }
+        });
+    }
+    for (int c = 0; c < nclients; c++) {
+        threads.emplace_back([&, c] {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(port);
+            while (!stop.load(std::memory_order_relaxed)) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                // Close with a RST, so the client ports do not pile up in
+                // TIME_WAIT
+                linger lg = { 1, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+                    connected[c].n++;
+                }
+                close(fd);
+            }
+        });
+    }
+
+    auto start = _clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(secs));
+    stop.store(true);
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> sec = _clock::now() - start;
+    for (auto fd : listeners) {
+        close(fd);
+    }
+
+    unsigned long total_connected = 0, total_accepted = 0;
+    unsigned long lo = ~0UL, hi = 0;
+    for (auto& c : connected) {
+        total_connected += c.n;
+    }
+    for (auto& a : accepted) {
+        total_accepted += a.n;
+        lo = std::min(lo, a.n);
+        hi = std::max(hi, a.n);
+    }
+    printf("%-22s %3d servers %3d clients: %10.0f connects/s, "
+           "accepts per server %lu..%lu\n",
+           reuseport ? "SO_REUSEPORT listeners" : "shared listener",
+           nservers, nclients, total_connected / sec.count(), lo, hi);
+    if (total_accepted > total_connected) {
+        printf("more accepts (%lu) than connects (%lu)!\n", total_accepted,
+               total_connected);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int nservers = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int nclients = argc > 2 ? atoi(argv[2]) : nservers;
+    int secs = argc > 3 ? atoi(argv[3]) : 5;
+    int port = argc > 4 ? atoi(argv[4]) : 2600;
+
+    run(nservers, nclients, secs, port, false);
+    run(nservers, nclients, secs, port + 1, true);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures page fault throughput as the number of threads faulting in
+// anonymous memory grows. Each thread faults in its own mapping, so faults
+// should scale with the number of threads. In the "churn" runs, an extra
+// thread keeps mapping and unmapping an unrelated region at the same time,
+// which should not slow the faulting threads down much.
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using _clock = std::chrono::high_resolution_clock;
+
+static constexpr size_t page_size = 4096;
+
+// Touch every page of a fresh mapping, with MADV_NOHUGEPAGE so each page
+// takes its own fault.
+static void fault_in(size_t size)
+{
+    char* p = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(p, size, MADV_NOHUGEPAGE);
+    for (size_t i = 0; i < size; i += page_size) {
+        p[i] = 1;
+    }
+    munmap(p, size);
+}
+
+static void test(unsigned nthreads, size_t mb, int rounds, bool churn)
+{
+    size_t size = mb << 20;
+    std::atomic<bool> done { false };
+    std::thread churner;
+    if (churn) {
+        churner = std::thread([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                void* p = mmap(nullptr, 1 << 20, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                munmap(p, 1 << 20);
+            }
+        });
+    }
+    std::vector<std::thread> threads;
+    auto start = _clock::now();
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([=] {
+            for (int j = 0; j < rounds; j++) {
+                fault_in(size);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            _clock::now() - start).count();
+    done.store(true);
+    if (churn) {
+        churner.join();
+    }
+    double faults = double(nthreads) * rounds * (size / page_size);
+    printf("%3u threads%s: %10.0f faults/s, %8.3f us/fault/thread\n",
+            nthreads, churn ? " + churn" : "", faults * 1e9 / ns,
+            ns / 1e3 / (faults / nthreads));
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    unsigned ncpus = std::thread::hardware_concurrency();
+
+    printf("page faults, %zu MiB per thread, %d rounds\n", mb, rounds);
+    for (unsigned n = 1; n <= ncpus; n *= 2) {
+        test(n, mb, rounds, false);
+    }
+    for (unsigned n = 1; n <= ncpus; n *= 2) {
+        test(n, mb, rounds, true);
+    }
+    return 0;
+}
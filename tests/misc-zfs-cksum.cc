@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Checks the SIMD fletcher-4 and SHA-256 implementations ZFS uses against
+// the portable ones, round-trips LZ4, and measures how fast each of them is
+// on a 128K block (ZFS's default record size).
+
+#include "stat.hh"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+struct zio_cksum {
+    uint64_t zc_word[4];
+};
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t bitcount;
+    uint8_t buffer[64];
+};
+
+extern "C" {
+void fletcher_4_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_scalar_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_sse2_native(const void *buf, uint64_t size, zio_cksum *zcp);
+void fletcher_4_avx2_native(const void *buf, uint64_t size, zio_cksum *zcp);
+bool fletcher_4_avx2_supported();
+void SHA256_Transform_blocks_generic(sha256_ctx *ctx, const uint8_t *data, size_t nblocks);
+void SHA256_Transform_blocks_shani(sha256_ctx *ctx, const uint8_t *data, size_t nblocks);
+bool sha256_shani_supported();
+char *SHA256_Data(const uint8_t *data, size_t len, char *digest);
+size_t lz4_compress(void *src, void *dst, size_t s_len, size_t d_len, int n);
+int lz4_decompress(void *src, void *dst, size_t s_len, size_t d_len, int n);
+}
+
+static std::chrono::high_resolution_clock s_clock;
+static std::mt19937_64 s_rand(1);
+static const size_t block_size = 128 * 1024;
+
+template <typename Func>
+static void bench(const char *name, Func func)
+{
+    const int iterations = 2000;
+    auto start = s_clock.now();
+    for (int i = 0; i < iterations; i++) {
+        func();
+    }
+    auto duration = to_seconds(s_clock.now() - start);
+    printf("\t%-24s %8.0f MB/s\n", name,
+           (double)iterations * block_size / (1024 * 1024) / duration);
+}
+
+typedef void (*fletcher_func)(const void *, uint64_t, zio_cksum *);
+
+static void test_fletcher(const char *name, fletcher_func func,
+                          const std::vector<uint8_t>& buf)
+{
+    printf("fletcher-4 %s\n", name);
+    for (int i = 0; i < 10000; i++) {
+        // Any alignment, and sizes which are not a multiple of 16 bytes
+        size_t off = s_rand() % 64;
+        size_t size = s_rand() % (buf.size() - off);
+        zio_cksum expected, got;
+        fletcher_4_scalar_native(buf.data() + off, size, &expected);
+        func(buf.data() + off, size, &got);
+        assert(!memcmp(&expected, &got, sizeof(got)));
+    }
+    zio_cksum z;
+    bench(name, [&] { func(buf.data(), block_size, &z); });
+}
+
+static void test_sha256(const std::vector<uint8_t>& buf)
+{
+    char digest[65];
+    SHA256_Data(reinterpret_cast<const uint8_t*>("abc"), 3, digest);
+    assert(!strcmp(digest,
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+
+    sha256_ctx ctx = {};
+    printf("sha-256\n");
+    if (sha256_shani_supported()) {
+        for (int i = 0; i < 1000; i++) {
+            sha256_ctx a, b;
+            for (auto& w : a.state) {
+                w = s_rand();
+            }
+            b = a;
+            size_t nblocks = s_rand() % 64;
+            size_t off = s_rand() % 64;
+            SHA256_Transform_blocks_generic(&a, buf.data() + off, nblocks);
+            SHA256_Transform_blocks_shani(&b, buf.data() + off, nblocks);
+            assert(!memcmp(a.state, b.state, sizeof(a.state)));
+        }
+        bench("sha-ni", [&] {
+            SHA256_Transform_blocks_shani(&ctx, buf.data(), block_size / 64);
+        });
+    }
+    bench("generic", [&] {
+        SHA256_Transform_blocks_generic(&ctx, buf.data(), block_size / 64);
+    });
+}
+
+static void test_lz4()
+{
+    // Compressible: runs of random bytes and repeats of earlier data
+    std::vector<uint8_t> src(block_size);
+    for (size_t i = 0; i < src.size();) {
+        size_t len = std::min<size_t>(1 + s_rand() % 40, src.size() - i);
+        if (i && s_rand() % 4) {
+            size_t dist = 1 + s_rand() % std::min<size_t>(i, 1000);
+            for (size_t j = 0; j < len; j++, i++) {
+                src[i] = src[i - dist];
+            }
+        } else {
+            for (size_t j = 0; j < len; j++) {
+                src[i++] = s_rand() % 16;
+            }
+        }
+    }
+    std::vector<uint8_t> comp(src.size()), dst(src.size());
+    size_t clen = lz4_compress(src.data(), comp.data(), src.size(), comp.size(), 0);
+    assert(clen < src.size());
+    assert(!lz4_decompress(comp.data(), dst.data(), clen, dst.size(), 0));
+    assert(src == dst);
+    printf("lz4 (compressed to %.0f%%)\n", 100.0 * clen / src.size());
+    bench("compress", [&] {
+        lz4_compress(src.data(), comp.data(), src.size(), comp.size(), 0);
+    });
+    bench("decompress", [&] {
+        lz4_decompress(comp.data(), dst.data(), clen, dst.size(), 0);
+    });
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> buf(block_size + 64);
+    for (auto& b : buf) {
+        b = s_rand();
+    }
+
+    test_fletcher("scalar", fletcher_4_scalar_native, buf);
+    test_fletcher("sse2", fletcher_4_sse2_native, buf);
+    if (fletcher_4_avx2_supported()) {
+        test_fletcher("avx2", fletcher_4_avx2_native, buf);
+    }
+    test_fletcher("selected", fletcher_4_native, buf);
+    test_sha256(buf);
+    test_lz4();
+
+    printf("PASSED\n");
+    return 0;
+}
@@ -9,12 +9,18 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <random>
+#include <algorithm>
 
 #define MB (1024 * 1024)
 #define BUF_SIZE 4096
@@ -70,6 +76,116 @@ static void seq_read(int fd, char *buf, unsigned long size, unsigned long offset
         (double) size / MB, duration, (double) size / MB / duration);
 }
 
+struct latencies {
+    std::vector<float> usecs;
+    unsigned long bytes = 0;
+
+    void add(const latencies& l)
+    {
+        usecs.insert(usecs.end(), l.usecs.begin(), l.usecs.end());
+        bytes += l.bytes;
+    }
+};
+
+static void report(const char *name, latencies& l, float duration)
+{
+    if (l.usecs.empty()) {
+        printf("\t* %s: no requests completed\n", name);
+        return;
+    }
+    std::sort(l.usecs.begin(), l.usecs.end());
+    auto percentile = [&] (double p) {
+        return l.usecs[std::min(l.usecs.size() - 1, size_t(l.usecs.size() * p))];
+    };
+    double sum = 0;
+    for (auto u : l.usecs) {
+        sum += u;
+    }
+    printf("\t* %s: %lu requests, %.3f MB/s, %.0f IOPS, latency (us): "
+           "avg %.0f p50 %.0f p99 %.0f max %.0f\n",
+           name, l.usecs.size(), (double) l.bytes / MB / duration,
+           l.usecs.size() / duration, sum / l.usecs.size(),
+           percentile(0.5), percentile(0.99), l.usecs.back());
+}
+
+/*
+ * Random synchronous reads from reader threads, racing writers which
+ * overwrite the file sequentially in large chunks and fsync() now and then,
+ * to see how well the reads fare behind the write back.
+ */
+static void mixed_rw(int fd, unsigned long size, unsigned readers,
+                     unsigned writers, unsigned seconds)
+{
+    const size_t read_size = BUF_SIZE;
+    const size_t write_size = 128 * 1024;
+    const unsigned fsync_every = 64;
+
+    printf("ZFS: Mixed workload for %us: %u random %luKB readers, "
+           "%u sequential %luKB writers...\n", seconds, readers,
+           read_size / 1024, writers, write_size / 1024);
+
+    std::atomic<bool> done(false);
+    std::vector<latencies> read_lat(readers), write_lat(writers);
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < readers; i++) {
+        threads.emplace_back([&, i] {
+            std::vector<char> buf(read_size);
+            std::mt19937_64 rand(i);
+            auto& l = read_lat[i];
+            while (!done.load(std::memory_order_relaxed)) {
+                off_t offset = rand() % (size / read_size) * read_size;
+                auto t0 = s_clock.now();
+                ssize_t r = pread(fd, buf.data(), read_size, offset);
+                auto t1 = s_clock.now();
+                assert(r == (ssize_t) read_size);
+                l.usecs.push_back(std::chrono::duration<float, std::micro>(t1 - t0).count());
+                l.bytes += r;
+            }
+        });
+    }
+
+    for (unsigned i = 0; i < writers; i++) {
+        threads.emplace_back([&, i] {
+            std::vector<char> buf(write_size, 0xCD);
+            unsigned long span = size / writers / write_size * write_size;
+            unsigned long offset = 0;
+            unsigned n = 0;
+            auto& l = write_lat[i];
+            while (!done.load(std::memory_order_relaxed)) {
+                auto t0 = s_clock.now();
+                ssize_t r = pwrite(fd, buf.data(), write_size, i * span + offset);
+                if (++n % fsync_every == 0) {
+                    fsync(fd);
+                }
+                auto t1 = s_clock.now();
+                assert(r == (ssize_t) write_size);
+                l.usecs.push_back(std::chrono::duration<float, std::micro>(t1 - t0).count());
+                l.bytes += r;
+                offset = (offset + write_size) % span;
+            }
+        });
+    }
+
+    auto start_time = s_clock.now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    done = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto duration = to_seconds(s_clock.now() - start_time);
+
+    latencies reads, writes;
+    for (auto& l : read_lat) {
+        reads.add(l);
+    }
+    for (auto& l : write_lat) {
+        writes.add(l);
+    }
+    report("Reads", reads, duration);
+    report("Writes", writes, duration);
+}
+
 int main(int argc, char **argv)
 {
     char fpath[64] = "/zfs-io-file";
@@ -80,6 +196,8 @@ int main(int argc, char **argv)
     bool rdonly = false;
     bool all_cached = false;
     bool unlink_file = true;
+    bool mixed = false;
+    unsigned readers = 4, writers = 2, seconds = 10;
 
     for (int i = 1; i < argc; i++) {
         if (!strcmp("--random", argv[i])) {
@@ -90,12 +208,20 @@ int main(int argc, char **argv)
             all_cached = true;
         } else if (!strcmp("--no-unlink", argv[i])) {
             unlink_file = false;
+        } else if (!strcmp("--mixed", argv[i])) {
+            mixed = true;
+        } else if (!strcmp("--readers", argv[i]) && i + 1 < argc) {
+            readers = atoi(argv[++i]);
+        } else if (!strcmp("--writers", argv[i]) && i + 1 < argc) {
+            writers = atoi(argv[++i]);
+        } else if (!strcmp("--duration", argv[i]) && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
         }
     }
 
     if (all_cached) {
         size = kmem_size() * 40U / 100U;
-    } else if (random) {
+    } else if (random || mixed) {
         size = kmem_size();
     } else {
         size = kmem_size() + (kmem_size() * 50U / 100U);
@@ -138,6 +264,10 @@ int main(int argc, char **argv)
         }
     }
 
+    if (mixed) {
+        mixed_rw(fd, size, readers, writers, seconds);
+    }
+
     close(fd);
     if (unlink_file) {
         unlink("/zfs-io-file");
@@ -19,6 +19,7 @@
 #include <algorithm>
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 
 static int tests = 0, fails = 0;
@@ -60,8 +61,27 @@ void test_posix_memalign(size_t alignment, size_t size)
     }
 }
 
+// malloc() rounds sizes up to a size class, whose objects must still have
+// the alignment malloc() guarantees, and be large enough.
+void test_malloc_sizes()
+{
+    bool aligned = true, large_enough = true;
+    for (size_t size = 1; size <= 8192; size++) {
+        void* ptr = malloc(size);
+        size_t alignment = std::min(size_t(16), size_t(1) << (63 - __builtin_clzl(size)));
+        aligned &= !((uintptr_t)ptr & (alignment - 1));
+        large_enough &= malloc_usable_size(ptr) >= size;
+        memset(ptr, 0, size);
+        free(ptr);
+    }
+    report(aligned, "malloc alignment");
+    report(large_enough, "malloc_usable_size");
+}
+
 int main(int ac, char** av)
 {
+    test_malloc_sizes();
+
     // posix_memalign expects its alignment argument to be a multiple of
     // sizeof(void*) (on 64 bit, that's 8 bytes) and a power of two.
     for (int shift = 3; shift <= 14; shift++) {
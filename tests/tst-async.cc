@@ -273,6 +273,33 @@ BOOST_AUTO_TEST_CASE(test_a_task_which_is_set_far_in_future_does_not_block_new_t
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_coarse_task_fires_and_can_be_cancelled)
+{
+    std::promise<bool> done;
+    mutex lock1;
+    mutex lock2;
+    SCOPE_LOCK(lock1);
+    SCOPE_LOCK(lock2);
+
+    timer_task cancelled(lock1, [&] {
+        abort();
+    }, async::timer_precision::coarse);
+    cancelled.reschedule(2_ms);
+
+    timer_task task(lock2, [&] {
+        done.set_value(true);
+    }, async::timer_precision::coarse);
+    task.reschedule(1_ms);
+
+    BOOST_REQUIRE(cancelled.cancel());
+
+    DROP_LOCK(lock1) {
+        DROP_LOCK(lock2) {
+            assert_resolves(done, 20_ms);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(test_task_which_is_scheduled_second_but_with_sooner_expiration_time_fires_first)
 {
     mutex lock;
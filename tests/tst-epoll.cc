@@ -79,6 +79,61 @@ static void test_epolloneshot()
     report(r == 0, "epoll_ctl DEL");
 }
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+static void test_epollexclusive()
+{
+    constexpr int MAXEVENTS = 16;
+    struct epoll_event events[MAXEVENTS];
+
+    int ep1 = epoll_create(1);
+    int ep2 = epoll_create(1);
+    report(ep1 >= 0 && ep2 >= 0, "epoll_create");
+
+    int s[2];
+    int r = pipe(s);
+    report(r == 0, "create pipe");
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE | EPOLLONESHOT;
+    event.data.u32 = 1;
+    r = epoll_ctl(ep1, EPOLL_CTL_ADD, s[0], &event);
+    report(r == -1 && errno == EINVAL, "EPOLLEXCLUSIVE with EPOLLONESHOT");
+
+    event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP | EPOLLEXCLUSIVE;
+    r = epoll_ctl(ep1, EPOLL_CTL_ADD, s[0], &event);
+    report(r == 0, "EPOLLEXCLUSIVE with EPOLLERR, EPOLLHUP and EPOLLRDHUP");
+    r = epoll_ctl(ep1, EPOLL_CTL_DEL, s[0], nullptr);
+    report(r == 0, "epoll_ctl DEL exclusive");
+
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    r = epoll_ctl(ep1, EPOLL_CTL_ADD, s[0], &event);
+    report(r == 0, "epoll_ctl ADD exclusive");
+    event.data.u32 = 2;
+    r = epoll_ctl(ep2, EPOLL_CTL_ADD, s[0], &event);
+    report(r == 0, "epoll_ctl ADD exclusive to a second epoll");
+
+    r = epoll_ctl(ep1, EPOLL_CTL_MOD, s[0], &event);
+    report(r == -1 && errno == EINVAL, "epoll_ctl MOD of exclusive registration");
+
+    // Only one of the two epolls is woken by the write
+    write_one(s[1]);
+    int r1 = epoll_wait(ep1, events, MAXEVENTS, 0);
+    int r2 = epoll_wait(ep2, events, MAXEVENTS, 0);
+    report(r1 + r2 == 1, "exactly one exclusive epoll woken");
+
+    char c;
+    r = read(s[0], &c, 1);
+    report(r == 1, "read");
+
+    close(ep1);
+    close(ep2);
+    close(s[0]);
+    close(s[1]);
+}
+
 int main(int ac, char** av)
 {
     int ep = epoll_create(1);
@@ -229,6 +284,7 @@ int main(int ac, char** av)
     report(r == -1 && errno == EEXIST, "EEXIST");
 
     test_epolloneshot();
+    test_epollexclusive();
 
     std::cout << "SUMMARY: " << tests << ", " << fails << " failures\n";
     return !!fails;
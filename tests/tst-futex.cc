@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Functional tests for the futex() operations: the counts returned by the
+// wake and requeue commands, where requeued waiters end up, the value check
+// of FUTEX_CMP_REQUEUE, FUTEX_WAKE_OP's conditional wake, and bitset masks.
+
+#include <unistd.h>
+#include <syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static long futex(std::atomic<int>* uaddr, int op, int val,
+        const struct timespec* timeout = nullptr,
+        std::atomic<int>* uaddr2 = nullptr, int val3 = 0)
+{
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, timeout,
+            uaddr2, val3);
+}
+
+static long futex2(std::atomic<int>* uaddr, int op, int val, int val2,
+        std::atomic<int>* uaddr2, int val3 = 0)
+{
+    return futex(uaddr, op, val,
+            reinterpret_cast<const struct timespec*>(uintptr_t(val2)),
+            uaddr2, val3);
+}
+
+// A thread blocked in FUTEX_WAIT_BITSET on one futex word.
+struct waiter {
+    std::atomic<bool> done { false };
+    long ret = 0;
+    std::thread t;
+    waiter(std::atomic<int>& word, unsigned bitset)
+        : t([this, &word, bitset] {
+            ret = futex(&word, FUTEX_WAIT_BITSET, word.load(), nullptr,
+                    nullptr, bitset);
+            done.store(true);
+        })
+    {
+    }
+    ~waiter() { t.join(); }
+};
+
+typedef std::vector<std::unique_ptr<waiter>> waiters;
+
+static void add_waiters(waiters& ws, std::atomic<int>& word, int n,
+        unsigned bitset = FUTEX_BITSET_MATCH_ANY)
+{
+    for (int i = 0; i < n; i++) {
+        ws.emplace_back(new waiter(word, bitset));
+    }
+    // There is no way to observe that a thread is queued on the futex, so
+    // give the new waiters ample time to block.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+static int count_done(waiters& ws)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    int n = 0;
+    for (auto& w : ws) {
+        n += w->done.load();
+    }
+    return n;
+}
+
+static void test_wake()
+{
+    std::atomic<int> a { 0 };
+    waiters ws;
+    add_waiters(ws, a, 4);
+    report(futex(&a, FUTEX_WAKE, 1) == 1, "FUTEX_WAKE of 1 wakes one waiter");
+    report(count_done(ws) == 1, "exactly one waiter returned");
+    report(futex(&a, FUTEX_WAKE, INT_MAX) == 3,
+            "FUTEX_WAKE of INT_MAX wakes the remaining three");
+    report(count_done(ws) == 4, "all waiters returned");
+    report(futex(&a, FUTEX_WAKE, INT_MAX) == 0,
+            "FUTEX_WAKE with no waiters returns 0");
+    bool ok = true;
+    for (auto& w : ws) {
+        ok &= w->ret == 0;
+    }
+    report(ok, "woken waiters return 0");
+}
+
+static void test_requeue()
+{
+    std::atomic<int> a { 0 }, b { 0 };
+    waiters ws;
+    add_waiters(ws, a, 4);
+    report(futex2(&a, FUTEX_REQUEUE, 1, 2, &b) == 3,
+            "FUTEX_REQUEUE returns woken plus requeued");
+    report(count_done(ws) == 1, "FUTEX_REQUEUE woke one waiter");
+    report(futex(&a, FUTEX_WAKE, INT_MAX) == 1,
+            "one waiter is left on the source futex");
+    report(futex(&b, FUTEX_WAKE, INT_MAX) == 2,
+            "two waiters were moved to the target futex");
+    report(count_done(ws) == 4, "all waiters returned");
+}
+
+static void test_cmp_requeue()
+{
+    std::atomic<int> a { 0 }, b { 0 };
+    waiters ws;
+    add_waiters(ws, a, 2);
+    errno = 0;
+    long r = futex2(&a, FUTEX_CMP_REQUEUE, 0, INT_MAX, &b, 1);
+    report(r == -1 && errno == EAGAIN,
+            "FUTEX_CMP_REQUEUE with a stale value fails with EAGAIN");
+    report(count_done(ws) == 0, "failed FUTEX_CMP_REQUEUE woke nobody");
+    report(futex2(&a, FUTEX_CMP_REQUEUE, 0, INT_MAX, &b, 0) == 2,
+            "FUTEX_CMP_REQUEUE with the current value requeues");
+    report(futex(&a, FUTEX_WAKE, INT_MAX) == 0,
+            "no waiters are left on the source futex");
+    report(futex(&b, FUTEX_WAKE, INT_MAX) == 2,
+            "both waiters were moved to the target futex");
+    report(count_done(ws) == 2, "all waiters returned");
+}
+
+static void test_wake_op()
+{
+    std::atomic<int> a { 0 }, b { 0 };
+    waiters ws;
+    add_waiters(ws, a, 1);
+    add_waiters(ws, b, 1);
+    // *b = 1, and wake on b if its old value was 0
+    report(futex2(&a, FUTEX_WAKE_OP, 1, 1, &b,
+            FUTEX_OP(FUTEX_OP_SET, 1, FUTEX_OP_CMP_EQ, 0)) == 2,
+            "FUTEX_WAKE_OP wakes both futexes when the compare holds");
+    report(b.load() == 1, "FUTEX_WAKE_OP stored the new value");
+    report(count_done(ws) == 2, "both waiters returned");
+
+    waiters ws2;
+    add_waiters(ws2, a, 1);
+    add_waiters(ws2, b, 1);
+    // *b += 1, and wake on b if its old value was 0 (it is 1)
+    report(futex2(&a, FUTEX_WAKE_OP, 1, 1, &b,
+            FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_EQ, 0)) == 1,
+            "FUTEX_WAKE_OP wakes only the first futex when the compare fails");
+    report(b.load() == 2, "FUTEX_WAKE_OP applied the operation anyway");
+    report(count_done(ws2) == 1, "one waiter returned");
+    report(futex(&b, FUTEX_WAKE, INT_MAX) == 1,
+            "the second futex's waiter was left queued");
+    report(count_done(ws2) == 2, "all waiters returned");
+}
+
+static void test_bitset()
+{
+    std::atomic<int> a { 0 };
+    waiters ws;
+    add_waiters(ws, a, 1, 0x1);
+    add_waiters(ws, a, 1, 0x2);
+    report(futex(&a, FUTEX_WAKE_BITSET, INT_MAX, nullptr, nullptr, 0x4) == 0,
+            "FUTEX_WAKE_BITSET with a disjoint mask wakes nobody");
+    report(futex(&a, FUTEX_WAKE_BITSET, INT_MAX, nullptr, nullptr, 0x2) == 1,
+            "FUTEX_WAKE_BITSET wakes only the matching waiter");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    report(!ws[0]->done.load() && ws[1]->done.load(),
+            "the waiter with the matching bitset returned");
+    report(futex(&a, FUTEX_WAKE, INT_MAX) == 1,
+            "FUTEX_WAKE matches any bitset");
+    report(count_done(ws) == 2, "all waiters returned");
+    errno = 0;
+    long r = futex(&a, FUTEX_WAKE_BITSET, 1, nullptr, nullptr, 0);
+    report(r == -1 && errno == EINVAL, "an empty bitset fails with EINVAL");
+}
+
+static void test_clock_realtime()
+{
+    std::atomic<int> a { 0 };
+    struct timespec ts = { 0, 1000000 };
+    errno = 0;
+    long r = futex(&a, FUTEX_WAIT | FUTEX_CLOCK_REALTIME, 0, &ts);
+    report(r == -1 && errno == ENOSYS,
+            "FUTEX_WAIT with FUTEX_CLOCK_REALTIME fails with ENOSYS");
+    clock_gettime(CLOCK_REALTIME, &ts);
+    errno = 0;
+    r = futex(&a, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, 0, &ts, nullptr,
+            FUTEX_BITSET_MATCH_ANY);
+    report(r == -1 && errno == ETIMEDOUT,
+            "FUTEX_WAIT_BITSET with FUTEX_CLOCK_REALTIME times out");
+}
+
+int main(int argc, char** argv)
+{
+    test_wake();
+    test_requeue();
+    test_cmp_requeue();
+    test_wake_op();
+    test_bitset();
+    test_clock_realtime();
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests that anonymous memory left in small pages by a partial
+// MADV_DONTNEED is collapsed back into huge pages in the background, as
+// seen in the AnonHugePages of its mapping in /proc/self/smaps, and that
+// the collapse keeps its contents.
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static constexpr size_t page_size = 4096;
+static constexpr size_t huge_page_size = 2 << 20;
+static constexpr size_t size = 16 << 20;
+
+// The AnonHugePages, in kB, of the mapping starting at addr
+static long anon_huge_kb(void* addr)
+{
+    char start[32];
+    snprintf(start, sizeof(start), "%lx-", reinterpret_cast<uintptr_t>(addr));
+    std::ifstream f("/proc/self/smaps");
+    std::string line;
+    bool found = false;
+    while (std::getline(f, line)) {
+        if (!line.compare(0, strlen(start), start)) {
+            found = true;
+        } else if (found && !line.compare(0, 14, "AnonHugePages:")) {
+            std::istringstream is(line.substr(14));
+            long kb = -1;
+            is >> kb;
+            return kb;
+        }
+    }
+    return -1;
+}
+
+static unsigned char pattern(size_t i)
+{
+    return i / page_size + i;
+}
+
+static bool check(unsigned char* p)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != pattern(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    auto p = static_cast<unsigned char*>(mmap(nullptr, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    report(p != MAP_FAILED, "mmap");
+    for (size_t i = 0; i < size; i++) {
+        p[i] = pattern(i);
+    }
+    std::cout << "AnonHugePages after touching: " << anon_huge_kb(p) << " kB\n";
+
+    // Drop a small page out of every huge page, and touch it again, so
+    // everything is mapped by small pages
+    auto first = reinterpret_cast<uintptr_t>(p);
+    first = (first + huge_page_size - 1) & ~(huge_page_size - 1);
+    auto end = reinterpret_cast<uintptr_t>(p) + size;
+    for (auto a = first; a + huge_page_size <= end; a += huge_page_size) {
+        auto page = reinterpret_cast<unsigned char*>(a + page_size);
+        madvise(page, page_size, MADV_DONTNEED);
+        for (size_t i = 0; i < page_size; i++) {
+            page[i] = pattern(page - p + i);
+        }
+    }
+    auto split = anon_huge_kb(p);
+    report(split == 0, "a partial MADV_DONTNEED leaves small pages");
+
+    long collapsed = split;
+    for (int i = 0; i < 60 && collapsed <= split; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        collapsed = anon_huge_kb(p);
+    }
+    report(collapsed > split, "AnonHugePages grows again (" +
+           std::to_string(split) + " kB -> " + std::to_string(collapsed) + " kB)");
+    report(check(p), "the collapse keeps the contents");
+
+    munmap(p, size);
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
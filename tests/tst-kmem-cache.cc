@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests the kmem_cache_*() object caches ZFS uses: objects are aligned as
+// asked, the constructor and destructor run once per object carved from and
+// given back to a slab (not on every allocation), and reaping a cache gives
+// its slabs back, which /proc/kmem_caches shows.
+
+#include <bsd/porting/netport.h>
+#include <sys/kmem.h>
+
+#include <osv/sched.hh>
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+struct counts {
+    std::atomic<long> ctors{0};
+    std::atomic<long> dtors{0};
+};
+
+static int ctor(void *obj, void *priv, int flags)
+{
+    static_cast<counts*>(priv)->ctors++;
+    return 0;
+}
+
+static void dtor(void *obj, void *priv)
+{
+    static_cast<counts*>(priv)->dtors++;
+}
+
+// The cache's slab_kb column in /proc/kmem_caches
+static long slab_kb(const char *name)
+{
+    std::ifstream f("/proc/kmem_caches");
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream is(line);
+        std::string cname;
+        is >> cname;
+        if (cname != name) {
+            continue;
+        }
+        long v = -1;
+        for (int i = 0; i < 9; i++) {
+            is >> v;
+        }
+        return v;
+    }
+    return -1;
+}
+
+static void test_cache(const char *name, size_t size, size_t align, int nobjs)
+{
+    std::cout << "Testing cache " << name << ", size=" << size
+              << ", align=" << align << "\n";
+    counts c;
+    auto *cache = kmem_cache_create(const_cast<char*>(name), size, align,
+                                    ctor, dtor, nullptr, &c, nullptr, 0);
+    std::vector<void*> objs;
+    bool aligned = true;
+    for (int i = 0; i < nobjs; i++) {
+        auto *p = kmem_cache_alloc(cache, KM_SLEEP);
+        aligned &= reinterpret_cast<uintptr_t>(p) % align == 0;
+        objs.push_back(p);
+    }
+    report(aligned, "objects are aligned");
+    report(c.ctors == nobjs && c.dtors == 0,
+           "constructor ran once per object");
+    auto used_kb = slab_kb(name);
+    report(used_kb >= long(nobjs * size / 1024), "slabs hold the objects");
+
+    for (auto p : objs) {
+        kmem_cache_free(cache, p);
+    }
+    objs.clear();
+    for (int i = 0; i < nobjs; i++) {
+        objs.push_back(kmem_cache_alloc(cache, KM_SLEEP));
+    }
+    report(c.ctors - c.dtors == nobjs && c.ctors < 2 * nobjs,
+           "freed objects are reused constructed");
+    for (auto p : objs) {
+        kmem_cache_free(cache, p);
+    }
+
+    // Everything but the few objects in this cpu's magazines goes back to
+    // the slabs, and their memory to the system
+    kmem_cache_reap_now(cache);
+    report(c.ctors - c.dtors < nobjs / 10, "reap destroyed the objects");
+    auto reaped_kb = slab_kb(name);
+    report(reaped_kb >= 0 && reaped_kb < used_kb / 2,
+           "reap gave the slabs back (" + std::to_string(used_kb) + "K -> "
+           + std::to_string(reaped_kb) + "K)");
+
+    kmem_cache_destroy(cache);
+    report(c.ctors == c.dtors, "destroy destroyed all objects");
+    report(slab_kb(name) == -1, "destroyed cache is gone");
+}
+
+int main(int argc, char **argv)
+{
+    // Stay on one cpu, so only its magazines keep objects after a reap
+    sched::thread t([] {
+        test_cache("tst-kmem-small", 100, 64, 20000);
+        test_cache("tst-kmem-large", 3000, 4096, 2000);
+    }, sched::thread::attr().pin(sched::cpus[0]));
+    t.start();
+    t.join();
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
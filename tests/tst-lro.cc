@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests the software LRO the virtio-net and vmxnet3 receive paths use:
+// in-order TCP segments of a flow are merged into one packet, which reaches
+// if_input when the driver flushes at the end of its batch, or earlier when
+// the flow breaks (out of order data, a packet which can't be merged) or
+// the merged packet would grow too large.
+
+#include <bsd/porting/netport.h>
+#include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/net/if.h>
+#include <bsd/sys/net/if_var.h>
+#include <bsd/sys/net/if_types.h>
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/ip.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
+
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static constexpr int hdr_len = ETHER_HDR_LEN + sizeof(struct ip) + sizeof(struct tcphdr);
+static constexpr int seg_len = 1000;
+
+// The packets LRO passed up
+static std::vector<struct mbuf*> input;
+
+static void capture(struct ifnet* ifp, struct mbuf* m)
+{
+    input.push_back(m);
+}
+
+static void clear_input()
+{
+    for (auto m : input) {
+        m_freem(m);
+    }
+    input.clear();
+}
+
+static unsigned char payload(u_int32_t seq)
+{
+    return seq * 7 + seq / 256;
+}
+
+// A segment of the flow from port sport, carrying bytes [seq, seq + len)
+static struct mbuf* segment(struct ifnet* ifp, u_short sport, u_int32_t seq,
+                            int len, u_char flags = TH_ACK)
+{
+    auto m = m_getcl(M_WAITOK, MT_DATA, M_PKTHDR);
+    auto eh = mtod(m, struct ether_header*);
+    memset(eh, 0, hdr_len);
+    eh->ether_type = htons(ETHERTYPE_IP);
+    auto ip = reinterpret_cast<struct ip*>(eh + 1);
+    ip->ip_v = IPVERSION;
+    ip->ip_hl = sizeof(*ip) >> 2;
+    ip->ip_len = htons(sizeof(struct ip) + sizeof(struct tcphdr) + len);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_TCP;
+    ip->ip_src.s_addr = htonl(0x0a000001);
+    ip->ip_dst.s_addr = htonl(0x0a000002);
+    auto th = reinterpret_cast<struct tcphdr*>(ip + 1);
+    th->th_sport = htons(sport);
+    th->th_dport = htons(80);
+    th->th_seq = htonl(seq);
+    th->th_ack = htonl(1);
+    th->th_off = sizeof(*th) >> 2;
+    th->th_flags = flags;
+    th->th_win = htons(65535);
+    auto data = reinterpret_cast<unsigned char*>(th + 1);
+    for (int i = 0; i < len; i++) {
+        data[i] = payload(seq + i);
+    }
+    m->m_hdr.mh_len = m->M_dat.MH.MH_pkthdr.len = hdr_len + len;
+    m->M_dat.MH.MH_pkthdr.rcvif = ifp;
+    // As the drivers mark segments whose checksum the device verified
+    m->M_dat.MH.MH_pkthdr.csum_flags = CSUM_IP_CHECKED | CSUM_IP_VALID |
+                                       CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+    m->M_dat.MH.MH_pkthdr.csum_data = 0xffff;
+    return m;
+}
+
+// What the drivers do at the end of every receive batch
+static void flush(struct lro_ctrl* lro)
+{
+    while (!SLIST_EMPTY(&lro->lro_active)) {
+        auto queued = SLIST_FIRST(&lro->lro_active);
+        SLIST_REMOVE_HEAD(&lro->lro_active, next);
+        tcp_lro_flush(lro, queued);
+    }
+}
+
+// Whether m is one packet carrying bytes [seq, seq + len) of the flow
+static bool merged(struct mbuf* m, u_int32_t seq, int len)
+{
+    if (m->M_dat.MH.MH_pkthdr.len != hdr_len + len) {
+        return false;
+    }
+    std::vector<unsigned char> buf(hdr_len + len);
+    m_copydata(m, 0, buf.size(), reinterpret_cast<caddr_t>(buf.data()));
+    auto ip = reinterpret_cast<struct ip*>(buf.data() + ETHER_HDR_LEN);
+    if (ntohs(ip->ip_len) != hdr_len - ETHER_HDR_LEN + len) {
+        return false;
+    }
+    auto th = reinterpret_cast<struct tcphdr*>(ip + 1);
+    if (ntohl(th->th_seq) != seq) {
+        return false;
+    }
+    for (int i = 0; i < len; i++) {
+        if (buf[hdr_len + i] != payload(seq + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    auto ifp = if_alloc(IFT_ETHER);
+    ifp->if_mtu = ETHERMTU;
+    ifp->if_input = capture;
+    struct lro_ctrl lro = {};
+    report(tcp_lro_init(&lro) == 0, "tcp_lro_init");
+    lro.ifp = ifp;
+
+    bool queued = true;
+    for (int i = 0; i < 10; i++) {
+        queued &= tcp_lro_rx(&lro, segment(ifp, 1000, i * seg_len, seg_len), 0) == 0;
+    }
+    report(queued && input.empty(), "in-order segments are held");
+    flush(&lro);
+    report(input.size() == 1 && merged(input[0], 0, 10 * seg_len),
+           "the flush passes them up as one packet");
+    report(lro.lro_queued == 10 && lro.lro_flushed == 1, "LRO counters");
+    clear_input();
+
+    tcp_lro_rx(&lro, segment(ifp, 1000, 0, seg_len), 0);
+    tcp_lro_rx(&lro, segment(ifp, 2000, 0, seg_len), 0);
+    tcp_lro_rx(&lro, segment(ifp, 1000, seg_len, seg_len), 0);
+    tcp_lro_rx(&lro, segment(ifp, 2000, seg_len, seg_len), 0);
+    flush(&lro);
+    report(input.size() == 2 && merged(input[0], 0, 2 * seg_len) &&
+           merged(input[1], 0, 2 * seg_len), "flows are merged separately");
+    clear_input();
+
+    tcp_lro_rx(&lro, segment(ifp, 1000, 0, seg_len), 0);
+    auto m = segment(ifp, 1000, 5 * seg_len, seg_len);
+    report(tcp_lro_rx(&lro, m, 0) == TCP_LRO_CANNOT && input.size() == 1 &&
+           merged(input[0], 0, seg_len),
+           "out of order data flushes the flow, and is left to the driver");
+    m_freem(m);
+    flush(&lro);
+    clear_input();
+
+    m = segment(ifp, 1000, 0, seg_len, TH_ACK | TH_FIN);
+    report(tcp_lro_rx(&lro, m, 0) == TCP_LRO_CANNOT && input.empty(),
+           "a FIN is not merged");
+    m_freem(m);
+
+    // A packet which could not take another full segment is flushed early
+    int n = 0;
+    while (input.empty() && n < 100) {
+        tcp_lro_rx(&lro, segment(ifp, 1000, n * seg_len, seg_len), 0);
+        n++;
+    }
+    report(input.size() == 1 && merged(input[0], 0, n * seg_len) &&
+           n * seg_len > 65535 - ETHERMTU - seg_len,
+           "a large packet is flushed before it overflows (" +
+           std::to_string(n) + " segments)");
+    flush(&lro);
+    report(input.size() == 1, "nothing is left after it");
+    clear_input();
+
+    tcp_lro_free(&lro);
+    if_free(ifp);
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests for the NUMA memory policy system calls used by libnuma. These run
+// on any machine: without a multi-node SRAT there is just node 0.
+
+#include <unistd.h>
+#include <syscall.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MPOL_DEFAULT        0
+#define MPOL_PREFERRED      1
+#define MPOL_BIND           2
+#define MPOL_INTERLEAVE     3
+#define MPOL_F_NODE         (1<<0)
+#define MPOL_F_ADDR         (1<<1)
+#define MPOL_F_MEMS_ALLOWED (1<<2)
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static long get_mempolicy(int* policy, unsigned long* nmask,
+        unsigned long maxnode, void* addr, int flags)
+{
+    return syscall(SYS_get_mempolicy, policy, nmask, maxnode, addr, flags);
+}
+
+static long set_mempolicy(int mode, unsigned long* nmask,
+        unsigned long maxnode)
+{
+    return syscall(SYS_set_mempolicy, mode, nmask, maxnode);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long allowed = 0;
+    report(get_mempolicy(nullptr, &allowed, 64, nullptr,
+            MPOL_F_MEMS_ALLOWED) == 0 && (allowed & 1),
+           "node 0 is allowed");
+
+    int policy = -1;
+    unsigned long mask = ~0UL;
+    report(get_mempolicy(&policy, &mask, 64, nullptr, 0) == 0 &&
+           policy == MPOL_DEFAULT && mask == 0, "default policy");
+
+    unsigned long node0 = 1;
+    report(set_mempolicy(MPOL_BIND, &node0, 64) == 0, "bind to node 0");
+    report(get_mempolicy(&policy, &mask, 64, nullptr, 0) == 0 &&
+           policy == MPOL_BIND && mask == 1, "policy reports bind to node 0");
+
+    // Large and page-sized allocations now come from node 0
+    void* big = malloc(4 << 20);
+    memset(big, 0, 4 << 20);
+    int node = -1;
+    report(get_mempolicy(&node, nullptr, 0, big, MPOL_F_NODE | MPOL_F_ADDR) == 0
+           && node == 0, "bound allocation is on node 0");
+    free(big);
+
+    unsigned long none = 0;
+    report(set_mempolicy(MPOL_BIND, &none, 64) == -1 && errno == EINVAL,
+           "bind to an empty node set fails");
+    report(set_mempolicy(MPOL_INTERLEAVE, &allowed, 64) == 0,
+           "interleave over all nodes");
+    for (int i = 0; i < 16; i++) {
+        void* p = malloc(1 << 20);
+        memset(p, 0, 1 << 20);
+        report(get_mempolicy(&node, nullptr, 0, p,
+                   MPOL_F_NODE | MPOL_F_ADDR) == 0 &&
+               (allowed & (1UL << node)),
+               "interleaved allocation on a valid node");
+        free(p);
+    }
+    report(set_mempolicy(MPOL_DEFAULT, nullptr, 0) == 0, "back to default");
+
+    report(get_mempolicy(&node, nullptr, 0, nullptr, MPOL_F_NODE) == 0 &&
+           (allowed & (1UL << node)), "current node is allowed");
+
+    void* region = mmap(nullptr, 1 << 20, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    report(syscall(SYS_mbind, region, 1 << 20, MPOL_PREFERRED, &node0, 64, 0) == 0,
+           "mbind accepts a preferred-node hint");
+    report(syscall(SYS_mbind, (char*)region + 1, 4096, MPOL_DEFAULT, nullptr, 0, 0) == -1
+           && errno == EINVAL, "mbind rejects an unaligned address");
+    munmap(region, 1 << 20);
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
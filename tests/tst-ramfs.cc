@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests for file data on ramfs: appends, sparse files, truncation,
+// fallocate() and mmap(), on a ramfs mounted for the purpose.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static const char* mnt = "/tst-ramfs";
+
+static char pattern(off_t off)
+{
+    return 'a' + off % 23;
+}
+
+static bool all_zero(const char* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_append()
+{
+    int fd = open("/tst-ramfs/append", O_CREAT|O_RDWR|O_APPEND, 0666);
+    assert(fd >= 0);
+    std::vector<char> buf(1000);
+    off_t off = 0;
+    bool ok = true;
+    for (int i = 0; i < 2500; i++) {
+        for (auto& c : buf) {
+            c = pattern(off++);
+        }
+        ok &= write(fd, buf.data(), buf.size()) == (ssize_t)buf.size();
+    }
+    report(ok, "append 2.5MB in 1000 byte writes");
+
+    struct stat st;
+    report(fstat(fd, &st) == 0 && st.st_size == off, "size after appends");
+
+    std::vector<char> rbuf(7000);
+    ok = true;
+    for (off_t pos = 0; pos < off; pos += rbuf.size()) {
+        auto n = pread(fd, rbuf.data(), rbuf.size(), pos);
+        ok &= n == std::min<off_t>(rbuf.size(), off - pos);
+        for (ssize_t i = 0; ok && i < n; i++) {
+            ok &= rbuf[i] == pattern(pos + i);
+        }
+    }
+    report(ok, "read back across page boundaries");
+    close(fd);
+    unlink("/tst-ramfs/append");
+}
+
+static void test_sparse()
+{
+    int fd = open("/tst-ramfs/sparse", O_CREAT|O_RDWR, 0666);
+    assert(fd >= 0);
+    off_t far = 1L << 32;
+    report(pwrite(fd, "x", 1, far) == 1, "write at 4GB");
+    struct stat st;
+    report(fstat(fd, &st) == 0 && st.st_size == far + 1, "sparse file size");
+
+    char buf[8192];
+    memset(buf, 1, sizeof(buf));
+    report(pread(fd, buf, sizeof(buf), far / 2) == sizeof(buf) &&
+           all_zero(buf, sizeof(buf)), "hole reads as zeros");
+    report(pread(fd, buf, sizeof(buf), far - 4096) == 4097 &&
+           all_zero(buf, 4096) && buf[4096] == 'x', "read up to end of file");
+
+    report(ftruncate(fd, 10) == 0 && pwrite(fd, "0123456789", 10, 0) == 10,
+           "truncate down");
+    report(ftruncate(fd, 8192) == 0, "truncate up");
+    memset(buf, 1, sizeof(buf));
+    report(pread(fd, buf, sizeof(buf), 0) == 8192 &&
+           memcmp(buf, "0123456789", 10) == 0 && all_zero(buf + 10, 8182),
+           "extended file reads as zeros past old end");
+    report(ftruncate(fd, 5) == 0 && ftruncate(fd, 100) == 0 &&
+           pread(fd, buf, 100, 0) == 100 && all_zero(buf + 5, 95),
+           "truncated data does not come back");
+    close(fd);
+    unlink("/tst-ramfs/sparse");
+}
+
+static void test_fallocate()
+{
+    int fd = open("/tst-ramfs/falloc", O_CREAT|O_RDWR, 0666);
+    assert(fd >= 0);
+    struct stat st;
+    report(fallocate(fd, 0, 0, 1 << 20) == 0 && fstat(fd, &st) == 0 &&
+           st.st_size == 1 << 20, "fallocate extends the file");
+    report(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 2 << 20) == 0 &&
+           fstat(fd, &st) == 0 && st.st_size == 1 << 20,
+           "fallocate with FALLOC_FL_KEEP_SIZE keeps the size");
+
+    std::vector<char> buf(3 * 4096);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = pattern(i);
+    }
+    assert(pwrite(fd, buf.data(), buf.size(), 0) == (ssize_t)buf.size());
+    report(fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+           100, 2 * 4096) == 0, "punch a hole");
+    std::vector<char> rbuf(buf.size());
+    bool ok = pread(fd, rbuf.data(), rbuf.size(), 0) == (ssize_t)rbuf.size();
+    ok &= memcmp(rbuf.data(), buf.data(), 100) == 0;
+    ok &= all_zero(rbuf.data() + 100, 2 * 4096);
+    ok &= memcmp(rbuf.data() + 100 + 2 * 4096, buf.data() + 100 + 2 * 4096,
+            buf.size() - 100 - 2 * 4096) == 0;
+    report(ok, "hole reads as zeros, data around it is kept");
+    report(fstat(fd, &st) == 0 && st.st_size == 1 << 20,
+           "punching a hole keeps the size");
+    close(fd);
+    unlink("/tst-ramfs/falloc");
+}
+
+static void test_mmap()
+{
+    int fd = open("/tst-ramfs/mmap", O_CREAT|O_RDWR, 0666);
+    assert(fd >= 0);
+    const size_t len = 4 * 4096;
+    std::vector<char> buf(len);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = pattern(i);
+    }
+    assert(pwrite(fd, buf.data(), len, 0) == (ssize_t)len);
+
+    auto p = (char*)mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    report(p != MAP_FAILED && memcmp(p, buf.data(), len) == 0,
+           "mapping shows file data");
+    assert(pwrite(fd, "XYZ", 3, 4096 + 10) == 3);
+    report(memcmp(p + 4096 + 10, "XYZ", 3) == 0,
+           "write to the file shows through the mapping");
+    munmap(p, len);
+
+    p = (char*)mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    assert(p != MAP_FAILED);
+    p[0] = '!';
+    char c;
+    report(pread(fd, &c, 1, 0) == 1 && c == pattern(0),
+           "write to a private mapping leaves the file alone");
+    munmap(p, len);
+
+    p = (char*)mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(p != MAP_FAILED);
+    p[1] = '?';
+    report(msync(p, len, MS_SYNC) == 0 && pread(fd, &c, 1, 1) == 1 &&
+           c == '?', "write to a shared mapping reaches the file");
+    munmap(p, len);
+
+    p = (char*)mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    assert(p != MAP_FAILED);
+    report(ftruncate(fd, 4096) == 0 && ftruncate(fd, len) == 0 &&
+           all_zero(p + 4096, len - 4096), "truncate drops mapped pages");
+    munmap(p, len);
+    close(fd);
+
+    fd = open("/tst-ramfs/mmap", O_RDONLY);
+    p = (char*)mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    report(p != MAP_FAILED && p[1] == '?', "map the file again");
+    close(fd);
+    report(unlink("/tst-ramfs/mmap") == 0, "remove a mapped file");
+    munmap(p, len);
+}
+
+static void test_rename()
+{
+    assert(mkdir("/tst-ramfs/dir", 0777) == 0);
+    int fd = open("/tst-ramfs/moved", O_CREAT|O_RDWR, 0666);
+    assert(fd >= 0);
+    std::vector<char> buf(3 * 4096 + 17);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = pattern(i);
+    }
+    assert(write(fd, buf.data(), buf.size()) == (ssize_t)buf.size());
+    close(fd);
+    report(rename("/tst-ramfs/moved", "/tst-ramfs/dir/moved") == 0,
+           "rename to another directory");
+    fd = open("/tst-ramfs/dir/moved", O_RDONLY);
+    std::vector<char> rbuf(buf.size());
+    report(fd >= 0 && read(fd, rbuf.data(), rbuf.size()) ==
+           (ssize_t)rbuf.size() && rbuf == buf, "data moves with the file");
+    close(fd);
+    unlink("/tst-ramfs/dir/moved");
+    rmdir("/tst-ramfs/dir");
+}
+
+int main(int argc, char **argv)
+{
+    mkdir(mnt, 0777);
+    if (mount("", mnt, "ramfs", 0, nullptr) < 0) {
+        perror("mount");
+        return 1;
+    }
+
+    test_append();
+    test_sparse();
+    test_fallocate();
+    test_mmap();
+    test_rename();
+
+    umount(mnt);
+    rmdir(mnt);
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
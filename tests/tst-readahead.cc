@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ *
+ * To compile on Linux:
+ * g++ -g -std=c++11 tests/tst-readahead.cc -o tests/tst-readahead \
+ *   -I./include -lboost_unit_test_framework -DBOOST_TEST_DYN_LINK
+ */
+
+#define BOOST_TEST_MODULE tst-readahead
+
+#include <utility>
+#include <vector>
+#include <osv/readahead.hh>
+#include <boost/test/unit_test.hpp>
+
+using osv::readahead;
+using range = std::pair<off_t, size_t>;
+using ranges = std::vector<range>;
+
+// Copies, which are safe to bind to references
+static const size_t min_window = readahead::min_window;
+static const size_t max_window = readahead::max_window;
+static const unsigned stride_depth = readahead::stride_depth;
+
+static constexpr off_t file_size = 1L << 30;
+
+static ranges access(readahead& ra, off_t offset, size_t len, off_t size = file_size)
+{
+    ranges issued;
+    ra.access(offset, len, size, [&] (off_t o, size_t l) {
+        issued.emplace_back(o, l);
+    });
+    return issued;
+}
+
+BOOST_AUTO_TEST_CASE(test_sequential_window_grows)
+{
+    readahead ra;
+    const size_t len = 4096;
+
+    BOOST_MESSAGE("The first read could be anything");
+    BOOST_REQUIRE(access(ra, 0, len).empty());
+
+    BOOST_MESSAGE("The second starts a stream");
+    auto issued = access(ra, len, len);
+    BOOST_REQUIRE(issued == ranges({{2 * len, min_window}}));
+
+    BOOST_MESSAGE("Reaching the window requests the next, twice as large");
+    issued = access(ra, 2 * len, len);
+    BOOST_REQUIRE(issued == ranges({{2 * len + min_window, 2 * min_window}}));
+
+    BOOST_MESSAGE("Repeating an access, like a retried fault, changes nothing");
+    BOOST_REQUIRE(access(ra, 2 * len, len).empty());
+
+    BOOST_MESSAGE("But not before the reader reaches the start of that one");
+    off_t off = 3 * len;
+    while (off + len < 2 * len + min_window) {
+        BOOST_REQUIRE(access(ra, off, len).empty());
+        off += len;
+    }
+    issued = access(ra, off, len);
+    BOOST_REQUIRE_EQUAL(issued.size(), 1);
+    BOOST_REQUIRE_EQUAL(issued[0].first, 2 * len + 3 * min_window);
+    BOOST_REQUIRE_EQUAL(issued[0].second, 4 * min_window);
+
+    BOOST_MESSAGE("The window stops growing at max_window");
+    off_t end = 0;
+    for (off += len; off < file_size / 2; off += len) {
+        for (auto& r : access(ra, off, len)) {
+            BOOST_REQUIRE(r.second <= max_window);
+            BOOST_REQUIRE(r.first >= end);
+            end = r.first + r.second;
+        }
+    }
+    BOOST_REQUIRE_EQUAL(ra.window(), max_window);
+    BOOST_REQUIRE(end > off);
+}
+
+BOOST_AUTO_TEST_CASE(test_nothing_past_eof)
+{
+    readahead ra;
+    const off_t size = 10000;
+    access(ra, 0, 4096, size);
+    auto issued = access(ra, 4096, 4096, size);
+    BOOST_REQUIRE(issued == ranges({{8192, size - 8192}}));
+    BOOST_REQUIRE(access(ra, 8192, 4096, size).empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_random_access_shrinks_window)
+{
+    readahead ra;
+    const size_t len = 4096;
+    off_t off = 0;
+    for (; off < 64 << 20; off += len) {
+        access(ra, off, len);
+    }
+    BOOST_REQUIRE_EQUAL(ra.window(), max_window);
+
+    BOOST_MESSAGE("Seeking away ends the stream");
+    BOOST_REQUIRE(access(ra, 7 * len, len).empty());
+    BOOST_REQUIRE(access(ra, 3 * len, len).empty());
+    BOOST_REQUIRE_EQUAL(ra.window(), max_window / 2);
+
+    BOOST_MESSAGE("The next stream starts with the smaller window");
+    auto issued = access(ra, 4 * len, len);
+    BOOST_REQUIRE(issued == ranges({{5 * len, max_window / 2}}));
+}
+
+BOOST_AUTO_TEST_CASE(test_strided_access)
+{
+    readahead ra;
+    const size_t len = 512;
+    const off_t stride = 8192;
+
+    BOOST_REQUIRE(access(ra, 0, len).empty());
+    BOOST_REQUIRE(access(ra, stride, len).empty());
+
+    BOOST_MESSAGE("The stride repeated: fetch the next records");
+    auto issued = access(ra, 2 * stride, len);
+    ranges expected;
+    for (unsigned i = 1; i <= stride_depth; i++) {
+        expected.emplace_back(2 * stride + i * stride, len);
+    }
+    BOOST_REQUIRE(issued == expected);
+
+    BOOST_MESSAGE("Then one record at a time");
+    issued = access(ra, 3 * stride, len);
+    BOOST_REQUIRE(issued == ranges({{(3 + stride_depth) * stride, len}}));
+
+    BOOST_MESSAGE("Backwards too");
+    readahead back;
+    off_t off = 100 * stride;
+    access(back, off, len);
+    access(back, off - stride, len);
+    issued = access(back, off - 2 * stride, len);
+    BOOST_REQUIRE_EQUAL(issued.size(), stride_depth);
+    BOOST_REQUIRE_EQUAL(issued.back().first, off - (2 + stride_depth) * stride);
+}
+
+BOOST_AUTO_TEST_CASE(test_advice)
+{
+    const size_t len = 4096;
+
+    BOOST_MESSAGE("Random: no readahead");
+    readahead random;
+    random.advise(readahead::advice::random);
+    for (off_t off = 0; off < 1 << 20; off += len) {
+        BOOST_REQUIRE(access(random, off, len).empty());
+    }
+
+    BOOST_MESSAGE("Sequential: the first read starts a larger stream");
+    readahead seq;
+    seq.advise(readahead::advice::sequential);
+    auto issued = access(seq, 0, len);
+    BOOST_REQUIRE(issued == ranges({{len, max_window / 2}}));
+    for (off_t off = len; off < 256 << 20; off += len) {
+        access(seq, off, len);
+    }
+    BOOST_REQUIRE_EQUAL(seq.window(), 2 * max_window);
+}
@@ -222,6 +222,13 @@ int main()
     report(ret == -1 && errno == EBADF, "test for bad mode of out_fd");
     report(close(write_fd) == 0, "close the dummy testfile");
 
+    /* a device's size (0) is not where its data ends */
+    int zero_fd = open("/dev/zero", O_RDONLY);
+    write_fd = open("temp_file", O_WRONLY|O_TRUNC);
+    offset = 0;
+    report(sendfile(write_fd, zero_fd, &offset, 4096) == 4096, "sendfile from /dev/zero");
+    report(close(write_fd) == 0 && close(zero_fd) == 0, "close /dev/zero and the dummy testfile");
+
     report(unlink(test_filename) == 0, "remove the testfile");
     printf("SUMMARY: %d tests, %d failures\n", tests, fails);
     munmap(src, size_test_file);
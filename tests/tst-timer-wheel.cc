@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ *
+ * To compile on Linux:
+ * g++ -g -pthread -std=c++11 tests/tst-timer-wheel.cc -o tests/tst-timer-wheel \
+ *   -I./include -lboost_unit_test_framework -DBOOST_TEST_DYN_LINK
+ */
+
+#define BOOST_TEST_MODULE tst-timer-wheel
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <unordered_set>
+#include <vector>
+#include <stdio.h>
+#include <osv/timer-wheel.hh>
+#include <boost/test/unit_test.hpp>
+
+using Clock = std::chrono::steady_clock;
+
+class test_timer
+{
+private:
+    Clock::time_point _timeout;
+
+public:
+    test_timer(Clock::time_point _time_point)
+        : _timeout(_time_point)
+    {
+    }
+
+    Clock::time_point get_timeout()
+    {
+        return _timeout;
+    }
+
+    void set_timeout(Clock::time_point new_timeout)
+    {
+        _timeout = new_timeout;
+    }
+public:
+    bi::list_member_hook<> link;
+    bool active = false;
+};
+
+using timer_wheel_t = timer_wheel<test_timer, &test_timer::link, Clock>;
+using timer_ptr_set = std::unordered_set<test_timer*>;
+
+static Clock::time_point abs_time_point(Clock::duration::rep value)
+{
+    return Clock::time_point(Clock::duration(value));
+}
+
+static timer_ptr_set get_expired(timer_wheel_t& timers)
+{
+    timer_ptr_set set;
+    test_timer* timer;
+    while ((timer = timers.pop_expired())) {
+        set.insert(timer);
+    }
+    return set;
+}
+
+BOOST_AUTO_TEST_CASE(test_typical_timer_insertion_and_expiry)
+{
+    timer_wheel_t _timers(Clock::duration(10));
+
+    test_timer t1(abs_time_point(15));
+    test_timer t2(abs_time_point(20));
+    test_timer t3(abs_time_point(21));
+
+    BOOST_MESSAGE("Expire when no timers inserted yet");
+    _timers.expire(abs_time_point(5));
+    BOOST_REQUIRE(_timers.pop_expired() == nullptr);
+    BOOST_REQUIRE(_timers.get_next_timeout() == Clock::time_point::max());
+    BOOST_REQUIRE(_timers.empty());
+
+    BOOST_REQUIRE_EQUAL(_timers.insert(t3), true);
+    BOOST_REQUIRE_EQUAL(_timers.insert(t2), true);
+    BOOST_REQUIRE_EQUAL(_timers.insert(t1), false);
+    BOOST_REQUIRE(_timers.get_next_timeout() == abs_time_point(20));
+
+    BOOST_MESSAGE("Timers never expire before their timeout");
+    _timers.expire(abs_time_point(19));
+    BOOST_REQUIRE(_timers.pop_expired() == nullptr);
+
+    BOOST_MESSAGE("Timers on the same tick expire together");
+    _timers.expire(abs_time_point(20));
+    BOOST_REQUIRE(get_expired(_timers) == timer_ptr_set({&t1, &t2}));
+    BOOST_REQUIRE(_timers.get_next_timeout() == abs_time_point(30));
+
+    BOOST_MESSAGE("Expire last timer");
+    _timers.expire(abs_time_point(35));
+    BOOST_REQUIRE(get_expired(_timers) == timer_ptr_set({&t3}));
+    BOOST_REQUIRE(_timers.get_next_timeout() == Clock::time_point::max());
+    BOOST_REQUIRE(_timers.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_timers_in_the_past_expire_on_next_expiry)
+{
+    timer_wheel_t _timers(Clock::duration(1));
+
+    _timers.expire(abs_time_point(1000));
+
+    test_timer t1(abs_time_point(10));
+    BOOST_REQUIRE_EQUAL(_timers.insert(t1), true);
+    BOOST_REQUIRE(_timers.get_next_timeout() == abs_time_point(1000));
+    _timers.expire(abs_time_point(1000));
+    BOOST_REQUIRE(get_expired(_timers) == timer_ptr_set({&t1}));
+}
+
+BOOST_AUTO_TEST_CASE(test_removal_from_cascaded_levels)
+{
+    timer_wheel_t _timers(Clock::duration(1));
+
+    test_timer t1(abs_time_point(5000));
+    test_timer t2(abs_time_point(5001));
+    test_timer t3(abs_time_point(300000));
+
+    _timers.insert(t1);
+    _timers.insert(t2);
+    _timers.insert(t3);
+
+    BOOST_MESSAGE("Cascade the slot holding t1 and t2, then remove t1");
+    _timers.expire(abs_time_point(4999));
+    BOOST_REQUIRE(_timers.pop_expired() == nullptr);
+    _timers.remove(t1);
+
+    _timers.expire(abs_time_point(200000));
+    BOOST_REQUIRE(get_expired(_timers) == timer_ptr_set({&t2}));
+
+    _timers.remove(t3);
+    BOOST_REQUIRE(_timers.empty());
+    _timers.expire(abs_time_point(400000));
+    BOOST_REQUIRE(_timers.pop_expired() == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_operations_match_a_reference_model)
+{
+    const Clock::duration::rep resolution = 7;
+    timer_wheel_t _timers { Clock::duration(resolution) };
+    std::vector<std::unique_ptr<test_timer>> timers;
+    for (int i = 0; i < 256; i++) {
+        timers.emplace_back(new test_timer(abs_time_point(0)));
+    }
+
+    std::mt19937 rand(1);
+    Clock::duration::rep now = 0;
+    for (int iter = 0; iter < 200000; iter++) {
+        auto& t = *timers[rand() % timers.size()];
+        switch (rand() % 4) {
+        case 0:
+        case 1:
+            if (t.active) {
+                _timers.remove(t);
+            }
+            // Mostly short delays, some long ones to exercise the higher levels
+            t.set_timeout(abs_time_point(now + (rand() % 8 ? rand() % 500 : rand() % 10000000)));
+            _timers.insert(t);
+            t.active = true;
+            break;
+        case 2:
+            if (t.active) {
+                _timers.remove(t);
+                t.active = false;
+            }
+            break;
+        case 3:
+            now += rand() % 100;
+            if (rand() % 1000 == 0 && !_timers.empty()) {
+                // Jump ahead to the next event
+                now = std::max(now, _timers.get_next_timeout().time_since_epoch().count());
+            }
+            _timers.expire(abs_time_point(now));
+            auto expired = get_expired(_timers);
+            auto tick = now / resolution;
+            for (auto& timer : timers) {
+                auto expiry = timer->get_timeout().time_since_epoch().count();
+                auto expiry_tick = (expiry + resolution - 1) / resolution;
+                bool due = timer->active && expiry_tick <= tick;
+                BOOST_REQUIRE_EQUAL(expired.count(timer.get()) != 0, due);
+                if (due) {
+                    BOOST_REQUIRE(expiry <= now);
+                    timer->active = false;
+                }
+            }
+            break;
+        }
+    }
+
+    _timers.clear();
+}